@@ -6,6 +6,7 @@ cmd apt-get install \
   debhelper \
   zlib1g-dev \
   libbz2-dev \
-  libdb4.2-dev \
+  libzstd-dev \
+  liblzma-dev \
   libgtk2.0-dev \
   libcurl3-dev
@@ -78,8 +78,8 @@ Requires:	compat-db, w3c-libwww, wget
 %{expand: %%define update_menus if [ -x %{_update_menus_bin} ]; then %{_update_menus_bin} || true ; fi}
 # Clean Menu
 %{expand: %%define clean_menus if [ "$1" = "0" -a -x %{_update_menus_bin} ]; then %{_update_menus_bin} || true ; fi}
-BuildRequires:	libdb3.3-devel, w3c-libwww-devel, mawk, libopenssl0-devel
-Requires:	libdb3.3, w3c-libwww, libopenssl0, common-licenses
+BuildRequires:	w3c-libwww-devel, mawk, libopenssl0-devel
+Requires:	w3c-libwww, libopenssl0, common-licenses
 %endif
 
 %if %{buildforsuse}
@@ -109,9 +109,6 @@ get http://www.gimp.org/~tml/gimp/win32/gettext-runtime-0.13.1.zip
 unzip "$file"
 #______________________________________________________________________
 
-# Still missing, but not strictly needed ATM:
-# - libdb
-
 # http://curl.haxx.se/download.html
 #get http://curl.haxx.se/download/curl-7.13.0-win32-ssl-devel-mingw32.zip
 #unzip "$file"
@@ -13,119 +13,679 @@
 
 #include <config.h>
 
-#include <cachefile.hh>
-#include <compat.hh>
-#if HAVE_LIBDB
-
-#if DEBUG
-#  include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h> /* rename() */
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h> /* time() */
+#if HAVE_MMAP
+#  include <sys/mman.h>
 #endif
+#include <unistd-jigdo.h>
+
+#include <algorithm>
 #include <new>
-#include <time.h> /* time() */
 
+#include <cachefile.hh>
+#include <compat.hh>
 #include <debug.hh>
 #include <log.hh>
 #include <serialize.hh>
+#include <string.hh>
+#include <thread.hh>
+
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
 //______________________________________________________________________
 
 DEBUG_UNIT("cachefile")
 
-CacheFile::CacheFile(const char* dbName) {
-  memset(&data, 0, sizeof(DBT));
+namespace {
+
+  // Start of file, without trailing zero byte
+  const char MAGIC[] = "jigdo-file cache";
+  const size_t MAGIC_LEN = 16;
 
-  int e = db_create(&db, 0, 0); // No env/flags
-  if (e != 0) throw DbError(e);
+  DbError writeError(const string& fileName) {
+    return DbError(errno, subst(_("Could not write `%1' (%2)"), fileName,
+                                strerror(errno)));
+  }
 
-  // Cache of 0GB+4MB, one contiguous chunk
-  db->set_cachesize(db, 0, 4*1024*1024, 1);
+  DbError readError(const string& fileName) {
+    return DbError(errno, subst(_("Could not read `%1' (%2)"), fileName,
+                                strerror(errno)));
+  }
 
-  // Use a btree, create database file if not yet present
-  e = compat_dbOpen(db, dbName, "jigdo filecache v0", DB_BTREE, DB_CREATE,
-                    0666);
-  if (e != 0) {
-    // Re-close, in case it is necessary
-    db->close(db, 0);
-    if (e != DB_OLD_VERSION && e != DB_RUNRECOVERY)
-      throw DbError(e);
-    /* If the DB file is old or corrupted, just regenerate it from
-       scratch, otherwise throw error. */
-    debug("Cache file corrupt, recreating it");
-    if (compat_dbOpen(db, dbName, "jigdo filecache v0", DB_BTREE,
-                      DB_CREATE | DB_TRUNCATE, 0666) != 0)
-      throw DbError(e);
+  // Write len bytes at offset off of fd
+  void writeAt(int fd, uint64 off, const byte* buf, size_t len,
+               const string& fileName) {
+    if (lseek(fd, off, SEEK_SET) == static_cast<off_t>(-1))
+      throw writeError(fileName);
+    while (len > 0) {
+      ssize_t n = write(fd, buf, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) throw writeError(fileName);
+      buf += n; len -= n;
+    }
   }
 
-  data.flags |= DB_DBT_REALLOC;
-}
+  /* Older jigdo-file versions used a Berkeley DB btree file, whose
+     metadata page has this magic number at offset 12, in the byte order
+     of the machine which wrote it */
+  bool isBerkeleyDb(const byte* d, uint64 len) {
+    static const byte le[4] = { 0x62, 0x31, 0x05, 0x00 };
+    static const byte be[4] = { 0x00, 0x05, 0x31, 0x62 };
+    return len >= 16 && (memcmp(d + 12, le, 4) == 0
+                         || memcmp(d + 12, be, 4) == 0);
+  }
+
+  // Rename from to to, replacing any existing file
+  void renameOver(const string& from, const string& to) {
+    if (rename(from.c_str(), to.c_str()) == 0) return;
+    // Windows cannot rename to an existing file
+    remove(to.c_str());
+    if (rename(from.c_str(), to.c_str()) != 0)
+      throw writeError(to);
+  }
+
+  /* Reads a file in large pieces. The offsets passed to get() must not
+     decrease. */
+  class Reader {
+  public:
+    Reader(int fd, const string& fileName)
+      : f(fd), name(fileName), bufOff(0), buf() { }
+    // Return pointer to len bytes at offset off of the file
+    const byte* get(uint64 off, size_t len) {
+      uint64 bufEnd = bufOff + buf.size();
+      if (off + len <= bufEnd) return &buf[off - bufOff];
+      // Keep what is already there of the requested bytes, read the rest
+      size_t n = 0;
+      if (off < bufEnd) {
+        n = bufEnd - off;
+        memmove(&buf[0], &buf[buf.size() - n], n);
+      }
+      buf.resize(max(len, BUF_SIZE));
+      bufOff = off;
+      if (lseek(f, off + n, SEEK_SET) == static_cast<off_t>(-1))
+        throw readError(name);
+      while (n < buf.size()) {
+        ssize_t r = read(f, &buf[n], buf.size() - n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) throw readError(name);
+        if (r == 0) break;
+        n += r;
+      }
+      buf.resize(n);
+      if (n < len)
+        throw DbError(0, subst(_("Could not read `%1' (%2)"), name,
+                               _("unexpected end of file")));
+      return &buf[0];
+    }
+  private:
+    static const size_t BUF_SIZE = 1024*1024;
+    int f;
+    const string& name;
+    uint64 bufOff; // File offset of buf[0]
+    vector<byte> buf;
+  };
+
+} // namespace
 //______________________________________________________________________
 
-namespace {
+/* Collects data in a buffer and appends it to the file in large
+   pieces. pos() is the file offset of the next byte put(). */
+class CacheFile::Writer {
+public:
+  Writer(int fd, uint64 off, const string& fileName)
+    : f(fd), fileOff(off), name(fileName), buf() { }
+  uint64 pos() const { return fileOff + buf.size(); }
+  const string& fileName() const { return name; }
+  byte* put(size_t len) {
+    if (buf.size() + len > BUF_SIZE && !buf.empty()) flush();
+    buf.resize(buf.size() + len);
+    return &buf[buf.size() - len];
+  }
+  void put(const byte* data, size_t len) { memcpy(put(len), data, len); }
+  void flush() {
+    if (buf.empty()) return;
+    writeAt(f, fileOff, &buf[0], buf.size(), name);
+    fileOff += buf.size();
+    buf.clear();
+  }
+private:
+  static const size_t BUF_SIZE = 1024*1024;
+  int f;
+  uint64 fileOff;
+  const string& name;
+  vector<byte> buf;
+};
+//______________________________________________________________________
+
+/* An entry which is still valid when the cache is closed: Either an 'E'
+   record in mapData, or an entry in "added" */
+struct CacheFile::Live {
+  bool operator<(const Live& x) const { return hash < x.hash; }
+  // Order by offset in the file, entries which are not in it first
+  static bool lessOffset(const Live& a, const Live& b) {
+    return a.offset < b.offset;
+  }
+  uint64 hash;
+  uint64 offset; // Offset of 'E' record, 0 if not yet written
+  const pair<const string, vector<byte> >* added; // Non-null if in added
+  bool indexed; // Record is in the index, fileId not read from it
+  uint64 fileId;
+};
+//______________________________________________________________________
+
+/* Copies the current records before offset end of the cache file to
+   name.tmp and appends an index for them, on a thread of its own while
+   the cache is in use. The records are read through a separate file
+   descriptor; the CacheFile only ever appends after end and updates
+   lastAccess fields, which finish() writes again. */
+class CacheFile::Compactor : public Thread {
+public:
+  // live must be sorted by offset, it is cleared
+  Compactor(const string& cacheName, uint64 compactEnd, vector<Live>& l);
+  // Waits for the thread, removes the new file unless finish() succeeded
+  ~Compactor();
+  // If no thread can be started, finish() does all the work
+  void startThread() { threaded = (start() == SUCCESS); }
+  /* Wait until the records are copied, then append those in cacheFd
+     from end to logEnd and update lastAccess of the records in accessed.
+     Returns the file descriptor of the new file, which the caller must
+     rename to the cache's name, or -1 if compaction failed. */
+  int finish(int cacheFd, uint64 logEnd);
+  const string& tmpFileName() const { return tmpName; }
+
+  uint64 end; // Only records before this are compacted
+  // Offsets of records before end which were looked up in the meantime
+  set<uint64> accessed;
+
+protected:
+  virtual void run();
+
+private:
+  void compact();
+
+  string name, tmpName;
+  int tmpFd;
+  vector<Live> live;
+  // Old offset of each copied record, new offset of its lastAccess field
+  vector<pair<uint64, uint64> > moved;
+  uint64 newEnd; // End of index in new file
+  bool threaded;
+  string error; // Non-empty if compact() failed
+};
+
+CacheFile::Compactor::Compactor(const string& cacheName, uint64 compactEnd,
+                                vector<Live>& l)
+  : end(compactEnd), accessed(), name(cacheName), tmpName(cacheName),
+    tmpFd(-1), live(), moved(), newEnd(0), threaded(false), error() {
+  tmpName += ".tmp";
+  live.swap(l);
+}
+
+CacheFile::Compactor::~Compactor() {
+  if (threaded) join();
+  if (tmpFd == -1) return;
+  ::close(tmpFd);
+  remove(tmpName.c_str());
+}
+
+void CacheFile::Compactor::run() {
+  try {
+    compact();
+  } catch (DbError e) {
+    error = e.message;
+  } catch (bad_alloc) {
+    error = _("Out of memory");
+  }
+}
+
+void CacheFile::Compactor::compact() {
+  int in = open(name.c_str(), O_RDONLY | O_BINARY);
+  if (in == -1) throw readError(name);
+  tmpFd = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
+               0666);
+  if (tmpFd == -1) {
+    DbError e = writeError(tmpName);
+    ::close(in);
+    throw e;
+  }
+  debug("Compacting `%1', %2 entries", name, live.size());
 
-  /** Local struct: Wrapper which calls close() for any DBC cursor at end of
-      scope */
-  struct AutoCursor {
-    AutoCursor() : c(0) { }
-    ~AutoCursor() { close(); }
-    int close() {
-      if (c == 0) return 0;
-      int r = c->c_close(c);
-      c = 0;
-      return r;
+  try {
+    Reader src(in, name);
+    Writer out(tmpFd, 0, tmpName);
+    putHeader(out);
+    vector<IdEntry> idList;
+    vector<AgeEntry> ageList;
+    moved.reserve(live.size());
+    vector<Live>::iterator o = live.begin();
+    for (vector<Live>::iterator i = live.begin(), e = live.end(); i != e;
+         ++i) {
+      size_t len, nameLen;
+      const byte* r = src.get(i->offset, REC_NAME);
+      unserialize4(len, r + REC_LENGTH);
+      unserialize4(nameLen, r + REC_NAMELEN);
+      // Leave out records which the index points to but which are broken
+      if (len < REC_NAME + USER_DATA || len > end - i->offset
+          || nameLen > len - REC_NAME - USER_DATA) continue;
+      uint64 off = out.pos();
+      byte* p = out.put(len);
+      memcpy(p, src.get(i->offset, len), len);
+      unserialize8(i->fileId, p + REC_FILEID);
+      uint32 lastAccess;
+      unserialize4(lastAccess, p + REC_NAME + nameLen + ACCESS);
+      moved.push_back(make_pair(i->offset,
+                                off + REC_NAME + nameLen + ACCESS));
+      *o = *i;
+      o->offset = off;
+      if (i->fileId != 0) idList.push_back(IdEntry(i->fileId, off));
+      ageList.push_back(AgeEntry(lastAccess, off));
+      ++o;
     }
-    int get(DBT *key, DBT *data, u_int32_t flags) {
-      return c->c_get(c, key, data, flags);
+    live.erase(o, live.end());
+    uint64 indexOff = out.pos();
+    putIndex(out, live, idList, ageList, indexOff - HEADER_SIZE);
+    newEnd = out.pos();
+    out.flush();
+    byte buf[8];
+    serialize8(indexOff, buf);
+    writeAt(tmpFd, INDEX_OFFSET, buf, 8, tmpName);
+  } catch (...) {
+    ::close(in);
+    throw;
+  }
+  ::close(in);
+}
+
+int CacheFile::Compactor::finish(int cacheFd, uint64 logEnd) {
+  if (threaded) join(); else run();
+  threaded = false;
+  if (error.empty()) {
+    try {
+      Reader src(cacheFd, name);
+      Writer out(tmpFd, newEnd, tmpName);
+      const size_t CHUNK = 1024*1024;
+      for (uint64 off = end; off < logEnd; off += CHUNK) {
+        size_t n = static_cast<size_t>(min(logEnd - off, uint64(CHUNK)));
+        out.put(src.get(off, n), n);
+      }
+      out.flush();
+      byte now[4];
+      serialize4(static_cast<uint32>(time(0)), now);
+      for (set<uint64>::const_iterator i = accessed.begin(),
+             e = accessed.end(); i != e; ++i) {
+        vector<pair<uint64, uint64> >::const_iterator m =
+          lower_bound(moved.begin(), moved.end(), make_pair(*i, uint64(0)));
+        if (m != moved.end() && m->first == *i)
+          writeAt(tmpFd, m->second, now, 4, tmpName);
+      }
+    } catch (DbError e) {
+      error = e.message;
     }
-    int put(DBT *key, DBT *data, u_int32_t flags) {
-      return c->c_put(c, key, data, flags);
+  }
+  if (!error.empty()) {
+    // The old file is still intact, so this is not fatal
+    debug("Compacting `%1' failed: %2", name, error);
+    return -1;
+  }
+  int result = tmpFd;
+  tmpFd = -1;
+  return result;
+}
+//______________________________________________________________________
+
+CacheFile::CacheFile(const char* dbName)
+  : name(dbName), fd(-1), mapData(0), mapLen(0), mapped(false),
+    convert(false), index(0), indexBits(0), indexCount(0), ids(0),
+    idCount(0), ages(0), liveBytes(0), logEnd(HEADER_SIZE), tail(),
+    tailIds(), added(), addedIds(), deleted(), accessed(), refreshed(),
+    compactor(0), data() {
+  fd = open(dbName, O_RDWR | O_CREAT | O_BINARY, 0666);
+  if (fd == -1) throw DbError(errno, strerror(errno));
+  try {
+    if (!mapFile())
+      throw DbError(0, subst(_("`%1' is not a jigdo-file cache"), name));
+  } catch (DbError) {
+    ::close(fd); fd = -1;
+    throw;
+  }
+  if (mapData == 0) { // New cache
+    convert = true;
+    return;
+  }
+
+  // Compact in the background if most of the file is stale records
+  if (logEnd - HEADER_SIZE - liveBytes > liveBytes) {
+    vector<Live> live;
+    liveEntries(live);
+    sort(live.begin(), live.end(), Live::lessOffset);
+    compactor = new Compactor(name, logEnd, live);
+    compactor->startThread();
+  }
+}
+
+/* Map the file into memory, or read it if mmap() is not available, and
+   set up index and tail, see readLog(). Returns false if the file is not
+   empty and not a cache file. */
+bool CacheFile::mapFile(bool resume) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) throw DbError(errno, strerror(errno));
+  if (st.st_size == 0) return true;
+  mapLen = st.st_size;
+
+# if HAVE_MMAP
+  void* m = mmap(0, mapLen, PROT_READ, MAP_SHARED, fd, 0);
+  if (m != MAP_FAILED) {
+    mapData = static_cast<byte*>(m);
+    mapped = true;
+  }
+# endif
+  if (!mapped) {
+    mapData = new byte[mapLen];
+    uint64 n = 0;
+    if (lseek(fd, 0, SEEK_SET) == 0) {
+      while (n < mapLen) {
+        ssize_t r = read(fd, mapData + n, mapLen - n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        n += r;
+      }
     }
-    int del(u_int32_t flags) {
-      return c->c_del(c, flags);
+    if (n < mapLen) {
+      int e = errno;
+      unmap();
+      throw DbError(e, strerror(e));
     }
-    DBC* c;
-  };
+  }
 
+  if (mapLen < HEADER_SIZE || memcmp(mapData, MAGIC, MAGIC_LEN) != 0) {
+    bool oldCache = isBerkeleyDb(mapData, mapLen);
+    unmap();
+    if (oldCache)
+      throw DbError(0, subst(_("`%1' is a cache file of an older "
+        "jigdo-file version, which cannot be read any more - please "
+        "delete it"), name));
+    return false;
+  }
+  uint32 version;
+  unserialize4(version, mapData + VERSION);
+  if (version != FORMAT_VERSION) {
+    unmap();
+    throw DbError(0, subst(_("`%1' was written by an incompatible version "
+                             "of jigdo-file"), name));
+  }
+  readLog(resume);
+  return true;
 }
 //________________________________________
 
-Status CacheFile::find(const byte*& resultData, size_t& resultSize,
-                       const string& fileName, uint64 fileSize, time_t mtime) {
-  DBT key; memset(&key, 0, sizeof(DBT));
-  key.data = const_cast<char*>(fileName.c_str());
-  key.size = fileName.size();
-
-  AutoCursor cursor;
-  // Cursor with no transaction id, no flags
-  if (db->cursor(db, 0, &cursor.c, 0) != 0) return FAILED;
-
-  if (cursor.get(&key, &data, DB_SET) == DB_NOTFOUND
-      || data.data == 0) return FAILED;
-
-  // Check whether mtime and size matches
-  Paranoid(data.size >= USER_DATA);
-  byte* d = static_cast<byte*>(data.data);
-  Paranoid(d != 0);
+CacheFile::~CacheFile() {
+  delete compactor;
+  unmap();
+  if (fd != -1) ::close(fd);
+}
+
+/* With keepLog, liveBytes, logEnd and tail are left alone, for
+   mapFile(true) */
+void CacheFile::unmap(bool keepLog) {
+# if HAVE_MMAP
+  if (mapped) munmap(mapData, mapLen);
+# endif
+  if (!mapped) delete[] mapData;
+  mapData = 0; mapLen = 0; mapped = false;
+  index = 0; indexCount = 0; ids = 0; idCount = 0; ages = 0;
+  accessed.clear(); refreshed.clear();
+  if (keepLog) return;
+  liveBytes = 0;
+  logEnd = HEADER_SIZE;
+  tail.clear(); tailIds.clear();
+}
+//______________________________________________________________________
+
+uint64 CacheFile::fileId(uint64 dev, uint64 ino) {
+  if (ino == 0) return 0;
+  // FNV-1a over the 16 bytes of dev and ino
+  uint64 h = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < 64; i += 8) {
+    h ^= (dev >> i) & 0xff;
+    h *= 0x100000001b3ULL;
+  }
+  for (int i = 0; i < 64; i += 8) {
+    h ^= (ino >> i) & 0xff;
+    h *= 0x100000001b3ULL;
+  }
+  return (h == 0 ? 1 : h);
+}
+
+// FNV-1a
+uint64 CacheFile::hash(const string& fileName) {
+  uint64 h = 0xcbf29ce484222325ULL;
+  for (string::const_iterator i = fileName.begin(), e = fileName.end();
+       i != e; ++i) {
+    h ^= static_cast<byte>(*i);
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+//______________________________________________________________________
+
+/* Set up index and read the records after it into tail. If the index
+   looks broken, ignore it and read all records. Stop at the first
+   incomplete record, which can be left by an interrupted close(). */
+void CacheFile::readLog(bool resume) {
+  uint64 pos = HEADER_SIZE;
+  uint64 indexOff;
+  unserialize8(indexOff, mapData + INDEX_OFFSET);
+  if (indexOff >= HEADER_SIZE && indexOff < mapLen - IDX_BUCKETS
+      && mapData[indexOff + REC_TYPE] == 'I') {
+    const byte* r = mapData + indexOff;
+    size_t len;
+    unserialize4(len, r + REC_LENGTH);
+    unsigned bits = r[IDX_BITS];
+    uint64 count, nIds;
+    unserialize8(count, r + IDX_COUNT);
+    unserialize8(nIds, r + IDX_IDCOUNT);
+    if (bits < 32 && count < (uint64(1) << 32) && nIds <= count
+        && len == IDX_BUCKETS + ((uint64(1) << bits) + 1) * 4
+                  + (count + nIds) * 16 + count * 12
+        && len <= mapLen - indexOff) {
+      index = r;
+      indexBits = bits;
+      indexCount = count;
+      ages = r + len - count * 12;
+      ids = ages - nIds * 16;
+      idCount = nIds;
+      if (!resume) unserialize8(liveBytes, r + IDX_LIVE);
+      pos = indexOff + len;
+    }
+  }
+  if (index == 0 && indexOff != 0) debug("Index of `%1' broken", name);
+  if (resume) pos = logEnd;
+
+  while (mapLen - pos >= REC_NAME) {
+    const byte* r = mapData + pos;
+    size_t len;
+    unserialize4(len, r + REC_LENGTH);
+    if (len < REC_NAME || len > mapLen - pos) break;
+    byte type = r[REC_TYPE];
+    if (type == 'E' || type == 'D') {
+      size_t nameLen;
+      unserialize4(nameLen, r + REC_NAMELEN);
+      if (nameLen > len - REC_NAME
+          || (type == 'E' && len - REC_NAME - nameLen < USER_DATA)) break;
+      string fileName(reinterpret_cast<const char*>(r + REC_NAME), nameLen);
+      // This record replaces any earlier one for the same file
+      uint64 old = lookupMapped(fileName);
+      if (old != 0) {
+        size_t oldLen;
+        unserialize4(oldLen, mapData + old + REC_LENGTH);
+        liveBytes -= oldLen;
+      }
+      if (type == 'E') {
+        tail[fileName] = pos;
+        liveBytes += len;
+        uint64 id;
+        unserialize8(id, r + REC_FILEID);
+        if (id != 0) tailIds[id] = pos;
+      } else {
+        tail[fileName] = 0;
+      }
+    } else if (type != 'I') {
+      break;
+    }
+    pos += len;
+  }
+  logEnd = pos;
+  debug("Opened `%1': %2 entries in index, %3 records after it", name,
+        indexCount, tail.size());
+}
+//______________________________________________________________________
+
+/* Look up fileName in tail and index. Returns offset of its 'E' record
+   in mapData, or 0 if there is none. */
+uint64 CacheFile::lookupMapped(const string& fileName) const {
+  map<string, uint64>::const_iterator t = tail.find(fileName);
+  if (t != tail.end()) return t->second;
+  if (index == 0) return 0;
+
+  uint64 h = hash(fileName);
+  size_t bucket = (indexBits == 0 ? 0 : h >> (64 - indexBits));
+  const byte* buckets = index + IDX_BUCKETS;
+  size_t i, end;
+  unserialize4(i, buckets + 4 * bucket);
+  unserialize4(end, buckets + 4 * bucket + 4);
+  const byte* entries = buckets + 4 * ((size_t(1) << indexBits) + 1);
+  for (; i < end && i < indexCount; ++i) {
+    uint64 entryHash;
+    unserialize8(entryHash, entries + 16 * i);
+    if (entryHash < h) continue;
+    if (entryHash > h) break;
+    uint64 off;
+    unserialize8(off, entries + 16 * i + 8);
+    if (off < HEADER_SIZE || mapLen - off < REC_NAME) continue;
+    size_t nameLen;
+    unserialize4(nameLen, mapData + off + REC_NAMELEN);
+    if (nameLen == fileName.size() && mapLen - off - REC_NAME >= nameLen
+        && memcmp(mapData + off + REC_NAME, fileName.data(), nameLen) == 0)
+      return off;
+  }
+  return 0;
+}
+
+/* Is the 'E' record at off in mapData still the current entry for its
+   filename? */
+bool CacheFile::isCurrent(uint64 off) const {
+  if (off < HEADER_SIZE || mapLen - off < REC_NAME) return false;
+  size_t nameLen;
+  unserialize4(nameLen, mapData + off + REC_NAMELEN);
+  if (mapLen - off - REC_NAME < nameLen) return false;
+  string fileName(reinterpret_cast<const char*>(mapData + off + REC_NAME),
+                  nameLen);
+  return added.find(fileName) == added.end()
+         && deleted.find(fileName) == deleted.end()
+         && lookupMapped(fileName) == off;
+}
+
+uint64 CacheFile::lookupId(uint64 id) const {
+  map<uint64, uint64>::const_iterator t = tailIds.find(id);
+  if (t != tailIds.end() && isCurrent(t->second)) return t->second;
+  if (ids == 0) return 0;
+
+  // Binary search for the first entry with that fileId
+  uint64 lo = 0, hi = idCount;
+  while (lo < hi) {
+    uint64 mid = lo + (hi - lo) / 2;
+    uint64 x;
+    unserialize8(x, ids + 16 * mid);
+    if (x < id) lo = mid + 1; else hi = mid;
+  }
+  for (; lo < idCount; ++lo) {
+    uint64 x, off;
+    unserialize8(x, ids + 16 * lo);
+    if (x != id) break;
+    unserialize8(off, ids + 16 * lo + 8);
+    if (isCurrent(off)) return off;
+  }
+  return 0;
+}
+
+/* Return pointer to the data (starting with lastAccess) for fileName, or
+   null if not found. *recordOff is the offset of the record in mapData,
+   or 0 if the entry is in added. */
+byte* CacheFile::lookup(const string& fileName, size_t* dataSize,
+                        uint64* recordOff) {
+  *recordOff = 0;
+  map<string, vector<byte> >::iterator a = added.find(fileName);
+  if (a != added.end()) {
+    *dataSize = a->second.size();
+    return &a->second[0];
+  }
+  if (fd == -1 || deleted.find(fileName) != deleted.end()) return 0;
+  uint64 off = lookupMapped(fileName);
+  if (off == 0) return 0;
+  *recordOff = off;
+  size_t len;
+  unserialize4(len, mapData + off + REC_LENGTH);
+  size_t skip = REC_NAME + fileName.size();
+  *dataSize = len - skip;
+  return mapData + off + skip;
+}
+//______________________________________________________________________
+
+// Check whether mtime and size of the entry at d match
+bool CacheFile::entryMatches(const byte* d, uint64 fileSize, time_t mtime) {
   time_t cacheMtime;
   unserialize4(cacheMtime, d + MTIME);
-  if (cacheMtime != mtime) return FAILED;
+  if (cacheMtime != mtime) return false;
   uint64 cacheFileSize;
   unserialize6(cacheFileSize, d + SIZE);
-  if (cacheFileSize != fileSize) return FAILED;
+  return cacheFileSize == fileSize;
+}
 
-  // Match - update access time
-  time_t now = time(0);
-  Paranoid(now != static_cast<time_t>(-1));
-  serialize4(now, d + ACCESS);
-  DBT partial; memset(&partial, 0, sizeof(DBT));
-  partial.data = d + ACCESS;
-  partial.size = 4;
-  partial.flags |= DB_DBT_PARTIAL;
-  partial.doff = ACCESS;
-  partial.dlen = 4;
-  //cerr << "CacheFile lookup successfull for "<<fileName<<endl;
-  cursor.put(&key, &partial, DB_CURRENT);
+Status CacheFile::find(const byte*& resultData, size_t& resultSize,
+                       const string& fileName, uint64 fileSize, time_t mtime,
+                       uint64 id) {
+  size_t size;
+  uint64 off;
+  byte* d = lookup(fileName, &size, &off);
+  if (d == 0 || !entryMatches(d, fileSize, mtime)) {
+    // Maybe the file was renamed, or is a hard link to a known file
+    if (id == 0) return FAILED;
+    off = lookupId(id);
+    if (off == 0) return FAILED;
+    size_t nameLen;
+    unserialize4(nameLen, mapData + off + REC_NAMELEN);
+    const byte* e = mapData + off + REC_NAME + nameLen;
+    size = recordLength(off) - REC_NAME - nameLen;
+    if (!entryMatches(e, fileSize, mtime)) return FAILED;
+    debug("Cache: %1 found under name %2", fileName,
+          string(reinterpret_cast<const char*>(mapData + off + REC_NAME),
+                 nameLen));
+    vector<byte>& entry = added[fileName];
+    entry.assign(e, e + size);
+    addedIds[fileName] = id;
+    deleted.erase(fileName);
+    d = &entry[0];
+    off = 0;
+  }
+
+  // Match - update access time, in the file during commit() or close()
+  if (off != 0) {
+    accessed.insert(off);
+  } else {
+    time_t now = time(0);
+    Paranoid(now != static_cast<time_t>(-1));
+    serialize4(static_cast<uint32>(now), d + ACCESS);
+  }
 
   resultData = d + USER_DATA;
-  resultSize = data.size - USER_DATA;
+  resultSize = size - USER_DATA;
   return OK;
 }
 //________________________________________
@@ -133,21 +693,13 @@ Status CacheFile::find(const byte*& resultData, size_t& resultSize,
 Status CacheFile::findName(const byte*& resultData, size_t& resultSize,
     const string& fileName, off_t& resultFileSize,
     time_t& resultMtime) {
-  DBT key; memset(&key, 0, sizeof(DBT));
-  key.data = const_cast<char*>(fileName.c_str());
-  key.size = fileName.size();
-
-  AutoCursor cursor;
-  // Cursor with no transaction id, no flags
-  if (db->cursor(db, 0, &cursor.c, 0) != 0) return FAILED;
-
-  if (cursor.get(&key, &data, DB_SET) == DB_NOTFOUND
-      || data.data == 0) return FAILED;
+  size_t size;
+  uint64 off;
+  byte* d = lookup(fileName, &size, &off);
+  if (d == 0) return FAILED;
 
   // get mtime and size
-  Paranoid(data.size >= USER_DATA);
-  byte* d = static_cast<byte*>(data.data);
-  Paranoid(d != 0);
+  Paranoid(size >= USER_DATA);
   time_t cacheMtime;
   unserialize4(cacheMtime, d + MTIME);
   resultMtime = cacheMtime;
@@ -155,85 +707,513 @@ Status CacheFile::findName(const byte*& resultData, size_t& resultSize,
   unserialize6(cacheFileSize, d + SIZE);
   resultFileSize = cacheFileSize;
 
-  // Match - update access time
-  time_t now = time(0);
-  Paranoid(now != static_cast<time_t>(-1));
-  serialize4(now, d + ACCESS);
-  DBT partial; memset(&partial, 0, sizeof(DBT));
-  partial.data = d + ACCESS;
-  partial.size = 4;
-  partial.flags |= DB_DBT_PARTIAL;
-  partial.doff = ACCESS;
-  partial.dlen = 4;
-  //cerr << "CacheFile lookup successfull for "<<fileName<<endl;
-  cursor.put(&key, &partial, DB_CURRENT);
+  // Match - update access time, in the file during commit() or close()
+  if (off != 0) {
+    accessed.insert(off);
+  } else {
+    time_t now = time(0);
+    Paranoid(now != static_cast<time_t>(-1));
+    serialize4(static_cast<uint32>(now), d + ACCESS);
+  }
 
   resultData = d + USER_DATA;
-  resultSize = data.size - USER_DATA;
+  resultSize = size - USER_DATA;
   return OK;
 }
 //______________________________________________________________________
 
-void CacheFile::expire(time_t t) {
-  DBT key; memset(&key, 0, sizeof(DBT));
-  DBT data; memset(&data, 0, sizeof(DBT));
-  AutoCursor cursor;
-  // Cursor with no transaction id, no flags
-  if (db->cursor(db, 0, &cursor.c, 0) != 0) return;
-
-  int status;
-  while ((status = cursor.get(&key, &data, DB_NEXT)) == 0) {
-    time_t lastAccess = 0;
-    // If data.data == 0, expire entry by leaving lastAccess at 0
-    if (data.data != 0)
-      unserialize4(lastAccess, static_cast<byte*>(data.data) + ACCESS);
-    // Same as 'if (lastAccess<t)', but deals with wraparound:
-    if (static_cast<signed>(t - lastAccess) > 0) {
-      debug("Cache: expiring %1",
-            string(static_cast<char*>(key.data), key.size));
-      cursor.del(0);
+/* Return the entries which are to be kept, i.e. those in index or tail
+   which have not been replaced or deleted, and those in added. To
+   avoid touching all records, index entries are only compared by name
+   if their hash is that of a changed entry. The offsets of index entries
+   which are not live are added to dropped. */
+void CacheFile::liveEntries(vector<Live>& result, set<uint64>* dropped)
+    const {
+  result.clear();
+  set<uint64> changed;
+  for (map<string, uint64>::const_iterator i = tail.begin(), e = tail.end();
+       i != e; ++i)
+    changed.insert(hash(i->first));
+  for (map<string, vector<byte> >::const_iterator i = added.begin(),
+         e = added.end(); i != e; ++i)
+    changed.insert(hash(i->first));
+  for (set<string>::const_iterator i = deleted.begin(), e = deleted.end();
+       i != e; ++i)
+    changed.insert(hash(*i));
+
+  Live x;
+  x.added = 0;
+  x.indexed = true;
+  x.fileId = 0;
+  if (index != 0) {
+    const byte* entries = index + IDX_BUCKETS
+                          + 4 * ((size_t(1) << indexBits) + 1);
+    for (uint64 i = 0; i < indexCount; ++i) {
+      unserialize8(x.hash, entries + 16 * i);
+      unserialize8(x.offset, entries + 16 * i + 8);
+      if (changed.find(x.hash) != changed.end()) {
+        size_t nameLen;
+        unserialize4(nameLen, mapData + x.offset + REC_NAMELEN);
+        string fileName(reinterpret_cast<const char*>(mapData + x.offset
+                                                      + REC_NAME), nameLen);
+        if (tail.find(fileName) != tail.end()
+            || added.find(fileName) != added.end()
+            || deleted.find(fileName) != deleted.end()) {
+          if (dropped != 0) dropped->insert(x.offset);
+          continue;
+        }
+      }
+      result.push_back(x);
     }
   }
-  if (status != DB_NOTFOUND)
-    throw DbError(status);
+  for (map<string, uint64>::const_iterator i = tail.begin(), e = tail.end();
+       i != e; ++i) {
+    if (i->second == 0 || added.find(i->first) != added.end()
+        || deleted.find(i->first) != deleted.end()) continue;
+    x.hash = hash(i->first);
+    x.offset = i->second;
+    x.indexed = false;
+    unserialize8(x.fileId, mapData + x.offset + REC_FILEID);
+    result.push_back(x);
+  }
+  x.offset = 0;
+  for (map<string, vector<byte> >::const_iterator i = added.begin(),
+         e = added.end(); i != e; ++i) {
+    x.hash = hash(i->first);
+    x.added = &*i;
+    x.indexed = false;
+    map<string, uint64>::const_iterator id = addedIds.find(i->first);
+    x.fileId = (id == addedIds.end() ? 0 : id->second);
+    result.push_back(x);
+  }
+}
+//______________________________________________________________________
+
+/* Only looks at those entries in the index whose lastAccess in the age
+   table is older than t. The age table can be out of date because
+   lastAccess is updated in place, so the entry itself is checked before
+   it is deleted. */
+void CacheFile::expire(time_t t) {
+  uint32 cutoff = static_cast<uint32>(t); // Stored like that on disc
+  for (uint64 i = 0; i < indexCount; ++i) {
+    uint32 age;
+    unserialize4(age, ages + 12 * i);
+    if (age >= cutoff) break;
+    uint64 off;
+    unserialize8(off, ages + 12 * i + 4);
+    if (!isCurrent(off)) continue; // Handled below if in tail or added
+    uint32 lastAccess = recordAccess(off);
+    if (lastAccess < cutoff)
+      expireRecord(off);
+    else
+      refreshed[off] = lastAccess;
+  }
+
+  for (map<string, uint64>::const_iterator i = tail.begin(), e = tail.end();
+       i != e; ++i) {
+    if (i->second == 0 || !isCurrent(i->second)) continue;
+    if (recordAccess(i->second) < cutoff) expireRecord(i->second);
+  }
+
+  map<string, vector<byte> >::iterator i = added.begin();
+  while (i != added.end()) {
+    uint32 lastAccess;
+    unserialize4(lastAccess, &i->second[ACCESS]);
+    if (lastAccess >= cutoff) { ++i; continue; }
+    debug("Cache: expiring %1", i->first);
+    addedIds.erase(i->first);
+    added.erase(i++);
+  }
+}
+
+// Mark the entry of the record at off as deleted
+void CacheFile::expireRecord(uint64 off) {
+  size_t nameLen;
+  unserialize4(nameLen, mapData + off + REC_NAMELEN);
+  string fileName(reinterpret_cast<const char*>(mapData + off + REC_NAME),
+                  nameLen);
+  debug("Cache: expiring %1", fileName);
+  deleted.insert(fileName);
+}
+
+/* Return lastAccess of the 'E' record at off in mapData, taking into
+   account that it may have been looked up since the file was opened */
+uint32 CacheFile::recordAccess(uint64 off) const {
+  if (accessed.find(off) != accessed.end())
+    return static_cast<uint32>(time(0));
+  size_t nameLen;
+  unserialize4(nameLen, mapData + off + REC_NAMELEN);
+  uint32 lastAccess;
+  unserialize4(lastAccess, mapData + off + REC_NAME + nameLen + ACCESS);
+  return lastAccess;
 }
 //______________________________________________________________________
 
 /* Prepare for an insertion of data, by allocating a sufficient amount
    of memory and returning a pointer to it. */
 byte* CacheFile::insert_prepare(size_t inSize) {
-  // Allocate enough memory for the new entry
-  void* tmp = realloc(data.data, USER_DATA + inSize);
-  if (tmp == 0) throw bad_alloc();
-  data.data = tmp;
-  data.size = USER_DATA + inSize;
-  return static_cast<byte*>(tmp) + USER_DATA;
+  data.resize(USER_DATA + inSize);
+  return &data[USER_DATA];
 }
 
 /* ASSUMES THAT insert_prepare() HAS JUST BEEN CALLED and that the
    data had been copied to the memory region it returned. This
-   function commits the data to the db. */
+   function adds the data to the entries to write during close(). */
 void CacheFile::insert_perform(const string& fileName, time_t mtime,
-                               uint64 fileSize) {
-  byte* buf = static_cast<byte*>(data.data);
+                               uint64 fileSize, uint64 id) {
+  byte* buf = &data[0];
 
   // Write our data members
   time_t now = time(0);
-  serialize4(now, buf + ACCESS);
+  serialize4(static_cast<uint32>(now), buf + ACCESS);
   serialize4(mtime, buf + MTIME);
   serialize6(fileSize, buf + SIZE);
 
-  // Insert in database
-  DBT key; memset(&key, 0, sizeof(DBT));
-  key.data = const_cast<char*>(fileName.c_str());
-  key.size = fileName.size();
-  db->put(db, 0, &key, &data, 0); // No transaction, overwrite
+  added[fileName].swap(data);
+  if (id != 0)
+    addedIds[fileName] = id;
+  else
+    addedIds.erase(fileName);
+  deleted.erase(fileName);
+}
+//______________________________________________________________________
+
+size_t CacheFile::recordLength(uint64 off) const {
+  size_t len;
+  unserialize4(len, mapData + off + REC_LENGTH);
+  return len;
+}
+
+// Append an 'E' record for an entry in added
+void CacheFile::putEntry(Writer& out, const string& fileName,
+                         const vector<byte>& entry, uint64 id) {
+  byte* p = out.put(REC_NAME);
+  serialize4(REC_NAME + fileName.size() + entry.size(), p + REC_LENGTH);
+  p[REC_TYPE] = 'E';
+  serialize8(id, p + REC_FILEID);
+  serialize4(fileName.size(), p + REC_NAMELEN);
+  out.put(reinterpret_cast<const byte*>(fileName.data()), fileName.size());
+  out.put(&entry[0], entry.size());
+}
 
-//   cerr << "CacheFile write `"<<fileName<<'\'';
-//   for (size_t i = USER_DATA; i < data.get_size(); ++i)
-//     cerr << ' '<< hex << (int)(buf[i]);
-//   cerr << endl;
+// Append a file header without index
+void CacheFile::putHeader(Writer& out) {
+  byte* p = out.put(HEADER_SIZE);
+  memset(p, 0, HEADER_SIZE);
+  memcpy(p, MAGIC, MAGIC_LEN);
+  serialize4(uint32(FORMAT_VERSION), p + VERSION);
+}
+
+/* Append an index over live, idList and ageList, which must contain the
+   final offsets of the records */
+void CacheFile::putIndex(Writer& out, vector<Live>& live,
+                         vector<IdEntry>& idList, vector<AgeEntry>& ageList,
+                         uint64 liveLen) {
+  sort(live.begin(), live.end());
+  sort(idList.begin(), idList.end());
+  sort(ageList.begin(), ageList.end());
+  uint64 count = live.size();
+  uint64 nIds = idList.size();
+  Paranoid(ageList.size() == count);
+  unsigned bits = 0;
+  while ((uint64(1) << bits) < count / 2) ++bits;
+  size_t buckets = size_t(1) << bits;
+  uint64 len = IDX_BUCKETS + (uint64(buckets) + 1) * 4 + (count + nIds) * 16
+               + count * 12;
+  if (len >= (uint64(1) << 32))
+    throw DbError(0, subst(_("Too many entries in `%1'"),
+                           out.fileName()));
+
+  byte* p = out.put(IDX_BUCKETS);
+  serialize4(len, p + REC_LENGTH);
+  p[REC_TYPE] = 'I';
+  p[IDX_BITS] = static_cast<byte>(bits); // Less than 32
+  serialize8(count, p + IDX_COUNT);
+  serialize8(nIds, p + IDX_IDCOUNT);
+  serialize8(liveLen, p + IDX_LIVE);
+  // For each bucket, the number of the first entry in it
+  size_t i = 0;
+  for (size_t b = 0; b <= buckets; ++b) {
+    while (i < count && (bits == 0 ? 0 : live[i].hash >> (64 - bits)) < b)
+      ++i;
+    serialize4(i, out.put(4));
+  }
+  for (i = 0; i < count; ++i) {
+    p = out.put(16);
+    serialize8(live[i].hash, p);
+    serialize8(live[i].offset, p + 8);
+  }
+  for (i = 0; i < nIds; ++i) {
+    p = out.put(16);
+    serialize8(idList[i].first, p);
+    serialize8(idList[i].second, p + 8);
+  }
+  for (i = 0; i < count; ++i) {
+    p = out.put(12);
+    serialize4(ageList[i].first, p);
+    serialize8(ageList[i].second, p + 4);
+  }
 }
 //______________________________________________________________________
 
-#endif /* HAVE_LIBDB */
+/* Unlike close(), this only appends the records and writes no new index;
+   the next open() or commit() finds them after the current index. */
+void CacheFile::commit() {
+  if (fd == -1) return;
+  if (convert) {
+    // The file does not have a header yet
+    if (!writeChanges()) return;
+  } else {
+    if (added.empty() && deleted.empty() && accessed.empty()) return;
+    appendRecords();
+  }
+  /* Start over with the file as it is now. Unless it was rewritten, the
+     records up to logEnd are unchanged, so only the new ones are read -
+     re-reading all records after the index on each commit would make a
+     long run quadratic. */
+  bool resume = !convert;
+  unmap(resume);
+  added.clear(); addedIds.clear(); deleted.clear();
+  convert = false;
+  if (!mapFile(resume))
+    throw DbError(0, subst(_("`%1' is not a jigdo-file cache"), name));
+}
+
+void CacheFile::close() {
+  if (fd == -1) return;
+  if (compactor != 0)
+    finishCompaction();
+  else
+    writeChanges();
+  unmap();
+  int r = ::close(fd);
+  fd = -1;
+  if (r != 0) throw writeError(name);
+}
+
+/* Append the changes to the old file, then have the compactor copy
+   them to the new file, which replaces the old one */
+void CacheFile::finishCompaction() {
+  uint64 end = appendRecords();
+  int newFd = compactor->finish(fd, end);
+  string tmpName = compactor->tmpFileName();
+  delete compactor;
+  compactor = 0;
+  if (newFd == -1) return;
+  unmap();
+  ::close(fd);
+  fd = newFd;
+  renameOver(tmpName, name);
+}
+
+/* Write any changes to the file. Returns false if there were none. A
+   new index is only appended once the records after the current one
+   amount to more than 1/8 of its entries. Until then, the changes are
+   just appended like in commit(), instead of an index for all entries
+   whenever one of them changes. */
+bool CacheFile::writeChanges() {
+  uint64 changes = tail.size() + added.size() + deleted.size()
+                   + refreshed.size();
+  if (!convert && changes <= indexCount / 8) {
+    if (added.empty() && deleted.empty() && accessed.empty()) return false;
+    appendRecords();
+    return true;
+  }
+
+  vector<Live> live;
+  set<uint64> dropped;
+  liveEntries(live, &dropped);
+  // Total length of the records in mapData which are kept
+  uint64 keptLen = liveBytes;
+  for (set<string>::const_iterator i = deleted.begin(), e = deleted.end();
+       i != e; ++i) {
+    uint64 off = lookupMapped(*i);
+    if (off != 0) keptLen -= recordLength(off);
+  }
+  uint64 addedLen = 0;
+  for (map<string, vector<byte> >::const_iterator i = added.begin(),
+         e = added.end(); i != e; ++i) {
+    uint64 off = lookupMapped(i->first);
+    if (off != 0) keptLen -= recordLength(off);
+    addedLen += REC_NAME + i->first.size() + i->second.size();
+  }
+
+  if (convert)
+    writeFile(live);
+  else
+    appendChanges(live, dropped, keptLen + addedLen);
+  return true;
+}
+
+// Update lastAccess of the entries in mapData which were looked up
+void CacheFile::writeAccessTimes() {
+  byte buf[4];
+  serialize4(static_cast<uint32>(time(0)), buf);
+  for (set<uint64>::const_iterator i = accessed.begin(), e = accessed.end();
+       i != e; ++i) {
+    size_t nameLen;
+    unserialize4(nameLen, mapData + *i + REC_NAMELEN);
+    writeAt(fd, *i + REC_NAME + nameLen + ACCESS, buf, 4, name);
+    // The compactor may already have copied the record
+    if (compactor != 0 && *i < compactor->end) compactor->accessed.insert(*i);
+  }
+}
+
+/* Update lastAccess of the entries in mapData which were looked up and
+   append records for the entries in added and deleted. Returns the new
+   end of the log. */
+uint64 CacheFile::appendRecords() {
+  writeAccessTimes();
+  if (added.empty() && deleted.empty()) return logEnd;
+  // Remove any incomplete record at the end
+  if (logEnd != mapLen && compat_truncate(name.c_str(), logEnd) != 0)
+    throw writeError(name);
+  Writer out(fd, logEnd, name);
+  putDeleted(out);
+  for (map<string, vector<byte> >::const_iterator i = added.begin(),
+         e = added.end(); i != e; ++i) {
+    map<string, uint64>::const_iterator id = addedIds.find(i->first);
+    putEntry(out, i->first, i->second,
+             (id == addedIds.end() ? 0 : id->second));
+  }
+  out.flush();
+  return out.pos();
+}
+
+// Append a 'D' record for each entry in deleted
+void CacheFile::putDeleted(Writer& out) {
+  for (set<string>::const_iterator i = deleted.begin(), e = deleted.end();
+       i != e; ++i) {
+    byte* p = out.put(REC_NAME);
+    serialize4(REC_NAME + i->size(), p + REC_LENGTH);
+    p[REC_TYPE] = 'D';
+    serialize8(uint64(0), p + REC_FILEID);
+    serialize4(i->size(), p + REC_NAMELEN);
+    out.put(reinterpret_cast<const byte*>(i->data()), i->size());
+  }
+}
+
+/* Update lastAccess of the entries in mapData which were looked up. If
+   there are other changes, append them to the log, followed by a new
+   index. Entries for which expire() found the age table to be out of
+   date count as changes, so once there are enough of them, later calls
+   need not look at the same entries again. */
+void CacheFile::appendChanges(vector<Live>& live,
+                              const set<uint64>& dropped, uint64 liveLen) {
+  writeAccessTimes();
+  if (!added.empty() || !deleted.empty() || !tail.empty()
+      || logEnd != mapLen || !refreshed.empty()) {
+    // Remove any incomplete record at the end
+    if (logEnd != mapLen && compat_truncate(name.c_str(), logEnd) != 0)
+      throw writeError(name);
+    Writer out(fd, logEnd, name);
+    putDeleted(out);
+    // Take over the entries of the old index which are kept
+    vector<IdEntry> idList;
+    for (uint64 i = 0; i < idCount; ++i) {
+      uint64 id, off;
+      unserialize8(id, ids + 16 * i);
+      unserialize8(off, ids + 16 * i + 8);
+      if (dropped.find(off) == dropped.end())
+        idList.push_back(IdEntry(id, off));
+    }
+    vector<AgeEntry> ageList;
+    uint32 now = static_cast<uint32>(time(0));
+    for (uint64 i = 0; i < indexCount; ++i) {
+      uint32 age;
+      uint64 off;
+      unserialize4(age, ages + 12 * i);
+      unserialize8(off, ages + 12 * i + 4);
+      if (dropped.find(off) != dropped.end()) continue;
+      if (accessed.find(off) != accessed.end()) {
+        age = now;
+      } else {
+        map<uint64, uint32>::const_iterator r = refreshed.find(off);
+        if (r != refreshed.end()) age = r->second;
+      }
+      ageList.push_back(AgeEntry(age, off));
+    }
+    for (vector<Live>::iterator i = live.begin(), e = live.end(); i != e;
+         ++i) {
+      if (i->indexed) continue;
+      uint32 lastAccess;
+      if (i->added != 0) {
+        i->offset = out.pos();
+        putEntry(out, i->added->first, i->added->second, i->fileId);
+        unserialize4(lastAccess, &i->added->second[ACCESS]);
+      } else {
+        lastAccess = recordAccess(i->offset);
+      }
+      if (i->fileId != 0) idList.push_back(IdEntry(i->fileId, i->offset));
+      ageList.push_back(AgeEntry(lastAccess, i->offset));
+    }
+    uint64 indexOff = out.pos();
+    putIndex(out, live, idList, ageList, liveLen);
+    out.flush();
+    // Only now that everything is written, make the new index current
+    byte buf[8];
+    serialize8(indexOff, buf);
+    writeAt(fd, INDEX_OFFSET, buf, 8, name);
+  }
+}
+
+/* Write all of live to a new file, which then replaces the old one. Used
+   to compact the file, and to create or convert it. */
+void CacheFile::writeFile(vector<Live>& live) {
+  string tmpName = name;
+  tmpName += ".tmp";
+  int tmpFd = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
+                   0666);
+  if (tmpFd == -1) throw writeError(tmpName);
+  debug("Writing new `%1' with %2 entries", name, live.size());
+
+  try {
+    Writer out(tmpFd, 0, tmpName);
+    putHeader(out);
+
+    byte now[4];
+    serialize4(static_cast<uint32>(time(0)), now);
+    // Copy old records in the order they are in the file
+    sort(live.begin(), live.end(), Live::lessOffset);
+    vector<IdEntry> idList;
+    vector<AgeEntry> ageList;
+    for (vector<Live>::iterator i = live.begin(), e = live.end(); i != e;
+         ++i) {
+      uint64 off = out.pos();
+      uint32 lastAccess;
+      if (i->added != 0) {
+        putEntry(out, i->added->first, i->added->second, i->fileId);
+        unserialize4(lastAccess, &i->added->second[ACCESS]);
+      } else {
+        size_t len = recordLength(i->offset);
+        byte* p = out.put(len);
+        memcpy(p, mapData + i->offset, len);
+        unserialize8(i->fileId, p + REC_FILEID);
+        size_t nameLen;
+        unserialize4(nameLen, p + REC_NAMELEN);
+        if (accessed.find(i->offset) != accessed.end())
+          memcpy(p + REC_NAME + nameLen + ACCESS, now, 4);
+        unserialize4(lastAccess, p + REC_NAME + nameLen + ACCESS);
+      }
+      i->offset = off;
+      if (i->fileId != 0) idList.push_back(IdEntry(i->fileId, off));
+      ageList.push_back(AgeEntry(lastAccess, off));
+    }
+    uint64 indexOff = out.pos();
+    putIndex(out, live, idList, ageList, indexOff - HEADER_SIZE);
+    out.flush();
+    byte buf[8];
+    serialize8(indexOff, buf);
+    writeAt(tmpFd, INDEX_OFFSET, buf, 8, tmpName);
+  } catch (DbError) {
+    ::close(tmpFd);
+    remove(tmpName.c_str());
+    throw;
+  }
+
+  // From now on, tmpFd is the cache file
+  unmap();
+  ::close(fd);
+  fd = tmpFd;
+  renameOver(tmpName, name);
+}
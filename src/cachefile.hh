@@ -13,11 +13,10 @@
 
   Cache with MD5 sums of file contents - used by JigdoCache in scan.hh
 
-  The created libdb3 database contains one table with a mapping from
-  filenames (without trailing zero byte) to a binary structure. The
-  filename key is the second part of the complete filename, i.e. the
-  part after any "//", as returned by FilePart::leafName(). The binary
-  structure has the following format:
+  The cache maps filenames to a binary structure. The filename key is
+  the second part of the complete filename, i.e. the part after any
+  "//", as returned by FilePart::leafName(). The binary structure has
+  the following format:
 
   This is accessed and interpreted by CacheFile:<pre>
   Size Meaning
@@ -31,15 +30,73 @@
    4   md5BlockLength
    4   blocks (number of valid md5 blocks in this entry)
    8   rsyncSum of file start (only valid if blocks > 0)
-  16   fileMD5Sum (only valid if
+  16   fileMD5Sum (only valid if, for any of the parameter sets,
                    blocks == (fileSize+md5BlockLength-1)/md5BlockLength )
   followed by n entries:
-  16   md5sum of block of size md5BlockLength</pre>
+  16   md5sum of block of size md5BlockLength
+  followed by sums for other blockLength/md5BlockLength parameters,
+  in the same format but without fileMD5Sum - see scan.cc</pre>
 
   Why is mtime and size not part of the key? Because we only want to
   store one entry per file, not an additional entry whenever the file
   is changed.
 
+  Entries can also be found by the device and inode number of the file,
+  as long as its mtime and size still match. This way, a file which was
+  renamed, or a hard link to it under another name, does not need to be
+  read again. The entry is then copied to the new filename.
+
+  The cache file is a log of records which is only ever appended to,
+  except for the lastAccess fields and the header, which are updated in
+  place. All numbers are little-endian:<pre>
+  Size Meaning
+  16   "jigdo-file cache" (no trailing zero byte)
+   8   indexOffset - offset of the current index record, or 0 if none
+   4   version - format version, currently 1
+   4   reserved, 0
+  followed by records:
+   4   recordLength, including these 4 bytes
+   1   type: 'E' = entry, 'D' = entry deleted, 'I' = index
+  for 'E' and 'D':
+   8   fileId - see fileId() below, 0 if not known
+   4   nameLength
+   n   filename
+  for 'E', the entry as described above (lastAccess, fileMtime, ...)
+  for 'I':
+   1   bits - the index has 2^bits buckets
+   8   count - number of entries in the index
+   8   idCount - number of fileId entries
+   8   liveBytes - total recordLength of the records in the index
+  (2^bits+1)*4  number of the first index entry of each bucket
+  followed by count index entries, sorted by hash:
+   8   hash - 64-bit FNV-1a hash of the filename
+   8   offset of the 'E' record in the file
+  followed by idCount fileId entries for the records with a fileId,
+  sorted by fileId:
+   8   fileId
+   8   offset of the 'E' record in the file
+  followed by count age table entries, sorted by lastAccess:
+   4   lastAccess of the entry when the index was written
+   8   offset of the 'E' record in the file</pre>
+
+  The file is memory-mapped. The index covers all entries whose records
+  come before it, so most lookups need no more than a hash calculation
+  and two or three memory accesses. Only the records after the index,
+  i.e. those written after the index, are read when the file is
+  opened. commit() and close() append new and changed entries. close()
+  only appends a new index once the records after the index amount to
+  more than 1/8 of the entries in it, so a run which changes few entries
+  appends little more than their records.
+
+  If more than half of the file consists of stale records when it is
+  opened, a thread copies the current records to a new file while the
+  cache is in use. close() waits for it, appends the records written in
+  the meantime, and then replaces the old file with the new one.
+
+  A file with an unknown version is neither used nor overwritten, and
+  neither is a Berkeley DB file as written by older jigdo-file
+  versions.
+
 */
 
 #ifndef CACHEFILE_HH
@@ -47,21 +104,19 @@
 
 #include <config.h>
 
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include <time.h> /* for time_t */
-
-#if HAVE_LIBDB
-#include <db.h>
-#include <stdlib.h> /* free() */
-#include <string.h> /* memcpy(), memset() */
+#include <string.h> /* memcpy() */
 
 #include <debug.hh>
 #include <status.hh>
 //______________________________________________________________________
 
-/** libdb errors */
+/** Errors when accessing the cache file */
 struct DbError : public Error {
-  explicit DbError(int c) : Error(db_strerror(c)), code(c) { }
   DbError(int c, const string& m) : Error(m), code(c) { }
   DbError(int c, const char* m) : Error(m), code(c) { }
   int code;
@@ -71,9 +126,15 @@ struct DbError : public Error {
 /** Cache with MD5 sums of file contents */
 class CacheFile {
 public:
-  /** Create new database or open existing database */
+  /** Create new cache file or open existing one. Throws DbError if the
+      file exists but is not a cache file of this format version. */
   CacheFile(const char* dbName);
-  inline ~CacheFile();
+  /** Does not close(), i.e. changes are lost unless close() was called */
+  ~CacheFile();
+
+  /** Return an ID for the file with the given device and inode number
+      (from stat()), or 0 if the system does not provide inode numbers. */
+  static uint64 fileId(uint64 dev, uint64 ino);
 
   /** Look for an entry in the database which matches the specified filename
       (which must be absolute), file modification time and file size. If no
@@ -81,9 +142,12 @@ public:
       resultData/resultSize with ptr/len of the binary string associated with
       this file. The first byte of resultData is the first byte of the
       "blockLength" entry (see start of this file). The result pointer is
-      only valid until the next database operation. */
+      only valid until the next database operation.
+      If there is no matching entry for fileName, but one for the non-zero
+      id, that entry is returned and also stored under fileName. */
   Status find(const byte*& resultData, size_t& resultSize,
-              const string& fileName, uint64 fileSize, time_t mtime);
+              const string& fileName, uint64 fileSize, time_t mtime,
+              uint64 id = 0);
 
   /** Look for an entry in the database which matches the specified filename
       (which must be absolute).
@@ -97,27 +161,38 @@ public:
                   off_t& resultFileSize, time_t& resultMtime);
 
   /** Insert/overwrite entry for the given file (name must be
-      absolute, file must have the supplied mtime and size). The data
-      for the entry is supplied in inData. */
+      absolute, file must have the supplied mtime, size and fileId()).
+      The data for the entry is supplied in inData. */
   inline void insert(const byte* inData, size_t inSize,
-                     const string& fileName, time_t mtime, uint64 fileSize);
+                     const string& fileName, time_t mtime, uint64 fileSize,
+                     uint64 id = 0);
   /** As above, but data is created by the supplied functor object,
       which must have the method 'void operator()(byte* x)' defined,
       which when called must write inSize bytes to the memory at x. */
   template<class Functor>
   inline void insert(Functor f, size_t inSize, const string& fileName,
-                     time_t mtime, uint64 fileSize);
+                     time_t mtime, uint64 fileSize, uint64 id = 0);
 
   /** Remove all entries from the database that have a "last access"
-      time that is older than the given time. */
+      time that is older than the given time. Thanks to the age table in
+      the index, only entries which were last accessed before the given
+      time when the index was written need to be looked at. */
   void expire(time_t t);
 
+  /** Write out any changes, keeping the file open. Afterwards, the
+      changes are safe even if the program is killed. Never writes a new
+      index. Throws DbError. */
+  void commit();
+  /** Write out any changes and close the file. Throws DbError. */
+  void close();
+
 private:
   // Don't copy
   explicit inline CacheFile(const CacheFile&);
   inline CacheFile& operator=(const CacheFile&);
   byte* insert_prepare(size_t inSize);
-  void insert_perform(const string& fileName, time_t mtime, uint64 fileSize);
+  void insert_perform(const string& fileName, time_t mtime, uint64 fileSize,
+                      uint64 id);
 
   /* Byte offsets of first members of a cache entry (see start of this
      file). Defining a struct with byte members would be more
@@ -125,54 +200,103 @@ private:
      alignment problems. (E.g., a RISC machine might pad to the next
      multiple of 4 bytes after every byte member.) */
   enum { ACCESS = 0, MTIME = 4, SIZE = 8, USER_DATA = 14 };
+  // Same for the file header, records and index records
+  enum { INDEX_OFFSET = 16, VERSION = 24, HEADER_SIZE = 32 };
+  enum { FORMAT_VERSION = 1 };
+  enum { REC_LENGTH = 0, REC_TYPE = 4, REC_FILEID = 5, REC_NAMELEN = 13,
+         REC_NAME = 17 };
+  enum { IDX_BITS = 5, IDX_COUNT = 6, IDX_IDCOUNT = 14, IDX_LIVE = 22,
+         IDX_BUCKETS = 30 };
 
-  DB* db; // Database object
-  DBT data; // Object for result data
-};
-//______________________________________________________________________
+  struct Live;
+  typedef pair<uint64, uint64> IdEntry; // fileId, offset of 'E' record
+  typedef pair<uint32, uint64> AgeEntry; // lastAccess, offset
+  class Writer;
+  class Compactor;
+  static uint64 hash(const string& fileName);
+  /* Read the current index and the records after it. With resume, tail
+     etc. are still valid for the records before logEnd, and only the
+     ones after it are read. */
+  void readLog(bool resume = false);
+  // Find entry in mapped file: record offset, or 0 if not present
+  uint64 lookupMapped(const string& fileName) const;
+  // Find any entry, return pointer to its data (ACCESS etc.) or null
+  byte* lookup(const string& fileName, size_t* dataSize, uint64* recordOff);
+  // Find current 'E' record in mapData with that fileId, or 0
+  uint64 lookupId(uint64 id) const;
+  bool isCurrent(uint64 off) const;
+  static bool entryMatches(const byte* d, uint64 fileSize, time_t mtime);
+  void liveEntries(vector<Live>& result, set<uint64>* dropped = 0) const;
+  size_t recordLength(uint64 off) const;
+  void putEntry(Writer& out, const string& fileName,
+                const vector<byte>& entry, uint64 id);
+  void putDeleted(Writer& out);
+  void writeAccessTimes();
+  static void putHeader(Writer& out);
+  static void putIndex(Writer& out, vector<Live>& live,
+                       vector<IdEntry>& idList, vector<AgeEntry>& ageList,
+                       uint64 liveLen);
+  uint32 recordAccess(uint64 off) const;
+  void expireRecord(uint64 off);
+  bool mapFile(bool resume = false);
+  bool writeChanges();
+  void writeFile(vector<Live>& live);
+  uint64 appendRecords();
+  void appendChanges(vector<Live>& live, const set<uint64>& dropped,
+                     uint64 liveLen);
+  void finishCompaction();
+  void unmap(bool keepLog = false);
 
-CacheFile::~CacheFile() {
-  free(data.data);
-  Paranoid(db != 0);
-  db->close(db, 0); // no flags, ignore any errors
-}
+  string name; // Filename of cache
+  int fd; // -1 after close()
+  byte* mapData; // Contents of file at the time it was opened
+  uint64 mapLen;
+  bool mapped; // true => mapData is mmap()ed, else allocated with new
+  bool convert; // true => mapData is not to be kept, write new file
+
+  // Data of index record in mapData, or null
+  const byte* index;
+  unsigned indexBits;
+  uint64 indexCount;
+  const byte* ids; // fileId entries of index
+  uint64 idCount;
+  const byte* ages; // Age table of index, indexCount entries
+  uint64 liveBytes; // Sum of recordLength of current records in mapData
+  uint64 logEnd; // End of last complete record in mapData
+
+  /* Records in mapData after the index, by filename: Offset of 'E'
+     record, or 0 for 'D' */
+  map<string, uint64> tail;
+  // 'E' records in mapData after the index, by fileId
+  map<uint64, uint64> tailIds;
+  // New entries not yet written to the file, incl. ACCESS etc.
+  map<string, vector<byte> > added;
+  map<string, uint64> addedIds; // fileId of entries in added, if known
+  // Filenames of entries in mapData which expire() deleted
+  set<string> deleted;
+  // Offsets of 'E' records in mapData whose lastAccess must be updated
+  set<uint64> accessed;
+  /* Records in mapData whose lastAccess expire() found to be newer than
+     in the age table */
+  map<uint64, uint32> refreshed;
+  // Non-null while the file is being compacted in the background
+  Compactor* compactor;
+
+  vector<byte> data; // Buffer for insert_prepare()/insert_perform()
+};
 //______________________________________________________________________
 
 void CacheFile::insert(const byte* inData, size_t inSize,
-    const string& fileName, time_t mtime, uint64 fileSize) {
+    const string& fileName, time_t mtime, uint64 fileSize, uint64 id) {
   memcpy(insert_prepare(inSize), inData, inSize);
-  insert_perform(fileName, mtime, fileSize);
+  insert_perform(fileName, mtime, fileSize, id);
 }
 
 template<class Functor>
 void CacheFile::insert(Functor f, size_t inSize, const string& fileName,
-                       time_t mtime, uint64 fileSize) {
+                       time_t mtime, uint64 fileSize, uint64 id) {
   f(insert_prepare(inSize));
-  insert_perform(fileName, mtime, fileSize);
+  insert_perform(fileName, mtime, fileSize, id);
 }
 
-//======================================================================
-
-#else
-
-// !HAVE_LIBDB - provide a dummy implementation which does nothing
-
-class CacheFile {
-public:
-  CacheFile(const char*) { }
-  ~CacheFile() { }
-  bool find(const byte*&, size_t&, const string&, time_t, uint64) {
-    return false;
-  }
-  bool find_name(const byte*&, size_t&, const string&,
-                 long long int&, time_t&) {
-    return false;
-  }
-  template<class Functor>
-  void insert(Functor, size_t, const string&, time_t, uint64) { }
-  void insert(const byte*, size_t, const string&, time_t, uint64) { }
-  void expire(time_t) { }
-};
-
-#endif
 #endif
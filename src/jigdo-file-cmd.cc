@@ -15,6 +15,7 @@
 
 #include <fstream>
 #include <memory>
+#include <new>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd-jigdo.h>
@@ -200,6 +201,8 @@ void JigdoFileCmd::addUris(ConfigFile& config) {
 //______________________________________________________________________
 
 int JigdoFileCmd::makeTemplate() {
+  if (!batchFile.empty()) return makeTemplateBatch();
+
   if (imageFile.empty() || jigdoFile.empty() || templFile.empty()) {
     cerr << subst(_("%1"
       " make-template: Not all of --image, --jigdo, --template specified.\n"
@@ -207,6 +210,18 @@ int JigdoFileCmd::makeTemplate() {
     exit_tryHelp();
   }
 
+  if (prevTemplFile.empty() != prevJigdoFile.empty()) {
+    cerr << subst(_("%1 make-template: --previous-template and "
+                    "--previous-jigdo must be used together\n"), binaryName);
+    exit_tryHelp();
+  }
+  if (!prevTemplFile.empty() && imageFile == "-") {
+    cerr << subst(_("%1 make-template: Cannot use --previous-template "
+                    "when reading the image from standard input"),
+                  binaryName) << endl;
+    return 3;
+  }
+
   if (fileNames.empty()) {
     optReporter->info(_("Warning - no files specified. The template will "
                         "contain the complete image contents!"));
@@ -216,9 +231,58 @@ int JigdoFileCmd::makeTemplate() {
   if (willOutputTo(jigdoFile, optForce)
       + willOutputTo(templFile, optForce) > 0) throw Cleanup(3);
 
+  // Template and jigdo file of the previous version of the image
+  bistream* prevTempl = 0;
+  auto_ptr<bistream> prevTemplDel;
+  ConfigFile prevJigdo;
+  if (!prevTemplFile.empty()) {
+    prevTemplDel.reset(openForInput(prevTempl, prevTemplFile));
+    istream* prevJigdoIn;
+    auto_ptr<istream> prevJigdoDel(openForInput(prevJigdoIn,
+                                                prevJigdoFile));
+    *prevJigdoIn >> prevJigdo;
+    if (prevJigdoIn->bad()) {
+      string err = subst(_("%1 make-template: Could not read `%2' (%3)"),
+                         binaryName, prevJigdoFile, strerror(errno));
+      optReporter->error(err);
+      return 3;
+    }
+  }
+  //____________________
+
+  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
+  if (makeTemplate_cache(cache)) return 3;
+  return makeTemplate1(cache, 0, *optReporter, optThreads, imageFile,
+                       jigdoFile, templFile, prevTempl, &prevJigdo);
+}
+//______________________________________________________________________
+
+/* Set up the cache for make-template and read the names of the files */
+int JigdoFileCmd::makeTemplate_cache(JigdoCache& cache) {
+  cache.setParams(blockLength, md5BlockLength);
+  cache.setCheckFiles(optCheckFiles);
+  cache.setThreads(optThreads);
+  if (addLabels(cache)) return 3;
+  while (true) {
+    try { cache.readFilenames(fileNames); } // Recurse through directories
+    catch (RecurseError e) { optReporter->error(e.message); continue; }
+    break;
+  }
+  return 0;
+}
+//______________________________________________________________________
+
+/* Create the template and jigdo file for one image, using an already set
+   up cache. With --batch, index is shared by all images, otherwise null.
+   threads is the number of threads to use for this image. prevTempl is
+   null unless --previous-template was given. */
+int JigdoFileCmd::makeTemplate1(JigdoCache& cache,
+    MkTemplate::FileIndex* index, AnyReporter& reporter, unsigned threads,
+    const string& imageName, const string& jigdoName,
+    const string& templName, bistream* prevTempl, ConfigFile* prevJigdo) {
   // Open files
   bistream* image;
-  auto_ptr<bistream> imageDel(openForInput(image, imageFile));
+  auto_ptr<bistream> imageDel(openForInput(image, imageName));
 
   auto_ptr<ConfigFile> cfDel(new ConfigFile());
   ConfigFile* cf = cfDel.get();
@@ -230,48 +294,54 @@ int JigdoFileCmd::makeTemplate() {
     if (jigdoMerge->bad()) {
       string err = subst(_("%1 make-template: Could not read `%2' (%3)"),
                          binaryName, jigdoMergeFile, strerror(errno));
-      optReporter->error(err);
+      reporter.error(err);
       return 3;
     }
   }
-  JigdoConfig jc(jigdoFile, cfDel.release(), *optReporter);
+  JigdoConfig jc(jigdoName, cfDel.release(), reporter);
 
   bostream* templ;
-  auto_ptr<bostream> templDel(openForOutput(templ, templFile));
+  auto_ptr<bostream> templDel(openForOutput(templ, templName));
   //____________________
 
-  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
-  cache.setParams(blockLength, md5BlockLength);
-  cache.setCheckFiles(optCheckFiles);
-  if (addLabels(cache)) return 3;
-  while (true) {
-    try { cache.readFilenames(fileNames); } // Recurse through directories
-    catch (RecurseError e) { optReporter->error(e.message); continue; }
-    break;
-  }
   // Create and run MkTemplate operation
   auto_ptr<MkTemplate>
-    op(new MkTemplate(&cache, image, &jc, templ, *optReporter,
-                      optZipQuality, readAmount, optAddImage, optAddServers,
-                      optBzip2));
+    op(new MkTemplate(&cache, image, &jc, templ, reporter,
+                      (optCompression == MkTemplate::ZSTD ?
+                       optZstdLevel : optZipQuality),
+                      readAmount, optAddImage, optAddServers,
+                      optCompression));
   op->setMatchExec(optMatchExec);
   op->setGreedyMatching(optGreedyMatching);
-  size_t lastDirSep = imageFile.rfind(DIRSEP);
+  op->setThreads(threads);
+  op->setParallelGzip(optParallelGzip);
+  op->setStoreIncompressible(optStoreIncompressible);
+  op->setZeroRunLength(optZeroRuns);
+  op->setAlignment(optAlign);
+  op->setFileIndex(index);
+  if (optMapImage && imageName != "-") op->setMapImage(imageName);
+  if (prevTempl != 0) op->setPrevious(prevTemplFile, prevTempl, prevJigdo);
+  size_t lastDirSep = imageName.rfind(DIRSEP);
   if (lastDirSep == string::npos) lastDirSep = 0; else ++lastDirSep;
-  string imageFileLeaf(imageFile, lastDirSep);
-  lastDirSep = templFile.rfind(DIRSEP);
+  string imageFileLeaf(imageName, lastDirSep);
+  lastDirSep = templName.rfind(DIRSEP);
   if (lastDirSep == string::npos) lastDirSep = 0; else ++lastDirSep;
-  string templFileLeaf(templFile, lastDirSep);
-  if (op->run(imageFileLeaf, templFileLeaf)) return 3;
+  string templFileLeaf(templName, lastDirSep);
+  bool failed = op->run(imageFileLeaf, templFileLeaf);
+  if (optStats) {
+    string s;
+    reporter.statsInfo(op->stats().appendJson(s));
+  }
+  if (failed) return 3;
 
   // Write out jigdo file
   ostream* jigdoF;
-  auto_ptr<ostream> jigdoDel(openForOutput(jigdoF, jigdoFile));
+  auto_ptr<ostream> jigdoDel(openForOutput(jigdoF, jigdoName));
   *jigdoF << jc.configFile();
   if (jigdoF->bad()) {
     string err = subst(_("%1 make-template: Could not write `%2' (%3)"),
-                       binaryName, jigdoFile, strerror(errno));
-    optReporter->error(err);
+                       binaryName, jigdoName, strerror(errno));
+    reporter.error(err);
     return 3;
   }
 
@@ -279,6 +349,207 @@ int JigdoFileCmd::makeTemplate() {
 }
 //______________________________________________________________________
 
+namespace {
+
+  /* With --batch-jobs, the reporter for the cache and all MkTemplates.
+     Passes everything on to optReporter, but only on one thread at a
+     time, so the progress line does not get garbled. */
+  class LockingReporter : public AnyReporter {
+  public:
+    explicit LockingReporter(AnyReporter* r) : rep(r), mutex() { }
+    virtual void error(const string& message) {
+      MutexLock lock(mutex); rep->error(message);
+    }
+    virtual void info(const string& message) {
+      MutexLock lock(mutex); rep->info(message);
+    }
+    virtual void coutInfo(const string& message) {
+      MutexLock lock(mutex); rep->coutInfo(message);
+    }
+    virtual void statsInfo(const string& message) {
+      MutexLock lock(mutex); rep->statsInfo(message);
+    }
+    virtual void scanningFile(const FilePart* file, uint64 offInFile) {
+      MutexLock lock(mutex); rep->scanningFile(file, offInFile);
+    }
+    virtual void scanningImage(uint64 offset) {
+      MutexLock lock(mutex); rep->scanningImage(offset);
+    }
+    virtual void matchFound(const FilePart* file, uint64 offInImage) {
+      MutexLock lock(mutex); rep->matchFound(file, offInImage);
+    }
+    virtual void finished(uint64 imageSize) {
+      MutexLock lock(mutex); rep->finished(imageSize);
+    }
+  private:
+    AnyReporter* rep;
+    Mutex mutex;
+  };
+
+} // local namespace
+
+/* Thread which creates templates for the images of a --batch, taking the
+   next image from the list whenever it has finished one. Errors are
+   reported like main() does it, but only end this thread. */
+class JigdoFileCmd::MakeTemplateThread : public Thread {
+public:
+  MakeTemplateThread(JigdoCache& c, MkTemplate::FileIndex& i,
+                     AnyReporter& r, unsigned threadsPerImage,
+                     const vector<string>& names, size_t& next,
+                     Mutex& nextMutex)
+    : cache(c), index(i), reporter(r), threads(threadsPerImage),
+      batch(names), nextImage(next), mutex(nextMutex), result(0) { }
+  /** Process images until none are left. Called by run(), but can also
+      be called directly to do the work on the calling thread. */
+  void process();
+  /** 0 if all of this thread's images were OK, else 3 */
+  int returnValue() const { return result; }
+protected:
+  virtual void run() { process(); }
+private:
+  JigdoCache& cache;
+  MkTemplate::FileIndex& index;
+  AnyReporter& reporter;
+  unsigned threads;
+  const vector<string>& batch;
+  size_t& nextImage; // Index of next image in batch, shared by threads
+  Mutex& mutex; // Protects nextImage
+  int result;
+};
+
+void JigdoFileCmd::MakeTemplateThread::process() {
+  while (true) {
+    size_t i;
+    {
+      MutexLock lock(mutex);
+      if (nextImage == batch.size()) return;
+      i = nextImage;
+      nextImage += 3;
+    }
+    int r;
+    try {
+      r = makeTemplate1(cache, &index, reporter, threads, batch[i],
+                        batch[i + 1], batch[i + 2], 0, 0);
+    } catch (Cleanup c) {
+      r = c.returnValue;
+    } catch (Error e) {
+      string err = binaryName; err += ": "; err += e.message;
+      reporter.error(err);
+      r = 3;
+    } catch (bad_alloc) {
+      reporter.error(subst(_("%1: Out of memory - aborted."), binaryName));
+      result = 3;
+      return;
+    } catch (...) { // Uncaught exception - this should not happen(tm)
+      string err = binaryName; err += ": Unknown error";
+      reporter.error(err);
+      result = 3;
+      return;
+    }
+    if (r != 0) result = r;
+  }
+}
+//______________________________________________________________________
+
+/* make-template with --batch: Read the files once, then create templates
+   for all images listed in batchFile. */
+int JigdoFileCmd::makeTemplateBatch() {
+  if (!imageFile.empty() || !jigdoFile.empty() || !templFile.empty()) {
+    cerr << subst(_("%1 make-template: --batch cannot be used together "
+                    "with --image, --jigdo or --template\n"), binaryName);
+    exit_tryHelp();
+  }
+  if (!prevTemplFile.empty() || !prevJigdoFile.empty()) {
+    cerr << subst(_("%1 make-template: --batch cannot be used together "
+                    "with --previous-template\n"), binaryName);
+    exit_tryHelp();
+  }
+
+  /* Read list of images: Each line contains the names of the image, jigdo
+     and template file, separated by whitespace and quoted if necessary,
+     like the values in a jigdo file. */
+  vector<string> batch; // 3 entries per image
+  {
+    istream* batchIn;
+    auto_ptr<istream> batchDel(openForInput(batchIn, batchFile));
+    string line;
+    size_t lineNr = 0;
+    while (getline(*batchIn, line)) {
+      ++lineNr;
+      vector<string> words;
+      ConfigFile::split(words, line);
+      if (words.empty()) continue;
+      if (words.size() != 3 || words[0] == "-") {
+        cerr << subst(_("%1 make-template: `%2' line %3: Expected names "
+                        "of image, jigdo and template file"),
+                      binaryName, batchFile, lineNr) << endl;
+        return 3;
+      }
+      batch.insert(batch.end(), words.begin(), words.end());
+    }
+    if (batchIn->bad()) {
+      string err = subst(_("%1 make-template: Could not read `%2' (%3)"),
+                         binaryName, batchFile, strerror(errno));
+      optReporter->error(err);
+      return 3;
+    }
+  }
+
+  if (fileNames.empty()) {
+    optReporter->info(_("Warning - no files specified. The template will "
+                        "contain the complete image contents!"));
+  }
+
+  int notPresent = 0;
+  for (size_t i = 0; i < batch.size(); i += 3)
+    notPresent += willOutputTo(batch[i + 1], optForce)
+                  + willOutputTo(batch[i + 2], optForce);
+  if (notPresent > 0) throw Cleanup(3);
+  //____________________
+
+  // Read the files and build the index only once for all images
+  size_t jobs = optBatchJobs;
+  if (jobs > batch.size() / 3) jobs = batch.size() / 3;
+  LockingReporter lockingReporter(optReporter);
+  AnyReporter& reporter = (jobs > 1 ? lockingReporter : *optReporter);
+  JigdoCache cache(cacheFile, optCacheExpiry, readAmount, reporter);
+  if (makeTemplate_cache(cache)) return 3;
+  MkTemplate::FileIndex index(&cache);
+  index.build();
+
+  int result = 0;
+  if (jobs <= 1) {
+    for (size_t i = 0; i < batch.size(); i += 3) {
+      if (makeTemplate1(cache, &index, reporter, optThreads, batch[i],
+                        batch[i + 1], batch[i + 2], 0, 0) != 0)
+        result = 3;
+    }
+    return result;
+  }
+
+  /* Share the --threads between the jobs rather than starting that many
+     threads for each image */
+  unsigned threadsPerJob = optThreads / static_cast<unsigned>(jobs);
+  if (threadsPerJob == 0) threadsPerJob = 1;
+  size_t nextImage = 0;
+  Mutex nextMutex;
+  vector<MakeTemplateThread*> threads;
+  for (size_t i = 0; i < jobs; ++i)
+    threads.push_back(new MakeTemplateThread(cache, index, reporter,
+        threadsPerJob, batch, nextImage, nextMutex));
+  /* If a thread cannot be started, the others (or this thread) take over
+     its images */
+  for (size_t i = 1; i < jobs; ++i) threads[i]->start();
+  threads[0]->process();
+  for (size_t i = 0; i < jobs; ++i) {
+    if (i > 0) threads[i]->join();
+    if (threads[i]->returnValue() != 0) result = 3;
+    delete threads[i];
+  }
+  return result;
+}
+//______________________________________________________________________
+
 int JigdoFileCmd::makeImage() {
   if (imageFile.empty() || templFile.empty()) {
     cerr << subst(_(
@@ -307,7 +578,8 @@ int JigdoFileCmd::makeImage() {
 
   try {
     return JigdoDesc::makeImage(&cache, imageFile, imageTmpFile, templFile,
-      templ, optForce, *optReporter, readAmount, optMkImageCheck);
+      templ, optForce, *optReporter, readAmount, optMkImageCheck,
+      optThreads);
   } catch (Error e) {
     string err = binaryName; err += " make-image: "; err += e.message;
     optReporter->error(err);
@@ -563,12 +835,20 @@ int JigdoFileCmd::scanFiles() {
 
   JigdoCache cache(cacheFile, optCacheExpiry, readAmount, *optReporter);
   cache.setParams(blockLength, md5BlockLength);
+  cache.setThreads(optThreads);
   if (addLabels(cache)) return 3;
   while (true) {
     try { cache.readFilenames(fileNames); } // Recurse through directories
     catch (RecurseError e) { optReporter->error(e.message); continue; }
     break;
   }
+  if (!optScanWholeFile) {
+    cache.readAheadSums(); // Read files in parallel
+    if (optStats) {
+      string s;
+      optReporter->statsInfo(cache.readStats().appendJson(s));
+    }
+  }
   JigdoCache::iterator ci = cache.begin(), ce = cache.end();
   if (optScanWholeFile) {
     // Cause entire file to be read
@@ -603,9 +883,9 @@ int JigdoFileCmd::md5sumFiles() {
   while (ci != ce) {
     Base64String m;
     // Causes whole file to be read
-    const MD5Sum* md = ci->getMD5Sum(&cache);
+    const MD5* md = ci->getMD5Sum(&cache);
     if (md != 0) {
-      m.write(md->digest(), 16).flush();
+      m.write(md->sum, 16).flush();
       string& s(m.result());
       s += "  ";
       if (ci->getPath() == "/") s += '/';
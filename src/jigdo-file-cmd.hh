@@ -45,6 +45,10 @@ struct AnyReporter : public MkTemplate::ProgressReporter,
   virtual void coutInfo(const string& message) {
     cout << message << endl;
   }
+  /** Print output of --stats. Unlike info(), also with --report=quiet */
+  virtual void statsInfo(const string& message) {
+    cerr << message << endl;
+  }
 };
 //______________________________________________________________________
 
@@ -74,6 +78,9 @@ class JigdoFileCmd {
   static string jigdoFile;
   static string templFile;
   static string jigdoMergeFile;
+  static string batchFile; // --batch
+  static string prevTemplFile; // --previous-template
+  static string prevJigdoFile; // --previous-jigdo
   static string cacheFile;
   static size_t optCacheExpiry; // Expiry time for cache in seconds
   static vector<string> optLabels; // Strings of the form "Label=/some/path"
@@ -81,8 +88,17 @@ class JigdoFileCmd {
   static size_t blockLength; // of rsync algorithm, is also minimum file size
   static size_t md5BlockLength;
   static size_t readAmount;
+  static unsigned optThreads; // Nr of threads for scanning, 0 => nr of CPUs
+  static unsigned optBatchJobs; // Nr of --batch images to process at once
   static int optZipQuality;
-  static bool optBzip2;
+  static int optZstdLevel; // Used instead of optZipQuality for zstd
+  static MkTemplate::Compression optCompression;
+  static bool optParallelGzip; // true => gzip on several threads
+  static bool optStoreIncompressible; // true => write STOR parts
+  static size_t optZeroRuns; // Min. length of ZERO_DATA entries, 0 => none
+  static size_t optAlign; // Only find files at multiples of this, 0 => any
+  static bool optStats; // true => print MkTemplate::Stats as JSON
+  static bool optMapImage; // true => mmap image in make-template
   static bool optForce; // true => Silently delete existent output
   static bool optMkImageCheck; // true => check MD5sums
   static bool optCheckFiles; // true => check if files exist
@@ -122,6 +138,13 @@ class JigdoFileCmd {
       Helper functions for the above functions, only to be used in
       jigdo-file-cmd.cc */
   //@{
+  static int makeTemplate_cache(JigdoCache& cache);
+  static int makeTemplate1(JigdoCache& cache, MkTemplate::FileIndex* index,
+    AnyReporter& reporter, unsigned threads, const string& imageName,
+    const string& jigdoName, const string& templName, bistream* prevTempl,
+    ConfigFile* prevJigdo);
+  static int makeTemplateBatch();
+  class MakeTemplateThread;
   static int addLabels(JigdoCache& cache);
   static void addUris(ConfigFile& config);
   static bool printMissing_lookup(JigdoConfig& jc, const string& query,
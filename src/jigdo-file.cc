@@ -37,6 +37,7 @@
 #include <recursedir.hh>
 #include <scan.hh>
 #include <string.hh>
+#include <thread.hh>
 //______________________________________________________________________
 
 RecurseDir JigdoFileCmd::fileNames;
@@ -44,6 +45,9 @@ string JigdoFileCmd::imageFile;
 string JigdoFileCmd::jigdoFile;
 string JigdoFileCmd::templFile;
 string JigdoFileCmd::jigdoMergeFile;
+string JigdoFileCmd::batchFile;
+string JigdoFileCmd::prevTemplFile;
+string JigdoFileCmd::prevJigdoFile;
 string JigdoFileCmd::cacheFile;
 size_t JigdoFileCmd::optCacheExpiry = 60*60*24*30; // default: 30 days
 vector<string> JigdoFileCmd::optLabels;
@@ -51,8 +55,17 @@ vector<string> JigdoFileCmd::optUris;
 size_t JigdoFileCmd::blockLength    =   1*1024U;
 size_t JigdoFileCmd::md5BlockLength = 128*1024U - 55;
 size_t JigdoFileCmd::readAmount     = 128*1024U;
+unsigned JigdoFileCmd::optThreads = 0;
+unsigned JigdoFileCmd::optBatchJobs = 1;
 int JigdoFileCmd::optZipQuality = Z_BEST_COMPRESSION;
-bool JigdoFileCmd::optBzip2 = false;
+int JigdoFileCmd::optZstdLevel = 19;
+MkTemplate::Compression JigdoFileCmd::optCompression = MkTemplate::GZIP;
+bool JigdoFileCmd::optParallelGzip = false;
+bool JigdoFileCmd::optStoreIncompressible = false;
+size_t JigdoFileCmd::optZeroRuns = 0;
+size_t JigdoFileCmd::optAlign = 0;
+bool JigdoFileCmd::optStats = false;
+bool JigdoFileCmd::optMapImage = false;
 bool JigdoFileCmd::optForce = false;
 bool JigdoFileCmd::optMkImageCheck = true;
 bool JigdoFileCmd::optCheckFiles = true;
@@ -75,6 +88,8 @@ namespace {
 
 // Absolute minimum for --min-length (i.e. blockLength), in bytes
 const size_t MINIMUM_BLOCKLENGTH = 256;
+// Upper limit for --threads and --batch-jobs
+const unsigned MAX_THREADS = 256;
 
 char optHelp = '\0';
 bool optVersion = false;
@@ -97,6 +112,7 @@ public:
   virtual void error(const string& message) { print(message); }
   virtual void info(const string& message) { print(message); }
   virtual void coutInfo(const string& message);
+  virtual void statsInfo(const string& message) { print(message); }
   virtual void scanningFile(const FilePart* file, uint64 offInFile) {
     if (!printProgress) return;
     string m;
@@ -337,6 +353,9 @@ inline void printUsage(bool detailed, size_t blockLength,
     "                   [print-missing] Override mapping in input jigdo\n"
     "  -0 to -9         Set amount of compression in output template\n"
     "      --bzip2      Use bzip2 compression instead of default --gzip\n"
+    "      --zstd[=LEVEL]\n"
+    "                   Use zstd compression, LEVEL 1 to 22 [19]\n"
+    "      --xz         Use xz compression, -0 to -9 select the preset\n"
     "      --cache=FILE Store/reload information about any files scanned\n"),
     (WINDOWS ? "C:" : ""), DIRSEPS, SPLITSEP, EXTSEPS);
   if (detailed) {
@@ -357,6 +376,15 @@ inline void printUsage(bool detailed, size_t blockLength,
     "\n"
     "Further options: (can append 'k', 'M', 'G' to any BYTES argument)\n"
     "  --merge=FILE     [make-template] Add FILE contents to output jigdo\n"
+    "  --previous-template=FILE --previous-jigdo=FILE\n"
+    "                   [make-template] Copy the unchanged parts of the\n"
+    "                   template for a previous version of the image\n"
+    "  --batch=FILE     [make-template] Create templates for several images,\n"
+    "                   reading the files only once. Each line of FILE\n"
+    "                   lists an image, its jigdo and its template file\n"
+    "  --batch-jobs=NUMBER [default 1]\n"
+    "                   [make-template] Number of --batch images to\n"
+    "                   process in parallel\n"
     "  --no-force       Do not delete existent output files [default]\n"
     "  --min-length=BYTES [default %1]\n"
     "                   [make-template] Minimum length of files to search\n"
@@ -366,6 +394,40 @@ inline void printUsage(bool detailed, size_t blockLength,
     "                   jigdo-file enforces: min-length < md5-block-size\n"
     "  --readbuffer=BYTES [default %3k]\n"
     "                   Amount of data to read at a time\n"
+    "  --threads=NUMBER [default: number of CPUs]\n"
+    "                   [make-template,scan] Number of files to read and\n"
+    "                   checksum in parallel. With more than 1, also\n"
+    "                   read, search and compress the image in parallel.\n"
+    "                   Also used for reading directories in advance,\n"
+    "                   and [make-image] for copying files into the image\n"
+    "  --parallel-gzip  [make-template] With --threads, also use several\n"
+    "                   threads for gzip compression. Gives a slightly\n"
+    "                   different (but compatible) template\n"
+    "  --no-parallel-gzip [default]\n"
+    "  --store-incompressible\n"
+    "                   [make-template] Do not compress template data\n"
+    "                   which would not get smaller, e.g. because it is\n"
+    "                   compressed already. Older versions of\n"
+    "                   jigdo-file cannot read such templates\n"
+    "  --no-store-incompressible [default]\n"
+    "  --zero-runs=BYTES\n"
+    "                   [make-template] Only record the length of runs\n"
+    "                   of at least BYTES unmatched zero bytes instead of\n"
+    "                   adding them to the template data. Older versions\n"
+    "                   of jigdo-file cannot read such templates\n"
+    "  --no-zero-runs [default]\n"
+    "  --align=BYTES    [make-template] Only look for files which start at\n"
+    "                   a multiple of BYTES in the image, e.g. 2048 for\n"
+    "                   CD/DVD images. Faster, but files at other offsets\n"
+    "                   are not found\n"
+    "  --no-align [default]\n"
+    "  --stats=json     [make-template,scan] Print counters and timings\n"
+    "                   for each image, or for reading the files, to\n"
+    "                   stderr as one line of JSON\n"
+    "  --no-stats [default]\n"
+    "  --mmap           [make-template] Memory-map the image file instead\n"
+    "                   of reading it, unless it is standard input\n"
+    "  --no-mmap [default]\n"
     "  --check-files [default]\n"
     "                   [make-template,md5sum] Check if files exist and\n"
     "                   get or verify checksums, date and size\n"
@@ -399,7 +461,8 @@ inline void printUsage(bool detailed, size_t blockLength,
     "  --no-hex [default]\n"
     "  --hex            [md5sum, list-template] Output checksums in\n"
     "                   hexadecimal, not Base64\n"
-    "  --gzip           [default] Use gzip compression, not --bzip2\n"),
+    "  --gzip           [default] Use gzip compression, not --bzip2,\n"
+    "                   --zstd or --xz\n"),
     blockLength, md5BlockLength, readAmount / 1024) << endl;
   }
   return;
@@ -454,6 +517,17 @@ size_t scanTimespan(const char* str) {
        << endl;
   throw Cleanup(3);
 }
+
+/* For --threads and similar: Parse a decimal number between min and
+   max into x. Returns false if str is something else. */
+bool scanCount(unsigned& x, const char* str, unsigned min, unsigned max) {
+  char* end;
+  long n = strtol(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || n < static_cast<long>(min)
+      || n > static_cast<long>(max)) return false;
+  x = static_cast<unsigned>(n);
+  return true;
+}
 //______________________________________________________________________
 
 /* Try creating a filename in dest by stripping any file extension
@@ -492,7 +566,12 @@ enum {
   LONGOPT_ADDIMAGE, LONGOPT_NOADDIMAGE, LONGOPT_NOCACHE, LONGOPT_CACHEEXPIRY,
   LONGOPT_MERGE, LONGOPT_HEX, LONGOPT_NOHEX, LONGOPT_DEBUG, LONGOPT_NODEBUG,
   LONGOPT_MATCHEXEC, LONGOPT_BZIP2, LONGOPT_GZIP, LONGOPT_SCANWHOLEFILE,
-  LONGOPT_NOSCANWHOLEFILE, LONGOPT_GREEDYMATCHING, LONGOPT_NOGREEDYMATCHING
+  LONGOPT_NOSCANWHOLEFILE, LONGOPT_GREEDYMATCHING, LONGOPT_NOGREEDYMATCHING,
+  LONGOPT_THREADS, LONGOPT_PARALLELGZIP, LONGOPT_NOPARALLELGZIP,
+  LONGOPT_MMAP, LONGOPT_NOMMAP, LONGOPT_PREVTEMPLATE, LONGOPT_PREVJIGDO,
+  LONGOPT_BATCH, LONGOPT_BATCHJOBS, LONGOPT_ZSTD, LONGOPT_XZ,
+  LONGOPT_STORE, LONGOPT_NOSTORE, LONGOPT_ZERORUNS, LONGOPT_NOZERORUNS,
+  LONGOPT_ALIGN, LONGOPT_NOALIGN, LONGOPT_STATS, LONGOPT_NOSTATS
 };
 
 // Deal with command line switches
@@ -505,6 +584,9 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
 
   while (true) {
     static const struct option longopts[] = {
+      { "align",              required_argument, 0, LONGOPT_ALIGN },
+      { "batch",              required_argument, 0, LONGOPT_BATCH },
+      { "batch-jobs",         required_argument, 0, LONGOPT_BATCHJOBS },
       { "bzip2",              no_argument,       0, LONGOPT_BZIP2 },
       { "cache",              required_argument, 0, 'c' },
       { "cache-expiry",       required_argument, 0, LONGOPT_CACHEEXPIRY },
@@ -525,6 +607,8 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { "md5-block-size",     required_argument, 0, LONGOPT_MD5SIZE },
       { "merge",              required_argument, 0, LONGOPT_MERGE },
       { "min-length",         required_argument, 0, LONGOPT_MINSIZE },
+      { "mmap",               no_argument,       0, LONGOPT_MMAP },
+      { "no-align",           no_argument,       0, LONGOPT_NOALIGN },
       { "no-cache",           no_argument,       0, LONGOPT_NOCACHE },
       { "no-check-files",     no_argument,       0, LONGOPT_NOMKIMAGECHECK },
       { "no-debug",           no_argument,       0, LONGOPT_NODEBUG },
@@ -532,15 +616,29 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
       { "no-greedy-matching", no_argument,       0, LONGOPT_NOGREEDYMATCHING },
       { "no-hex",             no_argument,       0, LONGOPT_NOHEX },
       { "no-image-section",   no_argument,       0, LONGOPT_NOADDIMAGE },
+      { "no-mmap",            no_argument,       0, LONGOPT_NOMMAP },
+      { "no-parallel-gzip",   no_argument,       0, LONGOPT_NOPARALLELGZIP },
       { "no-scan-whole-file", no_argument,       0, LONGOPT_NOSCANWHOLEFILE },
       { "no-servers-section", no_argument,       0, LONGOPT_NOADDSERVERS },
+      { "no-stats",           no_argument,       0, LONGOPT_NOSTATS },
+      { "no-store-incompressible", no_argument,  0, LONGOPT_NOSTORE },
+      { "no-zero-runs",       no_argument,       0, LONGOPT_NOZERORUNS },
+      { "parallel-gzip",      no_argument,       0, LONGOPT_PARALLELGZIP },
+      { "previous-jigdo",     required_argument, 0, LONGOPT_PREVJIGDO },
+      { "previous-template",  required_argument, 0, LONGOPT_PREVTEMPLATE },
       { "readbuffer",         required_argument, 0, LONGOPT_BUFSIZE },
       { "report",             required_argument, 0, 'r' },
       { "scan-whole-file",    no_argument,       0, LONGOPT_SCANWHOLEFILE },
       { "servers-section",    no_argument,       0, LONGOPT_ADDSERVERS },
+      { "stats",              required_argument, 0, LONGOPT_STATS },
+      { "store-incompressible", no_argument,     0, LONGOPT_STORE },
       { "template",           required_argument, 0, 't' },
+      { "threads",            required_argument, 0, LONGOPT_THREADS },
       { "uri",                required_argument, 0, LONGOPT_URI },
       { "version",            no_argument,       0, 'v' },
+      { "xz",                 no_argument,       0, LONGOPT_XZ },
+      { "zero-runs",          required_argument, 0, LONGOPT_ZERORUNS },
+      { "zstd",               optional_argument, 0, LONGOPT_ZSTD },
       { 0, 0, 0, 0 }
     };
 
@@ -552,8 +650,58 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
     case '0': case '1': case '2': case '3': case '4':
     case '5': case '6': case '7': case '8': case '9':
       optZipQuality = c - '0'; break;
-    case LONGOPT_BZIP2: optBzip2 = true; break;
-    case LONGOPT_GZIP:  optBzip2 = false; break;
+    case LONGOPT_BZIP2: optCompression = MkTemplate::BZIP2; break;
+    case LONGOPT_GZIP:  optCompression = MkTemplate::GZIP; break;
+    case LONGOPT_ZSTD:
+#     if HAVE_LIBZSTD
+      optCompression = MkTemplate::ZSTD;
+      if (optarg != 0) {
+        char* end;
+        optZstdLevel = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0'
+            || optZstdLevel < 1 || optZstdLevel > 22) {
+          cerr << subst(_("%1: Invalid argument to --zstd (allowed: 1 "
+                          "to 22)"), binName()) << '\n';
+          error = true;
+        }
+      }
+#     else
+      cerr << subst(_("%1: Sorry, --zstd is not available because "
+                      "jigdo-file was compiled without libzstd"),
+                    binName()) << '\n';
+      error = true;
+#     endif
+      break;
+    case LONGOPT_XZ:
+#     if HAVE_LIBLZMA
+      optCompression = MkTemplate::XZ;
+#     else
+      cerr << subst(_("%1: Sorry, --xz is not available because "
+                      "jigdo-file was compiled without liblzma"),
+                    binName()) << '\n';
+      error = true;
+#     endif
+      break;
+    case LONGOPT_PARALLELGZIP: optParallelGzip = true; break;
+    case LONGOPT_NOPARALLELGZIP: optParallelGzip = false; break;
+    case LONGOPT_STORE: optStoreIncompressible = true; break;
+    case LONGOPT_NOSTORE: optStoreIncompressible = false; break;
+    case LONGOPT_ZERORUNS: optZeroRuns = scanMemSize(optarg); break;
+    case LONGOPT_NOZERORUNS: optZeroRuns = 0; break;
+    case LONGOPT_ALIGN: optAlign = scanMemSize(optarg); break;
+    case LONGOPT_NOALIGN: optAlign = 0; break;
+    case LONGOPT_STATS:
+      if (strcmp(optarg, "json") == 0) {
+        optStats = true;
+      } else {
+        cerr << subst(_("%1: Invalid argument to --stats (allowed: "
+                        "json)"), binName()) << '\n';
+        error = true;
+      }
+      break;
+    case LONGOPT_NOSTATS: optStats = false; break;
+    case LONGOPT_MMAP: optMapImage = true; break;
+    case LONGOPT_NOMMAP: optMapImage = false; break;
     case 'h': case 'H': optHelp = c; break;
     case 'v': optVersion = true; break;
     case 'T': fileNames.addFilesFrom(
@@ -562,6 +710,9 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
     case 'j': jigdoFile = optarg; break;
     case 't': templFile = optarg; break;
     case LONGOPT_MERGE: jigdoMergeFile = optarg; break;
+    case LONGOPT_BATCH: batchFile = optarg; break;
+    case LONGOPT_PREVTEMPLATE: prevTemplFile = optarg; break;
+    case LONGOPT_PREVJIGDO: prevJigdoFile = optarg; break;
     case 'c': cacheFile = optarg; break;
     case LONGOPT_NOCACHE: cacheFile.erase(); break;
     case LONGOPT_CACHEEXPIRY: optCacheExpiry = scanTimespan(optarg); break;
@@ -570,6 +721,20 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
     case LONGOPT_MINSIZE:    blockLength = scanMemSize(optarg); break;
     case LONGOPT_MD5SIZE: md5BlockLength = scanMemSize(optarg); break;
     case LONGOPT_BUFSIZE:     readAmount = scanMemSize(optarg); break;
+    case LONGOPT_THREADS:
+      if (!scanCount(optThreads, optarg, 0, MAX_THREADS)) {
+        cerr << subst(_("%1: Invalid argument to --threads (allowed: 0 "
+                        "to %2)"), binName(), MAX_THREADS) << '\n';
+        error = true;
+      }
+      break;
+    case LONGOPT_BATCHJOBS:
+      if (!scanCount(optBatchJobs, optarg, 1, MAX_THREADS)) {
+        cerr << subst(_("%1: Invalid argument to --batch-jobs (allowed: "
+                        "1 to %2)"), binName(), MAX_THREADS) << '\n';
+        error = true;
+      }
+      break;
     case 'r':
       if (strcmp(optarg, "default") == 0) {
         optReporter = &reporterDefault;
@@ -639,6 +804,8 @@ JigdoFileCmd::Command JigdoFileCmd::cmdOptions(int argc, char* argv[]) {
 
   Paranoid(blockLength >= MINIMUM_BLOCKLENGTH
            && blockLength < md5BlockLength);
+  if (optThreads == 0) optThreads = Thread::cpuCount();
+  fileNames.setThreads(optThreads);
   //______________________________
 
   // Complain if name of command isn't there
@@ -14,10 +14,15 @@
 #include <config.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if HAVE_LINUX_FS_H
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#endif
 #include <unistd-jigdo.h>
 
 #include <iomanip>
@@ -31,12 +36,23 @@
 #include <scan.hh>
 #include <serialize.hh>
 #include <string.hh>
+#include <thread.hh>
 #include <zstream-gz.hh>
 
 //______________________________________________________________________
 
 DEBUG_UNIT("make-image")
 
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
+#if HAVE_LINUX_FS_H && defined FICLONERANGE
+#  define HAVE_FICLONERANGE 1
+#else
+#  define HAVE_FICLONERANGE 0
+#endif
+
 namespace {
 
 typedef JigdoDesc::ProgressReporter ProgressReporter;
@@ -161,6 +177,16 @@ bistream& JigdoDescVec::get(bistream& file)
       off += entryLen;
       break;
 
+    case JigdoDesc::ZERO_DATA:
+      unserialize6(entryLen, f);
+      if (!file) break;
+      debug("JigdoDesc::read: %1 ZeroData %2", off, entryLen);
+      desc.reset(new JigdoDesc::ZeroData(off, entryLen));
+      push_back(desc.release());
+      read += 1 + 6;
+      off += entryLen;
+      break;
+
     case JigdoDesc::MATCHED_FILE:
     case JigdoDesc::WRITTEN_FILE:
       unserialize6(entryLen, f);
@@ -260,6 +286,7 @@ bostream& JigdoDescVec::put(bostream& file, MD5Sum* md) const {
   for (const_iterator i = begin(), e = end(); i != e; ++i) {
     JigdoDesc::ImageInfo* info;
     JigdoDesc::UnmatchedData* unm;
+    JigdoDesc::ZeroData* zero;
     JigdoDesc::MatchedFile* matched;
     JigdoDesc::WrittenFile* written;
     /* NB we must first try to cast to WrittenFile, then to
@@ -268,6 +295,8 @@ bostream& JigdoDescVec::put(bostream& file, MD5Sum* md) const {
       p = info->serialize(buf);
     else if ((unm = dynamic_cast<JigdoDesc::UnmatchedData*>(*i)) != 0)
       p = unm->serialize(buf);
+    else if ((zero = dynamic_cast<JigdoDesc::ZeroData*>(*i)) != 0)
+      p = zero->serialize(buf);
     else if ((written = dynamic_cast<JigdoDesc::WrittenFile*>(*i)) != 0)
       p = written->serialize(buf);
     else if ((matched = dynamic_cast<JigdoDesc::MatchedFile*>(*i)) != 0)
@@ -298,6 +327,11 @@ ostream& JigdoDesc::UnmatchedData::put(ostream& s) const {
     << setw(SIZE_WIDTH) << size() << '\n';
   return s;
 }
+ostream& JigdoDesc::ZeroData::put(ostream& s) const {
+  s << "zero-filled " << setw(SIZE_WIDTH) << offset() << ' '
+    << setw(SIZE_WIDTH) << size() << '\n';
+  return s;
+}
 ostream& JigdoDesc::MatchedFile::put(ostream& s) const {
   s << "need-file   " << setw(SIZE_WIDTH) << offset() << ' '
     << setw(SIZE_WIDTH) << size() << ' ' << md5() << ' ' << rsync() << '\n';
@@ -340,31 +374,93 @@ namespace {
   }
   //______________________________
 
-  /* Read up to file.size() of bytes from file, write it to image
-     stream. Check MD5/rsync sum if requested. Take care not to write
-     more than specified amount to image, even if file is longer. */
-  int fileToImage(bostream* img, FilePart& file,
+  // Turn a MatchedFile into a WrittenFile once its data is in the image
+  void markAsWritten(JigdoDesc*& desc) {
+    JigdoDesc::MatchedFile* self =
+        dynamic_cast<JigdoDesc::MatchedFile*>(desc);
+    desc = new JigdoDesc::WrittenFile(self->offset(), self->size(),
+                                      self->rsync(), self->md5());
+    delete self;
+  }
+  //______________________________
+
+  /* Output of fileToImage(): The image stream at its current position.
+     Progress is reported as data is written. */
+  class StreamOut {
+  public:
+    StreamOut(bostream& i, uint64& o, uint64& n, const uint64 t,
+              ProgressReporter& r)
+      : img(i), off(o), nextReport(n), totalBytes(t), reporter(r) { }
+    bool ok() const { return !img.fail(); }
+    void write(const byte* buf, size_t n) {
+      writeBytes(img, buf, n);
+      reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+    }
+    // The stream offers no file descriptor, so the kernel cannot help
+    uint64 copy(const string&, uint64) { return 0; }
+    size_t readBack(byte*, size_t) { return 0; } // Never called
+  private:
+    bostream& img;
+    uint64& off;
+    uint64& nextReport;
+    const uint64 totalBytes;
+    ProgressReporter& reporter;
+  };
+
+  /* Get up to n bytes of the file into buf for the checksums, and return
+     their number. The first 'copied' bytes of the file are already in the
+     image; they are read back from there, so that the checksums cover
+     what the image really contains. Further bytes are read from f and
+     written to out. */
+  template<class Out>
+  inline size_t nextBytes(Out& out, bifstream& f, byte* buf, size_t n,
+                          uint64& copied) {
+    if (copied > 0) {
+      if (n > copied) n = static_cast<size_t>(copied);
+      n = out.readBack(buf, n);
+      copied -= n;
+      return n;
+    }
+    readBytes(f, buf, n);
+    n = f.gcount();
+    out.write(buf, n);
+    return n;
+  }
+
+  /* Read up to file.size() of bytes from file, write it to out, which
+     must provide ok(), write(), copy() and readBack() like StreamOut.
+     Check MD5/rsync sum if requested. Take care not to write more than
+     specified amount to image, even if file is longer. On error, store
+     a message in err, which the caller must report.
+
+     Whatever out.copy() manages to copy without help is not written
+     again. To check the sums, it is read back from the image, not from
+     the file, which might have changed in the meantime. */
+  template<class Out>
+  int fileToImage(Out& out, const FilePart& file,
       const JigdoDesc::MatchedFile& matched, bool checkMD5, size_t rsyncLen,
-      ProgressReporter& reporter, byte* buf, size_t readAmount, uint64& off,
-      uint64& nextReport, const uint64 totalBytes) {
+      byte* buf, size_t readAmount, string& err) {
     uint64 toWrite = file.size();
     MD5Sum md;
     RsyncSum64 rs;
     size_t rl = 0; // Length covered by rs so far
     string fileName(file.getPath());
     fileName += file.leafName();
+    uint64 copied = out.copy(fileName, toWrite);
     bifstream f(fileName.c_str(), ios::binary);
-    string err; // !err.empty() => error occurred
+    err.clear(); // !err.empty() => error occurred
+    if (copied > 0) f.seekg(copied, ios::beg);
+    if (!checkMD5) { // No need to read back what was copied
+      toWrite -= copied;
+      copied = 0;
+    }
 
     // Read from file, write to image
     // First couple of k: Calculate RsyncSum rs and MD5Sum md
     if (checkMD5 && rsyncLen > 0) {
-      while (*img && f && !f.eof() && toWrite > 0) {
+      while (out.ok() && (copied > 0 || (f && !f.eof())) && toWrite > 0) {
         size_t n = (toWrite < readAmount ? toWrite : readAmount);
-        readBytes(f, buf, n);
-        n = f.gcount();
-        writeBytes(*img, buf, n);
-        reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+        n = nextBytes(out, f, buf, n, copied);
         toWrite -= n;
         md.update(buf, n);
         // Update RsyncSum
@@ -378,12 +474,9 @@ namespace {
       }
     }
     // Rest of file: Only calculate MD5Sum md
-    while (*img && f && !f.eof() && toWrite > 0) {
+    while (out.ok() && (copied > 0 || (f && !f.eof())) && toWrite > 0) {
       size_t n = (toWrite < readAmount ? toWrite : readAmount);
-      readBytes(f, buf, n);
-      n = f.gcount();
-      writeBytes(*img, buf, n);
-      reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+      n = nextBytes(out, f, buf, n, copied);
       toWrite -= n;
       if (checkMD5) md.update(buf, n);
     }
@@ -395,10 +488,9 @@ namespace {
       err = subst(_("Error reading from `%1' (%2)"), fileName, errDetail);
       // Even if there was an error - always try to write right amount
       memClear(buf, readAmount);
-      while (*img && toWrite > 0) {
+      while (out.ok() && toWrite > 0) {
         size_t n = (toWrite < readAmount ? toWrite : readAmount);
-        writeBytes(*img, buf, n);
-        reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+        out.write(buf, n);
         toWrite -= n;
       }
     } else if (checkMD5
@@ -409,7 +501,6 @@ namespace {
     }
 
     if (err.empty()) return 0; // Success
-    reporter.error(err);
     if (toWrite == 0)
       return 2; // "May have to fix something before you can continue"
     else
@@ -417,6 +508,236 @@ namespace {
   }
   //______________________________
 
+  /* Copies files into the image on several threads, each with its own
+     buffer, using pwrite() on areas of the image which do not overlap.
+     Where the kernel supports it, the data is not copied through the
+     buffer at all, see PartWriter::Out::copy().
+     The caller adds one job per MatchedFile while it writes the rest of
+     the image, leaving the jobs' areas alone, then calls run(). Results
+     are looked at in the order of the jobs afterwards, so the errors and
+     the DESC section come out exactly like when copying one file after
+     the other. */
+  class PartWriter : NoCopy {
+  public:
+    struct Job {
+      JigdoDescVec::iterator desc; // Points to a MatchedFile
+      FilePart* file;
+      int status; // Like fileToImage(), or -1 if the job was not run
+      string err;
+    };
+    /* With stopOnError, no further jobs are started once one returned
+       nonzero, otherwise only after one returned 3 */
+    PartWriter(const char* n, bool check, size_t rl, size_t ra,
+               bool stopOnError, ProgressReporter& r, uint64& o,
+               uint64& nr, const uint64 t)
+      : name(n), checkMD5(check), rsyncLen(rl), readAmount(ra),
+        stopOn(stopOnError ? 1 : 3), reporter(r), off(o), nextReport(nr),
+        totalBytes(t), fd(-1), blockSize(0), next(0), stop(false) { }
+    ~PartWriter() { if (fd != -1) close(fd); }
+    void add(JigdoDescVec::iterator desc, FilePart* file) {
+      Job j;
+      j.desc = desc; j.file = file; j.status = -1;
+      jobs.push_back(j);
+    }
+    /* Run the jobs on up to nrThreads threads, including this one.
+       Returns false if the image cannot be opened for writing. */
+    bool run(unsigned nrThreads);
+    vector<Job>& results() { return jobs; }
+    // Whether the system supports this at all
+    static bool available() { return HAVE_PWRITE != 0; }
+    /* Whether the kernel can copy the files, in which case a PartWriter
+       is worth using even with just one thread */
+    static bool kernelCopy() {
+      return available()
+          && (HAVE_COPY_FILE_RANGE != 0 || HAVE_FICLONERANGE != 0);
+    }
+
+  private:
+    class Worker;
+    class Out;
+    void work();
+    void progress(uint64 n) {
+      MutexLock lock(mutex);
+      reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+    }
+
+    const char* name;
+    const bool checkMD5;
+    const size_t rsyncLen, readAmount;
+    const int stopOn;
+    ProgressReporter& reporter;
+    uint64& off;
+    uint64& nextReport;
+    const uint64 totalBytes;
+    int fd; // Image, opened again for pwrite() and pread()
+    uint64 blockSize; // Of the image's file system, for FICLONERANGE
+    vector<Job> jobs;
+    Mutex mutex; // Protects the members below, and calls to reporter
+    size_t next; // Index of next job to run
+    bool stop; // A job failed badly, do not start any more
+  };
+
+  class PartWriter::Worker : public Thread {
+  public:
+    explicit Worker(PartWriter* w) : writer(w) { }
+  protected:
+    virtual void run() { writer->work(); }
+  private:
+    PartWriter* writer;
+  };
+
+  // Output of fileToImage() for PartWriter: Writes at a fixed position
+  class PartWriter::Out {
+  public:
+    Out(PartWriter* w, uint64 p) : writer(w), pos(p), readPos(p),
+                                   error(0) { }
+    bool ok() const { return error == 0; }
+    int errorNr() const { return error; }
+    void write(const byte* buf, size_t n) {
+      size_t left = n;
+      while (left > 0) {
+#       if HAVE_PWRITE
+        ssize_t w = pwrite(writer->fd, buf, left, pos);
+#       else
+        ssize_t w = -1; errno = ENOSYS; // Not used, see available()
+#       endif
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { error = (errno != 0 ? errno : EIO); return; }
+        buf += w; left -= w; pos += w;
+      }
+      writer->progress(n);
+    }
+    uint64 copy(const string& fileName, uint64 n);
+    size_t readBack(byte* buf, size_t n);
+  private:
+    PartWriter* writer;
+    uint64 pos;
+    uint64 readPos; // Of the next byte for readBack()
+    int error;
+  };
+
+  /* Have the kernel copy up to n bytes from the start of the file to the
+     image, so they do not pass through user space: First try to share
+     the file's blocks with the image (a reflink, supported e.g. by btrfs
+     and XFS), which is only possible if the position in the image is a
+     multiple of the file system's block size. Copy the rest, or all of
+     it, with copy_file_range(). Returns the number of bytes copied, 0 if
+     the kernel cannot do it, e.g. because the file is on another file
+     system. */
+# if HAVE_COPY_FILE_RANGE || HAVE_FICLONERANGE
+  uint64 PartWriter::Out::copy(const string& fileName, uint64 n) {
+    if (n == 0) return 0;
+    int in = open(fileName.c_str(), O_RDONLY | O_BINARY);
+    if (in == -1) return 0;
+    int savedErrno = errno; // Failures below are not errors
+    uint64 done = 0;
+#   if HAVE_FICLONERANGE
+    uint64 bs = writer->blockSize;
+    if (bs > 0 && pos % bs == 0 && n >= bs) {
+      struct file_clone_range range;
+      range.src_fd = in;
+      range.src_offset = 0;
+      range.src_length = n - n % bs;
+      range.dest_offset = pos;
+      if (ioctl(writer->fd, FICLONERANGE, &range) == 0)
+        done = range.src_length;
+    }
+    if (done > 0) writer->progress(done);
+#   endif
+#   if HAVE_COPY_FILE_RANGE
+    // Not all at once, to keep the user entertained
+    const uint64 CHUNK = 8 * 1024 * 1024;
+    while (done < n) {
+      off_t inOff = done, outOff = pos + done;
+      size_t len = (n - done < CHUNK ? n - done : CHUNK);
+      ssize_t w = copy_file_range(in, &inOff, writer->fd, &outOff, len, 0);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) break; // Unsupported, or file shorter than expected
+      done += w;
+      writer->progress(w);
+    }
+#   endif
+    close(in);
+    errno = savedErrno;
+    pos += done;
+    debug("PartWriter: Kernel copied %1 of %2 bytes of `%3'", done, n,
+          fileName);
+    return done;
+  }
+
+  /* Read the next n bytes that copy() put into the image. Returns their
+     number, 0 after an error, which makes ok() return false. */
+  size_t PartWriter::Out::readBack(byte* buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t r = pread(writer->fd, buf + done, n - done, readPos);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) { error = (r < 0 ? errno : EIO); return 0; }
+      done += r; readPos += r;
+    }
+    return done;
+  }
+# else
+  uint64 PartWriter::Out::copy(const string&, uint64) { return 0; }
+  size_t PartWriter::Out::readBack(byte*, size_t) { return 0; }
+# endif
+
+  bool PartWriter::run(unsigned nrThreads) {
+    if (jobs.empty()) return true;
+    // Read access is for PartWriter::Out::readBack()
+    fd = open(name, O_RDWR | O_BINARY);
+    if (fd == -1) return false;
+#   if HAVE_FICLONERANGE
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_blksize > 0) blockSize = st.st_blksize;
+#   endif
+    if (nrThreads > jobs.size())
+      nrThreads = static_cast<unsigned>(jobs.size());
+    debug("PartWriter: %1 files, %2 threads", jobs.size(), nrThreads);
+    /* Start nrThreads-1 extra threads and also work on this one. If a
+       thread cannot be created, the remaining ones pick up its work. */
+    vector<Worker*> workers;
+    for (unsigned t = 1; t < nrThreads; ++t) {
+      Worker* w = new Worker(this);
+      if (w->start() == FAILURE) { delete w; break; }
+      workers.push_back(w);
+    }
+    work();
+    for (vector<Worker*>::iterator i = workers.begin(), e = workers.end();
+         i != e; ++i) {
+      (*i)->join();
+      delete *i;
+    }
+    return true;
+  }
+
+  void PartWriter::work() {
+    vector<byte> bufVec(readAmount);
+    while (true) {
+      Job* j;
+      {
+        MutexLock lock(mutex);
+        if (stop || next == jobs.size()) return;
+        j = &jobs[next++];
+      }
+      const JigdoDesc::MatchedFile& matched =
+          dynamic_cast<const JigdoDesc::MatchedFile&>(**j->desc);
+      Out out(this, matched.offset());
+      j->status = fileToImage(out, *j->file, matched, checkMD5, rsyncLen,
+                              &bufVec[0], readAmount, j->err);
+      if (!out.ok()) {
+        j->err = subst(_("Error while writing to `%1' (%2)"), name,
+                       strerror(out.errorNr()));
+        j->status = 3;
+      }
+      if (j->status >= stopOn) {
+        MutexLock lock(mutex);
+        stop = true;
+      }
+    }
+  }
+  //______________________________
+
   /* Write all bytes of the image data, i.e. both UnmatchedData and
      MatchedFiles. If any UnmatchedFiles are present in 'files', write
      zeroes instead of the file content and also append a DESC section
@@ -426,7 +747,12 @@ namespace {
      appropriate amount of bytes? - Because when seek() is used, a
      sparse file might be generated. This could result in "No room on
      device" later on - but we'd rather like that error as early as
-     possible.
+     possible. ZeroData areas are different: Nothing is ever written to
+     them later, so unless the output is stdout, they are skipped with
+     seekp() and end up as holes in a sparse file. Only their last byte
+     is written, so that the file gets the right length. With several
+     threads, the areas of MatchedFiles are skipped as well, and filled
+     in by a PartWriter before this returns.
 
      @param name Filename corresponding to img
      @param totalBytes length of image
@@ -437,7 +763,7 @@ namespace {
       queue<FilePart*>& toCopy, bistream* templ, const size_t readAmount,
       bostream* img, const char* name, bool checkMD5,
       ProgressReporter& reporter, JigdoCache* cache,
-      const uint64 totalBytes) {
+      const uint64 totalBytes, unsigned threads) {
 
     bool isTemplate = JigdoDesc::isTemplate(*templ); // seek to 1st DATA part
     Assert(isTemplate);
@@ -452,6 +778,7 @@ namespace {
        when it is compressed again by jigdo, it will get slightly
        larger. */
     auto_ptr<Zibstream> data(new Zibstream(*templ, readAmount + 8*1024));
+    const bool seekable = (img != 0);
 #   if HAVE_WORKING_FSTREAM
     if (img == 0) img = &cout; // EEEEEK!
 #   else
@@ -460,6 +787,12 @@ namespace {
 
     JigdoDesc::ImageInfo& imageInfo =
         dynamic_cast<JigdoDesc::ImageInfo&>(*files.back());
+    auto_ptr<PartWriter> parts;
+    if (seekable && (threads > 1 || PartWriter::kernelCopy())
+        && PartWriter::available())
+      parts.reset(new PartWriter(name, checkMD5, imageInfo.blockLength(),
+          readAmount, task == SINGLE_PASS, reporter, off, nextReport,
+          totalBytes));
 
     try {
       for (JigdoDescVec::iterator i = files.begin(), e = files.end();
@@ -493,6 +826,26 @@ namespace {
             }
             break;
           }
+          case JigdoDesc::ZERO_DATA: {
+            uint64 toWrite = (*i)->size();
+            debug("mkimage writeAll(): %1 of zero data", toWrite);
+            if (seekable && toWrite > 0) {
+              static const byte zero = 0;
+              img->seekp(toWrite - 1, ios::cur);
+              writeBytes(*img, &zero, 1);
+              reportBytesWritten(toWrite, off, nextReport, totalBytes,
+                                 reporter);
+              break;
+            }
+            memClear(buf, readAmount);
+            while (*img && toWrite > 0) {
+              size_t n = (toWrite < readAmount ? toWrite : readAmount);
+              writeBytes(*img, buf, n);
+              reportBytesWritten(n, off, nextReport, totalBytes, reporter);
+              toWrite -= n;
+            }
+            break;
+          }
           case JigdoDesc::MATCHED_FILE: {
             /* If file present in cache, copy its data to image, if
                not, copy zeroes. if check==true, verify MD sum match.
@@ -515,18 +868,23 @@ namespace {
                 toWrite -= n;
               }
               if (result == 0) result = 1; // Soft failure
+            } else if (parts.get() != 0) {
+              // Leave the area alone, parts->run() below writes it
+              parts->add(i, mfile);
+              toCopy.pop();
+              img->seekp(toWrite, ios::cur);
             } else {
               /* Copy data from file to image, taking care not to
                  write beyond toWrite. */
-              int status = fileToImage(img, *mfile, *self, checkMD5,
-                  imageInfo.blockLength(), reporter, buf, readAmount, off,
-                  nextReport, totalBytes);
+              StreamOut out(*img, off, nextReport, totalBytes, reporter);
+              string err;
+              int status = fileToImage(out, *mfile, *self, checkMD5,
+                  imageInfo.blockLength(), buf, readAmount, err);
+              if (!err.empty()) reporter.error(err);
               toCopy.pop();
               if (result < status) result = status;
               if (status == 0) { // Mark file as written to image
-                *i = new JigdoDesc::WrittenFile(self->offset(), self->size(),
-                                                self->rsync(), self->md5());
-                delete self;
+                markAsWritten(*i);
               } else if (*img && (status > 2 || task == SINGLE_PASS)) {
                 // If !*img, exit after error msg below
                 /* If status <= 2 and task == {CREATE_TMP,MERGE_TMP},
@@ -569,6 +927,27 @@ namespace {
       reporter.error(e.message); return 3;
     }
 
+    if (parts.get() != 0) {
+      if (!parts->run(threads)) {
+        string err = subst(_("Could not open `%1' for output: %2"),
+                           name, strerror(errno));
+        reporter.error(err);
+        return 3;
+      }
+      // Same as in the MATCHED_FILE case above, in the same order
+      vector<PartWriter::Job>& jobs = parts->results();
+      for (vector<PartWriter::Job>::iterator j = jobs.begin(),
+             e = jobs.end(); j != e; ++j) {
+        Paranoid(j->status >= 0);
+        if (!j->err.empty()) reporter.error(j->err);
+        if (result < j->status) result = j->status;
+        if (j->status == 0)
+          markAsWritten(*j->desc);
+        else if (j->status > 2 || task == SINGLE_PASS)
+          return result;
+      }
+    }
+
     // If we created a new tmp file, append DESC info
     if (task == CREATE_TMP && result > 0) {
       *img << files;
@@ -589,7 +968,7 @@ namespace {
   inline int writeMerge(JigdoDescVec& files, queue<FilePart*>& toCopy,
       const int missing, const size_t readAmount, bfstream* img,
       const string& imageTmpFile, bool checkMD5, ProgressReporter& reporter,
-      JigdoCache* cache, const uint64 totalBytes) {
+      JigdoCache* cache, const uint64 totalBytes, unsigned threads) {
     vector<byte> bufVec(readAmount);
     byte* buf = &bufVec[0];
     int result = (missing == 0 ? 0 : 1);
@@ -600,6 +979,12 @@ namespace {
         dynamic_cast<JigdoDesc::ImageInfo&>(*files.back());
 
     if (toCopy.empty() && missing > 0) return 1;
+    auto_ptr<PartWriter> parts;
+    if ((threads > 1 || PartWriter::kernelCopy())
+        && PartWriter::available())
+      parts.reset(new PartWriter(imageTmpFile.c_str(), checkMD5,
+          imageInfo.blockLength(), readAmount, false, reporter,
+          bytesWritten, nextReport, totalBytes));
     for (JigdoDescVec::iterator i = files.begin(), e = files.end();
          i != e; ++i) {
       // Compare to 'case JigdoDesc::MATCHED_FILE:' clause in writeAll()
@@ -613,6 +998,11 @@ namespace {
             (mfile != 0 ? mfile->leafName() : ""), toCopy.size());
       if (mfile == 0 || self->md5() != *(mfile->getMD5Sum(cache)))
         continue;
+      if (parts.get() != 0) {
+        parts->add(i, mfile); // Written by parts->run() below
+        toCopy.pop();
+        continue;
+      }
 
       /* Copy data from file to image, taking care not to write beyond
          self->size(). */
@@ -622,20 +1012,38 @@ namespace {
         result = 2;
         break;
       }
-      int status = fileToImage(img, *mfile, *self, checkMD5,
-          imageInfo.blockLength(), reporter, buf, readAmount, bytesWritten,
-          nextReport, totalBytes);
+      StreamOut out(*img, bytesWritten, nextReport, totalBytes, reporter);
+      string err;
+      int status = fileToImage(out, *mfile, *self, checkMD5,
+          imageInfo.blockLength(), buf, readAmount, err);
+      if (!err.empty()) reporter.error(err);
       toCopy.pop();
       if (result < status) result = status;
       if (status == 0) { // Mark file as written to image
-        *i = new JigdoDesc::WrittenFile(self->offset(), self->size(),
-                                        self->rsync(), self->md5());
-        delete self;
+        markAsWritten(*i);
       } else if (status > 2) {
         break;
       }
     } // end iterating over 'files'
 
+    if (parts.get() != 0 && !parts->run(threads)) {
+      reporter.error(_("Error - could not access temporary file"));
+      if (result < 2) result = 2;
+    } else if (parts.get() != 0) {
+      // Same as in the loop above, in the same order
+      vector<PartWriter::Job>& jobs = parts->results();
+      for (vector<PartWriter::Job>::iterator j = jobs.begin(),
+             e = jobs.end(); j != e; ++j) {
+        Paranoid(j->status >= 0);
+        if (!j->err.empty()) reporter.error(j->err);
+        if (result < j->status) result = j->status;
+        if (j->status == 0)
+          markAsWritten(*j->desc);
+        else if (j->status > 2)
+          break;
+      }
+    }
+
     uint64 imageSize = imageInfo.size();
     if (missing == 0 && result == 0) {
       img->close(); // Necessary on Windows before truncating is possible
@@ -731,7 +1139,7 @@ namespace {
 int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
     const string& imageTmpFile, const string& templFile,
     bistream* templ, const bool optForce, ProgressReporter& reporter,
-    const size_t readAmount, const bool optMkImageCheck) {
+    const size_t readAmount, const bool optMkImageCheck, unsigned threads) {
 
   Task task = CREATE_TMP;
 
@@ -816,7 +1224,7 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
     bool found = false;
     while (ci != ce) {
       // The call to getMD5Sum() may cause the whole file to be read!
-      const MD5Sum* md = ci->getMD5Sum(cache);
+      const MD5* md = ci->getMD5Sum(cache);
       if (md != 0 && *md == m->md5()) {
         toCopy.push(&*ci); // Found matching file
         totalBytes += m->size();
@@ -874,7 +1282,7 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
   if (task == MERGE_TMP) { // If MERGEing, img was already set up above
     int result = writeMerge(files, toCopy, missing, readAmount, img,
                             imageTmpFile, optMkImageCheck, reporter, cache,
-                            totalBytes);
+                            totalBytes, threads);
     if (missing != 0 && result < 3)
       info_NeedMoreFiles(reporter, imageTmpFile);
     if (result == 0) {
@@ -928,7 +1336,8 @@ int JigdoDesc::makeImage(JigdoCache* cache, const string& imageFile,
 # endif
 
   int result = writeAll(task, files, toCopy, templ, readAmount, img, name,
-                        optMkImageCheck, reporter, cache, totalBytes);
+                        optMkImageCheck, reporter, cache, totalBytes,
+                        threads);
   if (result >= 3) return result;
 
   if (task == CREATE_TMP && result == 1) {
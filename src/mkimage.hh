@@ -44,7 +44,7 @@ public:
   /** Types of entries in a description section */
   enum Type {
     IMAGE_INFO = 5, UNMATCHED_DATA = 2, MATCHED_FILE = 6, WRITTEN_FILE = 7,
-    OBSOLETE_IMAGE_INFO = 1, OBSOLETE_MATCHED_FILE = 3,
+    ZERO_DATA = 8, OBSOLETE_IMAGE_INFO = 1, OBSOLETE_MATCHED_FILE = 3,
     OBSOLETE_WRITTEN_FILE = 4
   };
   class ProgressReporter;
@@ -73,12 +73,14 @@ public:
       file pointer to the start of the section, allowing you to call
       read() immediately afterwards. */
   static void seekFromEnd(bistream& file) throw(JigdoDescError);
-  /** Create image file from template and files (via JigdoCache) */
+  /** Create image file from template and files (via JigdoCache). Unless
+      writing to stdout, up to the given number of files are copied to
+      the image in parallel, by the kernel if it supports this. */
   static int makeImage(JigdoCache* cache, const string& imageFile,
     const string& imageTmpFile, const string& templFile,
     bistream* templ, const bool optForce,
     ProgressReporter& pr = noReport, size_t readAmnt = 128U*1024,
-    const bool optMkImageCheck = true);
+    const bool optMkImageCheck = true, unsigned threads = 1);
   /** Return list of MD5sums of files that still need to be copied to
       the image to complete it. Reads info from tmp file or (if
       imageTmpFile.empty() or error opening tmp file) outputs complete
@@ -88,6 +90,7 @@ public:
 
   class ImageInfo;
   class UnmatchedData;
+  class ZeroData;
   class MatchedFile;
   class WrittenFile;
 
@@ -145,6 +148,29 @@ private:
 };
 //________________________________________
 
+/** Info about a run of zero bytes in the image. Unlike for UnmatchedData,
+    the template data does not contain anything for it. */
+class JigdoDesc::ZeroData : public JigdoDesc {
+public:
+  ZeroData(uint64 o, uint64 s) : offsetVal(o), sizeVal(s) { }
+  inline bool operator==(const JigdoDesc& x) const;
+  Type type() const { return ZERO_DATA; }
+  uint64 offset() const { return offsetVal; }
+  uint64 size() const { return sizeVal; }
+  void resize(uint64 s) { sizeVal = s; }
+  // Default dtor, operator==
+  virtual ostream& put(ostream& s) const;
+
+  template<class Iterator>
+  inline Iterator serialize(Iterator i) const;
+  inline size_t serialSizeOf() const;
+
+private:
+  uint64 offsetVal; // Offset in image
+  uint64 sizeVal;
+};
+//________________________________________
+
 /** Info about data that *was* matched by an input file */
 class JigdoDesc::MatchedFile : public JigdoDesc {
 public:
@@ -275,6 +301,12 @@ bool JigdoDesc::UnmatchedData::operator==(const JigdoDesc& x) const {
   else return size() == u->size();
 }
 
+bool JigdoDesc::ZeroData::operator==(const JigdoDesc& x) const {
+  const ZeroData* z = dynamic_cast<const ZeroData*>(&x);
+  if (z == 0) return false;
+  else return size() == z->size();
+}
+
 bool JigdoDesc::MatchedFile::operator==(const JigdoDesc& x) const {
   const MatchedFile* m = dynamic_cast<const MatchedFile*>(&x);
   if (m == 0) return false;
@@ -323,6 +355,14 @@ Iterator JigdoDesc::UnmatchedData::serialize(Iterator i) const {
 }
 size_t JigdoDesc::UnmatchedData::serialSizeOf() const { return 1 + 6; }
 
+template<class Iterator>
+Iterator JigdoDesc::ZeroData::serialize(Iterator i) const {
+  i = serialize1(ZERO_DATA, i);
+  i = serialize6(size(), i);
+  return i;
+}
+size_t JigdoDesc::ZeroData::serialSizeOf() const { return 1 + 6; }
+
 template<class Iterator>
 Iterator JigdoDesc::MatchedFile::serialize(Iterator i) const {
   i = serialize1(MATCHED_FILE, i);
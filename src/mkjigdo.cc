@@ -22,6 +22,7 @@
 #include <jigdoconfig.hh>
 #include <md5sum.hh>
 #include <mimestream.hh>
+#include <mkreuse.hh>
 #include <mktemplate.hh>
 #include <scan.hh>
 #include <string.hh>
@@ -51,6 +52,21 @@ struct MkTemplate::PartIndex {
 };
 //______________________________
 
+/* Store the label/value of a [Parts] line in x, the way they are kept in
+   jigdoParts */
+void MkTemplate::makePartLine(ConfigFile::iterator line, PartLine* x) {
+  size_t begin, end, value; // value is offset of first char after '='
+  if (line.setLabelOffsets(begin, end, value)) {
+    x->text.assign(*line, value, string::npos);
+    x->split = x->text.length();
+    x->text.append(*line, begin, end - begin);
+  } else {
+    x->text = *line;
+    x->split = x->text.length();
+  }
+}
+//______________________________
+
 /* Set up some sections/entries in jigdo file. jigdo->configFile() is
    either empty or contains a jigdo file passed to the program with
    --merge. Is called before the MkTemplate operation does its main
@@ -81,16 +97,8 @@ void MkTemplate::prepareJigdo() {
         j.erase(prev); // Remove empty lines
       } else if (*s != '#') { // Leave alone comment lines
         // Remove entry lines, enter them into jigdoParts
-        size_t begin, end, value; // value is offset of first char after '='
         PartLine x;
-        if (prev.setLabelOffsets(begin, end, value)) {
-          x.text.assign(*prev, value, string::npos);
-          x.split = x.text.length();
-          x.text.append(*prev, begin, end - begin);
-        } else {
-          x.text.swap(*prev);
-          x.split = x.text.length();
-        }
+        makePartLine(prev, &x);
         jigdoParts.insert(x);
         j.erase(prev);
       }
@@ -193,6 +201,37 @@ void MkTemplate::finalizeJigdo(const string& imageLeafName,
   }
   //____________________
 
+  /* With --previous-template, add the old [Parts] lines of files that were
+     matched in reused regions, and the old [Servers] lines they may refer
+     to. This happens before auto-generating new labels below, so these
+     will not clash with the old ones. */
+  if (previous != 0 && !previous->regions().empty()) {
+    set<string> md5s; // base64 md5sums already in jigdoParts
+    for (set<PartLine>::iterator i = jigdoParts.begin(),
+           e = jigdoParts.end(); i != e; ++i)
+      md5s.insert(string(i->text, i->split));
+    for (vector<Previous::Region>::const_iterator
+           r = previous->regions().begin(), re = previous->regions().end();
+         r != re; ++r) {
+      for (size_t i = r->firstEntry; i < r->endEntry; ++i) {
+        const Previous::Entry& e = previous->entry(i);
+        if (e.file == 0) continue;
+        const PartLine* x = previous->partLine(e.file->md5());
+        Paranoid(x != 0);
+        if (md5s.insert(string(x->text, x->split)).second)
+          jigdoParts.insert(*x);
+      }
+    }
+    if (addServersSection) {
+      string sect = "Servers";
+      const vector<string>& lines = previous->serverLines();
+      for (vector<string>::const_iterator i = lines.begin(),
+             e = lines.end(); i != e; ++i)
+        if (j.find(sect, *i) == j.end()) j.insert(servers, *i);
+    }
+  }
+  //____________________
+
   /* Add new lines to [Parts] section, but only if the part's md5sum
      isn't listed in the section yet. */
   {
@@ -208,11 +247,13 @@ void MkTemplate::finalizeJigdo(const string& imageLeafName,
     string locName = "A";
     string sect = "Servers";
 
-    // Now add FileParts from matchedParts to jigdoParts as PartLines
+    /* Now add FileParts from matchedParts to jigdoParts as PartLines. If
+       the index is shared, other threads may also be assigning labels. */
+    CacheLock lock(indexMutex);
     Base64String m;
     for (vector<FilePart*>::iterator i = matchedParts.begin(),
            e = matchedParts.end(); i != e; ++i) {
-      m.write((*i)->getMD5Sum(cache)->digest(), 16).flush();
+      m.write((*i)->getMD5Sum(cache)->sum, 16).flush();
       PartLine x;
       x.text.swap(m.result());
       x.split = 0;
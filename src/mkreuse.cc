@@ -0,0 +1,306 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Helper class for MkTemplate - reuse the .template/.jigdo of a previous
+  version of the image
+
+  This only finds out which parts of the old template are still valid. The
+  code which copies them to the new template is in mktemplate.cc.
+
+*/
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <log.hh>
+#include <mimestream.hh>
+#include <mkreuse.hh>
+#include <rsyncsum.hh>
+#include <serialize.hh>
+#include <string.hh>
+#include <zstream.hh>
+//______________________________________________________________________
+
+// Like in mktemplate.cc, always compile in debug messages
+#undef debug
+
+MkTemplate::Previous::Previous(const string& templName, bistream* t,
+                               ConfigFile* j)
+  : templFile(templName), templ(t), jigdo(j), blockLength(0), desc(),
+    entries(), chunks(), regionVec(), parts(), servers(), reused(0) { }
+//______________________________________________________________________
+
+bool MkTemplate::Previous::read(size_t blockLength,
+                                ProgressReporter& reporter) {
+  if (!JigdoDesc::isTemplate(*templ)) {
+    reporter.error(subst(_("`%1' is not a template file"), templFile));
+    return FAILURE;
+  }
+
+  // Index the compressed parts, which end where the DESC part starts
+  uint64 pos = templ->tellg();
+  uint64 unmatchedOff = 0;
+  while (true) {
+    byte hdr[16];
+    readBytes(*templ, hdr, 16);
+    if (templ->gcount() != 16) break;
+    Chunk c;
+    unserialize4(c.id, hdr);
+    if (!Zibstream::isDataPart(c.id)) break;
+    unserialize6(c.fileLen, hdr + 4);
+    uint64 unc;
+    unserialize6(unc, hdr + 10);
+    if (c.fileLen < 16) break;
+    c.filePos = pos;
+    c.unmatchedOff = unmatchedOff;
+    unmatchedOff += unc;
+    c.unmatchedEnd = unmatchedOff;
+    c.copy = false;
+    chunks.push_back(c);
+    pos += c.fileLen;
+    templ->seekg(pos, ios::beg);
+  }
+
+  try {
+    JigdoDesc::seekFromEnd(*templ);
+    *templ >> desc;
+  } catch (JigdoDescError e) {
+    reporter.error(subst(_("Could not read `%1': %2"), templFile,
+                         e.message));
+    return FAILURE;
+  }
+  JigdoDesc::ImageInfo* info =
+    dynamic_cast<JigdoDesc::ImageInfo*>(desc.back());
+  if (info == 0) {
+    reporter.error(subst(_("`%1' is not a template file"), templFile));
+    return FAILURE;
+  }
+  if (info->blockLength() != blockLength) {
+    reporter.error(subst(_("`%1' was created with a different "
+                           "--min-length (%2)"),
+                         templFile, info->blockLength()));
+    return FAILURE;
+  }
+  this->blockLength = blockLength;
+
+  // Flatten the DESC entries
+  uint64 off = 0;
+  unmatchedOff = 0;
+  entries.reserve(desc.size());
+  for (JigdoDescVec::iterator i = desc.begin(), e = desc.end(); i != e;
+       ++i) {
+    Entry x;
+    x.offset = off;
+    x.size = (*i)->size();
+    x.unmatchedOff = unmatchedOff;
+    x.file = dynamic_cast<const JigdoDesc::MatchedFile*>(*i);
+    x.zero = (dynamic_cast<JigdoDesc::ZeroData*>(*i) != 0);
+    if (x.file == 0 && !x.zero) {
+      if (dynamic_cast<JigdoDesc::UnmatchedData*>(*i) == 0) continue;
+      unmatchedOff += x.size;
+    }
+    off += x.size;
+    entries.push_back(x);
+  }
+  if ((chunks.empty() && unmatchedOff > 0)
+      || (!chunks.empty() && chunks.back().unmatchedEnd < unmatchedOff)) {
+    reporter.error(subst(_("Could not read `%1': %2"), templFile,
+                         _("Invalid template data - corrupted file?")));
+    return FAILURE;
+  }
+  debug("%1: %2 entries, %3 parts", templFile, entries.size(),
+        chunks.size());
+  //____________________
+
+  // Remember old [Parts] lines by md5sum, and old [Servers] lines
+  typedef ConfigFile::iterator iterator;
+  string sect = "Parts";
+  for (iterator i = jigdo->firstSection(sect); i != jigdo->end();
+       i.nextSection(sect)) {
+    iterator line = i;
+    while (line.nextLabel()) {
+      PartLine x;
+      makePartLine(line, &x);
+      string md5(x.text, x.split);
+      parts[md5] = x;
+    }
+  }
+  sect = "Servers";
+  for (iterator i = jigdo->firstSection(sect); i != jigdo->end();
+       i.nextSection(sect)) {
+    iterator line = i;
+    while (line.nextLabel()) servers.push_back(*line);
+  }
+  return SUCCESS;
+}
+//______________________________________________________________________
+
+const MkTemplate::PartLine* MkTemplate::Previous::partLine(const MD5& md5)
+    const {
+  Base64String m;
+  m.write(md5.sum, 16).flush();
+  map<string, PartLine>::const_iterator i = parts.find(m.result());
+  if (i == parts.end()) return 0;
+  return &i->second;
+}
+//______________________________________________________________________
+
+/* Compare len bytes from image and from the old template data. Always
+   reads len bytes from both, even if a difference is found. */
+bool MkTemplate::Previous::verifyUnmatched(bistream* image, Zibstream* old,
+    uint64 len, byte* buf, byte* oldBuf, size_t bufLen) {
+  bool same = true;
+  while (len > 0) {
+    size_t n = (len < bufLen ? len : bufLen);
+    readBytes(*image, buf, n);
+    if (static_cast<size_t>(image->gcount()) != n) return false;
+    old->read(oldBuf, static_cast<unsigned>(n)); // n <= bufLen
+    if (old->gcount() != n)
+      throw Zerror(0, string(_("Invalid template data - corrupted file?")));
+    if (same && memcmp(buf, oldBuf, n) != 0) same = false;
+    len -= n;
+  }
+  return same;
+}
+
+/* Check whether the first and last bufLen bytes of the len bytes at
+   offset are zero. The rest is checked by MkTemplate::reuseData(). */
+bool MkTemplate::Previous::verifyZero(bistream* image, uint64 offset,
+    uint64 len, byte* buf, size_t bufLen) {
+  size_t n = (len < bufLen ? len : bufLen);
+  uint64 pos[2] = { offset, offset + len - n };
+  for (int i = 0; i < 2; ++i) {
+    image->seekg(pos[i], ios::beg);
+    readBytes(*image, buf, n);
+    if (static_cast<size_t>(image->gcount()) != n) return false;
+    for (size_t j = 0; j < n; ++j)
+      if (buf[j] != 0) return false;
+  }
+  return true;
+}
+
+/* Only unmatched data is compared completely here. Of a matched file, only
+   the first blockLength bytes are read and compared via their rsync sum,
+   so the image is not read twice. The MD5 sums of matched files, and all
+   of the zero data, are checked by MkTemplate::reuseData() during the
+   scan. */
+bool MkTemplate::Previous::verify(bistream* image, size_t readAmount,
+                                  unsigned partId, bool stored,
+                                  ProgressReporter& reporter) {
+  image->seekg(0, ios::end);
+  uint64 imageSize = image->tellg();
+  image->seekg(0, ios::beg);
+  if (!*image) {
+    reporter.error(_("The image must be a seekable file for "
+                     "--previous-template"));
+    return FAILURE;
+  }
+
+  size_t bufLen = max(readAmount, blockLength);
+  vector<byte> bufVec(2 * bufLen);
+  byte* buf = &bufVec[0];
+  byte* oldBuf = buf + bufLen;
+  vector<bool> valid(entries.size(), false);
+  RsyncSum64 rsum;
+  bool isTemplate = JigdoDesc::isTemplate(*templ); // seek to 1st DATA part
+  Assert(isTemplate);
+  try {
+    auto_ptr<Zibstream> old(new Zibstream(*templ,
+        static_cast<unsigned>(readAmount + 8*1024)));
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const Entry& e = entries[i];
+      if (e.offset + e.size > imageSize) break; // Image has become shorter
+      if (e.zero) {
+        valid[i] = verifyZero(image, e.offset, e.size, buf, bufLen);
+      } else if (e.file == 0) {
+        image->seekg(e.offset, ios::beg);
+        valid[i] = verifyUnmatched(image, old.get(), e.size, buf, oldBuf,
+                                   bufLen);
+      } else {
+        size_t n = implicit_cast<size_t>(
+            min(e.size, implicit_cast<uint64>(blockLength)));
+        image->seekg(e.offset, ios::beg);
+        readBytes(*image, buf, n);
+        rsum.reset();
+        if (static_cast<size_t>(image->gcount()) == n)
+          rsum.addBack(buf, n);
+        valid[i] = (static_cast<size_t>(image->gcount()) == n
+                    && rsum == e.file->rsync()
+                    && partLine(e.file->md5()) != 0);
+      }
+      if (!*image) break;
+    }
+    old->close();
+  } catch (Zerror ze) {
+    reporter.error(subst(_("Could not read `%1': %2"), templFile,
+                         ze.message));
+    return FAILURE;
+  }
+  image->seekg(0, ios::beg);
+  if (!*image) {
+    reporter.error(subst(_("Error reading image (%1)"), strerror(errno)));
+    return FAILURE;
+  }
+
+  findRegions(valid, partId, stored);
+  return SUCCESS;
+}
+//______________________________________________________________________
+
+/* Set up regions from the valid entries, and decide which of the old parts
+   to copy */
+void MkTemplate::Previous::findRegions(const vector<bool>& valid,
+                                       unsigned chunkId, bool stored) {
+  regionVec.clear();
+  reused = 0;
+  size_t c = 0; // Index into chunks
+  size_t i = 0;
+  while (i < entries.size()) {
+    if (!valid[i]) { ++i; continue; }
+    size_t end = i + 1;
+    while (end < entries.size() && valid[end]) ++end;
+    size_t first = i, last = end;
+    i = end;
+    while (first < last && entries[first].file == 0) ++first;
+    while (last > first && entries[last - 1].file == 0) --last;
+    if (first == last) continue;
+
+    Region r;
+    r.start = entries[first].offset;
+    r.end = entries[last - 1].offset + entries[last - 1].size;
+    r.firstEntry = first;
+    r.endEntry = last;
+    regionVec.push_back(r);
+    reused += r.end - r.start;
+    debug("Region [%1,%2) unchanged", r.start, r.end);
+
+    // Copy parts whose data is all inside the region
+    uint64 unmatchedOff = entries[first].unmatchedOff;
+    uint64 unmatchedEnd = entries[last - 1].unmatchedOff;
+    while (c < chunks.size() && chunks[c].unmatchedOff < unmatchedOff) ++c;
+    for (; c < chunks.size() && chunks[c].unmatchedEnd <= unmatchedEnd; ++c)
+      chunks[c].copy = ((chunks[c].id == chunkId
+                         || (stored && chunks[c].id == Zibstream::STOR))
+                        && chunks[c].unmatchedOff < chunks[c].unmatchedEnd);
+  }
+}
+//______________________________________________________________________
+
+void MkTemplate::Previous::readChunk(size_t i, vector<byte>* result) {
+  const Chunk& c = chunks[i];
+  result->resize(c.fileLen);
+  templ->seekg(c.filePos, ios::beg);
+  readBytes(*templ, &(*result)[0], c.fileLen);
+  if (!*templ || static_cast<uint64>(templ->gcount()) != c.fileLen) {
+    throw Zerror(0, subst(_("Could not read `%1' (%2)"), templFile,
+                          strerror(errno)));
+  }
+}
@@ -0,0 +1,126 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Helper class for MkTemplate - reuse the .template/.jigdo of a previous
+  version of the image
+
+*/
+
+#ifndef MKREUSE_HH
+#define MKREUSE_HH
+
+#include <config.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <bstream.hh>
+#include <configfile.hh>
+#include <md5sum.hh>
+#include <mkimage.hh>
+#include <mktemplate.hh>
+#include <nocopy.hh>
+#include <zstream.fh>
+//______________________________________________________________________
+
+/** The template and jigdo file created for an earlier version of the
+    image. read() indexes the old DESC entries and the compressed parts,
+    verify() compares them to the new image: A MATCHED_FILE entry is still
+    valid if the new image's data at the same offset has the same rsync
+    sum over the first blockLength bytes, an UNMATCHED_DATA entry if the
+    data is identical to the decompressed old template data, a ZERO_DATA
+    entry if the data at its start and end is still all zeroes. Only data
+    at the same offsets is compared, so after an insertion which moves
+    the following files, nothing after it can be reused. While scanning,
+    MkTemplate::reuseData() checks the MD5 sums of the reused matched
+    files and the rest of the zero data.
+
+    Each maximal run of valid entries, shortened so that it starts and ends
+    with a matched file, becomes a region. MkTemplate copies the regions'
+    entries to the new DESC section and does not look for matches inside
+    them. Old parts whose uncompressed data lies completely inside a
+    region and which use the same compression method (or are STOR parts)
+    are copied to the new template as they are. */
+class MkTemplate::Previous : NoCopy {
+public:
+  /** Entry of the old DESC section */
+  struct Entry {
+    uint64 offset, size; // Area in image
+    /* Offset of the entry's data in the uncompressed template data, or
+       for a matched file, of the data of the next unmatched entry */
+    uint64 unmatchedOff;
+    const JigdoDesc::MatchedFile* file; // null => unmatched or zero data
+    bool zero; // true => ZERO_DATA entry
+  };
+  /** Compressed part of the old template */
+  struct Chunk {
+    uint64 filePos, fileLen; // Position in template file, incl. header
+    uint64 unmatchedOff, unmatchedEnd; // Uncompressed data covered
+    unsigned id; // Zibstream::DATA, BZIP, ZSTD or XZ
+    bool copy; // true => copy this part verbatim to new template
+  };
+  /** Area of the image whose old entries are still valid */
+  struct Region {
+    uint64 start, end; // Area in image
+    size_t firstEntry, endEntry; // Entries in [firstEntry, endEntry)
+  };
+
+  /** templ must stay open and be seekable until the object is destroyed.
+      templName is only used for error messages. */
+  Previous(const string& templName, bistream* templ, ConfigFile* jigdo);
+
+  /** Read the old template's DESC section and index its parts, and the
+      old jigdo's [Parts]. Returns FAILURE after reporting an error if the
+      old files cannot be used, e.g. because blockLength differs. */
+  bool read(size_t blockLength, ProgressReporter& reporter);
+  /** Read those parts of the image needed to check which old entries are
+      valid and set up regions(). Afterwards, the image is positioned at
+      its start again. Returns FAILURE after reporting an error.
+      @param partId ID of the new template's compressed parts
+      @param stored Whether the new template may contain STOR parts */
+  bool verify(bistream* image, size_t readAmount, unsigned partId,
+              bool stored, ProgressReporter& reporter);
+
+  const vector<Region>& regions() const { return regionVec; }
+  const Entry& entry(size_t i) const { return entries[i]; }
+  const Chunk& chunk(size_t i) const { return chunks[i]; }
+  size_t chunkCount() const { return chunks.size(); }
+  /** Read chunk i from the old template, including its header */
+  void readChunk(size_t i, vector<byte>* result); // May throw Zerror
+
+  /** The old [Parts] line for a matched file, or null */
+  const PartLine* partLine(const MD5& md5) const;
+  /** Lines of the old [Servers] section(s) */
+  const vector<string>& serverLines() const { return servers; }
+
+  /** Number of bytes covered by regions() */
+  uint64 reusedBytes() const { return reused; }
+
+private:
+  bool verifyUnmatched(bistream* image, Zibstream* old, uint64 len,
+                       byte* buf, byte* oldBuf, size_t bufLen);
+  bool verifyZero(bistream* image, uint64 offset, uint64 len, byte* buf,
+                  size_t bufLen);
+  void findRegions(const vector<bool>& valid, unsigned chunkId,
+                   bool stored);
+
+  string templFile;
+  bistream* templ;
+  ConfigFile* jigdo;
+  size_t blockLength;
+  JigdoDescVec desc;
+  vector<Entry> entries;
+  vector<Chunk> chunks;
+  vector<Region> regionVec;
+  map<string, PartLine> parts; // Indexed by base64 md5sum
+  vector<string> servers;
+  uint64 reused;
+};
+
+#endif
@@ -0,0 +1,36 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --align: Files at multiples of 2048 bytes are found by the aligned scan,
+# the one at an unaligned offset by the fallback which searches the
+# unmatched data. make-image must recreate the image.
+random 100k >a
+random 300k >b
+random 5000 >c
+random 2048 >x
+random 1000 >y
+cat x a x b y c >image
+
+mt -f --align=2048 a b c
+tlist <<EOF
+in-template            0         2048
+need-file           2048       102400 6bdJpH3DRwya1z3ALXQ-rg bqRXnKaA3-Y
+in-template       104448         2048
+need-file         106496       307200 FOzJcAAunMVFiRIvkgAhgQ 7nFEYj0J3Z0
+in-template       413696         1000
+need-file         414696         5000 75ttONiGCNVS0TwKB2OYqg osysEyqFgnM
+image-info        419696              gJ4mz0oVYX9RAJICSENGWA 1024
+EOF
+
+rm -f image.out
+../jigdo-file make-image $mtargs --image=image.out \
+    --jigdo=image.jigdo --template=image.template a b c
+cmp image image.out
+
+# The fallback only sees 32 times the --readbuffer of unmatched data at a
+# time, so with a small buffer, b is too large to be found at an unaligned
+# offset. Without --align, it is found.
+cat y b >image
+mt -f --align=2048 --readbuffer=4k b
+grep -c need-file image.tlist | grep '^0$' >/dev/null
+mt -f --readbuffer=4k b
+grep -c need-file image.tlist | grep '^1$' >/dev/null
@@ -0,0 +1,25 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --stats=json: One line of JSON on stderr, also with --report=quiet. File
+# p starts like b, so it is found by the rolling checksum, but an MD5
+# block after the first one does not match.
+random 100k >a
+random 300k >b
+head -c 200000 b >p
+random 100k >>p
+cat a b >image
+
+mt -f --stats=json a b p 2>stats
+tlist <<EOF
+need-file              0       102400 6bdJpH3DRwya1z3ALXQ-rg bqRXnKaA3-Y
+need-file         102400       307200 FOzJcAAunMVFiRIvkgAhgQ 7nFEYj0J3Z0
+image-info        409600              Sy0LPaouoiYRmZfhug_6Zw 1024
+EOF
+test `wc -l <stats` -eq 1
+for x in '"image":"image"' '"image_bytes":409600' '"rsync_hits":3' \
+         '"rsync_false_positives":0' '"md5_mismatches":1' \
+         '"matched_files":2' '"matched_bytes":409600' '"files_read":3'; do
+    if grep -F "$x" stats >/dev/null; then true; else
+        echo "FAILED: $x not in stats:"; cat stats; exit 1
+    fi
+done
@@ -0,0 +1,56 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --cache: The second run gets the file information from the cache. With
+# --no-check-files, files without a cache entry are not considered, which
+# shows that expired entries are gone, also after the cache file has been
+# compacted.
+random 100k >a
+random 300k >b
+random 50k >c
+cat a b c >image
+
+mt -f --cache=cache.db a b c
+cp image.tlist all.tlist
+tlist <all.tlist
+test "`head -c 16 cache.db`" = "jigdo-file cache"
+
+mt -f --cache=cache.db --no-check-files a b c
+tlist <all.tlist
+
+sleep 2
+mt -f --cache=cache.db --cache-expiry=1 a b
+mt -f --cache=cache.db --no-check-files a b c
+grep -c need-file image.tlist | grep '^2$' >/dev/null
+
+# Expire everything, then add entries again. Now that most of the file
+# is stale, it is compacted during the second run.
+sleep 2
+mt -f --cache=cache.db --cache-expiry=1 --no-check-files
+size=`wc -c <cache.db`
+mt -f --cache=cache.db a b c
+tlist <all.tlist
+test "`wc -c <cache.db`" -lt "$size"
+test ! -e cache.db.tmp
+mt -f --cache=cache.db --no-check-files a b c
+tlist <all.tlist
+
+# Files written by something else are not clobbered
+echo "not a cache" >other.db
+mt -f --cache=other.db a b c 2>/dev/null
+tlist <all.tlist
+test "`cat other.db`" = "not a cache"
+
+# Neither are Berkeley DB files from older versions, nor cache files with
+# a different format version
+printf 'xxxxxxxxxxxx\142\061\005\000xxxxxxxxxxxxxxxx' >old.db
+cp old.db old.orig
+mt -f --cache=old.db a b c 2>err
+tlist <all.tlist
+grep "older jigdo-file version" err >/dev/null
+cmp old.db old.orig
+(head -c 24 cache.db; printf '\002'; tail -c +26 cache.db) >new.db
+cp new.db new.orig
+mt -f --cache=new.db a b c 2>err
+tlist <all.tlist
+grep "incompatible version" err >/dev/null
+cmp new.db new.orig
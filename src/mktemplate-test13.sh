@@ -0,0 +1,33 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --cache: Entries are found by inode after a file has been renamed or
+# hard-linked under another name. To show that a file is not read again,
+# its contents are changed without changing its inode, size or mtime.
+random 100k >a
+random 300k >b
+cat a b >image
+mkdir d1
+cp a b d1
+
+mt -f --cache=cache.db d1
+cp image.tlist all.tlist
+grep -c need-file all.tlist | grep '^2$' >/dev/null
+
+mv d1 d2
+touch -r d2/a stamp
+random 100001 | head -c 102400 | dd of=d2/a conv=notrunc 2>/dev/null
+touch -r stamp d2/a
+cmp a d2/a >/dev/null && exit 1
+mt -f --cache=cache.db d2
+tlist <all.tlist
+
+# Same for a hard link, now that d2 is in the cache under its new name
+mkdir d3
+ln d2/a d3/x
+ln d2/b d3/y
+mt -f --cache=cache.db d3
+tlist <all.tlist
+
+# Without the cache, the changed file is not found
+mt -f d3
+grep -c need-file image.tlist | grep '^1$' >/dev/null
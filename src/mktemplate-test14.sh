@@ -0,0 +1,30 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --threads: Directories are read ahead on several threads, but the names
+# come out in the same order, each inode only once and under its real
+# name rather than via a symlink, also with a symlink loop.
+random 100k >a
+random 300k >b
+cat a b >image
+for d in t/d1/d2/d3 t/d1/d4 t/d5/d6 t/d7; do
+    mkdir -p $d
+    random 1000 >$d/x
+    random 2000 >$d/y
+done
+cp a t/d1/d4/a
+cp b t/d5/b
+ln -s d1 t/0link
+ln -s .. t/d5/d6/up
+
+../jigdo-file md5sum --no-cache $mtargs --threads=1 t >list1
+../jigdo-file md5sum --no-cache $mtargs --threads=4 t >list4
+diff -u list1 list4
+test `wc -l <list1` -eq 10
+grep -e link -e up list1 && exit 1
+
+mt -f --threads=4 t
+tlist <<EOT
+need-file              0       102400 6bdJpH3DRwya1z3ALXQ-rg bqRXnKaA3-Y
+need-file         102400       307200 FOzJcAAunMVFiRIvkgAhgQ 7nFEYj0J3Z0
+image-info        409600              Sy0LPaouoiYRmZfhug_6Zw 1024
+EOT
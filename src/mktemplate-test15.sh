@@ -0,0 +1,36 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --cache: Cache entries hold the sums for several --md5-block-size and
+# --min-length values. To show that a file is not read again, the end of
+# its contents is changed without changing its size or mtime.
+random 100k >a
+random 300k >b
+cat a b >image
+
+mt -f --cache=cache.db a b
+cp image.tlist all.tlist
+grep -c need-file all.tlist | grep '^2$' >/dev/null
+mt -f --cache=cache.db --md5-block-size=8k a b
+grep -c need-file image.tlist | grep '^2$' >/dev/null
+
+touch -r a stamp
+random 1000 | dd of=a bs=1000 seek=100 conv=notrunc 2>/dev/null
+touch -r stamp a
+cmp image a >/dev/null 2>&1 && exit 1
+
+mt -f --cache=cache.db a b
+tlist <all.tlist
+mt -f --cache=cache.db --md5-block-size=8k a b
+grep -c need-file image.tlist | grep '^2$' >/dev/null
+
+# The whole file's sum is also used for a third md5 block size
+../jigdo-file md5sum $mtargs --cache=cache.db --md5-block-size=16k a \
+    | grep '^6bdJpH3DRwya1z3ALXQ-rg  a$' >/dev/null
+
+# Other --min-length: Only the start of the file is read
+mt -f --cache=cache.db --min-length=512 a b
+grep -c need-file image.tlist | grep '^2$' >/dev/null
+
+# Without the cache, the changed file is not found
+mt -f a b
+grep -c need-file image.tlist | grep '^1$' >/dev/null
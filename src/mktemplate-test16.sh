@@ -0,0 +1,65 @@
+. $srcdir/mktemplate-funcs.sh
+
+# make-image --threads: The files are copied into the image in parallel.
+# The image, and the .tmp file with its DESC section, must be the same as
+# with one thread.
+random 100k >a
+random 300k >b
+random 50k >c
+random 5000 >x
+cat x a x b x c x >image
+
+mt -f a b c
+for t in 1 4; do
+    rm -f image.$t image.$t.tmp
+    ../jigdo-file make-image $mtargs --threads=$t --image=image.$t \
+        --jigdo=image.jigdo --template=image.template a b c
+    cmp image image.$t
+
+    rm -f part.$t part.$t.tmp
+    ../jigdo-file make-image $mtargs --threads=$t --image=part.$t \
+        --jigdo=image.jigdo --template=image.template a c || test $? -eq 1
+    cp part.$t.tmp first.$t
+    ../jigdo-file make-image $mtargs --threads=$t --image=part.$t \
+        --jigdo=image.jigdo --template=image.template b
+    cmp image part.$t
+done
+cmp first.1 first.4
+
+# Where the kernel copies the files, they are only read back to check them,
+# or not at all with --no-check-files. Output to stdout is never copied that
+# way.
+rm -f image.n image.n.tmp
+../jigdo-file make-image $mtargs --no-check-files --image=image.n \
+    --jigdo=image.jigdo --template=image.template a b c
+cmp image image.n
+../jigdo-file make-image $mtargs --image=- \
+    --jigdo=image.jigdo --template=image.template a b c >image.s
+cmp image image.s
+
+# With --cache, a file whose size and mtime are unchanged is assumed to
+# have the same contents as before. If it was changed nevertheless, the
+# kernel has already copied it into the image when it is read back, and
+# --check-files must still report that it does not match.
+rm -f image.k image.k.tmp
+../jigdo-file make-image $mtargs --cache=cache.db --image=image.k \
+    --jigdo=image.jigdo --template=image.template a b c
+cmp image image.k
+mv b b.orig
+(head -c 1000 b.orig; printf X; tail -c +1002 b.orig) >b
+if cmp -s b b.orig; then
+    (head -c 1000 b.orig; printf Y; tail -c +1002 b.orig) >b
+fi
+touch -r b.orig b
+rm -f image.k image.k.tmp
+status=0
+../jigdo-file make-image $mtargs --cache=cache.db --image=image.k \
+    --jigdo=image.jigdo --template=image.template a b c 2>err || status=$?
+test "$status" -eq 2
+grep "does not match checksum" err >/dev/null
+test ! -e image.k
+# The other files are in place; the original file completes the image
+mv b.orig b
+../jigdo-file make-image $mtargs --cache=cache.db --image=image.k \
+    --jigdo=image.jigdo --template=image.template b
+cmp image image.k
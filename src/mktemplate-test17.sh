@@ -0,0 +1,28 @@
+. $srcdir/mktemplate-funcs.sh
+
+# scan --stats=json: Same names for the read counters as make-template.
+# Only the files which are not in the cache yet are read, small ones
+# completely, of larger ones the first 128k.
+random 1000 >a
+random 2000 >b
+random 300k >c
+sync 2>/dev/null || true
+
+../jigdo-file scan --report=quiet --stats=json --cache=cache.db a b c 2>stats
+test `wc -l <stats` -eq 1
+for x in '"files_read":3,' '"file_bytes":134072,' '"file_bytes_per_s":' \
+         '"wall_ms":'; do
+    if grep -F "$x" stats >/dev/null; then true; else
+        echo "FAILED: $x not in stats:"; cat stats; exit 1
+    fi
+done
+# All three files are on the same filesystem, so the disc position of
+# either all or none of them is known
+if grep -E '"files_ordered":[03],' stats >/dev/null; then true; else
+    echo "FAILED: Unexpected files_ordered:"; cat stats; exit 1
+fi
+
+random 500 >d
+../jigdo-file scan --report=quiet --stats=json --cache=cache.db a b c d 2>stats
+grep -F '{"files_read":1,"files_ordered":' stats >/dev/null
+grep -F '"file_bytes":500,' stats >/dev/null
@@ -0,0 +1,19 @@
+. $srcdir/mktemplate-funcs.sh
+
+# A partial match of in1 fails after its start has left the buffer. With
+# --no-mmap, that data is re-read from in1, with --mmap it is still mapped.
+random 600k >in1
+random 1k >image
+head -c 409600 in1 >>image
+random 1k >>image
+mt --no-mmap in*
+tlist <<EOF
+in-template            0       411648
+image-info        411648              oht65SIA3FSHmtcxKS87BA 1024
+EOF
+
+mt -f --mmap in*
+tlist <<EOF
+in-template            0       411648
+image-info        411648              oht65SIA3FSHmtcxKS87BA 1024
+EOF
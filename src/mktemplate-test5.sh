@@ -0,0 +1,41 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --previous-template: in1 and in2 have not moved, so the area from in1 to
+# the end of in2 is copied from the old template. The rest is rescanned.
+random 300k >in1
+random 200k >in2
+random 100k >in3
+random 1k >image
+cat in1 >>image
+random 1k >>image
+cat in2 >>image
+random 1k >>image
+mt in1 in2
+mv image.template old.template
+mv image.jigdo old.jigdo
+
+head -c 514048 image >image2
+cat in3 >>image2
+random 1k >>image2
+mv image2 image
+mt --previous-template=old.template --previous-jigdo=old.jigdo in*
+tlist <<EOF
+in-template            0         1024
+need-file           1024       307200 wmFrscliekzirsVWz77Q1g bqRXnKaA3-Y
+in-template       308224         1024
+need-file         309248       204800 x4LdByLYW3YNvLvazY9UPg 7nFEYj0J3Z0
+need-file         514048       102400 lFSLQndSdT-JD5SuoVFCiQ osysEyqFgnM
+in-template       616448         1024
+image-info        617472              dpdzpobUdQshiA_HiE__kQ 1024
+EOF
+
+# Data in the middle of in1 has changed, but in1's start is unchanged. This
+# is only noticed while scanning, after in1's old entry has been reused.
+printf 'changed in1 data' | dd of=image bs=1 seek=100000 conv=notrunc 2>/dev/null
+rm -f image.template image.jigdo
+if mt --previous-template=old.template --previous-jigdo=old.jigdo in* \
+    2>mt.err; then
+    echo "FAILED: Change inside reused file was not noticed"
+    exit 1
+fi
+grep -q "differs from the previous template" mt.err
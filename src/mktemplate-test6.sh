@@ -0,0 +1,37 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --batch: Two images share the files, which are only read once
+random 300k >in1
+random 200k >in2
+random 1k >image
+cat in1 >>image
+random 1k >>image
+cat in2 >>image
+random 2k >image2
+cat in2 >>image2
+cat >list <<EOF
+image image.jigdo image.template
+# Comment
+"image2" image2.jigdo image2.template
+EOF
+
+for jobs in 1 2; do
+    ../jigdo-file make-template -0 $mtargs -f --batch=list \
+        --batch-jobs=$jobs in*
+    ../jigdo-file list-template --debug=~general \
+        --template=image.template >image.tlist
+    tlist <<EOF
+in-template            0         1024
+need-file           1024       307200 wmFrscliekzirsVWz77Q1g bqRXnKaA3-Y
+in-template       308224         1024
+need-file         309248       204800 x4LdByLYW3YNvLvazY9UPg 7nFEYj0J3Z0
+image-info        514048              iMI-FG9bhvIUL54YER4_Ig 1024
+EOF
+    ../jigdo-file list-template --debug=~general \
+        --template=image2.template >image.tlist
+    tlist <<EOF
+in-template            0         2048
+need-file           2048       204800 x4LdByLYW3YNvLvazY9UPg 7nFEYj0J3Z0
+image-info        206848              dns7RQlNrOEwGIhs61y3lA 1024
+EOF
+done
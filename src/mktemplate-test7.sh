@@ -0,0 +1,33 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --zstd, --xz: Enough template data for several parts, some of it
+# compressible. make-image must recreate the image from the template.
+random 64k >block
+random 1000k >in
+: >image
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+    cat block block >>image
+done
+random 3000k >>image
+cat in >>image
+random 100k >>image
+
+for method in --zstd --zstd=3 --xz; do
+    if ../jigdo-file $method --version >/dev/null 2>&1; then true; else
+        echo "jigdo-file compiled without support for $method, skipping"
+        continue
+    fi
+    for threads in 1 3; do
+        mt -f $method --threads=$threads in
+        tlist <<EOF
+in-template            0      5693440
+need-file        5693440      1024000 yQP-KUIDVbq3pe-o2zXE_A 7nFEYj0J3Z0
+in-template      6717440       102400
+image-info       6819840              EiGS_SO02yq-2w4Y4S98qA 1024
+EOF
+        rm -f image.out
+        ../jigdo-file make-image $mtargs --image=image.out \
+            --jigdo=image.jigdo --template=image.template in
+        cmp image image.out
+    done
+done
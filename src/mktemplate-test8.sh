@@ -0,0 +1,37 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --store-incompressible: The random data must end up in STOR parts, the
+# text in compressed parts. make-image must handle both.
+random 100k >in
+seq 1 50000 >image # 288894 bytes
+random 300k >>image
+cat in >>image
+random 30k >>image
+
+for method in --gzip --bzip2 --zstd --xz; do
+    if ../jigdo-file $method --version >/dev/null 2>&1; then true; else
+        echo "jigdo-file compiled without support for $method, skipping"
+        continue
+    fi
+    for threads in 1 3; do
+        mt -9 -f $method --threads=$threads --store-incompressible in
+        tlist <<EOF
+in-template            0       596094
+need-file         596094       102400 6bdJpH3DRwya1z3ALXQ-rg bqRXnKaA3-Y
+in-template       698494        30720
+image-info        729214              2ZFBXIizgUpH3TqhWxTS3w 1024
+EOF
+        grep STOR image.template >/dev/null
+        # 330k of random data is stored. Storing the text, too, would make
+        # the template larger than 600k
+        size=`wc -c <image.template`
+        if test "$size" -gt 500000; then
+            echo "FAILED: Template is $size bytes, text not compressed?"
+            exit 1
+        fi
+        rm -f image.out
+        ../jigdo-file make-image $mtargs --image=image.out \
+            --jigdo=image.jigdo --template=image.template in
+        cmp image image.out
+    done
+done
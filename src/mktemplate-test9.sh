@@ -0,0 +1,38 @@
+. $srcdir/mktemplate-funcs.sh
+
+# --zero-runs: Long runs of zeroes become zero-filled entries, short ones
+# stay in the template data. make-image must recreate the image both in
+# one go and via a .tmp file.
+random 100k >a
+random 300k >b
+random 50k >c
+: >zero
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+    dd if=/dev/zero bs=10240 count=1 2>/dev/null >>zero
+done
+cat zero a >image
+dd if=/dev/zero bs=1000 count=1 2>/dev/null >>image
+cat c zero b zero >>image
+
+mt -f --zero-runs=64k a b
+tlist <<EOF
+zero-filled            0       204800
+need-file         204800       102400 6bdJpH3DRwya1z3ALXQ-rg bqRXnKaA3-Y
+in-template       307200        52200
+zero-filled       359400       204800
+need-file         564200       307200 FOzJcAAunMVFiRIvkgAhgQ 7nFEYj0J3Z0
+zero-filled       871400       204800
+image-info       1076200              irl5JPIzM636eqk6AaOSnA 1024
+EOF
+
+rm -f image.out
+../jigdo-file make-image $mtargs --image=image.out \
+    --jigdo=image.jigdo --template=image.template a b
+cmp image image.out
+
+rm -f image.out image.out.tmp
+../jigdo-file make-image $mtargs --image=image.out \
+    --jigdo=image.jigdo --template=image.template a || test $? -eq 1
+../jigdo-file make-image $mtargs --image=image.out \
+    --jigdo=image.jigdo --template=image.template b
+cmp image image.out
@@ -26,9 +26,22 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <zlib.h>
+#if HAVE_MMAP
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/types.h>
+#  include <unistd-jigdo.h>
+#  ifndef MAP_ANONYMOUS
+#    define MAP_ANONYMOUS MAP_ANON
+#  endif
+#endif
 
 #include <algorithm>
+#include <deque>
 #include <iostream>
 #include <fstream>
 #include <map>
@@ -40,11 +53,15 @@
 #include <log.hh>
 #include <mimestream.hh>
 #include <mkimage.hh>
+#include <mkreuse.hh>
 #include <mktemplate.hh>
 #include <scan.hh>
 #include <string.hh>
+#include <thread.hh>
 #include <zstream-gz.hh>
 #include <zstream-bz.hh>
+#include <zstream-xz.hh>
+#include <zstream-zstd.hh>
 //______________________________________________________________________
 
 void MkTemplate::ProgressReporter::error(const string& message) {
@@ -60,16 +77,20 @@ MkTemplate::ProgressReporter MkTemplate::noReport;
 MkTemplate::MkTemplate(JigdoCache* jcache, bistream* imageStream,
     JigdoConfig* jigdoInfo, bostream* templateStream, ProgressReporter& pr,
     int zipQuality, size_t readAmnt, bool addImage, bool addServers,
-    bool useBzip2)
-  : fileSizeTotal(0U), fileCount(0U), block(), readAmount(readAmnt),
-    off(), unmatchedStart(), greedyMatching(true),
-    cache(jcache),
-    image(imageStream), templ(templateStream), zip(0),
+    Compression compression)
+  : sharedIndex(0), index(0), indexMutex(0),
+    readAmount(readAmnt),
+    off(), unmatchedStart(), greedyMatching(true), threads(1),
+    parallelGzip(false), storeIncompressible(false), zeroRunLength(0),
+    zeroRun(0), alignment(0), cache(jcache),
+    image(imageStream), mapImageFile(), templ(templateStream), zip(0),
     zipQual(zipQuality), reporter(pr), matches(new PartialMatchQueue()),
-    sectorLength(),
+    sectorLength(), blockMd5(), reuseMd5(), prevTemplFile(), prevTempl(0),
+    prevJigdo(0), previous(0),
+    reuseRegion(0), reuseEntry(0), reuseChunk(0),
     jigdo(jigdoInfo), addImageSection(addImage),
-    addServersSection(addServers), useBzLib(useBzip2),
-    matchExec() { }
+    addServersSection(addServers), zipMethod(compression),
+    matchExec(), statsVal() { }
 //______________________________________________________________________
 
 /* Because make-template should be debuggable even in non-debug builds,
@@ -78,6 +99,40 @@ MkTemplate::MkTemplate(JigdoCache* jcache, bistream* imageStream,
 Logger MkTemplate::debug("make-template");
 //______________________________________________________________________
 
+MkTemplate::FileIndex::FileIndex(JigdoCache* jc)
+  : jcache(jc), sizeTotal(0), block(), blockFiles(), mutex() { }
+
+void MkTemplate::FileIndex::build() {
+  // Kick out files that are too small
+  size_t fileCount = 0;
+  sizeTotal = 0;
+  for (JigdoCache::iterator f = jcache->begin(), e = jcache->end();
+       f != e; ++f) {
+    if (f->size() < jcache->getBlockLen()) {
+      f->markAsDeleted(jcache);
+      continue;
+    }
+    sizeTotal += f->size();
+    ++fileCount;
+  }
+
+  block.reserve(fileCount);
+  blockFiles.clear();
+  blockFiles.reserve(fileCount);
+
+  jcache->readAheadSums(); // Read files in parallel if possible
+  for (JigdoCache::iterator file = jcache->begin();
+       file != jcache->end(); ++file) {
+    const RsyncSum64* sum = file->getRsyncSum(jcache);
+    if (sum == 0) continue; // Error - skip
+    // Add file to hash table
+    block.insert(*sum, static_cast<uint32>(blockFiles.size()));
+    blockFiles.push_back(&*file);
+  }
+}
+//______________________________________________________________________
+
+
 namespace {
 
   // Find the position of the highest set bit (e.g. for 0x20, result is 5)
@@ -121,22 +176,82 @@ namespace {
   }
   //____________________
 
-  /* Write part of a circular buffer to a Zobstream object, starting
-     with offset "start" (incl) and ending with offset "end" (excl).
-     Offsets can be equal to bufferLength. If both offsets are equal,
-     the whole buffer content is written. */
-  inline void writeBuf(const byte* const buf, size_t begin, size_t end,
-                       const size_t bufferLength, Zobstream* zip) {
-    Paranoid(begin <= bufferLength && end <= bufferLength);
-    if (begin < end) {
-      zip->write(buf + begin, end - begin);
+  /* Calculate rsum from scratch over the blockLength bytes at offset back
+     in the circular buffer buf */
+  inline void rsumFromBuf(RsyncSum64* rsum, const byte* buf, size_t back,
+                          size_t blockLength, size_t bufferLength) {
+    rsum->reset();
+    if (back + blockLength <= bufferLength) {
+      rsum->addBack(buf + back, blockLength);
     } else {
-      zip->write(buf + begin, bufferLength - begin);
-      zip->write(buf, end);
+      rsum->addBack(buf + back, bufferLength - back);
+      rsum->addBack(buf, blockLength + back - bufferLength);
     }
   }
   //____________________
 
+  // Return number of zero bytes at the start of [p, end)
+  inline size_t zeroBytes(const byte* p, const byte* end) {
+    const byte* q = p;
+    while (q < end && (reinterpret_cast<size_t>(q) & 7) != 0 && *q == 0)
+      ++q;
+    if ((reinterpret_cast<size_t>(q) & 7) == 0) {
+      // Compare 8 bytes at a time
+      while (end - q >= 8 && *reinterpret_cast<const uint64*>(q) == 0)
+        q += 8;
+    }
+    while (q < end && *q == 0) ++q;
+    return q - p;
+  }
+  //____________________
+
+  /* For MkTemplate::Stats: Measures wall clock and process CPU time from
+     its creation until stop() */
+  class PhaseTimer {
+  public:
+    PhaseTimer() { now(&wall, &cpu); }
+    void stop(MkTemplate::Stats::Phase* p) const {
+      uint64 w, c;
+      now(&w, &c);
+      p->wall += (w - wall) / 1000;
+      p->cpu += (c - cpu) / 1000;
+    }
+  private:
+    // Current times in microseconds
+    static void now(uint64* w, uint64* c) {
+      struct timeval t;
+      gettimeofday(&t, 0);
+      *w = implicit_cast<uint64>(t.tv_sec) * 1000000 + t.tv_usec;
+      *c = implicit_cast<uint64>(clock()) * 1000000 / CLOCKS_PER_SEC;
+    }
+    uint64 wall, cpu;
+  };
+  //____________________
+
+  // Append x as a JSON string, with quotes
+  void appendJsonString(string& s, const string& x) {
+    static const char hex[] = "0123456789abcdef";
+    s += '"';
+    for (string::const_iterator i = x.begin(), e = x.end(); i != e; ++i) {
+      byte c = static_cast<byte>(*i);
+      if (c == '"' || c == '\\') {
+        s += '\\'; s += *i;
+      } else if (c < 0x20) {
+        s += "\\u00"; s += hex[c >> 4]; s += hex[c & 0xf];
+      } else {
+        s += *i;
+      }
+    }
+    s += '"';
+  }
+
+  void appendJsonPhase(string& s, const char* name,
+                       const MkTemplate::Stats::Phase& p) {
+    s += '"'; s += name; s += "\":{\"wall_ms\":"; append(s, p.wall);
+    s += ",\"cpu_ms\":"; append(s, p.cpu); s += '}';
+  }
+  //____________________
+
   // Write lower 48 bits of x to s in little-endian order
   void write48(bostream& s, uint64 x) {
 #   if 0
@@ -159,6 +274,446 @@ namespace {
 } // namespace
 //______________________________________________________________________
 
+MkTemplate::Stats::Stats()
+  : image(), files(), previous(), scan(), total(), imageBytes(0),
+    partBytes(0), rsyncHits(0), rsyncFalsePositives(0), md5Mismatches(0),
+    droppedMatches(0), peakMatches(0), matchedFiles(0), matchedBytes(0),
+    reusedBytes(0), zipIn(0), zipOut(0), read() { }
+
+string& MkTemplate::Stats::appendJson(string& s) const {
+  s += "{\"image\":"; appendJsonString(s, image);
+  s += ",\"phases\":{";
+  appendJsonPhase(s, "files", files); s += ',';
+  appendJsonPhase(s, "previous", previous); s += ',';
+  appendJsonPhase(s, "scan", scan); s += ',';
+  appendJsonPhase(s, "total", total);
+  s += "},\"image_bytes\":"; append(s, imageBytes);
+  s += ",\"part_bytes\":"; append(s, partBytes);
+  s += ",\"rsync_hits\":"; append(s, rsyncHits);
+  s += ",\"rsync_false_positives\":"; append(s, rsyncFalsePositives);
+  s += ",\"md5_mismatches\":"; append(s, md5Mismatches);
+  s += ",\"dropped_matches\":"; append(s, droppedMatches);
+  s += ",\"peak_matches\":"; append(s, peakMatches);
+  s += ",\"matched_files\":"; append(s, matchedFiles);
+  s += ",\"matched_bytes\":"; append(s, matchedBytes);
+  s += ",\"reused_bytes\":"; append(s, reusedBytes);
+  s += ",\"zip_in\":"; append(s, zipIn);
+  s += ",\"zip_out\":"; append(s, zipOut);
+  s += ',';
+  read.appendJsonFields(s);
+  return s += '}';
+}
+//______________________________________________________________________
+
+/** First stage of scanImage(): Reading the image. scanImage() treats
+    buffer() as a ring buffer of bufferLength() bytes. Initially, the
+    blockLength bytes at its end must be 0x7f, see scanImage(). */
+class MkTemplate::ImageInput {
+public:
+  ImageInput() : buf(0), bufLen(0), goodVal(true) { }
+  virtual ~ImageInput() { }
+  byte* buffer() const { return buf; }
+  size_t bufferLength() const { return bufLen; }
+  /** Make the next up to n bytes of the image available at dest, which
+      must be buffer() + offset in image % bufferLength(). Like
+      readBytes(*image, dest, n) followed by image->gcount() */
+  virtual size_t read(byte* dest, size_t n) = 0;
+  /** Like image->good(): false once read() returned less than requested */
+  bool good() const { return goodVal; }
+  /** Wait until the MD5 sum of the image is complete. Call this after
+      read() returned less than requested. */
+  virtual void finish() { }
+protected:
+  byte* buf;
+  size_t bufLen;
+  bool goodVal;
+};
+//________________________________________
+
+/** Read the image from a stream, copying it into a ring buffer of the
+    requested size. Data not needed any more is overwritten, so matched
+    data whose MD5 check fails later may need to be re-read from the
+    file it partially matched. With a thread, data is read ahead into a
+    ring of blocks and the image's MD5 sum is calculated on that thread,
+    otherwise both happen during read(). */
+class MkTemplate::ImageReader : public ImageInput, public Thread {
+public:
+  ImageReader(bistream* img, size_t bufferLength, size_t blockLen,
+              MD5Sum* imageMd5Sum, bool useThread);
+  ~ImageReader();
+  virtual size_t read(byte* dest, size_t n);
+protected:
+  virtual void run();
+private:
+  static const unsigned BLOCKS = 16;
+  bistream* image;
+  size_t blockLength;
+  MD5Sum* md;
+  bool threaded;
+  ArrayAutoPtr<byte> bufDel;
+
+  Mutex mutex;
+  Condition cond; // Broadcast whenever any of the members below change
+  vector<byte> ring; // BLOCKS blocks of blockLength bytes each
+  size_t blockSize[BLOCKS]; // Nr of valid bytes in each block
+  unsigned head, count; // First filled block, nr of filled blocks
+  size_t headPos; // Nr of bytes of block "head" already consumed
+  bool eof; // Reader thread has read all of the image
+  bool stop; // Tell reader thread to exit early
+};
+
+MkTemplate::ImageReader::ImageReader(bistream* img, size_t bufferLength,
+    size_t blockLen, MD5Sum* imageMd5Sum, bool useThread)
+  : image(img), blockLength(blockLen), md(imageMd5Sum), threaded(false),
+    bufDel(new byte[bufferLength]), ring(), head(0), count(0), headPos(0),
+    eof(false), stop(false) {
+  buf = bufDel.get();
+  bufLen = bufferLength;
+  // Init entire buf, keep valgrind happy
+  memset(buf, 0x7f, bufLen);
+  goodVal = img->good();
+  if (!useThread || !goodVal) return;
+  ring.resize(BLOCKS * blockLength);
+  threaded = (start() == SUCCESS);
+}
+
+MkTemplate::ImageReader::~ImageReader() {
+  if (!threaded) return;
+  mutex.lock();
+  stop = true;
+  cond.broadcast();
+  mutex.unlock();
+  join();
+}
+
+void MkTemplate::ImageReader::run() {
+  MutexLock lock(mutex);
+  while (true) {
+    while (count == BLOCKS && !stop) cond.wait(mutex);
+    if (stop) break;
+    unsigned tail = (head + count) % BLOCKS;
+    byte* block = &ring[tail * blockLength];
+    // Only this thread accesses the tail block until count is increased
+    mutex.unlock();
+    readBytes(*image, block, blockLength);
+    size_t n = image->gcount();
+    md->update(block, n);
+    bool more = image->good();
+    mutex.lock();
+    blockSize[tail] = n;
+    ++count;
+    cond.broadcast();
+    if (!more) break;
+  }
+  eof = true;
+  cond.broadcast();
+}
+
+size_t MkTemplate::ImageReader::read(byte* dest, size_t n) {
+  if (!threaded) {
+    readBytes(*image, dest, n);
+    size_t r = image->gcount();
+    md->update(dest, r);
+    goodVal = image->good();
+    return r;
+  }
+
+  size_t r = 0;
+  MutexLock lock(mutex);
+  while (r < n) {
+    while (count == 0 && !eof) cond.wait(mutex);
+    if (count == 0) break; // End of image
+    // The reader thread does not touch the head block while count > 0
+    const byte* block = &ring[head * blockLength];
+    size_t len = blockSize[head] - headPos;
+    if (len > n - r) len = n - r;
+    mutex.unlock();
+    memcpy(dest + r, block + headPos, len);
+    mutex.lock();
+    r += len;
+    headPos += len;
+    if (headPos == blockSize[head]) {
+      head = (head + 1) % BLOCKS;
+      --count;
+      headPos = 0;
+      cond.broadcast();
+    }
+  }
+  if (r < n) goodVal = false;
+  return r;
+}
+//________________________________________
+
+#if HAVE_MMAP
+/** Memory-map the whole image file, with the pages following it used for
+    the 0x7f bytes at the end of the "ring buffer". The buffer is larger
+    than the image, so it never wraps around, no data is copied and all of
+    the image remains available until the end - nothing ever needs to be
+    re-read. With a thread, the image's MD5 sum is calculated on that
+    thread, which also makes the kernel read ahead. */
+class MkTemplate::ImageMap : public ImageInput, public Thread {
+public:
+  /** Check whether fileName can be mapped. If not, return null, otherwise
+      an object which has already started the thread (if any). */
+  static ImageMap* open(const string& fileName, size_t blockLen,
+                        MD5Sum* imageMd5Sum, bool useThread);
+  ~ImageMap();
+  virtual size_t read(byte* dest, size_t n);
+  virtual void finish();
+protected:
+  virtual void run();
+private:
+  ImageMap(byte* base, size_t mapLen, uint64 size, MD5Sum* imageMd5Sum);
+  size_t mapLength; // Size of the whole mapping at buf
+  size_t imageSize;
+  size_t pos; // Nr of bytes returned by read()
+  MD5Sum* md;
+  bool threaded;
+
+  Mutex mutex;
+  Condition cond;
+  bool stop; // Tell MD5 thread to exit early
+};
+
+MkTemplate::ImageMap::ImageMap(byte* base, size_t mapLen, uint64 size,
+                               MD5Sum* imageMd5Sum)
+  : mapLength(mapLen), imageSize(size), pos(0), md(imageMd5Sum),
+    threaded(false), stop(false) {
+  buf = base;
+}
+
+MkTemplate::ImageMap* MkTemplate::ImageMap::open(const string& fileName,
+    size_t blockLen, MD5Sum* imageMd5Sum, bool useThread) {
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { close(fd); return 0; }
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  uint64 size = st.st_size;
+  uint64 imageLen = (size + page - 1) / page * page;
+  uint64 mapLen = imageLen + (blockLen + page - 1) / page * page;
+  // Image might be too large for the address space
+  if (mapLen != static_cast<size_t>(mapLen)) { close(fd); return 0; }
+
+  /* Reserve the address range with an anonymous mapping, then map the
+     file over its start. */
+  void* base = mmap(0, static_cast<size_t>(mapLen), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) { close(fd); return 0; }
+  if (size > 0
+      && mmap(base, static_cast<size_t>(size), PROT_READ,
+              MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(base, static_cast<size_t>(mapLen));
+    close(fd);
+    return 0;
+  }
+  close(fd); // The mapping stays valid
+# if HAVE_MADVISE
+  if (size > 0) madvise(base, static_cast<size_t>(size), MADV_SEQUENTIAL);
+# endif
+
+  ImageMap* result = new ImageMap(static_cast<byte*>(base),
+      static_cast<size_t>(mapLen), size, imageMd5Sum);
+  result->bufLen = static_cast<size_t>(imageLen) + blockLen;
+  memset(result->buf + imageLen, 0x7f, blockLen);
+  if (useThread) result->threaded = (result->start() == SUCCESS);
+  return result;
+}
+
+MkTemplate::ImageMap::~ImageMap() {
+  if (threaded) {
+    mutex.lock();
+    stop = true;
+    mutex.unlock();
+    join();
+  }
+  munmap(buf, mapLength);
+}
+
+void MkTemplate::ImageMap::run() {
+  const size_t CHUNK = 1024U * 1024U;
+  for (size_t done = 0; done < imageSize; done += CHUNK) {
+    {
+      MutexLock lock(mutex);
+      if (stop) return;
+    }
+    md->update(buf + done, min(CHUNK, imageSize - done));
+  }
+}
+
+size_t MkTemplate::ImageMap::read(byte* dest, size_t n) {
+  Paranoid(dest == buf + pos);
+  if (n > imageSize - pos) {
+    n = imageSize - pos;
+    goodVal = false;
+  }
+  if (!threaded) md->update(dest, n);
+  pos += n;
+  return n;
+}
+
+void MkTemplate::ImageMap::finish() {
+  if (!threaded) return;
+  join();
+  threaded = false;
+}
+#endif /* HAVE_MMAP */
+//________________________________________
+
+MkTemplate::ImageInput* MkTemplate::newImageInput(size_t bufferLength,
+    size_t blockLength, MD5Sum* imageMd5Sum) {
+# if HAVE_MMAP
+  if (!mapImageFile.empty()) {
+    ImageMap* result = ImageMap::open(mapImageFile, blockLength,
+                                      imageMd5Sum, threads > 1);
+    if (result != 0) {
+      debug("Memory-mapped image `%1'", mapImageFile);
+      return result;
+    }
+    debug("Could not mmap `%1', reading it instead", mapImageFile);
+  }
+# endif
+  return new ImageReader(image, bufferLength, readAmount, imageMd5Sum,
+                         threads > 1);
+}
+//______________________________________________________________________
+
+/** Last stage of scanImage(): Compressing unmatched data into the
+    template. With a thread, write() only queues a copy of the data, and
+    the thread passes it on to the Zobstream in the same portions, so the
+    output is identical. A Zerror thrown by the Zobstream is rethrown by
+    the next call to write(), writeChunk() or close(). */
+class MkTemplate::ZipWriter : public Thread {
+public:
+  ZipWriter(Zobstream* z, size_t maxQueued, bool useThread);
+  ~ZipWriter();
+  void write(const byte* data, size_t n) { queueData(data, n, false); }
+  /** Like Zobstream::writeChunk() */
+  void writeChunk(const byte* part, size_t n) { queueData(part, n, true); }
+  void close();
+protected:
+  virtual void run();
+private:
+  // Pass data to zip, or queue it for the thread
+  void queueData(const byte* data, size_t n, bool chunk);
+  // Let thread process remaining data, then wait for it to exit
+  void finish();
+  struct Item {
+    vector<byte>* data;
+    bool chunk; // true => pass to zip->writeChunk(), else zip->write()
+  };
+  Zobstream* zip;
+  size_t maxBytes;
+  bool threaded;
+
+  Mutex mutex;
+  Condition cond; // Broadcast whenever any of the members below change
+  deque<Item> queue; // Data not yet passed to zip
+  vector<vector<byte>*> pool; // Buffers for reuse
+  size_t queuedBytes;
+  bool done; // No more data will be queued
+  bool failed; // zip threw a Zerror which was not yet rethrown
+  int errStatus;
+  string errMessage;
+};
+
+MkTemplate::ZipWriter::ZipWriter(Zobstream* z, size_t maxQueued,
+                                 bool useThread)
+  : zip(z), maxBytes(maxQueued), threaded(false), queue(), pool(),
+    queuedBytes(0), done(false), failed(false), errStatus(0),
+    errMessage() {
+  if (useThread) threaded = (start() == SUCCESS);
+}
+
+MkTemplate::ZipWriter::~ZipWriter() {
+  finish();
+  for (size_t i = 0; i < queue.size(); ++i) delete queue[i].data;
+  for (size_t i = 0; i < pool.size(); ++i) delete pool[i];
+}
+
+void MkTemplate::ZipWriter::finish() {
+  if (!threaded) return;
+  mutex.lock();
+  done = true;
+  cond.broadcast();
+  mutex.unlock();
+  join();
+  threaded = false;
+}
+
+void MkTemplate::ZipWriter::run() {
+  bool skip = false; // After an error, discard any further data
+  MutexLock lock(mutex);
+  while (true) {
+    while (queue.empty() && !done) cond.wait(mutex);
+    if (queue.empty()) return;
+    vector<byte>* v = queue.front().data;
+    bool chunk = queue.front().chunk;
+    bool error = false;
+    mutex.unlock();
+    if (!skip) {
+      try {
+        if (chunk)
+          zip->writeChunk(&(*v)[0], v->size());
+        else // Queued in pieces of at most one buffer each
+          zip->write(&(*v)[0], static_cast<unsigned>(v->size()));
+      } catch (Zerror e) {
+        skip = error = true;
+        errStatus = e.status;
+        errMessage = e.message;
+      }
+    }
+    mutex.lock();
+    queue.pop_front();
+    queuedBytes -= v->size();
+    pool.push_back(v);
+    if (error) failed = true;
+    cond.broadcast();
+  }
+}
+
+void MkTemplate::ZipWriter::queueData(const byte* data, size_t n,
+                                      bool chunk) {
+  if (!threaded) {
+    if (chunk)
+      zip->writeChunk(data, n);
+    else
+      zip->write(data, static_cast<unsigned>(n)); // At most one buffer
+    return;
+  }
+  if (n == 0) return;
+  MutexLock lock(mutex);
+  while (queuedBytes >= maxBytes && !failed) cond.wait(mutex);
+  if (failed) {
+    failed = false;
+    throw Zerror(errStatus, errMessage);
+  }
+  vector<byte>* v;
+  if (pool.empty()) {
+    v = new vector<byte>();
+  } else {
+    v = pool.back();
+    pool.pop_back();
+  }
+  v->assign(data, data + n);
+  Item item = { v, chunk };
+  queue.push_back(item);
+  queuedBytes += n;
+  cond.broadcast();
+}
+
+void MkTemplate::ZipWriter::close() {
+  bool wasThreaded = threaded;
+  finish();
+  if (wasThreaded && failed) {
+    failed = false;
+    throw Zerror(errStatus, errMessage);
+  }
+  zip->close();
+}
+//______________________________________________________________________
+
 /** Build up a template DESC section by appending items to a
     JigdoDescVec. Calls to descUnmatchedData() are allowed to accumulate, so
     that >1 consecutive unmatched data areas are merged into one in the DESC
@@ -186,6 +741,18 @@ public:
     }
     offset += len;
   }
+  // Insert in DESC section: a run of zero bytes, merged like unmatchedData()
+  inline void zeroData(uint64 len) {
+    JigdoDesc::ZeroData* z;
+    if (files.size() > 0
+        && (z = dynamic_cast<JigdoDesc::ZeroData*>(files.back())) != 0) {
+      z->resize(z->size() + len);
+    } else {
+      files.reserve((files.size() + 16) % 16);
+      files.push_back(new JigdoDesc::ZeroData(offset, len));
+    }
+    offset += len;
+  }
   // Insert in DESC section: information about a file that matched
   inline void matchedFile(uint64 len, const RsyncSum64& r,
                           const MD5Sum& md5) {
@@ -193,6 +760,11 @@ public:
     files.push_back(new JigdoDesc::MatchedFile(offset, len, r, md5));
     offset += len;
   }
+  inline void matchedFile(uint64 len, const RsyncSum64& r, const MD5& md5) {
+    files.reserve((files.size() + 16) % 16);
+    files.push_back(new JigdoDesc::MatchedFile(offset, len, r, md5));
+    offset += len;
+  }
   inline bostream& put(bostream& s, MD5Sum* md) {
     files.put(s, md);
     return s;
@@ -207,28 +779,9 @@ private:
    to make such large functions inline, but there is only one call to
    them, anyway. */
 
-inline bool MkTemplate::scanFiles(size_t blockLength, uint32 blockMask,
-                                  size_t md5BlockLength) {
-  bool result = SUCCESS;
-
-  cache->setParams(blockLength, md5BlockLength);
-  FileVec::iterator hashPos;
-
-  for (JigdoCache::iterator file = cache->begin();
-       file != cache->end(); ++file) {
-    const RsyncSum64* sum = file->getRsyncSum(cache);
-    if (sum == 0) continue; // Error - skip
-    // Add file to hash list
-    hashPos = block.begin() + (sum->getHi() & blockMask);
-    hashPos->push_back(&*file);
-  }
-  return result;
-}
-//________________________________________
-
 void MkTemplate::checkRsyncSumMatch2(const size_t blockLen,
     const size_t back, const size_t md5BlockLength, uint64& nextEvent,
-    FilePart* file) {
+    FilePart* file, uint64 fileSize) {
 
   /* Don't schedule match if its startOff (== off - blockLen) is impossible.
      This is e.g. the case when file A is 1024 bytes long (i.e. is
@@ -264,9 +817,9 @@ void MkTemplate::checkRsyncSumMatch2(const size_t blockLen,
 
   /* Rolling rsum matched - schedule an MD5Sum match. NB: In extreme cases,
      nextEvent may be equal to off */
-  x->setStartOffset(off - blockLen);
-  size_t eventLen = (file->size() < md5BlockLength ?
-                     file->size() : md5BlockLength);
+  x->setStartOffset(matches, off - blockLen);
+  size_t eventLen = (fileSize < md5BlockLength ?
+                     fileSize : md5BlockLength);
   x->setNextEvent(matches, x->startOffset() + eventLen);
   debug(" %1: Head of %2 match at offset %3, my next event %4",
         off, file->leafName(), x->startOffset(), x->nextEvent());
@@ -279,30 +832,228 @@ void MkTemplate::checkRsyncSumMatch2(const size_t blockLen,
 /* Look for matches of sum (i.e. scanImage()'s rsum). If found, insert
    appropriate entry in "matches". */
 void MkTemplate::checkRsyncSumMatch(const RsyncSum64& sum,
-    const uint32& bitMask, const size_t blockLen, const size_t back,
-    const size_t md5BlockLength, uint64& nextEvent) {
-
-  typedef const vector<FilePart*> FVec;
-  FVec& hashEntry = block[sum.getHi() & bitMask];
-  if (hashEntry.empty()) return;
-
-  FVec::const_iterator i = hashEntry.begin(), e = hashEntry.end();
-  do {
-    FilePart* file = *i;
-    const RsyncSum64* fileSum = file->getRsyncSum(cache);
-    if (fileSum != 0 && *fileSum == sum)
-      // Insert new partial file match in "matches" queue
-      checkRsyncSumMatch2(blockLen, back, md5BlockLength, nextEvent, file);
+    const size_t blockLen, const size_t back, const size_t md5BlockLength,
+    uint64& nextEvent) {
+
+  RsyncSumIndex& block = index->block;
+  if (!block.mayContain(sum)) return;
+  // A shared index is used by several threads, so collect no statistics
+  size_t i = (indexMutex == 0 ? block.first(sum) : block.find(sum));
+  for (; i != RsyncSumIndex::npos; i = block.next(sum, i)) {
+    FilePart* file = index->blockFiles[block.value(i)];
+    uint64 fileSize;
+    { // With a shared index, another thread may be reading the file
+      CacheLock lock(indexMutex);
+      if (file->deleted()) continue; // Read error while matching it earlier
+      fileSize = file->size();
+    }
+    ++statsVal.rsyncHits;
+    // Insert new partial file match in "matches" queue
+    checkRsyncSumMatch2(blockLen, back, md5BlockLength, nextEvent, file,
+                        fileSize);
+  }
+}
+//________________________________________
+
+/* Write len bytes of unmatched image data to zip and add them to desc.
+   With setZeroRunLength(), runs of zero bytes of at least zeroRunLength
+   bytes become ZERO_DATA entries instead. Because the data arrives in
+   pieces, the zeroes at its end are only counted in zeroRun; they are
+   dealt with once the run ends, by endZeroRun(). */
+void MkTemplate::unmatchedData(const byte* data, size_t len, Desc& desc) {
+  if (zeroRunLength == 0) {
+    zip->write(data, len);
+    desc.unmatchedData(len);
+    return;
+  }
+
+  const byte* p = data;
+  const byte* end = data + len;
+  while (p < end) {
+    if (zeroRun > 0 || *p == 0) {
+      size_t n = zeroBytes(p, end);
+      zeroRun += n;
+      p += n;
+      if (p == end) return; // Run may continue
+      endZeroRun(desc);
+    }
+
+    /* Look for the start of the next run of zeroes which is long enough,
+       or which extends to the end of the data */
+    const byte* q = p;
+    while (true) {
+      q = static_cast<const byte*>(memchr(q, 0, end - q));
+      if (q == 0) { q = end; break; }
+      size_t n = zeroBytes(q, end);
+      if (n >= zeroRunLength || q + n == end) break;
+      q += n;
+    }
+    zip->write(p, q - p);
+    desc.unmatchedData(q - p);
+    p = q;
+  }
+}
+
+/* Called when the run of zeroes at the end of the unmatched data has
+   ended, or before a matched file or the end of the image */
+void MkTemplate::endZeroRun(Desc& desc) {
+  if (zeroRun == 0) return;
+  if (zeroRun >= zeroRunLength) {
+    debug("%1 zero bytes", zeroRun);
+    desc.zeroData(zeroRun);
+  } else {
+    // Too short, write the zeroes after all
+    static const byte zeroes[4096] = { 0 };
+    desc.unmatchedData(zeroRun);
+    while (zeroRun > 0) {
+      size_t n = (zeroRun < sizeof(zeroes) ? zeroRun : sizeof(zeroes));
+      zip->write(zeroes, n);
+      zeroRun -= n;
+    }
+  }
+  zeroRun = 0;
+}
+
+/* Write part of a circular buffer as unmatched data, starting with offset
+   "start" (incl) and ending with offset "end" (excl). Offsets can be equal
+   to bufferLength. If both offsets are equal, the whole buffer content is
+   written. */
+void MkTemplate::writeBuf(const byte* const buf, size_t begin, size_t end,
+                          const size_t bufferLength, Desc& desc) {
+  Paranoid(begin <= bufferLength && end <= bufferLength);
+  if (begin < end) {
+    unmatchedData(buf + begin, end - begin, desc);
+  } else {
+    unmatchedData(buf + begin, bufferLength - begin, desc);
+    unmatchedData(buf, end, desc);
+  }
+}
+
+/* Write the unmatched data in buf from begin to end (which wraps around
+   at bufferLength, begin == end means the whole buffer) to the template.
+   The data starts at offset unmatchedStart in the image.
+
+   With setAlignment(), this is where files at unaligned offsets are
+   looked for: Roll the checksum over every offset of the data, and where
+   a file lies completely inside the data, add it as a match instead. Only
+   data which is still buffered is searched. */
+bool MkTemplate::writeUnmatched(const byte* const buf, size_t begin,
+    size_t end, const size_t bufferLength, Desc& desc) {
+  if (alignment <= 1) {
+    writeBuf(buf, begin, end, bufferLength, desc);
+    return SUCCESS;
+  }
+  const size_t blockLength = cache->getBlockLen();
+  size_t len = modSub(end, begin, bufferLength);
+  if (len == 0) len = bufferLength;
+  size_t written = 0; // Data before this has been written
+  size_t i = 0; // Checksum covers data from i to i + blockLength
+  RsyncSum64 rsum;
+  if (len >= blockLength)
+    rsumFromBuf(&rsum, buf, begin, blockLength, bufferLength);
+  while (i + blockLength <= len) {
+    uint64 fileSize;
+    FilePart* file = 0;
+    if (index->block.mayContain(rsum))
+      file = findUnaligned(rsum, buf, modAdd(begin, i, bufferLength),
+                           len - i, bufferLength, &fileSize);
+    if (file != 0) {
+      if (written < i)
+        writeBuf(buf, modAdd(begin, written, bufferLength),
+                 modAdd(begin, i, bufferLength), bufferLength, desc);
+      endZeroRun(desc);
+      uint64 start = unmatchedStart + i;
+      reporter.matchFound(file, start);
+      matchedParts.push_back(file);
+      {
+        CacheLock lock(indexMutex);
+        desc.matchedFile(fileSize, *(file->getRsyncSum(cache)),
+                         *(file->getMD5Sum(cache)));
+      }
+      ++statsVal.matchedFiles;
+      statsVal.matchedBytes += fileSize;
+      // Inside the range already passed to debugRangeInfo() by caller
+      printRangeInfo(start, start + fileSize, "MATCH at unaligned offset:");
+      if (!matchExec.empty() && matchExecCommands(file) == FAILURE)
+        return FAILURE;
+      i += implicit_cast<size_t>(fileSize);
+      written = i;
+      if (i + blockLength <= len)
+        rsumFromBuf(&rsum, buf, modAdd(begin, i, bufferLength),
+                    blockLength, bufferLength);
+      continue;
+    }
+    if (i + blockLength == len) break;
+    rsum.removeFront(buf[modAdd(begin, i, bufferLength)], blockLength);
+    rsum.addBack(buf[modAdd(begin, i + blockLength, bufferLength)]);
     ++i;
-  } while (i != e);
-  return;
+  }
+  if (written < len)
+    writeBuf(buf, modAdd(begin, written, bufferLength), end, bufferLength,
+             desc);
+  return SUCCESS;
+}
+
+/* Called by writeUnmatched() for a checksum found in the index. Return
+   the first file with that checksum whose MD5 sums match the avail bytes
+   in buf from pos onwards (wrapping around at bufferLength), or null. */
+FilePart* MkTemplate::findUnaligned(const RsyncSum64& sum,
+    const byte* const buf, size_t pos, size_t avail,
+    const size_t bufferLength, uint64* fileSize) {
+  const size_t md5BlockLength = cache->getMD5BlockLen();
+  RsyncSumIndex& block = index->block;
+  size_t i = (indexMutex == 0 ? block.first(sum) : block.find(sum));
+  for (; i != RsyncSumIndex::npos; i = block.next(sum, i)) {
+    FilePart* file = index->blockFiles[block.value(i)];
+    {
+      CacheLock lock(indexMutex);
+      if (file->deleted()) continue;
+      *fileSize = file->size();
+    }
+    if (*fileSize > avail) continue;
+    ++statsVal.rsyncHits;
+
+    // Compare the data with the file's MD5 sums, one block at a time
+    MD5Sum& md = blockMd5;
+    size_t blockNr = 0;
+    uint64 done = 0;
+    while (done < *fileSize) {
+      size_t n = implicit_cast<size_t>(
+          min(*fileSize - done, implicit_cast<uint64>(md5BlockLength)));
+      size_t p = modAdd(pos, implicit_cast<size_t>(done), bufferLength);
+      md.reset();
+      if (p + n <= bufferLength) {
+        md.update(buf + p, n);
+      } else {
+        md.update(buf + p, bufferLength - p);
+        md.update(buf, n - (bufferLength - p));
+      }
+      md.finishForReuse();
+      const MD5* fileSum;
+      {
+        CacheLock lock(indexMutex);
+        fileSum = file->getSums(cache, blockNr);
+      }
+      if (fileSum == 0 || md != *fileSum) break;
+      done += n;
+      ++blockNr;
+    }
+    if (done == *fileSize) return file;
+    if (blockNr == 0)
+      ++statsVal.rsyncFalsePositives;
+    else
+      ++statsVal.md5Mismatches;
+  }
+  return 0;
 }
 //________________________________________
 
-// Read the 'count' first bytes from file x and write them to zip
-bool MkTemplate::rereadUnmatched(FilePart* file, uint64 count) {
+/* Read the 'count' first bytes from file x and write them as unmatched
+   data */
+bool MkTemplate::rereadUnmatched(FilePart* file, uint64 count,
+                                 Desc& desc) {
   // Lower peak memory usage: Deallocate cache's buffer
-  cache->deallocBuffer();
+  { CacheLock lock(indexMutex); cache->deallocBuffer(); }
 
   ArrayAutoPtr<byte> tmpBuf(new byte[readAmount]);
   string inputName = file->getPath();
@@ -313,7 +1064,8 @@ bool MkTemplate::rereadUnmatched(FilePart* file, uint64 count) {
     readBytes(*inputFile, tmpBuf.get(),
               (readAmount < count ? readAmount : count));
     size_t n = inputFile->gcount();
-    zip->write(tmpBuf.get(), n); // will catch Zerror "upstream"
+    statsVal.partBytes += n;
+    unmatchedData(tmpBuf.get(), n, desc); // will catch Zerror "upstream"
     Paranoid(n <= count);
     count -= n;
   }
@@ -382,11 +1134,10 @@ bool MkTemplate::checkMD5Match_mismatch(const size_t stillBuffered,
   debugRangeInfo(xStartOffset, rereadEnd,
                  "UNMATCHED after some blocks, re-reading from", x);
 
-  desc.unmatchedData(rereadEnd - xStartOffset);
   unmatchedStart = rereadEnd;
 
   uint64 bytesToWrite = rereadEnd - xStartOffset;
-  return rereadUnmatched(xfile, bytesToWrite);
+  return rereadUnmatched(xfile, bytesToWrite, desc);
 }
 //________________________________________
 
@@ -399,11 +1150,11 @@ bool MkTemplate::checkMD5Match_mismatch(const size_t stillBuffered,
    say $DEST, which might contain spaces. In that case, using exec() with
    some kind of "%label" substitution is awkward and error-prone - let's just
    have one single substitution scheme, that used by the shell! */
-bool MkTemplate::matchExecCommands(PartialMatch* x) {
+bool MkTemplate::matchExecCommands(FilePart* matched) {
   Paranoid(!matchExec.empty());
 
   string matchPath, leaf;
-  const string& leafName = x->file()->leafName();
+  const string& leafName = matched->leafName();
   string::size_type lastSlash = leafName.rfind(DIRSEP);
   if (lastSlash == string::npos) {
     leaf = leafName;
@@ -411,14 +1162,17 @@ bool MkTemplate::matchExecCommands(PartialMatch* x) {
     matchPath.assign(leafName, 0, lastSlash + 1);
     leaf.assign(leafName, lastSlash + 1, string::npos);
   }
+  /* Also serializes the setenv()/system() calls of MkTemplates running on
+     several threads */
+  CacheLock lock(indexMutex);
   Base64String md5Sum;
-  md5Sum.write(x->file()->getMD5Sum(cache)->digest(), 16).flush();
-  string file = x->file()->getLocation()->getPath();
+  md5Sum.write(matched->getMD5Sum(cache)->sum, 16).flush();
+  string file = matched->getLocation()->getPath();
   file += leafName;
 
   // Set environment vars
-  if (compat_setenv("LABEL", x->file()->getLocation()->getLabel().c_str())
-      || compat_setenv("LABELPATH", x->file()->getLocation()->getPath()
+  if (compat_setenv("LABEL", matched->getLocation()->getLabel().c_str())
+      || compat_setenv("LABELPATH", matched->getLocation()->getPath()
                        .c_str())
       || compat_setenv("MATCHPATH", matchPath.c_str())
       || compat_setenv("LEAF", leaf.c_str())
@@ -454,7 +1208,7 @@ bool MkTemplate::checkMD5Match(byte* const buf,
   /* Calculate MD5Sum from buf[x->blockOff] to buf[data-1], deal with
      wraparound. NB 0 <= x->blockOff < bufferLength, but 1 <= data <
      bufferLength+1 */
-  static MD5Sum md;
+  MD5Sum& md = blockMd5;
   md.reset();
   if (x->blockOffset() < data) {
     md.update(buf + x->blockOffset(), data - x->blockOffset());
@@ -465,7 +1219,13 @@ bool MkTemplate::checkMD5Match(byte* const buf,
   md.finishForReuse();
   //____________________
 
-  const MD5* xfileSum = x->file()->getSums(cache, x->blockNumber());
+  const MD5* xfileSum;
+  uint64 fileSize; // Read under the lock, getSums() may mark it deleted
+  {
+    CacheLock lock(indexMutex);
+    xfileSum = x->file()->getSums(cache, x->blockNumber());
+    fileSize = x->file()->size();
+  }
   if (debug)
     debug("checkMD5Match?: image %1, file %2 block #%3 %4",
           md.toString(), x->file()->leafName(), x->blockNumber(),
@@ -475,17 +1235,21 @@ bool MkTemplate::checkMD5Match(byte* const buf,
     /* The block didn't match, so the whole file doesn't match - re-read from
        file any data that is no longer buffered (and not covered by another
        match), and write it to the Zobstream. */
+    if (x->blockNumber() == 0)
+      ++statsVal.rsyncFalsePositives;
+    else
+      ++statsVal.md5Mismatches;
     return checkMD5Match_mismatch(stillBuffered, x, desc);
   }
   //____________________
 
   // Another block of file matched - was it the last one?
-  if (off < x->startOffset() + x->file()->size()) {
+  if (off < x->startOffset() + fileSize) {
     // Still some more to go - update x and its position in queue
     x->setBlockOffset(data);
     x->setBlockNumber(x->blockNumber() + 1);
     x->setNextEvent(matches, min(x->nextEvent() + md5BlockLength,
-                                 x->startOffset() + x->file()->size()));
+                                 x->startOffset() + fileSize));
     nextEvent = min(nextEvent, x->nextEvent());
     debug("checkMD5Match: match and more to go, next at off %1",
           x->nextEvent());
@@ -493,7 +1257,7 @@ bool MkTemplate::checkMD5Match(byte* const buf,
   }
   //____________________
 
-  Assert(off == x->startOffset() + x->file()->size());
+  Assert(off == x->startOffset() + fileSize);
   // Heureka! *MATCH*
   // x = address of PartialMatch obj of file that matched
 
@@ -518,8 +1282,7 @@ bool MkTemplate::checkMD5Match(byte* const buf,
     debugRangeInfo(oldestMatch->startOffset(), unmatchedStart,
                    "UNMATCHED, re-reading partial match from", oldestMatch);
     size_t toReread = unmatchedStart - oldestMatch->startOffset();
-    desc.unmatchedData(toReread);
-    if (rereadUnmatched(oldestMatch->file(), toReread))
+    if (rereadUnmatched(oldestMatch->file(), toReread, desc))
       return FAILURE;
   }
 
@@ -531,20 +1294,27 @@ bool MkTemplate::checkMD5Match(byte* const buf,
     size_t toWrite = x->startOffset() - unmatchedStart;
     Paranoid(off - unmatchedStart <= bufferLength);
     size_t writeStart = modSub(data, off - unmatchedStart, bufferLength);
-    writeBuf(buf, writeStart, modAdd(writeStart, toWrite, bufferLength),
-             bufferLength, zip);
-    desc.unmatchedData(toWrite);
+    if (writeUnmatched(buf, writeStart,
+                       modAdd(writeStart, toWrite, bufferLength),
+                       bufferLength, desc))
+      return FAILURE;
   }
+  endZeroRun(desc);
 
   // Assert(x->file->mdValid);
-  desc.matchedFile(x->file()->size(), *(x->file()->getRsyncSum(cache)),
-                   *(x->file()->getMD5Sum(cache)));
+  {
+    CacheLock lock(indexMutex);
+    desc.matchedFile(fileSize, *(x->file()->getRsyncSum(cache)),
+                     *(x->file()->getMD5Sum(cache)));
+  }
+  ++statsVal.matchedFiles;
+  statsVal.matchedBytes += fileSize;
   unmatchedStart = off;
   debugRangeInfo(x->startOffset(), off, "MATCH:", x);
 
   // With --match-exec, execute user-supplied command(s)
   if (!matchExec.empty()
-      && matchExecCommands(x) == FAILURE)
+      && matchExecCommands(x->file()) == FAILURE)
     return FAILURE;
 
   /* Remove all matches with startOff < off (this includes x). This is the
@@ -564,37 +1334,131 @@ bool MkTemplate::checkMD5Match(byte* const buf,
    either by re-reading from the partially matched file, or from the buffer.
    Compare to similar code in checkMD5Match.
 
-   Since we are at the end of the image, the full last bufferLength bytes of
-   the image are in the buffer. */
+   At the end of the image, the full last bufferLength bytes of the image
+   are in the buffer. This is also called at the start of a region reused
+   from a previous template, where only stillBuffered bytes are. */
 bool MkTemplate::unmatchedAtEnd(byte* const buf,
-    const size_t bufferLength, const size_t data, Desc& desc) {
+    const size_t bufferLength, const size_t data,
+    const size_t stillBuffered, Desc& desc) {
   Paranoid(unmatchedStart < off); // cf. where this is called
 
   // Re-read and write out data that is no longer buffered.
   const PartialMatch* y = matches->findStartOffset(unmatchedStart);
-  if (y != 0 && y->startOffset() < off - bufferLength) {
-    unmatchedStart = off - bufferLength;
+  if (y != 0 && off > stillBuffered
+      && y->startOffset() < off - stillBuffered) {
+    unmatchedStart = off - stillBuffered;
     debugRangeInfo(y->startOffset(), unmatchedStart,
                    "UNMATCHED at end, re-reading partial match from", y);
     size_t toReread = unmatchedStart - y->startOffset();
-    desc.unmatchedData(toReread);
-    if (rereadUnmatched(y->file(), toReread))
+    if (rereadUnmatched(y->file(), toReread, desc))
       return FAILURE;
   }
   // Write out data that is still buffered
   if (unmatchedStart < off) {
     debugRangeInfo(unmatchedStart, off, "UNMATCHED at end");
     size_t toWrite = off - unmatchedStart;
-    Assert(toWrite <= bufferLength);
+    Assert(toWrite <= stillBuffered);
     size_t writeStart = modSub(data, toWrite, bufferLength);
-    writeBuf(buf, writeStart, data, bufferLength, zip);
-    desc.unmatchedData(toWrite);
+    if (writeUnmatched(buf, writeStart, data, bufferLength, desc))
+      return FAILURE;
     unmatchedStart = off;
   }
   return SUCCESS;
 }
 //________________________________________
 
+/* off has reached the start of the next region of the image which is
+   reused from the previous template. As at the end of the image, any
+   partial matches are discarded. Add the old DESC entries of the whole
+   region. */
+bool MkTemplate::beginReuse(byte* const buf, const size_t bufferLength,
+    const size_t data, const size_t stillBuffered, Desc& desc) {
+  const Previous::Region& r = previous->regions()[reuseRegion];
+  Paranoid(off == r.start);
+  if (unmatchedStart < off
+      && unmatchedAtEnd(buf, bufferLength, data, stillBuffered, desc))
+    return FAILURE;
+  matches->eraseStartOffsetLess(off);
+  Assert(matches->empty());
+  endZeroRun(desc);
+
+  for (size_t i = r.firstEntry; i < r.endEntry; ++i) {
+    const Previous::Entry& e = previous->entry(i);
+    if (e.zero)
+      desc.zeroData(e.size);
+    else if (e.file == 0)
+      desc.unmatchedData(e.size);
+    else
+      desc.matchedFile(e.size, e.file->rsync(), e.file->md5());
+  }
+  debugRangeInfo(r.start, r.end, "REUSED from previous template");
+  reuseEntry = r.firstEntry;
+  return SUCCESS;
+}
+
+/* The len bytes at off are part of the current region reused from the
+   previous template. Write those of them which are unmatched data to zip -
+   or rather, where a whole compressed part of the old template covers the
+   data, copy that part once its start is reached. Previous::verify() only
+   looked at the start of matched files and zero data, so check the rest
+   of it here. */
+bool MkTemplate::reuseData(const byte* data, size_t len) {
+  uint64 pos = off;
+  vector<byte> part;
+  while (len > 0) {
+    const Previous::Entry* e = &previous->entry(reuseEntry);
+    while (pos >= e->offset + e->size) e = &previous->entry(++reuseEntry);
+    size_t n = implicit_cast<size_t>(
+        min(implicit_cast<uint64>(len), e->offset + e->size - pos));
+    len -= n;
+    pos += n;
+    if (e->zero) {
+      for (size_t i = 0; i < n; ++i)
+        if (data[i] != 0) return reuseMismatch(e->offset);
+      data += n;
+      continue;
+    }
+    if (e->file != 0) {
+      if (pos - n == e->offset) reuseMd5.reset();
+      reuseMd5.update(data, n);
+      if (pos == e->offset + e->size
+          && reuseMd5.finish() != e->file->md5())
+        return reuseMismatch(e->offset);
+      data += n;
+      continue;
+    }
+
+    uint64 u = e->unmatchedOff + (pos - n - e->offset); // In old templ data
+    while (n > 0) {
+      while (previous->chunk(reuseChunk).unmatchedEnd <= u) {
+        ++reuseChunk;
+        Paranoid(reuseChunk < previous->chunkCount());
+      }
+      const Previous::Chunk& c = previous->chunk(reuseChunk);
+      size_t m = implicit_cast<size_t>(
+          min(implicit_cast<uint64>(n), c.unmatchedEnd - u));
+      if (!c.copy) {
+        zip->write(data, m);
+      } else if (u == c.unmatchedOff) {
+        previous->readChunk(reuseChunk, &part);
+        zip->writeChunk(&part[0], part.size());
+      }
+      data += m; u += m; n -= m;
+    }
+  }
+  return SUCCESS;
+}
+
+/* The data of an entry reused from the previous template has changed
+   after all, but its DESC entry has already been written. */
+bool MkTemplate::reuseMismatch(uint64 entryOffset) {
+  reporter.error(subst(_("The image data at offset %1 differs from the "
+    "previous template - try again without --previous-template"),
+    entryOffset));
+  return FAILURE;
+}
+//________________________________________
+
 /* The "matches" queue is full. Typically, when this happens there is a big
    zero-filled area in the image and one or more input files start with
    zeroes. At this point, we must start dropping some prospective file
@@ -607,8 +1471,7 @@ bool MkTemplate::unmatchedAtEnd(byte* const buf,
    time. */
 void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
     RsyncSum64* rsum, byte* buf, size_t* data, size_t* n, size_t* rsumBack,
-    size_t bufferLength, size_t blockLength, uint32 blockMask,
-    size_t md5BlockLength) {
+    size_t bufferLength, size_t blockLength, size_t md5BlockLength) {
 
 # if 0
   // Simple version
@@ -621,7 +1484,7 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
     ++*data; ++off; --*n;
     *rsumBack = modAdd(*rsumBack, 1, bufferLength);
     if (((off - blockLength) & sectorMask) == 0) {
-      checkRsyncSumMatch(*rsum, blockMask, blockLength, *rsumBack,
+      checkRsyncSumMatch(*rsum, blockLength, *rsumBack,
                          md5BlockLength, nextEvent);
       sectorMask = sectorLength - 1;
       Paranoid(matches->empty()
@@ -689,7 +1552,7 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
 
     if (off == nextAlignedOff) {
       Paranoid(((off - blockLength) & sectorMask) == 0);
-      checkRsyncSumMatch(*rsum, blockMask, blockLength, *rsumBack,
+      checkRsyncSumMatch(*rsum, blockLength, *rsumBack,
                          md5BlockLength, nextEvent);
       Paranoid(matches->empty()
                || matches->front()->startOffset() >= unmatchedStart);
@@ -701,6 +1564,39 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
 }
 //________________________________________
 
+/* Variant of the main loop for setAlignment(): Only offsets where a match
+   would start at a multiple of alignment are examined. At each of them,
+   the rsum over the preceding blockLength bytes is calculated from
+   scratch, the bytes in between are skipped. rsum is only valid at these
+   offsets. If the matches queue is full, checkRsyncSumMatch2() drops
+   matches according to sectorLength as usual. */
+void MkTemplate::scanImage_mainLoop_aligned(uint64 nextEvent,
+    RsyncSum64* rsum, byte* buf, size_t* data, size_t* n, size_t* rsumBack,
+    size_t bufferLength, size_t blockLength, size_t md5BlockLength) {
+  if (!matches->full()) sectorLength = INITIAL_SECTOR_LENGTH;
+
+  while (off < nextEvent) {
+    // Next offset > off where a match would start at an aligned offset
+    uint64 nextAlignedOff = blockLength;
+    if (off >= blockLength)
+      nextAlignedOff = off + alignment - (off - blockLength) % alignment;
+    Assert(nextAlignedOff > off);
+
+    size_t len = implicit_cast<size_t>(min(nextAlignedOff, nextEvent) - off);
+    Paranoid(*data + len <= bufferLength);
+    *data += len; off += len; *n -= len;
+    *rsumBack = modAdd(*rsumBack, len, bufferLength);
+    if (off < nextAlignedOff) break; // Reached nextEvent
+
+    rsumFromBuf(rsum, buf, *rsumBack, blockLength, bufferLength);
+    checkRsyncSumMatch(*rsum, blockLength, *rsumBack, md5BlockLength,
+                       nextEvent);
+    Paranoid(matches->empty()
+             || matches->front()->startOffset() >= unmatchedStart);
+  }
+}
+//________________________________________
+
 /* Scan image. Central function for template generation.
 
    Treat buf as a circular buffer. Read new data into at most half the
@@ -715,36 +1611,54 @@ void MkTemplate::scanImage_mainLoop_fastForward(uint64 nextEvent,
    re-read that part of the image and pump it through zlib to templ - but we
    can't if the image is stdin! Solution: Since we know that the MD5Sum of a
    block matched part of an input file, we can re-read from there. */
-inline bool MkTemplate::scanImage(byte* buf, size_t bufferLength,
-    size_t blockLength, uint32 blockMask, size_t md5BlockLength,
+inline bool MkTemplate::scanImage(size_t minBufferLength,
+    size_t blockLength, size_t md5BlockLength,
     MD5Sum& templMd5Sum) {
   bool result = SUCCESS;
-
-  /* Cause input files to be analysed */
-  if (scanFiles(blockLength, blockMask, md5BlockLength))
-    result = FAILURE;
+  RsyncSumIndex& block = index->block;
 
   /* Initialise rolling sums with blockSize bytes 0x7f, and do the same with
      part of buffer, to avoid special-case code in main loop. (Any value
      would do - except that 0x00 or 0xff might lead to a larger number of
      false positives.) */
   RsyncSum64 rsum;
-  byte* bufEnd = buf + bufferLength;
-  //for (byte* z = bufEnd - blockLength; z < bufEnd; ++z) *z = 0x7f;
-  // Init entire buf, keep valgrind happy
-  for (byte* z = buf; z < bufEnd; ++z) *z = 0x7f;
   rsum.addBackNtimes(0x7f, blockLength);
+  RsyncScanner scanner(blockLength);
+  debug("Rolling checksum code: %1",
+        RsyncScanner::kernelName(scanner.kernel()));
 
   // Compression pipe for templ data
   auto_ptr<Zobstream> zipDel;
-  if (useBzLib)
+  switch (zipMethod) {
+  case BZIP2:
     zipDel.reset(implicit_cast<Zobstream*>(
       new ZobstreamBz(*templ, zipQual, 256U, &templMd5Sum) ));
-  else
+    break;
+# if HAVE_LIBZSTD
+  case ZSTD:
+    zipDel.reset(implicit_cast<Zobstream*>(
+      new ZobstreamZstd(*templ, zipQual, 256U, &templMd5Sum) ));
+    break;
+# endif
+# if HAVE_LIBLZMA
+  case XZ:
+    zipDel.reset(implicit_cast<Zobstream*>(
+      new ZobstreamXz(*templ, zipQual, 256U, &templMd5Sum) ));
+    break;
+# endif
+  default:
+    Assert(zipMethod == GZIP);
     zipDel.reset(implicit_cast<Zobstream*>(
       new ZobstreamGz(*templ, ZIPCHUNK_SIZE, zipQual, 15, 8, 256U,
                       &templMd5Sum) ));
-  zip = zipDel.get();
+  }
+  // Except for gzip, parts are limited by their uncompressed size anyway
+  if (zipMethod != GZIP || parallelGzip) zipDel->setThreads(threads);
+  zipDel->setStoreIncompressible(storeIncompressible);
+  /* With threads, do the compression on another thread. Allow for a few
+     buffers' worth of data to be queued for it. */
+  ZipWriter zipWriter(zipDel.get(), 4 * minBufferLength, threads > 1);
+  zip = &zipWriter;
   Desc desc; // Buffer for DESC data, will be appended to templ at end
   size_t data = 0; // Offset into buf of byte currently being processed
   off = 0; // Current absolute offset in image, corresponds to "data"
@@ -756,19 +1670,44 @@ inline bool MkTemplate::scanImage(byte* buf, size_t bufferLength,
      detected, unmatchedStart "gets stuck" at the start offset of this file
      within the image. */
   unmatchedStart = 0;
+  zeroRun = 0;
 
   MD5Sum imageMd5Sum; // MD5 of whole image
   MD5Sum md; // Re-used for each 2nd-level check of any rsum match
   matches->erase();
   sectorLength = INITIAL_SECTOR_LENGTH;
 
+  /* With threads, read ahead and calculate imageMd5Sum on another
+     thread, so reading the image overlaps with looking for matches. If
+     the image is memory-mapped, buf is the mapping. */
+  auto_ptr<ImageInput> imageReader(newImageInput(minBufferLength,
+                                                 blockLength, &imageMd5Sum));
+  byte* const buf = imageReader->buffer();
+  const size_t bufferLength = imageReader->bufferLength();
+  /* With setAlignment(), max. amount of unmatched data kept in buffer.
+     run() made the buffer large enough, and with setMapImage(), reading
+     never overwrites data. */
+  const size_t holdBack = ALIGNED_HOLDBACK * readAmount;
+
   // Read image
   size_t rsumBack = bufferLength - blockLength;
 
+  /* With setPrevious(), the area of the image from reuseStart to reuseEnd
+     is the next region to reuse from the previous template. reusing is
+     true while off is inside it. */
+  const uint64 NO_REGION = ~implicit_cast<uint64>(0);
+  uint64 reuseStart = NO_REGION, reuseEnd = NO_REGION;
+  bool reusing = false;
+  reuseRegion = reuseEntry = reuseChunk = 0;
+  if (previous != 0 && !previous->regions().empty()) {
+    reuseStart = previous->regions()[0].start;
+    reuseEnd = previous->regions()[0].end;
+  }
+
   try {
     /* Catch Zerrors, which can occur in zip->write(), writeBuf(),
        checkMD5Match(), zip->close() */
-    while (image->good()) {
+    while (imageReader->good()) {
 
       debug("---------- main loop. off=%1 data=%2 unmatchedStart=%3",
             off, data, unmatchedStart);
@@ -788,7 +1727,12 @@ inline bool MkTemplate::scanImage(byte* buf, size_t bufferLength,
         newUnmatchedStart = min(newUnmatchedStart,
                                 matches->lowestStartOffset()->startOffset());
       }
-      if (unmatchedStart < newUnmatchedStart) {
+      /* With setAlignment(), keep unmatched data in the buffer for as
+         long as possible, to give writeUnmatched() a chance to find
+         files at unaligned offsets in it */
+      if (unmatchedStart < newUnmatchedStart
+          && (alignment <= 1
+              || off + thisReadAmount - unmatchedStart > holdBack)) {
         size_t toWrite = newUnmatchedStart - unmatchedStart;
         Paranoid(off - unmatchedStart <= bufferLength);
         //debug("off=%1 unmatchedStart=%2 buflen=%3",
@@ -797,11 +1741,13 @@ inline bool MkTemplate::scanImage(byte* buf, size_t bufferLength,
                                    bufferLength);
         debugRangeInfo(unmatchedStart, unmatchedStart + toWrite,
                        "UNMATCHED");
-        writeBuf(buf, writeStart,
-                 modAdd(writeStart, toWrite, bufferLength),
-                 bufferLength, zip);
+        if (writeUnmatched(buf, writeStart,
+                           modAdd(writeStart, toWrite, bufferLength),
+                           bufferLength, desc)) {
+          try { zip->close(); } catch (Zerror ze) { }
+          return FAILURE;
+        }
         unmatchedStart = newUnmatchedStart;
-        desc.unmatchedData(toWrite);
       }
 
       // Read new data from image
@@ -815,75 +1761,78 @@ inline bool MkTemplate::scanImage(byte* buf, size_t bufferLength,
         debug("thisReadAmount=%1", thisReadAmount);
       }
 #     endif
-      readBytes(*image, buf + data, thisReadAmount);
-      size_t n = image->gcount();
-      imageMd5Sum.update(buf + data, n);
+      size_t n = imageReader->read(buf + data, thisReadAmount);
+      statsVal.imageBytes += n;
 
       while (n > 0) { // Still unprocessed bytes left
+        if (reusing) {
+          /* Inside a reused region: No need to look for matches, just
+             write out unmatched data */
+          size_t len = implicit_cast<size_t>(min(uint64(n), reuseEnd - off));
+          if (reuseData(buf + data, len)) {
+            try { zip->close(); } catch (Zerror ze) { }
+            return FAILURE;
+          }
+          data += len; off += len; n -= len;
+          rsumBack = modAdd(rsumBack, len, bufferLength);
+          unmatchedStart = off;
+          if (off < reuseEnd) continue;
+
+          // End of region - resume rolling checksum over last blockLength
+          rsumFromBuf(&rsum, buf, rsumBack, blockLength, bufferLength);
+          reusing = false;
+          reuseStart = reuseEnd = NO_REGION;
+          if (++reuseRegion < previous->regions().size()) {
+            reuseStart = previous->regions()[reuseRegion].start;
+            reuseEnd = previous->regions()[reuseRegion].end;
+          }
+          continue;
+        }
+
         uint64 nextEvent = off + n; // Special event: end of buffer
         if (!matches->empty())
           nextEvent = min(nextEvent, matches->front()->nextEvent());
+        nextEvent = min(nextEvent, reuseStart);
 
-        if (!matches->full()) {
+        if (alignment > 1) {
+          // Innermost loop with setAlignment(), matches full or not
+          scanImage_mainLoop_aligned(nextEvent, &rsum, buf, &data, &n,
+              &rsumBack, bufferLength, blockLength, md5BlockLength);
+        } else if (!matches->full()) {
           sectorLength = INITIAL_SECTOR_LENGTH;
 
-          /* Unrolled innermost loop - see below for single-iteration
-             version. Also see checkRsyncSumMatch above. */
-          while (off + 32 < nextEvent && rsumBack < bufferLength - 32) {
-            size_t dataOld = data;
-            do {
-              const vector<FilePart*>* hashEntry;
-#             define x ; \
-              rsum.removeFront(buf[rsumBack], blockLength); \
-              rsum.addBack(buf[data]); \
-              ++data; ++rsumBack; \
-              hashEntry = &block[rsum.getHi() & blockMask]; \
-              if (hashEntry->size() > 1) break; \
-              if (hashEntry->size() == 1) { \
-                FilePart* file = (*hashEntry)[0]; \
-                const RsyncSum64* fileSum = file->getRsyncSum(cache); \
-                if (fileSum != 0 && *fileSum == rsum) break; \
-              }
-              x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x
-#             undef x
-              dataOld = data; // Special case: "Did not break out of loop"
-            } while (false);
-            if (dataOld == data) {
-              off += 32; n -= 32;
-            } else {
-              dataOld = data - dataOld; off += dataOld; n -= dataOld;
-              checkRsyncSumMatch(rsum, blockMask, blockLength, rsumBack,
-                                 md5BlockLength, nextEvent);
-            }
-            if (matches->full()) break;
-          }
-        } // endif (!matches->full())
-
-        if (!matches->full()) {
-          // Innermost loop - single-byte version, matches not full
+          /* Innermost loop, matches not full: Roll checksum over as
+             many bytes as possible in one go, only stopping where the
+             checksum's bit in block's bitmap is set. The data between
+             rsumBack and the end of buf must be handled separately
+             because the buffer wraps around there. */
           while (off < nextEvent) {
-            // Roll checksum by one byte
-            rsum.removeFront(buf[rsumBack], blockLength);
-            rsum.addBack(buf[data]);
-            ++data; ++off; --n;
-            rsumBack = modAdd(rsumBack, 1, bufferLength);
+            size_t len = implicit_cast<size_t>(min(
+                nextEvent - off, uint64(bufferLength - rsumBack)));
+            size_t done = scanner.find(&rsum, buf + rsumBack, buf + data,
+                len, block.bitmap(), block.bitmapMask());
+            data += done; off += done; n -= done;
+            rsumBack = modAdd(rsumBack, done, bufferLength);
+            if (!block.mayContain(rsum)) continue;
 
             /* Look for matches of rsum. If found, insert appropriate
                entry in matches list and maybe modify nextEvent. */
-            checkRsyncSumMatch(rsum, blockMask, blockLength, rsumBack,
-                               md5BlockLength, nextEvent);
+            checkRsyncSumMatch(rsum, blockLength, rsumBack, md5BlockLength,
+                               nextEvent);
 
             /* We mustn't by accident schedule an event for a part of
                the image that has already been flushed out of the
                buffer/matched */
             Paranoid(matches->empty()
                      || matches->front()->startOffset() >= unmatchedStart);
+            if (matches->full()) break;
           }
-        } else {
+        } // endif (!matches->full())
+
+        if (alignment <= 1 && matches->full()) {
           // Innermost loop - MATCHES IS FULL
           scanImage_mainLoop_fastForward(nextEvent, &rsum, buf, &data, &n,
-              &rsumBack, bufferLength, blockLength, blockMask,
-              md5BlockLength);
+              &rsumBack, bufferLength, blockLength, md5BlockLength);
         } // endif (matches->full())
         if (matches->empty())
           debug(" %1: Event, matches empty", off);
@@ -904,21 +1853,34 @@ inline bool MkTemplate::scanImage(byte* buf, size_t bufferLength,
         }
 
         Assert(matches->empty() || matches->nextEvent() > off);
+
+        if (off == reuseStart) {
+          size_t stillBuffered = bufferLength - n;
+          if (stillBuffered > off) stillBuffered = off;
+          if (beginReuse(buf, bufferLength, data, stillBuffered, desc)) {
+            try { zip->close(); } catch (Zerror ze) { }
+            return FAILURE;
+          }
+          reusing = true;
+        }
       } // endwhile (n > 0), i.e. more unprocessed bytes left in buffer
 
       if (data == bufferLength) data = 0;
       Assert(data < bufferLength);
 
-    } // endwhile (image->good()), i.e. more data left in input image
+    } // endwhile (imageReader->good()), i.e. more data left in input image
 
     // End of image data - any remaining partial match is UNMATCHED
     if (unmatchedStart < off
-        && unmatchedAtEnd(buf, bufferLength, data, desc)) {
+        && unmatchedAtEnd(buf, bufferLength, data, bufferLength, desc)) {
       return FAILURE;
     }
     Assert(unmatchedStart == off);
+    endZeroRun(desc);
 
     zip->close();
+    statsVal.zipIn = zipDel->bytesIn();
+    statsVal.zipOut = zipDel->bytesOut();
   }
   catch (Zerror ze) {
     string err = subst(_("Error during compression: %1"), ze.message);
@@ -927,6 +1889,7 @@ inline bool MkTemplate::scanImage(byte* buf, size_t bufferLength,
     return FAILURE;
   }
 
+  imageReader->finish();
   imageMd5Sum.finish();
   desc.imageInfo(off, imageMd5Sum, cache->getBlockLen());
   desc.put(*templ, &templMd5Sum);
@@ -946,23 +1909,27 @@ bool MkTemplate::run(const string& imageLeafName,
                      const string& templLeafName) {
   bool result = SUCCESS;
   oldAreaEnd = 0;
-
-  // Kick out files that are too small
-  for (JigdoCache::iterator f = cache->begin(), e = cache->end();
-       f != e; ++f) {
-    if (f->size() < cache->getBlockLen()) {
-      f->markAsDeleted(cache);
-      continue;
-    }
-    fileSizeTotal += f->size();
-    ++fileCount;
+  statsVal = Stats();
+  statsVal.image = imageLeafName;
+  PhaseTimer totalTimer;
+
+  /* Cause input files to be analysed, unless this was done beforehand for
+     several images */
+  auto_ptr<FileIndex> indexDel;
+  if (sharedIndex != 0) {
+    Assert(sharedIndex->cache() == cache);
+    index = sharedIndex;
+    indexMutex = &index->mutex;
+  } else {
+    PhaseTimer timer;
+    indexDel.reset(new FileIndex(cache));
+    index = indexDel.get();
+    indexMutex = 0;
+    index->build();
+    timer.stop(&statsVal.files);
+    statsVal.read = cache->readStats();
   }
 
-  // Hash table performance drops when linked lists become long => "+1"
-  int    blockBits = bitWidth(fileCount) + 1;
-  uint32 blockMask = (1 << blockBits) - 1;
-  block.resize(blockMask + 1);
-
   size_t max_MD5Len_blockLen =
       cache->getBlockLen() + 64; // +64 for Assert below
   if (max_MD5Len_blockLen < cache->getMD5BlockLen())
@@ -976,23 +1943,44 @@ bool MkTemplate::run(const string& imageLeafName,
     (max_MD5Len_blockLen > readAmount ? max_MD5Len_blockLen : readAmount);
   // Avoid reading less bytes than readAmount at any time
   bufferLength = (bufferLength + readAmount - 1) / readAmount * readAmount;
+  // Room for the unmatched data kept back with setAlignment()
+  if (alignment > 1 && bufferLength < (ALIGNED_HOLDBACK + 1) * readAmount)
+    bufferLength = (ALIGNED_HOLDBACK + 1) * readAmount;
 
   Paranoid(bufferLength % readAmount == 0); // for efficiency only
   // Asserting this makes things easier in pass 2. Yes it is ">" not ">="
   Assert(cache->getMD5BlockLen() > cache->getBlockLen());
 
   if (debug) {
-    debug("Nr of files: %1 (%2 bits)", fileCount, blockBits);
-    debug("Total bytes: %1", fileSizeTotal);
+    debug("Nr of files: %1 (hash table %2 kB)", index->fileCount(),
+          index->block.memoryUsage() / 1024);
+    debug("Total bytes: %1", index->fileSizeTotal());
     debug("blockLength: %1", cache->getBlockLen());
     debug("md5BlockLen: %1", cache->getMD5BlockLen());
     debug("bufLen (kB): %1", bufferLength/1024);
     debug("zipQual:     %1", zipQual);
   }
 
+  // With setPrevious(), find out which regions of the image are unchanged
+  auto_ptr<Previous> previousDel;
+  if (prevTempl != 0) {
+    // Part IDs for the values of zipMethod
+    static const unsigned partIds[] = { Zibstream::DATA, Zibstream::BZIP,
+                                        Zibstream::ZSTD, Zibstream::XZ };
+    PhaseTimer timer;
+    previousDel.reset(new Previous(prevTemplFile, prevTempl, prevJigdo));
+    if (previousDel->read(cache->getBlockLen(), reporter)
+        || previousDel->verify(image, readAmount, partIds[zipMethod],
+                               storeIncompressible, reporter))
+      return FAILURE;
+    previous = previousDel.get();
+    statsVal.reusedBytes = previous->reusedBytes();
+    timer.stop(&statsVal.previous);
+    debug("Previous template: %1 regions, %2 bytes unchanged",
+          previous->regions().size(), previous->reusedBytes());
+  }
+
   MD5Sum templMd5Sum;
-  ArrayAutoPtr<byte> bufDel(new byte[bufferLength]);
-  byte* buf = bufDel.get();
 
   prepareJigdo(); // Add [Jigdo]
 
@@ -1007,16 +1995,33 @@ bool MkTemplate::run(const string& imageLeafName,
   }
 
   // Read input image and output parts that do not match
-  if (scanImage(buf, bufferLength, cache->getBlockLen(), blockMask,
+  PhaseTimer scanTimer;
+  if (scanImage(bufferLength, cache->getBlockLen(),
                 cache->getMD5BlockLen(), templMd5Sum)) {
     result = FAILURE;
   }
-  cache->deallocBuffer();
+  scanTimer.stop(&statsVal.scan);
+  { CacheLock lock(indexMutex); cache->deallocBuffer(); }
   templMd5Sum.finish();
 
   // Add [Image], (re-)add [Parts]
   finalizeJigdo(imageLeafName, templLeafName, templMd5Sum);
+  previous = 0;
 
+  if (indexMutex == 0) {
+    const RsyncSumIndex& block = index->block;
+    debug("Hash table: %1 lookups, %2 false candidates, %3 other sums in "
+          "same slot", block.lookups(), block.falseCandidates(),
+          block.sameSlotMismatches());
+  }
+  debug("Match queue: peak %1 entries, %2 beyond old limit of %3, "
+        "%4 dropped", matches->peakSize(), matches->overflowCount(),
+        PartialMatchQueue::LEGACY_MAX_MATCHES, matches->dropCount());
+  statsVal.droppedMatches = matches->dropCount();
+  statsVal.peakMatches = matches->peakSize();
+  index = 0;
+  indexMutex = 0;
   debug("MkTemplate::run() finished");
+  totalTimer.stop(&statsVal.total);
   return result;
 }
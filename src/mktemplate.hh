@@ -39,8 +39,11 @@
 #include <jigdoconfig.fh>
 #include <log.hh>
 #include <md5sum.hh>
+#include <nocopy.hh>
 #include <rsyncsum.hh>
-#include <scan.fh>
+#include <rsyncsumindex.hh>
+#include <scan.hh>
+#include <thread.hh>
 #include <zstream.fh>
 //______________________________________________________________________
 
@@ -53,6 +56,11 @@
 class MkTemplate {
 public:
   class ProgressReporter;
+  class FileIndex;
+
+  /** Compression method for the template data. ZSTD and XZ are only
+      available if jigdo-file was compiled with libzstd resp. liblzma. */
+  enum Compression { GZIP, BZIP2, ZSTD, XZ };
 
   /** A create operation with no files known to it yet.
       @param jcache Cache for the files (will not be deleted in dtor)
@@ -62,7 +70,8 @@ public:
       @param pr Function object which is called at regular intervals
       during run() to inform about files scanned, nr of bytes scanned,
       matches found etc.
-      @param zipQuality 0 (fast) to 9 (smallest output)
+      @param zipQuality 0 (fast) to 9 (smallest output), or for ZSTD the
+      zstd level, 1 to 22
       @param readAmnt Number of bytes that are read at a time with one
       read() call by the operation before the data is processed.
       Should not be too large because the OS copes best when small
@@ -70,12 +79,12 @@ public:
       practice, the default seems to work well.
       @param addImage Add a [Image] section to the output .jigdo.
       @param addServers Add a [Servers] section to the output .jigdo.
-      @param useBzip2 false=>gzip, true=>bzip2 */
+      @param compression Compression method for the template data */
   MkTemplate(JigdoCache* jcache, bistream* imageStream,
              JigdoConfig* jigdoInfo, bostream* templateStream,
              ProgressReporter& pr = noReport, int zipQuality = 9,
              size_t readAmnt = 128U*1024, bool addImage = true,
-             bool addServers = true, bool useBzip2 = false);
+             bool addServers = true, Compression compression = GZIP);
   inline ~MkTemplate();
 
   /** Set command(s) to be executed when a file matches. */
@@ -87,6 +96,74 @@ public:
   inline void setGreedyMatching(bool x) { greedyMatching = x; }
   inline bool getGreedyMatching() const { return greedyMatching; }
 
+  /** Set number of threads. If >1, reading the image, looking for
+      matches and compressing the template data happen on separate
+      threads, connected by bounded buffers. The output is the same
+      regardless of this setting. Default: 1 */
+  inline void setThreads(unsigned n) { threads = n; }
+
+  /** With gzip and more than one thread, whether to also compress the
+      template data on several threads. This cuts the data into parts of
+      a fixed *uncompressed* size, so unlike the default, the output
+      depends on this setting. (bzip2 parts are always cut that way, so
+      bzip2 data is compressed in parallel regardless.) Default: false */
+  inline void setParallelGzip(bool x) { parallelGzip = x; }
+
+  /** Whether to write template data which does not compress, e.g. parts
+      of the image which are already compressed, to uncompressed STOR
+      parts. Saves time for both make-template and make-image, but older
+      versions of jigdo-file cannot read the template. Default: false */
+  inline void setStoreIncompressible(bool x) { storeIncompressible = x; }
+  /** Record runs of at least this many unmatched zero bytes as ZERO_DATA
+      entries of the DESC section instead of adding them to the template
+      data. make-image does not need to decompress them, and can leave
+      holes in the output file. Older versions of jigdo-file cannot read
+      the template. 0 means no special treatment. Default: 0 */
+  inline void setZeroRunLength(size_t n) { zeroRunLength = n; }
+  /** Only look for files which start at a multiple of n bytes in the
+      image, e.g. 2048 for ISO9660 and UDF images. Instead of rolling the
+      checksum over every byte, it is calculated from scratch at these
+      offsets, which is much faster if n is larger than about half of the
+      --min-length. Files at other offsets are only found in areas of the
+      image where no other file was found, if they are smaller than
+      ALIGNED_HOLDBACK * readAmount. 0 or 1 means no alignment. Default: 0 */
+  inline void setAlignment(size_t n) { alignment = n; }
+
+  /** Name of the image file to memory-map instead of reading it from
+      imageStream. If the file cannot be mapped (e.g. it is not a regular
+      file, or mmap() is not available), imageStream is read as usual.
+      A mapped image never needs to be re-read from partially matched
+      files, so the template data is written in different portions and
+      the compressed data may differ slightly (but is just as usable).
+      Default: empty, i.e. do not map */
+  inline void setMapImage(const string& imageFile) {
+    mapImageFile = imageFile;
+  }
+
+  /** Reuse the .template and .jigdo created for an earlier version of the
+      image. Before the image is scanned for matches, it is compared to the
+      old template: Wherever the files matched back then are still present
+      at the same offsets, and the unmatched data between them has not
+      changed either, the old DESC entries and [Parts] lines are copied,
+      and so are the old compressed DATA/BZIP parts if they use the same
+      compression method. Only the rest of the image is searched for
+      matches. Apart from the old unmatched data, only the start of the
+      reused entries is read in advance, and the rest is checked while
+      scanning. imageStream must be seekable.
+      --match-exec commands are not run for the reused matches.
+      @param prevTemplName Name of the old template, for error messages
+      @param prevTemplate Old template, must be seekable
+      @param prevJigdo Old jigdo file, for its [Parts] and [Servers] */
+  inline void setPrevious(const string& prevTemplName,
+                          bistream* prevTemplate, ConfigFile* prevJigdo);
+
+  /** Use an index of the input files which has already been built, and
+      which can be shared by the MkTemplate objects for several images.
+      These may run() on different threads at the same time. The index
+      must have been created for the same JigdoCache as this object.
+      Default: null, i.e. run() reads the files and builds its own index */
+  inline void setFileIndex(FileIndex* fileIndex) { sharedIndex = fileIndex; }
+
   /** First scan through all the individual files, creating checksums,
       then read image file and find matches. Write .template and .jigdo
       files.
@@ -102,6 +179,38 @@ public:
   bool run(const string& imageLeafName = "image",
            const string& templLeafName = "template");
 
+  /** Counters and timings collected by the last run(), for tuning
+      --min-length etc. and for spotting performance regressions. Times
+      are in milliseconds, CPU time is that of the whole process, i.e. it
+      includes any helper threads and other MkTemplates running at the
+      same time. */
+  struct Stats {
+    struct Phase {
+      Phase() : wall(0), cpu(0) { }
+      uint64 wall, cpu;
+    };
+    Stats();
+    string image; // imageLeafName passed to run()
+    Phase files; // Reading input files, not done if setFileIndex() used
+    Phase previous; // Comparing the image with setPrevious() template
+    Phase scan; // Scanning the image, writing the template
+    Phase total;
+    uint64 imageBytes; // Nr of bytes read from the image
+    uint64 partBytes; // Bytes re-read from files after an MD5 mismatch
+    uint64 rsyncHits; // Possible matches found with the rolling checksum
+    uint64 rsyncFalsePositives; // ...whose first MD5 block did not match
+    uint64 md5Mismatches; // Later MD5 blocks of partial matches not matching
+    uint64 droppedMatches; // Possible matches dropped, queue was full
+    size_t peakMatches; // Max nr of partial matches at the same time
+    uint64 matchedFiles, matchedBytes;
+    uint64 reusedBytes; // Image bytes covered by setPrevious() template
+    uint64 zipIn, zipOut; // Template data before/after compression
+    JigdoCache::ReadStats read; // Reading the start of the files
+    /** Append as one line of JSON to s */
+    string& appendJson(string& s) const;
+  };
+  const Stats& stats() const { return statsVal; }
+
   /** Default reporter: Only prints error messages to stderr */
   static ProgressReporter noReport;
 
@@ -109,17 +218,22 @@ private:
   // Values for codes in the template data's DESC section
   static const byte IMAGE_INFO = 1, UNMATCHED_DATA = 2, MATCHED_FILE = 3;
   static const size_t REPORT_INTERVAL = 256U*1024;
-  /* If the queue of matches runs full, we enter a special mode where new
-     matches are only added to the queue if their start offset is a multiple
-     of this assumed sector size. This is a heuristics - matches are more
-     likely to start at "even" offsets. Because the actual sector size of the
-     input image is not known, we'll prefer
+  /* If the queue of matches reaches its (high) size limit, we enter a
+     special mode where new matches are only added to the queue if their
+     start offset is a multiple of this assumed sector size. This is a
+     heuristics - matches are more likely to start at "even" offsets.
+     Because the actual sector size of the input image is not known,
+     we'll prefer
      SECTOR_LENGTH-aligned matches to matches at odd offsets,
      2*SECTOR_LENGTH-aligned ones to SECTOR_LENGTH-aligned ones,
      4*SECTOR_LENGTH-aligned ones to 2*SECTOR_LENGTH-aligned ones etc.
      Initial value for sectorLength. */
   static const unsigned INITIAL_SECTOR_LENGTH = 512;
   static const unsigned MAX_SECTOR_LENGTH = 65536;
+  /* With setAlignment(), up to this many times readAmount bytes of
+     unmatched data are kept in the buffer, and files at unaligned offsets
+     are looked for in them before they are written to the template. */
+  static const unsigned ALIGNED_HOLDBACK = 32;
 
   /* debug(...) may be defined as a CPP macro. Luckily, that won't affect
      this occurance of the word. */
@@ -130,23 +244,31 @@ private:
 
   // Various helper classes and functions for run()
   class Desc;
+  class ImageInput;
+  class ImageReader;
+  class ImageMap;
+  class ZipWriter;
   class PartialMatch;
   class PartialMatchQueue;
   friend class PartialMatchQueue;
+  class CacheLock;
+  class Previous;
+  friend class Previous;
   void prepareJigdo();
   void finalizeJigdo(const string& imageLeafName,
     const string& templLeafName, const MD5Sum& templMd5Sum);
-  INLINE bool scanFiles(size_t blockLength, uint32 blockMask,
-    size_t md5BlockLength);
-  INLINE bool scanImage(byte* buf, size_t bufferLength, size_t blockLength,
-    uint32 blockMask, size_t md5BlockLength, MD5Sum&);
+  INLINE bool scanImage(size_t minBufferLength, size_t blockLength,
+    size_t md5BlockLength, MD5Sum&);
+  ImageInput* newImageInput(size_t bufferLength, size_t blockLength,
+                            MD5Sum* imageMd5Sum);
   static INLINE void insertInTodo(PartialMatchQueue& matches,
     PartialMatch* x);
   void checkRsyncSumMatch2(const size_t blockLen, const size_t back,
-    const size_t md5BlockLength, uint64& nextEvent, FilePart* file);
+    const size_t md5BlockLength, uint64& nextEvent, FilePart* file,
+    uint64 fileSize);
   INLINE void checkRsyncSumMatch(const RsyncSum64& sum,
-    const uint32& bitMask, const size_t blockLen, const size_t back,
-    const size_t md5BlockLength, uint64& nextEvent);
+    const size_t blockLen, const size_t back, const size_t md5BlockLength,
+    uint64& nextEvent);
   INLINE bool checkMD5Match(byte* const buf,
     const size_t bufferLength, const size_t data,
     const size_t md5BlockLength, uint64& nextEvent,
@@ -154,13 +276,27 @@ private:
   INLINE bool checkMD5Match_mismatch(const size_t stillBuffered,
     PartialMatch* x, Desc& desc);
   INLINE bool unmatchedAtEnd(byte* const buf, const size_t bufferLength,
-    const size_t data, Desc& desc);
-  bool rereadUnmatched(FilePart* file, uint64 count);
+    const size_t data, const size_t stillBuffered, Desc& desc);
+  bool beginReuse(byte* const buf, const size_t bufferLength,
+    const size_t data, const size_t stillBuffered, Desc& desc);
+  bool reuseData(const byte* data, size_t len);
+  bool reuseMismatch(uint64 entryOffset);
+  bool rereadUnmatched(FilePart* file, uint64 count, Desc& desc);
+  INLINE void writeBuf(const byte* const buf, size_t begin, size_t end,
+    const size_t bufferLength, Desc& desc);
+  bool writeUnmatched(const byte* const buf, size_t begin, size_t end,
+    const size_t bufferLength, Desc& desc);
+  FilePart* findUnaligned(const RsyncSum64& sum, const byte* const buf,
+    size_t pos, size_t avail, const size_t bufferLength, uint64* fileSize);
+  void unmatchedData(const byte* data, size_t len, Desc& desc);
+  void endZeroRun(Desc& desc);
   INLINE void scanImage_mainLoop_fastForward(uint64 nextEvent,
     RsyncSum64* rsum, byte* buf, size_t* data, size_t* n, size_t* rsumBack,
-    size_t bufferLength, size_t blockLength, uint32 blockMask,
-    size_t md5BlockLength);
-  INLINE bool matchExecCommands(PartialMatch* x);
+    size_t bufferLength, size_t blockLength, size_t md5BlockLength);
+  INLINE void scanImage_mainLoop_aligned(uint64 nextEvent,
+    RsyncSum64* rsum, byte* buf, size_t* data, size_t* n, size_t* rsumBack,
+    size_t bufferLength, size_t blockLength, size_t md5BlockLength);
+  INLINE bool matchExecCommands(FilePart* matched);
 
   inline void debugRangeInfo(uint64 start, uint64 end, const char* msg,
                              const PartialMatch* x = 0);
@@ -168,12 +304,11 @@ private:
                       const PartialMatch* x = 0);
   void debugRangeFailed();
 
-  uint64 fileSizeTotal; // Accumulated lengths of all the files
-  size_t fileCount; // Total number of files added
-
-  // Look up list of FileParts by hash of RsyncSum
-  typedef vector<vector<FilePart*> > FileVec;
-  FileVec block;
+  FileIndex* sharedIndex; // As passed to setFileIndex()
+  FileIndex* index; // Index used during run(), sharedIndex or our own
+  /* Non-null during run() if the index is shared. Must be locked while
+     accessing the cache or the FileParts' sums, see CacheLock. */
+  Mutex* indexMutex;
 
   // Nr of bytes to read in one go, as specified by caller of MkTemplate()
   size_t readAmount;
@@ -187,30 +322,52 @@ private:
   uint64 unmatchedStart;
 
   bool greedyMatching;
+  unsigned threads;
+  bool parallelGzip;
+  bool storeIncompressible;
+  size_t zeroRunLength; // As passed to setZeroRunLength()
+  /* Number of zero bytes at the end of the unmatched data so far which
+     have not been passed to zip or the Desc yet, because the run of zeroes
+     may continue. */
+  uint64 zeroRun;
+  size_t alignment; // As passed to setAlignment()
 
   JigdoCache* cache;
   bistream* image;
+  string mapImageFile; // If non-empty, try to mmap this instead of image
   bostream* templ;
-  Zobstream* zip; // Compressing stream for template data output
+  ZipWriter* zip; // Compressing stream for template data output
 
-  int zipQual; // 0..9, passed to zlib
+  int zipQual; // 0..9, passed to zlib/libbz2/liblzma, or zstd level
   ProgressReporter& reporter;
   PartialMatchQueue* matches; // queue of partially matched files
   unsigned sectorLength;
+  MD5Sum blockMd5; // Used by checkMD5Match()
+  MD5Sum reuseMd5; // Used by reuseData()
+
+  // Data for setPrevious()
+  string prevTemplFile;
+  bistream* prevTempl;
+  ConfigFile* prevJigdo;
+  Previous* previous; // Non-null during run() if prevTempl != 0
+  size_t reuseRegion, reuseEntry, reuseChunk; // Current position in it
   //____________________
 
   JigdoConfig* jigdo;
   struct PartLine;
   struct PartIndex;
+  static void makePartLine(ConfigFile::iterator line, PartLine* x);
   set<PartLine> jigdoParts; // lines of [Parts] section
   vector<FilePart*> matchedParts; // New parts to add to [Parts] at end
   // true => add a [Image/Servers] section to the output .jigdo file
   bool addImageSection;
   bool addServersSection;
-  bool useBzLib;
+  Compression zipMethod;
   string matchExec;
   //____________________
 
+  Stats statsVal;
+
   // For debugging of the template creation
   uint64 oldAreaEnd;
 };
@@ -218,6 +375,55 @@ private:
 #include <partialmatch.hh>
 //______________________________________________________________________
 
+/** The input files of a make-template operation, indexed by the rsync sum
+    of their first blockLength bytes. Normally, MkTemplate::run() creates
+    one itself. When creating templates for several images from the same
+    set of files, build() one index and pass it to setFileIndex() for all
+    images, so that the cache is read and the hash table is built only
+    once. */
+class MkTemplate::FileIndex : NoCopy {
+  friend class MkTemplate;
+public:
+  /** @param jcache Cache with the files (will not be deleted in dtor),
+      already set up with the right block lengths and file names */
+  explicit FileIndex(JigdoCache* jcache);
+
+  /** Kick out files that are too small, read the sums of the others
+      (where necessary) and add them to the hash table */
+  void build();
+
+  JigdoCache* cache() const { return jcache; }
+  /** Number of files in the index */
+  size_t fileCount() const { return blockFiles.size(); }
+  /** Accumulated lengths of all the files */
+  uint64 fileSizeTotal() const { return sizeTotal; }
+
+private:
+  JigdoCache* jcache;
+  uint64 sizeTotal;
+
+  /* Look up FileParts by RsyncSum of their first blockLength bytes. The
+     values in block are indexes into blockFiles. */
+  RsyncSumIndex block;
+  vector<FilePart*> blockFiles;
+
+  // Serializes access to jcache by MkTemplates running on several threads
+  Mutex mutex;
+};
+//______________________________________________________________________
+
+/* While it exists, holds the lock of a shared FileIndex, if any. Needed
+   around all calls which may read data into the cache's buffer, or
+   modify the FileParts in it. */
+class MkTemplate::CacheLock : NoCopy {
+public:
+  explicit CacheLock(Mutex* m) : mutex(m) { if (mutex != 0) mutex->lock(); }
+  ~CacheLock() { if (mutex != 0) mutex->unlock(); }
+private:
+  Mutex* mutex;
+};
+//______________________________________________________________________
+
 /** Class allowing MkTemplate to convey information back to the
     creator of a MkTemplate object. The default versions of the
     methods do nothing at all (except for error(), which prints the
@@ -255,10 +461,17 @@ struct MkTemplate::PartLine {
   }
 };
 
-MkTemplate::~MkTemplate() { }
+MkTemplate::~MkTemplate() { delete matches; }
 
 void MkTemplate::setMatchExec(const string& me) { matchExec = me; }
 
+void MkTemplate::setPrevious(const string& name, bistream* t,
+                             ConfigFile* j) {
+  prevTemplFile = name;
+  prevTempl = t;
+  prevJigdo = j;
+}
+
 void MkTemplate::debugRangeInfo(uint64 start, uint64 end, const char* msg,
                                 const PartialMatch* x) {
   printRangeInfo(start, end, msg, x);
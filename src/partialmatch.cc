@@ -17,18 +17,35 @@
 #include <partialmatch.ih>
 //______________________________________________________________________
 
+const size_t MkTemplate::PartialMatchQueue::LEGACY_MAX_MATCHES;
+const size_t MkTemplate::PartialMatchQueue::MAX_MATCHES;
+const size_t MkTemplate::PartialMatchQueue::CHUNK_SIZE;
+
+void MkTemplate::PartialMatchQueue::allocChunk() {
+  PartialMatch* chunk = new PartialMatch[CHUNK_SIZE];
+  chunks.push_back(chunk);
+  for (size_t i = CHUNK_SIZE; i > 0; --i) {
+    chunk[i - 1].nextPart = freeHead;
+    freeHead = &chunk[i - 1];
+  }
+}
+//______________________________________________________________________
+
 #if DEBUG
 
 void MkTemplate::PartialMatchQueue::consistencyCheck() const {
-  int count = 0;
-  for (PartialMatch* i = head; i != 0 && count <= MAX_MATCHES;
-       i = i->next()) {
-    Assert(i->next() == 0 || *i <= *(i->next()));
-    ++count;
+  size_t n = byEvent.v.size();
+  Assert(byStart.v.size() == n);
+  for (size_t i = 0; i < n; ++i) {
+    Assert(byEvent.v[i]->eventPos == i);
+    Assert(byStart.v[i]->startPos == i);
+    if (i == 0) continue;
+    Assert(!eventBefore(byEvent.v[i], byEvent.v[(i - 1) / 2]));
+    Assert(!startBefore(byStart.v[i], byStart.v[(i - 1) / 2]));
   }
-  for (PartialMatch* i = freeHead; i != 0 && count <= MAX_MATCHES;
-       i = i->next()) ++count;
-  Assert(count == MAX_MATCHES);
+  size_t count = n;
+  for (PartialMatch* i = freeHead; i != 0; i = i->nextPart) ++count;
+  Assert(count == chunks.size() * CHUNK_SIZE);
 }
 
 #endif
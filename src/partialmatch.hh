@@ -16,6 +16,7 @@
 #ifndef PARTIALMATCH_HH
 #include <debug.hh>
 #include <log.hh>
+#include <nocopy.hh>
 #define PARTIALMATCH_HH
 
 #ifndef INLINE
@@ -34,12 +35,13 @@ class MkTemplate::PartialMatch {
 public:
   /** Offset in image at which this match starts */
   uint64 startOffset() const { return startOff; }
-  void setStartOffset(uint64 o) { startOff = o; }
+  /** Change startOffset() and update x's position in the queue */
+  INLINE void setStartOffset(PartialMatchQueue* matches, uint64 o);
 
   /** Next value of off at which to finish() sum & compare */
   uint64 nextEvent() const { return nextEv; }
   /** Move x's position in the queue depending on the new value of its
-      nextEvent. Uses linear search. */
+      nextEvent. O(log n) for a queue with n entries. */
   INLINE void setNextEvent(PartialMatchQueue* matches, uint64 newNextEvent);
 
   /** Offset in buf of start of current MD5 block */
@@ -54,48 +56,49 @@ public:
   FilePart* file() const { return filePart; }
   void setFile(FilePart* f) { filePart = f; }
 
-  /** Next in list, or null */
-  PartialMatch* next() const { return nextPart; }
-
 private:
   PartialMatch() { } // Only to be instantiated by PartialMatchQueue
   uint64 startOff; // Offset in image at which this match starts
   uint64 nextEv; // Next value of off at which to finish() sum & compare
+  uint64 seq; // Value of queue's counter when nextEv was last set
   size_t blockOff; // Offset in buf of start of current MD5 block
   size_t blockNr; // Number of block in file, i.e. index into file->sums[]
   FilePart* filePart; // File whose sums matched so far
-  PartialMatch* nextPart;
-  bool operator<=(const PartialMatch& x) {
-    return nextEvent() <= x.nextEvent();
-  }
+  PartialMatch* nextPart; // Next entry in list of free entries
+  size_t eventPos, startPos; // Index in PartialMatchQueue's two heaps
 };
 //________________________________________
 
-/** Queue of PartialMatch objects, always kept sorted by ascending
-    nextEvent. This may seem to make many operations inefficient, but
-    this sort order is best for the central mktemplate loop. */
-class MkTemplate::PartialMatchQueue {
+/** Queue of PartialMatch objects. front() is always the entry with the
+    lowest nextEvent; of several entries with the same nextEvent, it is the
+    one whose setNextEvent() was called last.
+
+    Two binary heaps of pointers are maintained: One ordered by nextEvent,
+    the other by startOffset (with the nextEvent order as tie-breaker, so
+    the result of findLowestStartOffset() is deterministic). This makes
+    adding, rescheduling and removing an entry O(log n). The PartialMatch
+    objects themselves are allocated in chunks which are never freed until
+    the queue is destroyed, their addresses remain stable.
+
+    There is still a limit for the number of entries, but it is high - it
+    only exists to keep memory usage and the number of MD5 calculations
+    bounded if an image contains huge areas which match the start of
+    files at every offset, e.g. both image and a file are all zeroes. */
+class MkTemplate::PartialMatchQueue : NoCopy {
   friend class MkTemplate::PartialMatch;
 public:
   inline PartialMatchQueue();
+  inline ~PartialMatchQueue();
 
-  bool empty() const { return head == 0; }
-
-  bool full() const { return freeHead == 0; }
+  bool empty() const { return byEvent.v.empty(); }
+  size_t size() const { return byEvent.v.size(); }
 
-  /* If true is returned, the queue is not only full, findDropCandidate() is
-      also going to always return 0 from now on. Intended to be used for
-      optimisation: As long as crammed()==true, needn't even check for
-      further prospective matches.
-      The value returned by this function is set to true by
-      findDropCandidate(), and set to false by erase(), eraseFront(),
-      eraseStartOffsetLess() and setNextEvent(). (NB not by
-      setStartOffset()) */
-  //bool crammed() const { return crammedVal; }
+  /** True if the hard limit on the number of entries has been reached */
+  bool full() const { return size() >= MAX_MATCHES; }
 
-  PartialMatch* front() const { return head; }
+  PartialMatch* front() const { return empty() ? 0 : byEvent.v[0]; }
 
-  /** Add a new entry to the front of the queue. The queue must not be full.
+  /** Add a new entry to the queue. The queue must not be full.
       The new entry has all members set to 0, including its startOffset().
       Use the setter methods to change this.
       @return new object at front() */
@@ -103,22 +106,24 @@ public:
 
   /** Return pointer to element with the lowest startOff value, or
       null if queue empty. */
-  INLINE PartialMatch* lowestStartOffset() const;
+  PartialMatch* lowestStartOffset() const {
+    return empty() ? 0 : byStart.v[0];
+  }
 
   /** Return lowest nextEvent() of all queue entries, which is always
       the nextEvent() of the first queue entry. Queue must not be
       empty. */
   INLINE uint64 nextEvent() const;
 
-  /** Return first matching entry with startOffset()==off, or null if
-      none found. */
+  /** Return first matching entry (in the order of nextEvent()) with
+      startOffset()==off, or null if none found. Uses linear search. */
   INLINE PartialMatch* findStartOffset(uint64 off) const;
 
   /** Return entry in list with lowest startOffset() value. List must not be
       empty. */
   INLINE PartialMatch* findLowestStartOffset() const;
 
-  /** Remove all entries from list. */
+  /** Remove all entries from list. Also resets the statistics below. */
   inline void erase();
 
   /** Remove first entry from list. List must not be empty. */
@@ -129,7 +134,7 @@ public:
 
   /** If the queue is full, use some heuristics to find a PartialMatch in the
       queue which is "unlikely to lead to an actual match", or 0 if none
-      exists.
+      exists. Either way, a possible match is dropped by the caller.
       @param sectorLength assumed "sector size"
       @param newStartOffset start offset of the new match which is to replace
       the object returned by this function. The heuristics favours offsets
@@ -137,6 +142,20 @@ public:
   INLINE PartialMatch* findDropCandidate(unsigned* sectorLength,
                                          uint64 newStartOffset);
 
+  /** Highest number of entries since the last erase() */
+  size_t peakSize() const { return peak; }
+  /** Number of entries added while the queue already contained
+      LEGACY_MAX_MATCHES or more. Before the queue could grow, it held at
+      most that many entries, so for each of these additions one possible
+      match was discarded. */
+  uint64 overflowCount() const { return overflows; }
+  /** Number of calls to findDropCandidate(), i.e. possible matches which
+      were discarded because the queue was full */
+  uint64 dropCount() const { return drops; }
+
+  /** Size of the fixed queue used by earlier versions */
+  static const size_t LEGACY_MAX_MATCHES = 2048;
+
 # if DEBUG
   void consistencyCheck() const;
 # else
@@ -144,34 +163,69 @@ public:
 # endif
 
 private:
-  /* The size of the linked list of MD5 blocks awaiting matching must
-     be limited for cases where there are lots of overlapping matches,
-     e.g. both image and a file are all zeroes. */
-  static const int MAX_MATCHES = 2048;
-  PartialMatch* head; // First entry of queue, or null if queue empty
+  /* Hard limit for the number of entries. With the default md5BlockLength,
+     all of them together may need to MD5 several GB of data before the
+     matches are either confirmed or discarded. */
+  static const size_t MAX_MATCHES = 65536;
+  // Number of PartialMatch objects allocated at a time
+  static const size_t CHUNK_SIZE = 1024;
+
+  typedef bool (*Before)(const PartialMatch*, const PartialMatch*);
+  // Binary min-heap. Every entry's x->*pos is its index in v
+  struct Heap {
+    vector<PartialMatch*> v;
+    Before before;
+    size_t PartialMatch::*pos;
+  };
+  static INLINE bool eventBefore(const PartialMatch* a,
+                                 const PartialMatch* b);
+  static INLINE bool startBefore(const PartialMatch* a,
+                                 const PartialMatch* b);
+  static INLINE void siftUp(Heap& h, size_t i);
+  static INLINE void siftDown(Heap& h, size_t i);
+  static INLINE void heapPush(Heap& h, PartialMatch* x);
+  static INLINE void heapRemove(Heap& h, PartialMatch* x);
+  static INLINE void heapUpdate(Heap& h, PartialMatch* x);
+  INLINE void remove(PartialMatch* x);
+  void allocChunk();
+
+  Heap byEvent, byStart;
+  vector<PartialMatch*> chunks; // Arrays of CHUNK_SIZE entries
   PartialMatch* freeHead; // First elem of linked list of free slots, or null
-  PartialMatch data[MAX_MATCHES];
+  uint64 seqCounter; // Incremented whenever an entry's nextEvent is set
 
-  /* If true, queue is full, and furthermore findDropCandidate() will always
-     return 0 */
-  //bool crammedVal;
+  size_t peak;
+  uint64 overflows, drops;
 };
 //______________________________________________________________________
 
 void MkTemplate::PartialMatchQueue::erase() {
-  head = 0;
-  freeHead = &data[0];
-  //crammedVal = false;
-  // Put all elements in free list
-  data[MAX_MATCHES - 1].nextPart = 0;
-  for (int i = MAX_MATCHES - 2; i >= 0; --i)
-    data[i].nextPart = &data[i + 1];
+  for (vector<PartialMatch*>::iterator i = byEvent.v.begin(),
+         e = byEvent.v.end(); i != e; ++i) {
+    (*i)->nextPart = freeHead;
+    freeHead = *i;
+  }
+  byEvent.v.clear();
+  byStart.v.clear();
+  seqCounter = 0;
+  peak = 0;
+  overflows = drops = 0;
   consistencyCheck();
 }
 
-MkTemplate::PartialMatchQueue::PartialMatchQueue() {
+MkTemplate::PartialMatchQueue::PartialMatchQueue() : freeHead(0) {
+  byEvent.before = &eventBefore;
+  byEvent.pos = &PartialMatch::eventPos;
+  byStart.before = &startBefore;
+  byStart.pos = &PartialMatch::startPos;
   erase();
 }
+
+MkTemplate::PartialMatchQueue::~PartialMatchQueue() {
+  for (vector<PartialMatch*>::iterator i = chunks.begin(), e = chunks.end();
+       i != e; ++i)
+    delete[] *i;
+}
 //______________________________________________________________________
 
 #ifndef NOINLINE
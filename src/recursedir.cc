@@ -25,20 +25,29 @@
   This goes into great contortions in order to first access
   non-symlink objects and then symlinks.
 
+  With several threads, the traversal order above is kept: The worker
+  threads only read the contents of directories (names and lstat()
+  results) in the order in which getName() is likely to need them, all
+  decisions about which names to return are still made by getName().
+
 */
 
 #include <config.h>
 
 #include <recursedir.hh>
 
+#include <deque>
 #include <iostream>
+#include <map>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd-jigdo.h>
 
 #include <string.hh>
+#include <thread.hh>
 //______________________________________________________________________
 
 namespace {
@@ -59,6 +68,264 @@ namespace {
 
 //______________________________________________________________________
 
+/* Reads directories ahead of getName(). Whenever a directory has been
+   read, its subdirectories are put at the front of the todo list, so
+   the workers proceed depth-first like getName() does. Each directory
+   is only queued once per device/inode, which also ends bind mount
+   loops. To bound memory usage, the workers pause while more than
+   MAX_BUFFERED entries are waiting to be picked up by getName(). The
+   workers mostly wait for the filesystem (e.g. an NFS server), so
+   their number does not depend on the number of CPUs. However, they
+   all take their work from one todo list, so more than MAX_WORKERS
+   workers would mostly compete for its mutex. */
+class RecurseDir::Prefetch {
+public:
+  explicit Prefetch(unsigned threads);
+  ~Prefetch();
+  /* false if no worker thread could be started */
+  bool running() const { return !workers.empty(); }
+  /* Return listing of dirName, either one read by a worker or, if none
+     has started reading the directory yet, one read now. The caller
+     takes ownership of the result. */
+  Listing* get(const string& dirName);
+
+private:
+  enum { MAX_BUFFERED = 65536, MAX_WORKERS = 8 };
+  class Worker : public Thread {
+  public:
+    explicit Worker(Prefetch* p) : prefetch(p) { }
+  protected:
+    virtual void run() { prefetch->work(); }
+  private:
+    Prefetch* prefetch;
+  };
+  void work();
+  // Put subdirs of just read listing on todo list. Mutex must be locked
+  void queueSubdirs(const string& dirName, const Listing* l);
+
+  Mutex mutex;
+  Condition changed; // Signalled when todo or a listing's state changes
+  vector<Worker*> workers;
+  typedef map<string, Listing*> Listings;
+  Listings listings; // Queued/read dirs, by name with trailing DIRSEP
+  deque<string> todo; // Names of dirs to read next, first one first
+  set<DevIno> queued; // Dirs which have already been queued
+  size_t buffered; // Nr of entries in DONE listings not yet picked up
+  bool stop;
+};
+//________________________________________
+
+RecurseDir::Prefetch::Prefetch(unsigned threads)
+    : buffered(0), stop(false) {
+  if (threads > MAX_WORKERS) threads = MAX_WORKERS;
+  for (unsigned i = 0; i < threads; ++i) {
+    Worker* w = new Worker(this);
+    if (w->start()) { delete w; break; }
+    workers.push_back(w);
+  }
+}
+
+RecurseDir::Prefetch::~Prefetch() {
+  {
+    MutexLock lock(mutex);
+    stop = true;
+    changed.broadcast();
+  }
+  for (vector<Worker*>::iterator i = workers.begin(); i != workers.end();
+       ++i) {
+    (*i)->join();
+    delete *i;
+  }
+  for (Listings::iterator i = listings.begin(); i != listings.end(); ++i)
+    delete i->second;
+}
+//________________________________________
+
+void RecurseDir::Prefetch::work() {
+  MutexLock lock(mutex);
+  while (true) {
+    while (!stop && (todo.empty() || buffered >= MAX_BUFFERED))
+      changed.wait(mutex);
+    if (stop) return;
+    string dirName;
+    dirName.swap(todo.front());
+    todo.pop_front();
+    Listings::iterator i = listings.find(dirName);
+    // getName() may have got there first and read the dir itself
+    if (i == listings.end() || i->second->state != Listing::PENDING)
+      continue;
+    Listing* l = i->second;
+    l->state = Listing::LISTING;
+    mutex.unlock();
+    listDir(dirName, l);
+    mutex.lock();
+    l->state = Listing::DONE;
+    buffered += l->entries.size();
+    queueSubdirs(dirName, l);
+  }
+}
+//________________________________________
+
+void RecurseDir::Prefetch::queueSubdirs(const string& dirName,
+                                        const Listing* l) {
+  deque<string>::iterator pos = todo.begin();
+  for (vector<Entry>::const_iterator e = l->entries.begin();
+       e != l->entries.end(); ++e) {
+    if (e->error != 0 || isSymlink(&e->info) || !S_ISDIR(e->info.st_mode))
+      continue;
+    if (!queued.insert(DevIno(&e->info)).second) continue;
+    string name = dirName;
+    name += e->name;
+    name += DIRSEP;
+    Listing*& x = listings[name];
+    if (x != 0) continue;
+    x = new Listing();
+    pos = todo.insert(pos, name);
+    ++pos;
+  }
+  changed.broadcast();
+}
+//________________________________________
+
+RecurseDir::Listing* RecurseDir::Prefetch::get(const string& dirName) {
+  MutexLock lock(mutex);
+  Listings::iterator i = listings.find(dirName);
+  Listing* l;
+  if (i == listings.end() || i->second->state == Listing::PENDING) {
+    // No worker has started on it, don't wait for one
+    if (i == listings.end()) {
+      l = new Listing();
+    } else {
+      l = i->second;
+      listings.erase(i);
+    }
+    l->state = Listing::LISTING;
+    mutex.unlock();
+    listDir(dirName, l);
+    mutex.lock();
+    l->state = Listing::DONE;
+    queueSubdirs(dirName, l);
+    return l;
+  }
+
+  l = i->second;
+  while (l->state != Listing::DONE) changed.wait(mutex);
+  listings.erase(dirName);
+  buffered -= l->entries.size();
+  changed.broadcast();
+  return l;
+}
+//______________________________________________________________________
+
+void RecurseDir::listDir(const string& dirName, Listing* l) {
+  DIR* dir = opendir(dirName.c_str());
+  if (dir == 0) {
+    l->error = errno;
+    return;
+  }
+# if !HAVE_FSTATAT
+  string name;
+# endif
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != 0) {
+    const char* n = entry->d_name;
+#   if UNIX || WINDOWS
+    if (n[0] == '.' && (n[1] == 0 || (n[1] == '.' && n[2] == 0)))
+      continue;
+#   endif
+    l->entries.push_back(Entry());
+    Entry& e = l->entries.back();
+    e.name = n;
+#   if HAVE_FSTATAT
+    int r = fstatat(dirfd(dir), n, &e.info,
+                    (HAVE_LSTAT ? AT_SYMLINK_NOFOLLOW : 0));
+#   else
+    name = dirName;
+    name += n;
+    int r = lstat(name.c_str(), &e.info);
+#   endif
+    e.error = (r == 0 ? 0 : errno);
+  }
+  closedir(dir);
+}
+//________________________________________
+
+RecurseDir::Listing* RecurseDir::openDir(const string& dirName) {
+  if (threads > 1 && prefetch == 0) {
+    prefetch = new Prefetch(threads);
+    if (!prefetch->running()) {
+      delete prefetch;
+      prefetch = 0;
+      threads = 1;
+    }
+  }
+
+  Listing* l;
+  if (prefetch != 0) {
+    l = prefetch->get(dirName);
+  } else {
+    l = new Listing();
+    listDir(dirName, l);
+  }
+  if (l->error != 0) {
+    errno = l->error;
+    delete l;
+    throw_RecurseError_forDir(string(dirName, 0, dirName.length() - 1));
+  }
+  return l;
+}
+//________________________________________
+
+#if HAVE_LSTAT
+size_t RecurseDir::InodeSet::slotFor(ino_t ino, size_t mask) {
+  uint64 x = static_cast<uint64>(ino) * 0x9e3779b97f4a7c15ULL;
+  return static_cast<size_t>(x >> 32) & mask;
+}
+
+bool RecurseDir::InodeSet::insert(dev_t dev, ino_t ino) {
+  Table& t = tables[dev];
+  if (ino == 0) {
+    bool result = t.haveZero;
+    t.haveZero = true;
+    return result;
+  }
+
+  // Keep the table at most 3/4 full
+  if ((t.count + 1) * 4 > t.slots.size() * 3) {
+    vector<ino_t> old(t.slots.empty() ? 1024 : t.slots.size() * 2, 0);
+    old.swap(t.slots);
+    size_t mask = t.slots.size() - 1;
+    for (vector<ino_t>::iterator i = old.begin(), e = old.end(); i != e; ++i) {
+      if (*i == 0) continue;
+      size_t s = slotFor(*i, mask);
+      while (t.slots[s] != 0) s = (s + 1) & mask;
+      t.slots[s] = *i;
+    }
+  }
+
+  size_t mask = t.slots.size() - 1;
+  size_t s = slotFor(ino, mask);
+  while (t.slots[s] != 0) {
+    if (t.slots[s] == ino) return true;
+    s = (s + 1) & mask;
+  }
+  t.slots[s] = ino;
+  ++t.count;
+  return false;
+}
+#endif
+//________________________________________
+
+RecurseDir::~RecurseDir() {
+  if (listStream != 0 && listStream != &cin) fileList.close();
+  while (!recurseStack.empty()) {
+    recurseStack.top().close();
+    recurseStack.pop();
+  }
+  delete prefetch;
+}
+//______________________________________________________________________
+
 /* Assign the next object name to result. Returns FAILURE if no more
    names available. Note: An object name is immediately removed from
    the start of "objects" when it is copied to "result". The name of
@@ -148,20 +415,7 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
     if (!recurseStack.empty()) {
       // Continue recursing through directories
       Level& level = recurseStack.top();
-      struct dirent* entry;
-      while (true) {
-        entry = readdir(level.dir);
-#       if UNIX || WINDOWS
-        if (entry == 0) break;
-        const char* n = entry->d_name;
-        if (n[0] == '.' && (n[1] == 0 || (n[1] == '.' && n[2] == 0))) {
-          //cerr << "Recurse: Skip `" << n << "'" << endl;
-          continue;
-        }
-#       endif
-        break;
-      }
-      if (entry == 0) {
+      if (level.next == level.dir->entries.size()) {
         // End-of-directory reached, continue one dir level up
         //cerr << "Recurse: End of dir `" << curDir << "'" << endl;
         level.close();
@@ -173,10 +427,14 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
       //____________________
 
       // Valid object name was read from directory
+      const Entry& entry = level.dir->entries[level.next++];
       result = curDir;
-      result += entry->d_name;
-      if (lstat(result.c_str(), fileInfo) != 0)
+      result += entry.name;
+      if (entry.error != 0) {
+        errno = entry.error;
         throw_RecurseError_forObject(result);
+      }
+      *fileInfo = entry.info;
       if (isSymlink(fileInfo)) {
         // Do not handle object now, push at end of queue
         objects.push(result);
@@ -200,11 +458,10 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
 
       // Object is a directory - recurse
       //cerr << "Recurse: into `" << result << "'" << endl;
-      DIR* dir = opendir(result.c_str());
-      if (dir == 0)
-        throw_RecurseError_forDir(result);
-      curDir += entry->d_name;
-      curDir += DIRSEP;
+      string dirName = result;
+      dirName += DIRSEP;
+      Listing* dir = openDir(dirName);
+      curDir.swap(dirName);
       recurseStack.push(Level(dir, curDir.length()));
       continue;
 
@@ -212,7 +469,11 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
     //________________________________________
 
     // Finished recursing - any more input objects?
-    if (getNextObjectName(result)) return FAILURE;
+    if (getNextObjectName(result)) {
+      delete prefetch; // Stop the threads, start again if more names added
+      prefetch = 0;
+      return FAILURE;
+    }
 
 #   if WINDOWS
     /* Allow trailing '\' in input args, by removing it before
@@ -255,11 +516,10 @@ bool RecurseDir::getName(string& result, struct stat* fileInfo,
     }
 
     // Object is directory - recurse
-    DIR* dir = opendir(result.c_str());
-    if (dir == 0)
-      throw_RecurseError_forDir(result);
-    curDir = result;
-    if (curDir[curDir.size() - 1] != DIRSEP) curDir += DIRSEP;
+    string dirName = result;
+    if (dirName[dirName.size() - 1] != DIRSEP) dirName += DIRSEP;
+    Listing* dir = openDir(dirName);
+    curDir.swap(dirName);
     recurseStack.push(Level(dir, curDir.length()));
     continue;
 
@@ -22,9 +22,11 @@
 
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <queue>
 #include <set>
 #include <stack>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -46,12 +48,19 @@ struct RecurseError : Error {
     than one name for an inode, and avoid symlink loops. If an inode
     can be reached both through its "normal" name and through symlinks
     during recursion into one directory, it is guaranteed that the
-    normal name will be listed. */
+    normal name will be listed.
+
+    The contents of a directory are read all at once, including the
+    stat() information for each entry. With setThreads(), further
+    threads read subdirectories ahead of the directory whose entries
+    getName() is currently returning. This does not affect the order
+    of the returned names or the handling of symlinks and inodes
+    described above, only how soon the information is available. */
 class RecurseDir {
 public:
   RecurseDir() : curDir(), recurseStack(), objects(), objectsFrom(),
-                 fileList(), listStream(0) { }
-  inline ~RecurseDir();
+                 fileList(), listStream(0), threads(1), prefetch(0) { }
+  ~RecurseDir();
 
   /** Provide single file/directory name to output or recurse into */
   void addFile(const char* name) { objects.push(string(name)); }
@@ -64,6 +73,12 @@ public:
   /** Are there no filename sources present at all? */
   bool empty() const { return objects.empty() && objectsFrom.empty(); }
 
+  /** Number of threads for reading directories ahead of getName(). With
+      1 (the default), directories are only read when getName() gets to
+      them. The threads are started by the first getName() call which
+      enters a directory, and stopped once getName() returns FAILURE. */
+  void setThreads(unsigned n) { threads = (n == 0 ? 1 : n); }
+
   /** Returns FAILURE if no more names. After a RecurseError has been
       thrown, it is no problem to continue using the object.
       @param result Returned filename (output only)
@@ -84,18 +99,57 @@ public:
 private:
   // Insert fileInfo in beenThere, return true if it was already there
   inline bool alreadyVisited(const struct stat* fileInfo);
-  // For recording device/inode of objects already visited
+  /* For recording device/inode of objects already visited. With many
+     files, a set<DevIno> needs several times more memory than the
+     JigdoCache entries of the files, so for each device, the inode
+     numbers are stored in a hash table with open addressing. */
+  class InodeSet {
+  public:
+    // Insert, return true if it was already there
+    bool insert(dev_t dev, ino_t ino);
+  private:
+    struct Table {
+      Table() : slots(), count(0), haveZero(false) { }
+      vector<ino_t> slots; // 0 means free, size is a power of 2
+      size_t count; // Nr of slots in use
+      bool haveZero; // Whether inode 0 is in the set
+    };
+    static size_t slotFor(ino_t ino, size_t mask);
+    map<dev_t, Table> tables;
+  };
+  // For recording device/inode of directories
   struct DevIno {
     DevIno(const struct stat* s) : dev(s->st_dev), ino(s->st_ino) { }
     bool operator<(const DevIno& d) const {
       return (ino < d.ino) || (ino == d.ino && dev < d.dev); }
     dev_t dev; ino_t ino;
   };
+  // One object in a directory, with the result of lstat()ing it
+  struct Entry {
+    string name; // Leafname
+    struct stat info;
+    int error; // errno if lstat() failed, else 0
+  };
+  // Complete contents of one directory
+  struct Listing {
+    Listing() : state(PENDING), error(0), entries() { }
+    enum State { PENDING, LISTING, DONE } state; // Only used by Prefetch
+    int error; // errno if opendir() failed, else 0
+    vector<Entry> entries;
+  };
+  // Read directory dirName (which ends in DIRSEP) into l
+  static void listDir(const string& dirName, Listing* l);
+  // Return listing of dirName, throw RecurseError if it cannot be read
+  Listing* openDir(const string& dirName);
+  // Worker threads reading directories in advance, defined in .cc
+  class Prefetch;
+
   // One stack entry (recursion level) when recursing into directories
   struct Level {
-    Level(DIR* d, size_t l) : dir(d), dirNameLen(l) { }
-    void close() { if (dir == 0) return; closedir(dir); dir = 0; }
-    DIR* dir; // Handle for readdir()
+    Level(Listing* d, size_t l) : dir(d), next(0), dirNameLen(l) { }
+    void close() { delete dir; dir = 0; }
+    Listing* dir; // Contents of the directory
+    size_t next; // Index of next entry of dir to look at
     size_t dirNameLen; // Length to shorten curDir to to get this dir's name
   };
   string curDir;
@@ -108,33 +162,26 @@ private:
   ifstream fileList; // Was head of objectsFrom once, now has been opened
   istream* listStream; // null if not open, else &fileList, or &cin
 # if HAVE_LSTAT
-  set<DevIno> beenThere; // Already visited inodes, for loop prevention
+  InodeSet beenThere; // Already visited inodes, for loop prevention
 # endif
+  unsigned threads;
+  Prefetch* prefetch; // null if not (yet) running
 };
 //______________________________________________________________________
 
 #if HAVE_LSTAT
-  inline bool isSymlink(struct stat* buf) { return S_ISLNK(buf->st_mode); }
+  inline bool isSymlink(const struct stat* buf) {
+    return S_ISLNK(buf->st_mode);
+  }
   bool RecurseDir::alreadyVisited(const struct stat* fileInfo) {
-    pair<set<DevIno>::iterator, bool>
-      ins = beenThere.insert(DevIno(fileInfo));
-    return !ins.second;
+    return beenThere.insert(fileInfo->st_dev, fileInfo->st_ino);
   }
 #else
   inline int lstat(const char* filename, struct stat* buf) {
     return stat(filename, buf);
   }
-  inline bool isSymlink(struct stat*) { return false; }
+  inline bool isSymlink(const struct stat*) { return false; }
   bool RecurseDir::alreadyVisited(const struct stat*) { return false; }
 #endif
-//____________________
-
-RecurseDir::~RecurseDir() {
-  if (listStream != 0 && listStream != &cin) fileList.close();
-  while (!recurseStack.empty()) {
-    recurseStack.top().close();
-    recurseStack.pop();
-  }
-}
 
 #endif
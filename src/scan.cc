@@ -18,11 +18,24 @@
 #include <string>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h> /* getenv(), mkstemp() */
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#if HAVE_MMAP
+#  include <sys/mman.h>
+#endif
+#if HAVE_LINUX_FIEMAP_H
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#  include <linux/fiemap.h>
+#endif
+#include <sys/time.h>
 #include <unistd-jigdo.h>
 
+#include <algorithm>
+
 #include <bstream.hh>
 #include <compat.hh>
 #include <configfile.hh>
@@ -30,6 +43,7 @@
 #include <scan.hh>
 #include <string.hh>
 #include <serialize.hh>
+#include <thread.hh>
 //______________________________________________________________________
 
 DEBUG_UNIT("scan")
@@ -47,117 +61,317 @@ JigdoCache::ProgressReporter JigdoCache::noReport;
 struct stat JigdoCache::fileInfo;
 //______________________________________________________________________
 
-#if HAVE_LIBDB
 /* Interpret a string of bytes (out of the file cache) like this:
 
    4   blockLength (of rsync sum)
    4   md5BlockLength
    4   blocks (number of valid md5 blocks in this entry), curr. always >0
    8   rsyncSum of file start (only valid if blocks > 0)
-  16   fileMD5Sum (only valid if
+  16   fileMD5Sum (only valid if, for this or one of the further
+                   parameter sets below,
                    blocks == (fileSize+md5BlockLength-1)/md5BlockLength )
   followed by n entries:
   16   md5sum of block of size md5BlockLength
 
-  If stored md5BlockLength doesn't match supplied length, do nothing.
-  Otherwise, restore *this from cached data and return cached
-  blockLength (0 if not cached). The caller needs to make sure the
-  blockLength matches.
+  followed by up to MAX_PARAM_SETS-1 further parameter sets, each:
+   4   blockLength
+   4   md5BlockLength
+   4   blocks
+   8   rsyncSum
+  followed by n entries:
+  16   md5sum of block of size md5BlockLength
+
+  The further sets are the sums for other blockLength/md5BlockLength
+  parameters, e.g. from a make-template run with a different
+  --md5-block-size. An entry with just one set has the same format as
+  with jigdo-file versions before these sets were introduced.
+
+  If there is no set for the supplied md5BlockLength, only restore the
+  whole file's md5 sum (if present) and return 0. Otherwise, also
+  restore sums[] from the set and return its blockLength. If that does
+  not match, the caller needs to re-calculate rsyncSum.
 
   This is not a standard unserialize() member of FilePart because it
   does not create a complete serialization - e.g. the location path
   iter is missing. It only creates a cache entry. */
 
-size_t FilePart::unserializeCacheEntry(const byte* data, size_t dataSize,
-                                       size_t md5BlockLength){
-  Assert(dataSize > PART_MD5SUM);
+bool FilePart::parseCacheEntry(const byte* data, size_t dataSize,
+                               uint64 fileSize, vector<ParamSet>& result) {
+  const byte* end = data + dataSize;
+  const byte* p = data;
+  result.clear();
+  while (p != end) {
+    ParamSet s;
+    s.data = p;
+    size_t headerLen = (p == data ? PART_MD5SUM : SET_MD5SUM);
+    if (static_cast<size_t>(end - p) < headerLen) {
+      debug("ERR truncated entry");
+      return false;
+    }
+    p = unserialize4(s.blockLength, p);
+    p = unserialize4(s.md5BlockLength, p);
+    p = unserialize4(s.blocks, p);
+    s.sums = s.data + headerLen;
+    // Ignore strange-looking entries
+    if (s.md5BlockLength == 0 || s.blocks == 0
+        || s.blocks > (fileSize + s.md5BlockLength - 1) / s.md5BlockLength
+        || static_cast<size_t>(end - s.sums) / 16 < s.blocks) {
+      debug("ERR #blocks %1 for md5BlockLength %2, %3 bytes left",
+            s.blocks, s.md5BlockLength, end - s.sums);
+      return false;
+    }
+    p = s.sums + s.blocks * 16;
+    result.push_back(s);
+  }
+  return !result.empty();
+}
 
+size_t FilePart::unserializeCacheEntry(const byte* data, size_t dataSize,
+    size_t blockLength, size_t md5BlockLength) {
   // The resize() must have been made by the caller
-  Paranoid(sums.size() == (size() + md5BlockLength - 1) / md5BlockLength);
-
-  size_t cachedBlockLength;
-  data = unserialize4(cachedBlockLength, data);
-  size_t cachedMd5BlockLength;
-  data = unserialize4(cachedMd5BlockLength, data);
-  if (cachedMd5BlockLength != md5BlockLength) return 0;
-
-  size_t blocks;
-  data = unserialize4(blocks, data);
-  // Ignore strange-looking entries
-  if (blocks * serialSizeOf(md5Sum) != dataSize - PART_MD5SUM
-      || blocks == 0) {
-    if (blocks == 0) debug("ERR #blocks == 0");
-    else debug("ERR wrong entry size (%1 vs %2)",
-               blocks * 16, dataSize - PART_MD5SUM);
-    return 0;
+  Paranoid(nrOfSums == (size() + md5BlockLength - 1) / md5BlockLength);
+
+  vector<ParamSet> sets;
+  if (!parseCacheEntry(data, dataSize, size(), sets)) return 0;
+
+  const ParamSet* set = 0;
+  bool haveMd5Sum = false;
+  for (vector<ParamSet>::const_iterator i = sets.begin(), e = sets.end();
+       i != e; ++i) {
+    if (i->blocks == (size() + i->md5BlockLength - 1) / i->md5BlockLength)
+      haveMd5Sum = true;
+    if (i->md5BlockLength == md5BlockLength
+        && (set == 0 || i->blockLength == blockLength))
+      set = &*i;
   }
-  Paranoid(serialSizeOf(rsyncSum) == 8);
-  data = unserialize(rsyncSum, data);
+
   Paranoid(serialSizeOf(md5Sum) == 16);
-  // All blocks of file present?
-  if (blocks == sums.size()) {
+  if (haveMd5Sum && !mdValid()) {
+    unserialize(md5Sum, data + FILE_MD5SUM);
     setFlag(MD_VALID);
-    data = unserialize(md5Sum, data);
-  } else {
-    clearFlag(MD_VALID);
-    data += 16;
   }
+  if (set == 0) return 0;
+
+  Paranoid(serialSizeOf(rsyncSum) == 8);
+  unserialize(rsyncSum, set->data + RSYNCSUM);
+  if (set->blocks == nrOfSums) setFlag(SUMS_VALID);
+  else clearFlag(SUMS_VALID);
   // Read md5 sums of individual chunks of file
-  vector<MD5>::iterator sum = sums.begin();
-  for (size_t i = blocks; i > 0; --i) {
+  data = set->sums;
+  MD5* sum = sums;
+  for (size_t i = set->blocks; i > 0; --i) {
     data = unserialize(*sum, data);
     ++sum;
   }
 
-  return cachedBlockLength;
+  return set->blockLength;
 }
-#endif
 //______________________________________________________________________
 
-#if HAVE_LIBDB
-/** Opposite of unserializeCacheEntry; create byte stream from object */
+/** Opposite of unserializeCacheEntry; create byte stream from object.
+    The parameter sets of the old entry (if any) are appended, except
+    for the one with the same md5BlockLength, which this one
+    replaces. The old entry must stay valid until operator() returns. */
 struct FilePart::SerializeCacheEntry {
   SerializeCacheEntry(const FilePart& f, JigdoCache* c, size_t blockLen,
-                      size_t md5Len)
-    : file(f), cache(c), blockLength(blockLen), md5BlockLength(md5Len) { }
+                      size_t md5Len, const byte* old = 0, size_t oldLen = 0)
+      : file(f), cache(c), blockLength(blockLen), md5BlockLength(md5Len),
+        keep() {
+    if (old == 0 || !parseCacheEntry(old, oldLen, file.size(), keep))
+      keep.clear();
+    vector<ParamSet>::iterator out = keep.begin();
+    for (vector<ParamSet>::iterator i = keep.begin(), e = keep.end();
+         i != e; ++i) {
+      if (i->md5BlockLength == md5BlockLength) continue;
+      if (static_cast<size_t>(out - keep.begin()) == MAX_PARAM_SETS - 1)
+        break;
+      *out = *i; ++out;
+    }
+    keep.erase(out, keep.end());
+  }
   const FilePart& file;
   JigdoCache* cache;
   size_t blockLength;
   size_t md5BlockLength;
+  vector<ParamSet> keep; // Parameter sets of old entry to append
 
   size_t serialSizeOf() {
-    return PART_MD5SUM + (file.mdValid() ? file.sums.size() * 16 : 16);
+    size_t result =
+      PART_MD5SUM + (file.sumsValid() ? file.nrOfSums * 16 : 16);
+    for (vector<ParamSet>::const_iterator i = keep.begin(), e = keep.end();
+         i != e; ++i)
+      result += SET_MD5SUM + i->blocks * 16;
+    return result;
   }
 
   void operator()(byte* data) {
     Paranoid(file.getFlag(TO_BE_WRITTEN));
     // If empty(), shouldn't have been marked TO_BE_WRITTEN:
-    Assert(!file.sums.empty());
+    Assert(file.nrOfSums > 0);
 
     data = serialize4(blockLength, data);
     data = serialize4(md5BlockLength, data);
     // Nr of valid blocks - either 1 or all
-    size_t blocks = (file.mdValid() ? file.sums.size() : 1);
+    size_t blocks = (file.sumsValid() ? file.nrOfSums : 1);
     data = serialize4(blocks, data);
     data = serialize(file.rsyncSum, data);
-    data = serialize(file.md5Sum, data);
+    if (file.mdValid()) {
+      data = serialize(file.md5Sum, data);
+    } else {
+      memset(data, 0, 16);
+      data += 16;
+    }
     // Write md5 sums of individual chunks of file
-    vector<MD5>::const_iterator sum = file.sums.begin();
+    const MD5* sum = file.sums;
     for (size_t i = blocks; i > 0; --i) {
       data = serialize(*sum, data);
       ++sum;
     }
+    // Copy the other parameter sets, without any fileMD5Sum
+    for (vector<ParamSet>::const_iterator i = keep.begin(), e = keep.end();
+         i != e; ++i) {
+      memcpy(data, i->data, SET_MD5SUM);
+      data += SET_MD5SUM;
+      memcpy(data, i->sums, i->blocks * 16);
+      data += i->blocks * 16;
+    }
   }
 };
-#endif
 //______________________________________________________________________
 
-#if HAVE_LIBDB
+/* Inserts cache entries into the cache file and commits them, in batches,
+   so that the work is not lost if the program is interrupted. queue() is
+   called by the main thread. The batches are written by a separate
+   thread, or by the calling thread if none could be started. */
+class JigdoCache::WriteBack : public Thread {
+public:
+  struct Entry {
+    string name;
+    time_t mtime;
+    uint64 size;
+    uint64 fileId;
+    vector<byte> data;
+  };
+
+  explicit WriteBack(JigdoCache* c)
+    : cache(c), threaded(false), stop(false), ready(false),
+      lastCommit(time(0)), pending(), error() { }
+  void startThread() { threaded = (start() == SUCCESS); }
+  // Add entry, swapping its data with an empty one
+  void queue(Entry& e);
+  /* Stop the thread and insert any remaining entries into the cache
+     file, without committing them */
+  void finish();
+  // Return the message of the first error, if any, and clear it
+  string takeError();
+
+protected:
+  virtual void run();
+
+private:
+  // Commit after this many entries or seconds
+  static const size_t BATCH_SIZE = 1000;
+  static const time_t BATCH_SECONDS = 10;
+  void insert(list<Entry>& batch, bool commit);
+
+  JigdoCache* cache;
+  bool threaded;
+  Mutex mutex; // Protects the members below
+  Condition cond; // Signalled when stop or ready is set
+  bool stop; // Thread is to exit
+  bool ready; // A batch is ready to be written
+  time_t lastCommit;
+  list<Entry> pending;
+  string error;
+};
+
+void JigdoCache::WriteBack::queue(Entry& e) {
+  list<Entry> batch;
+  {
+    MutexLock lock(mutex);
+    pending.push_back(Entry());
+    Entry& x = pending.back();
+    x.name.swap(e.name);
+    x.mtime = e.mtime;
+    x.size = e.size;
+    x.fileId = e.fileId;
+    x.data.swap(e.data);
+    if (pending.size() < BATCH_SIZE
+        && time(0) - lastCommit < BATCH_SECONDS) return;
+    if (threaded) {
+      ready = true;
+      cond.signal();
+      return;
+    }
+    batch.swap(pending);
+  }
+  insert(batch, true);
+}
+
+void JigdoCache::WriteBack::run() {
+  while (true) {
+    list<Entry> batch;
+    {
+      MutexLock lock(mutex);
+      while (!ready && !stop) cond.wait(mutex);
+      if (!ready) return;
+      ready = false;
+      batch.swap(pending);
+    }
+    insert(batch, true);
+  }
+}
+
+void JigdoCache::WriteBack::finish() {
+  if (threaded) {
+    {
+      MutexLock lock(mutex);
+      stop = true;
+      cond.signal();
+    }
+    join();
+    threaded = false;
+  }
+  list<Entry> batch;
+  batch.swap(pending);
+  insert(batch, false);
+}
+
+void JigdoCache::WriteBack::insert(list<Entry>& batch, bool commit) {
+  string err;
+  {
+    MutexLock lock(cache->cacheMutex);
+    try {
+      for (list<Entry>::iterator i = batch.begin(), e = batch.end();
+           i != e; ++i) {
+        debug("Writing %1", i->name);
+        const byte* data = &i->data[0];
+        cache->cacheFile->insert(data, i->data.size(), i->name, i->mtime,
+                                 i->size, i->fileId);
+      }
+      if (commit) cache->cacheFile->commit();
+    } catch (DbError e) {
+      err = e.message;
+    }
+  }
+  MutexLock lock(mutex);
+  if (commit) lastCommit = time(0);
+  if (error.empty()) error = err;
+}
+
+string JigdoCache::WriteBack::takeError() {
+  MutexLock lock(mutex);
+  string result;
+  result.swap(error);
+  return result;
+}
+//______________________________________________________________________
+
 JigdoCache::JigdoCache(const string& cacheFileName, size_t expiryInSeconds,
                        size_t bufLen, ProgressReporter& pr)
   : blockLength(0), md5BlockLength(0), checkFiles(true), files(), nrOfFiles(0),
-    locationPaths(), readAmount(bufLen), buffer(), reporter(pr),
-    cacheExpiry(expiryInSeconds) {
+    locationPaths(), readAmount(bufLen), buffer(), reporter(pr), threads(1),
+    cacheExpiry(expiryInSeconds), writeBack(0) {
   cacheFile = 0;
   try {
     if (!cacheFileName.empty())
@@ -166,28 +380,74 @@ JigdoCache::JigdoCache(const string& cacheFileName, size_t expiryInSeconds,
     string err = subst(_("Could not open cache file: %L1"), e.message);
     reporter.error(err);
   }
+  if (cacheFile != 0) {
+    writeBack = new WriteBack(this);
+    writeBack->startThread();
+  }
+  /* For a large pool, the block sums may not fit into memory, so let the
+     kernel page them out */
+  sumArena.useTempFile();
+}
+//______________________________________________________________________
+
+void JigdoCache::serializeEntry(const FilePart& file, vector<byte>& data) {
+  MutexLock lock(cacheMutex); // writeBack might be committing
+  const byte* old = 0;
+  size_t oldSize = 0;
+  try {
+    if (cacheFile->find(old, oldSize, file.leafName(), file.size(),
+                        file.mtime(), file.fileId).failed())
+      old = 0;
+  } catch (DbError e) {
+    // Only lose the sums for other parameters
+    debug("serializeEntry: %1", e.message);
+    old = 0;
+  }
+  FilePart::SerializeCacheEntry serializer(file, this, blockLength,
+                                           md5BlockLength, old, oldSize);
+  data.resize(serializer.serialSizeOf());
+  serializer(&data[0]);
+}
+
+void JigdoCache::sumsWritten(const FilePart* file) {
+  sumArena.written(reinterpret_cast<const byte*>(file->sums),
+                   file->sumsValid() ? file->nrOfSums * 16 : 16);
+}
+
+void JigdoCache::queueWrite(FilePart* file) {
+  if (writeBack == 0) return;
+  WriteBack::Entry e;
+  e.name = file->leafName();
+  e.mtime = file->mtime();
+  e.size = file->size();
+  e.fileId = file->fileId;
+  serializeEntry(*file, e.data);
+  file->clearFlag(FilePart::TO_BE_WRITTEN);
+  writeBack->queue(e);
+  string err = writeBack->takeError();
+  if (!err.empty()) reporter.error(err); // might throw
 }
-#else
-JigdoCache::JigdoCache(const string&, size_t, size_t bufLen,
-                       ProgressReporter& pr)
-  : blockLength(0), md5BlockLength(0), files(), nrOfFiles(0),
-    locationPaths(), readAmount(bufLen), buffer(), reporter(pr) { }
-#endif
 //______________________________________________________________________
 
 JigdoCache::~JigdoCache() {
-# if HAVE_LIBDB
   if (cacheFile) {
-    // Write out any cache entries that need it
-    for (list<FilePart>::const_iterator i = files.begin(), e = files.end();
+    // Entries which were already committed are not TO_BE_WRITTEN
+    writeBack->finish();
+    string err = writeBack->takeError();
+    if (!err.empty()) reporter.error(err);
+    delete writeBack;
+
+    // Write out any other cache entries that need it
+    for (deque<FilePart>::const_iterator i = files.begin(), e = files.end();
          i != e; ++i) {
       if (i->deleted() || !i->getFlag(FilePart::TO_BE_WRITTEN)) continue;
       debug("Writing %1", i->leafName());
-      FilePart::SerializeCacheEntry serializer(*i, this, blockLength,
-                                               md5BlockLength);
+      vector<byte> entry;
+      serializeEntry(*i, entry);
       try {
-        cacheFile->insert(serializer, serializer.serialSizeOf(),
-                          i->leafName(), i->mtime(), i->size());
+        const byte* data = &entry[0];
+        cacheFile->insert(data, entry.size(), i->leafName(), i->mtime(),
+                          i->size(), i->fileId);
       } catch (DbError e) {
         reporter.error(e.message);
       }
@@ -208,10 +468,14 @@ JigdoCache::~JigdoCache() {
       }
     }
 
-    // Close db object, flushing changes to disc
+    // Write changes to disc, compacting the file if worthwhile
+    try {
+      cacheFile->close();
+    } catch (DbError e) {
+      reporter.error(e.message);
+    }
     delete cacheFile;
   }
-# endif
 }
 //______________________________________________________________________
 
@@ -219,87 +483,149 @@ JigdoCache::~JigdoCache() {
    rsyncSum, or reads whole file and creates all sums[] entries and
    rsyncSum and the whole file's MD5 sum. */
 const MD5* FilePart::getSumsRead(JigdoCache* c, size_t blockNr) {
+  if (getSumsCached(c, blockNr)) return &sums[blockNr];
+
+  // Allocate or resize buffer, or do nothing if already right size
+  c->buffer.resize(c->readAmount > c->md5BlockLength ?
+                   c->readAmount : c->md5BlockLength);
+  string err;
+  const MD5* result = getSumsReadFile(c, blockNr, c->buffer, true, &err);
+  if (result == 0) {
+    markAsDeleted(c);
+    c->reporter.error(err); // might throw
+    return 0;
+  }
+  c->sumsWritten(this);
+  c->queueWrite(this);
+  return result;
+}
+//________________________________________
+
+bool FilePart::getSumsCached(JigdoCache* c, size_t blockNr) {
   // Should do this check before calling:
-  Paranoid((blockNr == 0 && sums.empty()) || !mdValid());
+  Paranoid((blockNr == 0 && nrOfSums == 0) || !sumsValid());
 
   // Do not forget to setParams() before calling this!
   Assert(c->md5BlockLength != 0);
-  const size_t thisBlockLength = c->blockLength;
 
-  sums.resize((size() + c->md5BlockLength - 1) / c->md5BlockLength);
+  size_t blocks = (size() + c->md5BlockLength - 1) / c->md5BlockLength;
+  // Memory from an earlier call is large enough, see setParams()
+  if (sums == 0)
+    sums = reinterpret_cast<MD5*>(c->sumArena.alloc(blocks * 16));
+  Paranoid(blocks <= 0xffffffffU);
+  nrOfSums = static_cast<uint32>(blocks);
   //____________________
 
-# if HAVE_LIBDB
+  const size_t thisBlockLength = c->blockLength;
   // Can we maybe get the info from the cache?
   if (c->cacheFile != 0 && !getFlag(WAS_LOOKED_UP)) {
     setFlag(WAS_LOOKED_UP);
     const byte* data;
     size_t dataSize;
-    try {
-      /* Unserialize will do nothing if md5BlockLength differs. If
-         md5BlockLength matches, but returned blockLength doesn't, we
-         need to re-read the first block. */
-      if (c->cacheFile->find(data, dataSize, leafName(), size(), mtime())
-          .ok()) {
-        debug("%1 found, want block#%2", leafName(), blockNr);
-        size_t cachedBlockLength = unserializeCacheEntry(data, dataSize,
-                                                         c->md5BlockLength);
-        // Was all necessary data in cache? Yes => return it now.
-        if (cachedBlockLength == thisBlockLength
-            && (blockNr == 0 || mdValid())) {
-          debug("%1 loaded, blockLen (%2) matched, %3/%4 in cache",
-                leafName(), thisBlockLength, (mdValid() ? sums.size() : 1),
-                sums.size());
-          return &sums[blockNr];
+    size_t cachedBlockLength = 0;
+    {
+      MutexLock lock(c->cacheMutex); // writeBack might be committing
+      try {
+        /* Unserialize will only restore the whole file's md5 sum if there
+           is no entry for md5BlockLength. If md5BlockLength matches, but
+           returned blockLength doesn't, we need to re-read the start of
+           the file for rsyncSum. */
+        if (c->cacheFile->find(data, dataSize, leafName(), size(), mtime(),
+                               fileId).ok()) {
+          debug("%1 found, want block#%2", leafName(), blockNr);
+          cachedBlockLength = unserializeCacheEntry(data, dataSize,
+              thisBlockLength, c->md5BlockLength);
         }
-        /* blockLengths didn't match and/or the cache only contained
-           the first md5 sum while we asked for a later one. It's as
-           if we never queried the cache, except for the case when we
-           need to re-read the first block because the blockLength
-           changed, but *all* blocks' md5sums were in the cache. */
-        debug("%1 loaded, NO match (blockLen %2 vs %3), %4/%5 in cache",
-              leafName(), cachedBlockLength, thisBlockLength,
-              (mdValid() ? sums.size() : 1), sums.size());
+      } catch (DbError e) {
+        string err = subst(_("Error accessing cache: %1"), e.message);
+        c->reporter.error(err);
+      }
+    }
+    // Was all necessary data in cache? Yes => return it now.
+    if (cachedBlockLength != 0 && (blockNr == 0 || sumsValid())) {
+      if (cachedBlockLength == thisBlockLength) {
+        debug("%1 loaded, blockLen (%2) matched, %3/%4 in cache",
+              leafName(), thisBlockLength, (sumsValid() ? nrOfSums : 1),
+              nrOfSums);
+        c->sumsWritten(this);
+        return true;
+      }
+      /* Only the rsyncSum is for another blockLength. Reading the first
+         blockLength bytes is enough, and the cache entry is updated. */
+      debug("%1 loaded, blockLen %2 vs %3, reading rsyncSum", leafName(),
+            cachedBlockLength, thisBlockLength);
+      if (getRsyncSumReadFile(c)) {
+        c->sumsWritten(this);
+        c->queueWrite(this);
+        return true;
       }
-    } catch (DbError e) {
-      string err = subst(_("Error accessing cache: %1"), e.message);
-      c->reporter.error(err);
     }
+    /* The cache only contained the first md5 sum while we asked for a
+       later one, or no sums for this md5BlockLength. It's as if we
+       never queried the cache, except that the whole file's md5 sum may
+       be known. */
+    debug("%1: NO match (blockLen %2 vs %3)", leafName(), cachedBlockLength,
+          thisBlockLength);
+    clearFlag(SUMS_VALID);
   }
-# endif /* HAVE_LIBDB */
-  //____________________
+  return false;
+}
+//________________________________________
+
+bool FilePart::getRsyncSumReadFile(const JigdoCache* c) {
+  string name(getPath());
+  name += leafName();
+  bifstream input(name.c_str(), ios::binary);
+  if (!input) return false;
+  const size_t thisBlockLength = c->blockLength;
+  vector<byte> buf(thisBlockLength);
+  byte* bufpos = &buf[0];
+  byte* bufend = bufpos + thisBlockLength;
+  while (input && bufpos < bufend) {
+    readBytes(input, bufpos, bufend - bufpos);
+    bufpos += input.gcount();
+  }
+  // Leave at 0 if file too small, like getSumsReadFile()
+  rsyncSum.reset();
+  if (bufpos == bufend) rsyncSum.addBack(&buf[0], thisBlockLength);
+  else if (static_cast<uint64>(bufpos - &buf[0]) != size()) return false;
+  setFlag(TO_BE_WRITTEN);
+  return true;
+}
+//________________________________________
+
+const MD5* FilePart::getSumsReadFile(const JigdoCache* c, size_t blockNr,
+    vector<byte>& buffer, bool report, string* err, uint64* bytesRead) {
+  const size_t thisBlockLength = c->blockLength;
+  Paranoid(buffer.size() >= c->readAmount
+           && buffer.size() >= c->md5BlockLength);
 
   // Open input file
   string name(getPath());
   name += leafName();
   bifstream input(name.c_str(), ios::binary);
   if (!input) {
-    string err;
+    string msg;
     if (name == "-") {
       /* Actually, stdin /would/ be allowed /here/, but it isn't
          possible with mktemplate. */
-      err = _("Error opening file `-' "
+      msg = _("Error opening file `-' "
               "(using standard input not allowed here)");
     } else {
-      err = subst(_("Could not open `%L1' for input - excluded"), name);
+      msg = subst(_("Could not open `%L1' for input - excluded"), name);
       if (errno != 0) {
-        err += " (";
-        err += strerror(errno);
-        err += ')';
+        msg += " (";
+        msg += strerror(errno);
+        msg += ')';
       }
     }
-    markAsDeleted(c);
-    c->reporter.error(err); // might throw
+    *err = msg;
     return 0;
   }
   //____________________
 
   // We're going to write this to the cache later on
   setFlag(TO_BE_WRITTEN);
-
-  // Allocate or resize buffer, or do nothing if already right size
-  c->buffer.resize(c->readAmount > c->md5BlockLength ?
-                   c->readAmount : c->md5BlockLength);
   //______________________________
 
   // Read data and create sums
@@ -311,14 +637,16 @@ const MD5* FilePart::getSumsRead(JigdoCache* c, size_t blockNr) {
      if scanning >1 md5 block */
   uint64 nextReport = mdLeft;
   MD5Sum md;
-  md5Sum.reset();
-  vector<MD5>::iterator sum = sums.begin();
+  // The whole file's sum may be known from an entry for other parameters
+  const bool makeMd5Sum = !mdValid();
+  MD5Sum fileMd;
+  MD5* sum = sums;
   //____________________
 
   // Calculate RsyncSum of head of file and MD5Sums for all blocks
 
   Assert(thisBlockLength <= c->md5BlockLength);
-  byte* buf = &c->buffer[0];
+  byte* buf = &buffer[0];
   byte* bufpos = buf;
   byte* bufend = buf + (c->readAmount > thisBlockLength ?
                         c->readAmount : thisBlockLength);
@@ -340,7 +668,7 @@ const MD5* FilePart::getSumsRead(JigdoCache* c, size_t blockNr) {
     off += n;
     if (off > size()) break; // Argh - file size changed
 
-    if (off >= nextReport) {
+    if (report && off >= nextReport) {
       c->reporter.scanningFile(this, off);
       nextReport += REPORT_INTERVAL;
     }
@@ -357,8 +685,8 @@ const MD5* FilePart::getSumsRead(JigdoCache* c, size_t blockNr) {
         md.finishForReuse();
         debug("%1: mdLeft (0), switching to next md at off %2, left %3, "
               "writing sum#%4: %5", name, off - n + cur - buf, nn,
-              sum - sums.begin(), md.toString());
-        Paranoid(sum != sums.end());
+              sum - sums, md.toString());
+        Paranoid(sum != sums + nrOfSums);
         *sum = md;
         ++sum;
         size_t m = (nn < c->md5BlockLength ? nn : c->md5BlockLength);
@@ -368,9 +696,10 @@ const MD5* FilePart::getSumsRead(JigdoCache* c, size_t blockNr) {
       } while (nn > 0);
     }
 
-    md5Sum.update(buf, n); // Create MD5 for the whole file
+    // Create MD5 for the whole file
+    if (makeMd5Sum) fileMd.update(buf, n);
 
-    if (blockNr == 0 && sum != sums.begin()) break; // Only wanted 1st block
+    if (blockNr == 0 && sum != sums) break; // Only wanted 1st block
     if (!input) break; // End of file or error
 
     // Read more data
@@ -380,41 +709,265 @@ const MD5* FilePart::getSumsRead(JigdoCache* c, size_t blockNr) {
 
   } // Endwhile (true), will break out if error or whole file read
 
-  Paranoid(sum != sums.end() // >=1 trailing bytes
+  Paranoid(sum != sums + nrOfSums // >=1 trailing bytes
            || mdLeft == c->md5BlockLength); // 0 trailing bytes
+  if (bytesRead != 0) *bytesRead += off;
   if (off == size() && input.eof()) {
     // Whole file was read
-    c->reporter.scanningFile(this, size()); // 100% scanned
+    if (report) c->reporter.scanningFile(this, size()); // 100% scanned
     if (mdLeft < c->md5BlockLength) {
       (*sum) = md.finish(); // Digest of trailing bytes
       debug("%1: writing trailing sum#%2: %3",
-            name, sum - sums.begin(), md.toString());
+            name, sum - sums, md.toString());
     }
-    md5Sum.finish(); // Digest of whole file
+    if (makeMd5Sum) md5Sum = fileMd.finish(); // Digest of whole file
     setFlag(MD_VALID);
+    setFlag(SUMS_VALID);
     return &sums[blockNr];
-  } else if (blockNr == 0 && sum != sums.begin()) {
+  } else if (blockNr == 0 && sum != sums) {
     // Only first md5 block of file was read
     debug("%1: file header read, sum#0 written", name);
-#   if DEBUG
-    md5Sum.finish(); // else failed assert in FilePart::SerializeCacheEntry
-#   else
-    md5Sum.abort(); // Saves the memory until whole file is read
-#   endif
     return &sums[0];
   }
   //____________________
 
   // Some error happened
-  string err = subst(_("Error while reading `%1' - file will be ignored "
-                       "(%2)"), name, strerror(errno));
-  markAsDeleted(c);
-  c->reporter.error(err);
+  *err = subst(_("Error while reading `%1' - file will be ignored "
+                 "(%2)"), name, strerror(errno));
   return 0;
 }
 //______________________________________________________________________
 
-const MD5Sum* FilePart::getMD5SumRead(JigdoCache* c) {
+namespace {
+
+  /* Where the data of a file starts on disc. Files for which this cannot
+     be determined are sorted after the others on the same device, by
+     inode number, which follows the disc layout on many filesystems. */
+  struct DiscPos {
+    dev_t dev;
+    bool byInode;
+    uint64 pos; // Byte offset on the device, or inode number
+    size_t index; // Into the list of files to read
+    bool operator<(const DiscPos& x) const {
+      if (dev != x.dev) return dev < x.dev;
+      if (byInode != x.byInode) return x.byInode;
+      if (pos != x.pos) return pos < x.pos;
+      return index < x.index;
+    }
+  };
+
+  // Return true and set *pos to the offset of the file's data on disc
+# if HAVE_LINUX_FIEMAP_H
+  bool physicalStart(int fd, uint64* pos) {
+    // Room for struct fiemap and one struct fiemap_extent
+    uint64 buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / 8
+               + 1];
+    memset(buf, 0, sizeof(buf));
+    struct fiemap* map = reinterpret_cast<struct fiemap*>(buf);
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0) {
+      // Not for empty files, or data which is inline or not yet on disc
+      const struct fiemap_extent& e = map->fm_extents[0];
+      if (map->fm_mapped_extents == 0 || (e.fe_flags
+          & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_NOT_ALIGNED)) != 0)
+        return false;
+      *pos = e.fe_physical;
+      return true;
+    }
+#   ifdef FIBMAP
+    // Kernels without FIEMAP support for the filesystem; needs root
+    int blockSize = 0, block = 0;
+    if (ioctl(fd, FIGETBSZ, &blockSize) == 0
+        && ioctl(fd, FIBMAP, &block) == 0 && block != 0) {
+      *pos = implicit_cast<uint64>(block) * blockSize;
+      return true;
+    }
+#   endif
+    return false;
+  }
+# else
+  bool physicalStart(int, uint64*) { return false; }
+# endif
+
+  /* Store in order the indexes of files[] in the order of their data on
+     disc. Returns the nr of files whose disc position is known. */
+  size_t discOrder(const vector<FilePart*>& files, vector<size_t>& order) {
+    vector<DiscPos> discPos(files.size());
+    size_t known = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+      DiscPos& p = discPos[i];
+      p.dev = 0; p.byInode = true; p.pos = 0; p.index = i;
+      string name(files[i]->getPath());
+      name += files[i]->leafName();
+      int fd = open(name.c_str(), O_RDONLY);
+      if (fd == -1) continue; // Reading it will fail and report the error
+      struct stat st;
+      if (fstat(fd, &st) == 0) {
+        p.dev = st.st_dev;
+        p.pos = st.st_ino;
+      }
+      if (physicalStart(fd, &p.pos)) {
+        p.byInode = false;
+        ++known;
+      }
+      close(fd);
+    }
+    sort(discPos.begin(), discPos.end());
+    order.resize(files.size());
+    for (size_t i = 0; i < files.size(); ++i) order[i] = discPos[i].index;
+    return known;
+  }
+
+  /* Ask the kernel to start reading the first len bytes of file, so that
+     a rotating disc can serve several requests in one sweep */
+# if HAVE_POSIX_FADVISE
+  void willNeed(const FilePart* file, size_t len) {
+    string name(file->getPath());
+    name += file->leafName();
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+# else
+  void willNeed(const FilePart*, size_t) { }
+# endif
+
+  // Current wall clock time in milliseconds
+  uint64 nowMs() {
+    struct timeval t;
+    gettimeofday(&t, 0);
+    return implicit_cast<uint64>(t.tv_sec) * 1000 + t.tv_usec / 1000;
+  }
+
+} // namespace
+
+/* One of the threads of JigdoCache::readAheadSums(). All threads share
+   the list of files, the order in which to read them and the position of
+   the next one in that order; each has its own read buffer. */
+class JigdoCache::ReadAhead : public Thread {
+public:
+  ReadAhead(JigdoCache* c, vector<FilePart*>& f, const vector<size_t>& o,
+            vector<string>& e, size_t& n, Mutex& m)
+    : cache(c), files(f), order(o), errors(e), next(n), mutex(m),
+      bytes(0) { }
+  // Process files until none are left
+  void work() {
+    vector<byte> buffer(cache->readAmount > cache->md5BlockLength ?
+                        cache->readAmount : cache->md5BlockLength);
+    while (true) {
+      size_t k;
+      {
+        MutexLock lock(mutex);
+        if (next == files.size()) return;
+        k = next++;
+      }
+      // Keep the next few files' reads queued ahead of this one
+      size_t j = (k == 0 ? 1 : k + WILLNEED_AHEAD);
+      for (; j <= k + WILLNEED_AHEAD && j < files.size(); ++j)
+        willNeed(files[order[j]], buffer.size());
+      size_t i = order[k];
+      files[i]->getSumsReadFile(cache, 0, buffer, false, &errors[i], &bytes);
+    }
+  }
+  // Nr of bytes read by work()
+  uint64 bytesRead() const { return bytes; }
+protected:
+  virtual void run() { work(); }
+private:
+  static const size_t WILLNEED_AHEAD = 16;
+  JigdoCache* cache;
+  vector<FilePart*>& files;
+  const vector<size_t>& order;
+  vector<string>& errors;
+  size_t& next;
+  Mutex& mutex;
+  uint64 bytes;
+};
+
+void JigdoCache::readAheadSums() {
+  // Files whose sums are neither known nor in the cache file
+  vector<FilePart*> toRead;
+  for (deque<FilePart>::iterator i = files.begin(), e = files.end();
+       i != e; ++i) {
+    if (i->deleted() || i->rsyncValid()) continue;
+    if (!i->getSumsCached(this, 0)) toRead.push_back(&*i);
+  }
+  readStatsVal = ReadStats();
+  if (toRead.empty()) return;
+  uint64 start = nowMs();
+
+  vector<size_t> order;
+  readStatsVal.files = toRead.size();
+  readStatsVal.ordered = discOrder(toRead, order);
+  vector<string> errors(toRead.size());
+  size_t next = 0;
+  Mutex mutex;
+  size_t nrThreads = threads;
+  if (nrThreads > toRead.size()) nrThreads = toRead.size();
+  debug("readAheadSums: %1 files (%2 by disc position), %3 threads",
+        toRead.size(), readStatsVal.ordered, nrThreads);
+
+  /* Start nrThreads-1 extra threads and also work on this one. If a
+     thread cannot be created, the remaining ones pick up its work. */
+  vector<ReadAhead*> workers;
+  for (size_t t = 1; t < nrThreads; ++t) {
+    ReadAhead* w = new ReadAhead(this, toRead, order, errors, next, mutex);
+    if (w->start() == FAILURE) { delete w; break; }
+    workers.push_back(w);
+  }
+  ReadAhead self(this, toRead, order, errors, next, mutex);
+  self.work();
+  readStatsVal.bytes = self.bytesRead();
+  for (vector<ReadAhead*>::iterator i = workers.begin(), e = workers.end();
+       i != e; ++i) {
+    (*i)->join();
+    readStatsVal.bytes += (*i)->bytesRead();
+    delete *i;
+  }
+  readStatsVal.wall = nowMs() - start;
+  debug("readAheadSums: %1 bytes in %2 ms", readStatsVal.bytes,
+        readStatsVal.wall);
+
+  // Report results in the same order as a serial scan would
+  for (size_t i = 0; i < toRead.size(); ++i) {
+    FilePart* file = toRead[i];
+    if (errors[i].empty()) {
+      sumsWritten(file);
+      queueWrite(file);
+      if (file->sumsValid()) reporter.scanningFile(file, file->size());
+      continue;
+    }
+    file->markAsDeleted(this);
+    reporter.error(errors[i]); // might throw
+  }
+}
+
+string& JigdoCache::ReadStats::appendJsonFields(string& s) const {
+  s += "\"files_read\":"; append(s, files);
+  s += ",\"files_ordered\":"; append(s, ordered);
+  s += ",\"file_bytes\":"; append(s, bytes);
+  s += ",\"file_bytes_per_s\":"; append(s, bytesPerSec());
+  return s;
+}
+
+string& JigdoCache::ReadStats::appendJson(string& s) const {
+  s += '{';
+  appendJsonFields(s);
+  s += ",\"wall_ms\":"; append(s, wall);
+  return s += '}';
+}
+//______________________________________________________________________
+
+const MD5* FilePart::getMD5SumRead(JigdoCache* c) {
+  if (nrOfSums == 0) {
+    /* The cache file might have the whole file's md5 sum, from an entry
+       for other parameters. nrOfSums must be 0 again if nothing was
+       loaded; getSumsRead() then reuses the memory of sums[]. */
+    if (!getSumsCached(c, 0)) nrOfSums = 0;
+    if (mdValid()) return &md5Sum;
+  }
   if (getSumsRead(c,
                   (fileSize + c->md5BlockLength - 1) / c->md5BlockLength - 1)
       == 0) return 0;
@@ -426,12 +979,23 @@ const MD5Sum* FilePart::getMD5SumRead(JigdoCache* c) {
 void JigdoCache::setParams(size_t blockLen, size_t md5BlockLen) {
   if (blockLen == blockLength && md5BlockLen == md5BlockLength) return;
 
+  size_t oldMd5BlockLen = md5BlockLength;
   blockLength = blockLen;
   md5BlockLength = md5BlockLen;
   Assert(blockLength <= md5BlockLength);
-  for (list<FilePart>::iterator file = files.begin(), end = files.end();
+  /* Look up the files in the cache file again, it may have sums for
+     the new parameters. The whole file's md5 sum stays valid. sumArena
+     cannot free the sums, so they are overwritten unless there are now
+     more blocks than they have room for. */
+  for (deque<FilePart>::iterator file = files.begin(), end = files.end();
        file != end; ++file) {
-    file->sums.resize(0);
+    if (oldMd5BlockLen == 0
+        || (file->fileSize + md5BlockLen - 1) / md5BlockLen
+           > (file->fileSize + oldMd5BlockLen - 1) / oldMd5BlockLen)
+      file->sums = 0;
+    file->nrOfSums = 0;
+    file->clearFlag(FilePart::SUMS_VALID);
+    file->clearFlag(FilePart::WAS_LOOKED_UP);
   }
 }
 //______________________________________________________________________
@@ -487,6 +1051,132 @@ void JigdoCache::addFile(const string& name) {
   Paranoid(i != locationPaths.end());
 
   // Append new obj at end of list
-  FilePart fp(i, nameRest, fileInfo.st_size, fileInfo.st_mtime);
+  /* With checkFiles, fileInfo is from the stat() which RecurseDir does
+     anyway to detect files it has already visited */
+  uint64 id = 0;
+  if (checkFiles) id = CacheFile::fileId(fileInfo.st_dev, fileInfo.st_ino);
+  /* Many files share the same directory, so it is only stored once. The
+     elements of a set<> never move. */
+  FilePart::Dir dir;
+  dir.path = i;
+  string::size_type dirLen = nameRest.rfind(DIRSEP) + 1; // 0 if npos
+  dir.name.assign(nameRest, 0, dirLen);
+  const FilePart::Dir* d = &*dirs.insert(dir).first;
+  const char* leaf = storeLeafName(nameRest.substr(dirLen));
+  FilePart fp(d, leaf, fileInfo.st_size, fileInfo.st_mtime, id);
   files.push_back(fp);
 }
+//______________________________________________________________________
+
+JigdoCache::Arena::~Arena() {
+  for (vector<Chunk>::iterator i = chunks.begin(), e = chunks.end();
+       i != e; ++i) {
+#   if HAVE_MMAP
+    if (i->mapped) { munmap(i->data, i->len); continue; }
+#   endif
+    delete[] i->data;
+  }
+  if (fd != -1) close(fd);
+}
+
+byte* JigdoCache::Arena::alloc(size_t n) {
+  if (n <= left) {
+    byte* result = next;
+    next += n;
+    left -= n;
+    return result;
+  }
+  /* A large request gets a heap chunk of its own, but a file-backed
+     chunk may be larger than requested. Continue with whichever of the
+     new and the current chunk has more room left. */
+  size_t len = (n > CHUNK_SIZE / 4 ? n : CHUNK_SIZE);
+  byte* result = newChunk(len);
+  if (len - n > left) {
+    next = result + n;
+    left = len - n;
+  }
+  return result;
+}
+
+byte* JigdoCache::Arena::newChunk(size_t& n) {
+# if HAVE_MMAP
+  if (useFile && fd == -1) {
+    useFile = false; // Only try once
+    const char* dir = getenv("TMPDIR");
+    string name = (dir != 0 && *dir != '\0' ? dir : "/tmp");
+    name += "/jigdo-file.XXXXXX";
+    vector<char> tmpl(name.begin(), name.end());
+    tmpl.push_back('\0');
+    fd = mkstemp(&tmpl[0]);
+    if (fd == -1) {
+      debug("Arena: Cannot create %1: %2", &tmpl[0], strerror(errno));
+    } else {
+      debug("Arena: Chunks in %1", &tmpl[0]);
+      useFile = true;
+      unlink(&tmpl[0]); // Goes away when closed, also if we crash
+    }
+  }
+  if (useFile) {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t len = (max(n, mapSize) + page - 1) / page * page;
+    /* Write access to a page for which the disc has no room would kill
+       us with SIGBUS, so allocate the space now if possible. */
+#   if HAVE_POSIX_FALLOCATE
+    int err = posix_fallocate(fd, fileSize, len);
+#   else
+    int err = (ftruncate(fd, fileSize + len) == 0 ? 0 : errno);
+#   endif
+    void* m = MAP_FAILED;
+    if (err == 0) {
+      m = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, fileSize);
+      if (m == MAP_FAILED) err = errno;
+    }
+    if (m != MAP_FAILED) {
+      fileSize += len;
+      if (mapSize < MAX_MAP_SIZE) mapSize *= 2;
+      Chunk c = { static_cast<byte*>(m), len, true, false };
+      chunks.push_back(c);
+      n = len;
+      return c.data;
+    }
+    // Existing mappings stay valid after close()
+    debug("Arena: Cannot extend file: %1", strerror(err));
+    close(fd);
+    fd = -1;
+    useFile = false;
+  }
+# endif
+  Chunk c = { new byte[n], n, false, false };
+  chunks.push_back(c);
+  return c.data;
+}
+
+void JigdoCache::Arena::written(const byte* p, size_t n) {
+# if HAVE_MMAP && HAVE_MADVISE
+  // Usually, p is in one of the most recent chunks
+  for (vector<Chunk>::reverse_iterator i = chunks.rbegin(),
+         e = chunks.rend(); i != e; ++i) {
+    if (p < i->data || p >= i->data + i->len) continue;
+    if (i->mapped) i->dirty = true;
+    break;
+  }
+  sinceTrim += n;
+  if (sinceTrim < TRIM_AMOUNT) return;
+  sinceTrim = 0;
+  /* For a shared mapping, this only unmaps the pages; their data is kept
+     in the page cache and in the file. */
+  for (vector<Chunk>::iterator i = chunks.begin(), e = chunks.end();
+       i != e; ++i) {
+    if (!i->dirty) continue;
+    madvise(i->data, i->len, MADV_DONTNEED);
+    i->dirty = false;
+  }
+# endif
+}
+
+const char* JigdoCache::storeLeafName(const string& s) {
+  char* result = reinterpret_cast<char*>(nameArena.alloc(s.length() + 1));
+  memcpy(result, s.c_str(), s.length() + 1);
+  return result;
+}
+
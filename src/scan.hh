@@ -18,7 +18,7 @@
 
 #include <config.h>
 
-#include <list>
+#include <deque>
 #include <set>
 #include <vector>
 #include <time.h>
@@ -27,10 +27,12 @@
 #include <cachefile.hh>
 #include <debug.hh>
 #include <md5sum.hh>
+#include <nocopy.hh>
 #include <recursedir.fh>
 #include <rsyncsum.hh>
 #include <scan.fh>
 #include <string.hh>
+#include <thread.hh>
 //______________________________________________________________________
 
 /** First part of the filename of a "part", a directory on the local
@@ -74,17 +76,17 @@ class FilePart {
 public:
   /** Sort FileParts by RsyncSum of first bytes */
   inline const string& getPath() const;
-  LocationPathSet::iterator getLocation() { return path; }
+  LocationPathSet::iterator getLocation() { return dir->path; }
   /** @return The further dir names and the leafname, after what getPath()
       returns. */
-  inline const string& leafName() const;
+  inline string leafName() const;
   inline uint64 size() const;
   inline time_t mtime() const;
   /** Returns null ptr if error and you don't throw it in your
       JigdoCache error handler */
   inline const MD5* getSums(JigdoCache* c, size_t blockNr);
   /** Returns null ptr if error and you don't throw it */
-  inline const MD5Sum* getMD5Sum(JigdoCache* c);
+  inline const MD5* getMD5Sum(JigdoCache* c);
   /** Returns null ptr if error and you don't throw it */
   inline const RsyncSum64* getRsyncSum(JigdoCache* c);
 
@@ -100,48 +102,82 @@ public:
       failed, or other reasons. */
   bool deleted() const { return fileSize == 0; }
 
-  /** Do not call - this is public only because list<> must be able to
+  /** Do not call - this is public only because deque<> must be able to
       delete FileParts */
   ~FilePart() { }
   // default copy ctor / assignment op
   //__________
 
 private:
-  inline FilePart(LocationPathSet::iterator p, string rest, uint64 fSize,
-                  time_t fMtime);
+  // Location and further dir names, shared by the files in a directory
+  struct Dir {
+    LocationPathSet::iterator path;
+    string name; // Dir names after path, ending with DIRSEP, or ""
+    bool operator<(const Dir& d) const {
+      if (&*path != &*d.path) return &*path < &*d.path;
+      return name < d.name;
+    }
+  };
+
+  inline FilePart(const Dir* d, const char* leaf, uint64 fSize,
+                  time_t fMtime, uint64 fId);
 
   /* Called when the methods getSums/getMD5Sum() need data read from
      file. Might return null. */
   const MD5* getSumsRead(JigdoCache* c, size_t blockNr);
-  const MD5Sum* getMD5SumRead(JigdoCache* c);
+  const MD5* getMD5SumRead(JigdoCache* c);
+  /* Resize sums[] and, if possible, load them from the cache file.
+     Returns true if the cache contained all data needed for blockNr. */
+  bool getSumsCached(JigdoCache* c, size_t blockNr);
+  /* Only calculate rsyncSum, by reading the first blockLength bytes of
+     the file. Returns false on error, without reporting it. */
+  bool getRsyncSumReadFile(const JigdoCache* c);
+  /* Read the file into buffer and calculate the sums. Only reads the
+     parameters of c, so can be called concurrently for different
+     FileParts. Progress is only reported if report is true. On error,
+     returns null and stores a message in err - the caller must
+     markAsDeleted() and report it. If bytesRead is non-null, the number
+     of bytes read from the file is added to it. */
+  const MD5* getSumsReadFile(const JigdoCache* c, size_t blockNr,
+                             vector<byte>& buffer, bool report, string* err,
+                             uint64* bytesRead = 0);
   //__________
 
   /* There are 3 states of a FilePart:
-     a) sums.empty(): File has not been read from so far
-     b) !sums.empty() && !mdValid: sums[0] and rsyncSum are valid
-     c) !sums.empty() && mdValid: all sums[] and rsyncSum and md5Sum valid*/
-
-  LocationPathSet::iterator path;
-  string pathRest; // further dir names after "path", and leafname of file
+     a) nrOfSums == 0: File has not been read from so far
+     b) nrOfSums > 0 && !sumsValid: sums[0] and rsyncSum are valid
+     c) nrOfSums > 0 && sumsValid: all sums[] and rsyncSum valid
+     Independently of this, md5Sum is valid if mdValid. */
+
+  /* Both are owned by JigdoCache, so that there is no allocation per
+     FilePart. leafName() returns dir->name + pathLeaf. */
+  const Dir* dir;
+  const char* pathLeaf; // leafname of file
   uint64 fileSize;
   time_t fileMtime;
+  // Device/inode, to find the cache entry if the file was renamed
+  uint64 fileId;
 
   /* RsyncSum64 of the first MkTemplate::blockLength bytes of the
      file. */
   RsyncSum64 rsyncSum;
-  bool rsyncValid() const { return sums.size() > 0; }
+  bool rsyncValid() const { return nrOfSums > 0; }
 
   /* File is split up into chunks of length md5BlockLength (the last
-     one may be smaller) and the MD5 checksum of each is
-     calculated. */
-  vector<MD5> sums;
+     one may be smaller) and the MD5 checksum of each is calculated.
+     The nrOfSums entries are allocated from JigdoCache::sumArena and
+     only freed with the JigdoCache. If sums is not null, it has room
+     for the blocks of the current md5BlockLength even if nrOfSums is 0,
+     so the memory can be used again. */
+  MD5* sums;
 
   /* Hash of complete file contents. mdValid is true iff md5Sum is
      cached and valid. NB, it is possible that mdValid==true, but
-     sums.size()==0, after md5BlockSize has been changed. If
-     sums.size()==fileSize/md5ChunkSize, then not necessarily
-     mdValid==true */
-  MD5Sum md5Sum;
+     nrOfSums==0, after md5BlockSize has been changed, or that only
+     sums[0] is valid, if the cache file had the whole file's sum from
+     an entry for other parameters. */
+  MD5 md5Sum;
+  uint32 nrOfSums;
   enum Flags {
     EMPTY = 0,
     // Bit flag is set iff md5Sum contains the whole file's md5 sum
@@ -150,26 +186,41 @@ private:
        or not doesn't matter) - don't look it up again. */
     WAS_LOOKED_UP = 2,
     // Write this file's info into the cache file during ~JigdoCache()
-    TO_BE_WRITTEN = 4
+    TO_BE_WRITTEN = 4,
+    // Bit flag is set iff all entries of sums[] are valid
+    SUMS_VALID = 8
   };
   Flags flags;
   bool getFlag(Flags f) const { return (flags & f) != 0; }
   inline void setFlag(Flags f);
   inline void clearFlag(Flags f);
   bool mdValid() const { return getFlag(MD_VALID); }
+  bool sumsValid() const { return getFlag(SUMS_VALID); }
 
-# if HAVE_LIBDB
   // Offsets for binary representation in database (see cachefile.hh)
   enum {
     BLOCKLEN = 0, MD5BLOCKLEN = 4, MD5BLOCKS = 8, RSYNCSUM = 12,
-    FILE_MD5SUM = 20, PART_MD5SUM = 36
+    FILE_MD5SUM = 20, PART_MD5SUM = 36,
+    // In the further parameter sets, which have no FILE_MD5SUM
+    SET_MD5SUM = 20
+  };
+  // Max nr of parameter sets in one cache entry
+  static const size_t MAX_PARAM_SETS = 4;
+  // One parameter set of a cache entry
+  struct ParamSet {
+    size_t blockLength, md5BlockLength, blocks;
+    const byte* data; // Start of set, with blockLength etc.
+    const byte* sums; // MD5 sums of the blocks
   };
+  /* Split cache entry into its parameter sets. Returns false if the
+     entry looks broken. */
+  static bool parseCacheEntry(const byte* data, size_t dataSize,
+                              uint64 fileSize, vector<ParamSet>& result);
 
   size_t unserializeCacheEntry(const byte* data, size_t dataSize,
-      size_t md5BlockLength); // Byte stream => FilePart
+      size_t blockLength, size_t md5BlockLength); // Byte stream => FilePart
   struct SerializeCacheEntry; // FilePart => byte stream
   friend struct SerializeCacheEntry;
-# endif
 };
 //______________________________________________________________________
 
@@ -214,7 +265,8 @@ public:
       are not the same as the old, the start of the files will
       (eventually) have to be re-read to re-calculate the checksums
       for blockLength, and the *whole* file will have to be re-read
-      for a changed md5BlockLength. */
+      for a changed md5BlockLength - unless the cache file has sums for
+      the new parameters, too. */
   void setParams(size_t blockLen,size_t md5BlockLen);
   size_t getBlockLen() const { return blockLength; }
   size_t getMD5BlockLen() const { return md5BlockLength; }
@@ -228,6 +280,36 @@ public:
       re-opened/re-allocated automatically if/when needed. */
   void deallocBuffer() { buffer.resize(0); }
 
+  /** Number of threads to use for readAheadSums(), default 1 */
+  void setThreads(unsigned n) { threads = (n == 0 ? 1 : n); }
+  unsigned getThreads() const { return threads; }
+  /** Make sure that the RsyncSum64 of the first blockLength bytes and
+      the MD5 sum of the first md5BlockLength bytes are available for
+      all files, reading getThreads() files in parallel, each with its
+      own buffer. Has the same effect as calling
+      FilePart::getRsyncSum() for each file in turn, including the
+      reporting of errors, which happens in list order once all files
+      have been read. However, the files are read in the order of
+      their data on disc if that can be determined, to avoid seeks on
+      rotating discs. */
+  void readAheadSums();
+  /** Counters of the last readAheadSums(), to measure the throughput it
+      achieves: Nr of files read and how many of them could be ordered by
+      their disc position (the rest is ordered by inode number), bytes
+      read and wall clock time in milliseconds. */
+  struct ReadStats {
+    ReadStats() : files(0), ordered(0), bytes(0), wall(0) { }
+    size_t files, ordered;
+    uint64 bytes, wall;
+    uint64 bytesPerSec() const { return wall == 0 ? bytes : bytes*1000/wall; }
+    /** Append as one line of JSON to s */
+    string& appendJson(string& s) const;
+    /** Append the fields without wall time and braces, for use in the
+        make-template stats, so both use the same names */
+    string& appendJsonFields(string& s) const;
+  };
+  const ReadStats& readStats() const { return readStatsVal; }
+
   /** Return reporter supplied by JigdoCache creator */
   ProgressReporter* getReporter() { return &reporter; }
 
@@ -262,30 +344,87 @@ public:
   public:
     iterator() { }
     inline iterator& operator++(); // might throw(RecurseError, bad_alloc)
-    FilePart& operator*() { return *part; }
-    FilePart* operator->() { return &*part; }
+    FilePart& operator*() { return cache->files[part]; }
+    FilePart* operator->() { return &cache->files[part]; }
     // Won't compare cache members - their being different is usu. a bug
     bool operator==(const iterator& i) const {
       Paranoid(cache == i.cache);
-      return part == i.part;
+      return part == i.part || (atEnd() && i.atEnd());
     }
     bool operator!=(const iterator& i) const { return !(*this == i); }
     // Default dtor
   private:
-    iterator(JigdoCache* c, const list<FilePart>::iterator& p)
-      : cache(c), part(p) { }
+    iterator(JigdoCache* c, size_t p) : cache(c), part(p) { }
+    bool atEnd() const { return part >= cache->files.size(); }
     JigdoCache* cache;
-    list<FilePart>::iterator part;
+    size_t part; // Index in cache->files, or END
   };
   friend class JigdoCache::iterator;
   /** First element of the JigdoCache */
   inline iterator begin();
   /** NB the list auto-extends, so the value of end() may change while
       you iterate over a JigdoCache. */
-  iterator end() { return iterator(this, files.end()); }
+  iterator end() { return iterator(this, END); }
   //____________________
 
 private:
+  class ReadAhead;
+  friend class ReadAhead;
+  class WriteBack;
+  friend class WriteBack;
+  /* Hand the cache entry of a file whose sums were just read to
+     writeBack, which commits entries to the cache file in batches */
+  void queueWrite(FilePart* file);
+  /* Create the cache entry of a file, keeping the sums for other
+     parameters from its current entry in the cache file, if any */
+  void serializeEntry(const FilePart& file, vector<byte>& data);
+  // Account for the sums of file having been filled in, see Arena
+  void sumsWritten(const FilePart* file);
+  /* Memory for many small objects which are only freed all at once, by
+     the dtor. Not thread-safe. */
+  class Arena : NoCopy {
+  public:
+    Arena() : chunks(), next(0), left(0), useFile(false), fd(-1),
+              fileSize(0), mapSize(CHUNK_SIZE), sinceTrim(0) { }
+    ~Arena();
+    // Return n bytes of memory, not aligned in any way
+    byte* alloc(size_t n);
+    /* Take further chunks from a mapped temporary file in $TMPDIR rather
+       than the heap, if mmap() is available. The file is only created
+       once the first chunk is needed. If it cannot be created or grown,
+       the heap is used instead. */
+    void useTempFile() { useFile = true; }
+    /* Tell the arena that the n bytes at p, returned by alloc(), have
+       been written. After every TRIM_AMOUNT bytes, the pages of those
+       file-backed chunks which were written since the last time are
+       dropped from the process; the kernel writes them to the file when
+       memory is short, and pages them in again when they are accessed. */
+    void written(const byte* p, size_t n);
+  private:
+    static const size_t CHUNK_SIZE = 256*1024;
+    /* File-backed chunks start at CHUNK_SIZE and double in size up to
+       this, so a large pool does not need thousands of mappings */
+    static const size_t MAX_MAP_SIZE = 64*1024*1024;
+    static const size_t TRIM_AMOUNT = 4*1024*1024;
+    struct Chunk {
+      byte* data;
+      size_t len;
+      bool mapped; // Else allocated with new[]
+      bool dirty; // Mapped and written since the last trim
+    };
+    // Add a chunk of at least n bytes, set n to its actual size
+    byte* newChunk(size_t& n);
+    vector<Chunk> chunks;
+    byte* next;
+    size_t left;
+    bool useFile;
+    int fd; // Temporary file, or -1 if not (yet) open
+    off_t fileSize;
+    size_t mapSize; // Size of next file-backed chunk
+    size_t sinceTrim;
+  };
+  // Return copy of s in nameArena
+  const char* storeLeafName(const string& s);
   // Read one filename from recurseDir and (if success) add entry to "files"
   void addFile(const string& name);
   /// Default reporter: Only prints error messages to stderr
@@ -298,8 +437,9 @@ private:
 
   /* List of files in the cache (not vector<> because jigdo-file keeps
      ptrs, and if a vector realloc()s, all elements' addresses may
-     change) */
-  list<FilePart> files;
+     change - deque<>::push_back() does not move elements) */
+  deque<FilePart> files;
+  static const size_t END = ~static_cast<size_t>(0);
   // Equal to files.size() less any files that are deleted()
   size_t nrOfFiles;
   // Temporarily used during readFilenames()
@@ -311,11 +451,17 @@ private:
   size_t readAmount;
   vector<byte> buffer;
   ProgressReporter& reporter;
+  unsigned threads;
+  ReadStats readStatsVal;
+
+  Arena nameArena; // For FilePart::pathLeaf
+  set<FilePart::Dir> dirs; // For FilePart::dir
+  Arena sumArena; // For FilePart::sums
 
-# if HAVE_LIBDB
   CacheFile* cacheFile;
   size_t cacheExpiry;
-# endif
+  WriteBack* writeBack; // Null if no cacheFile
+  Mutex cacheMutex; // Locked while accessing cacheFile
 };
 //______________________________________________________________________
 
@@ -346,21 +492,22 @@ public:
 };
 //______________________________________________________________________
 
-FilePart::FilePart(LocationPathSet::iterator p, string rest, uint64 fSize,
-                   time_t fMtime)
-  : path(p), pathRest(rest), fileSize(fSize), fileMtime(fMtime),
-    rsyncSum(), sums(), md5Sum(), flags(EMPTY) {
-  //pathRest.reserve(0);
-}
+FilePart::FilePart(const Dir* d, const char* leaf, uint64 fSize,
+                   time_t fMtime, uint64 fId)
+  : dir(d), pathLeaf(leaf), fileSize(fSize), fileMtime(fMtime),
+    fileId(fId), rsyncSum(), sums(0), md5Sum(), nrOfSums(0),
+    flags(EMPTY) { }
 
 const string& FilePart::getPath() const {
   Paranoid(!deleted());
-  return path->getPath();
+  return dir->path->getPath();
 }
 
-const string& FilePart::leafName() const {
+string FilePart::leafName() const {
   Paranoid(!deleted());
-  return pathRest;
+  string result(dir->name);
+  result += pathLeaf;
+  return result;
 }
 
 uint64 FilePart::size() const {
@@ -375,11 +522,11 @@ time_t FilePart::mtime() const {
 
 const MD5* FilePart::getSums(JigdoCache* c, size_t blockNr) {
   Paranoid(!deleted());
-  if (mdValid() || (blockNr == 0 && !sums.empty())) return &sums[blockNr];
+  if (sumsValid() || (blockNr == 0 && nrOfSums > 0)) return &sums[blockNr];
   else return getSumsRead(c, blockNr);
 }
 
-const MD5Sum* FilePart::getMD5Sum(JigdoCache* c) {
+const MD5* FilePart::getMD5Sum(JigdoCache* c) {
   Paranoid(!deleted());
   if (mdValid()) return &md5Sum;
   else return getMD5SumRead(c);
@@ -395,7 +542,7 @@ const RsyncSum64* FilePart::getRsyncSum(JigdoCache* c) {
 }
 
 void FilePart::markAsDeleted(JigdoCache* c) {
-  fileSize = 0; sums.resize(0); --(c->nrOfFiles);
+  fileSize = 0; nrOfSums = 0; --(c->nrOfFiles);
 }
 
 void FilePart::setFlag(Flags f) {
@@ -421,34 +568,34 @@ void JigdoCache::readFilenames(RecurseDir& rd) {
     bool status = rd.getName(name, &fileInfo, checkFiles); // Might throw error
     if (status == FAILURE) return; // No more names
     off_t stSize = fileInfo.st_size;
-#   if HAVE_LIBDB
     if (!checkFiles) {
       const byte* data;
       size_t dataSize;
+      MutexLock lock(cacheMutex);
       try {
         if (cacheFile->findName(data, dataSize, name, stSize,
                                 fileInfo.st_mtime).failed())
           continue;
+        fileInfo.st_size = stSize;
       } catch (DbError e) {
         string err = subst(_("Error accessing cache: %1"), e.message);
         reporter.error(err);
       }
     }
-#   endif
     if (stSize == 0) continue; // Skip zero-length files
     addFile(name);
   }
 }
 
 JigdoCache::iterator JigdoCache::begin() {
-  list<FilePart>::iterator i = files.begin();
-  while (i != files.end() && i->deleted()) ++i;
+  size_t i = 0;
+  while (i < files.size() && files[i].deleted()) ++i;
   return iterator(this, i);
 }
 
 JigdoCache::iterator& JigdoCache::iterator::operator++() {
-  list<FilePart>::iterator end = cache->files.end();
-  do ++part; while (part != end && part->deleted());
+  size_t end = cache->files.size();
+  do ++part; while (part < end && cache->files[part].deleted());
   return *this;
 }
 //______________________________________________________________________
@@ -0,0 +1,159 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Microbenchmark for rolling the RsyncSum64 over a buffer, as done by
+  make-template while scanning the image. Not run by "make test"; build
+  it with "make util/rsyncsum-bench" and run it as
+
+    util/rsyncsum-bench [MEGABYTES [WINDOW]]
+
+  #test-deps util/rsyncsum.o
+
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <rsyncsum.hh>
+//______________________________________________________________________
+
+namespace {
+
+  // Number of checksums calculated in one RsyncScanner::roll() call
+  const size_t BATCH = 32;
+
+  double now() {
+    struct timeval t;
+    gettimeofday(&t, 0);
+    return t.tv_sec + t.tv_usec / 1e6;
+  }
+
+  void report(const char* name, size_t bytes, double seconds, uint32 x) {
+    cout << "  " << name << ": " << (bytes / seconds / 1e6) << " MB/s"
+         << " (" << seconds << " s, check " << x << ')' << endl;
+  }
+
+  // Byte-at-a-time rolling, like in MkTemplate::scanImage()
+  void benchSingle(const vector<byte>& buf, size_t window) {
+    RsyncSum64 sum(&buf[0], window);
+    size_t count = buf.size() - window;
+    uint32 x = 0;
+    double start = now();
+    for (size_t i = 0; i < count; ++i) {
+      sum.removeFront(buf[i], window).addBack(buf[window + i]);
+      x += sum.getHi();
+    }
+    report("byte-at-a-time", count, now() - start, x);
+  }
+
+  void benchScanner(const vector<byte>& buf, size_t window,
+                    RsyncScanner::Kernel k) {
+    RsyncScanner scanner(window, k);
+    if (scanner.kernel() != k) {
+      cout << "  " << RsyncScanner::kernelName(k)
+           << ": not supported" << endl;
+      return;
+    }
+    RsyncSum64 sum(&buf[0], window);
+    size_t count = buf.size() - window;
+    uint32 lo[BATCH], hi[BATCH];
+    uint32 x = 0;
+    double start = now();
+    for (size_t i = 0; i < count; i += BATCH) {
+      size_t n = (count - i < BATCH ? count - i : BATCH);
+      scanner.roll(&sum, &buf[i], &buf[window + i], n, lo, hi);
+      for (size_t j = 0; j < n; ++j) x += hi[j];
+    }
+    report(RsyncScanner::kernelName(k), count, now() - start, x);
+  }
+
+}
+//________________________________________
+
+  /* Searching for checksums whose masked high 32 bits are in a bitmap,
+     with a density of one bit in 1024 */
+  const uint32 MASK = (1U << 20) - 1;
+
+  void makeBitmap(vector<uint32>* bitmap) {
+    bitmap->assign(MASK / 32 + 1, 0);
+    for (uint32 i = 0; i < MASK; i += 1024)
+      (*bitmap)[(i * 2654435761U & MASK) / 32] |= 1U << (i % 32);
+  }
+
+  void benchFindSingle(const vector<byte>& buf, size_t window) {
+    vector<uint32> bitmap;
+    makeBitmap(&bitmap);
+    RsyncSum64 sum(&buf[0], window);
+    size_t count = buf.size() - window;
+    uint32 x = 0;
+    double start = now();
+    for (size_t i = 0; i < count; ++i) {
+      sum.removeFront(buf[i], window).addBack(buf[window + i]);
+      uint32 bit = sum.getHi() & MASK;
+      if ((bitmap[bit / 32] & (1U << (bit % 32))) != 0)
+        x += static_cast<uint32>(i);
+    }
+    report("find, byte-at-a-time", count, now() - start, x);
+  }
+
+  void benchFind(const vector<byte>& buf, size_t window,
+                 RsyncScanner::Kernel k) {
+    RsyncScanner scanner(window, k);
+    if (scanner.kernel() != k) return;
+    vector<uint32> bitmap;
+    makeBitmap(&bitmap);
+    RsyncSum64 sum(&buf[0], window);
+    size_t count = buf.size() - window;
+    uint32 x = 0;
+    double start = now();
+    size_t i = 0;
+    while (i < count) {
+      i += scanner.find(&sum, &buf[i], &buf[window + i], count - i,
+                        &bitmap[0], MASK);
+      uint32 bit = sum.getHi() & MASK;
+      if ((bitmap[bit / 32] & (1U << (bit % 32))) != 0)
+        x += static_cast<uint32>(i - 1);
+    }
+    string name = "find, ";
+    name += RsyncScanner::kernelName(k);
+    report(name.c_str(), count, now() - start, x);
+  }
+
+//______________________________________________________________________
+
+int main(int argc, char* argv[]) {
+  size_t megs = (argc > 1 ? atoi(argv[1]) : 256);
+  size_t window = (argc > 2 ? atoi(argv[2]) : 4096);
+  if (megs == 0 || window == 0) {
+    cerr << "Usage: " << argv[0] << " [MEGABYTES [WINDOW]]" << endl;
+    return 1;
+  }
+
+  vector<byte> buf(megs * 1024 * 1024 + window);
+  uint32 r = 1;
+  for (size_t i = 0; i < buf.size(); ++i) {
+    r = r * 1103515245 + 12345;
+    buf[i] = static_cast<byte>(r >> 24);
+  }
+
+  cout << "Rolling over " << megs << " MB with a " << window
+       << " byte window (all checks should be equal):" << endl;
+  benchSingle(buf, window);
+  benchScanner(buf, window, RsyncScanner::SCALAR);
+  benchScanner(buf, window, RsyncScanner::SSE2);
+  benchScanner(buf, window, RsyncScanner::AVX2);
+  benchFindSingle(buf, window);
+  benchFind(buf, window, RsyncScanner::SCALAR);
+  benchFind(buf, window, RsyncScanner::SSE2);
+  benchFind(buf, window, RsyncScanner::AVX2);
+  return 0;
+}
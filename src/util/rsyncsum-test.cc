@@ -19,8 +19,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include <bstream.hh>
 #include <rsyncsum.hh>
@@ -166,6 +168,32 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  //____________________
+  // RsyncScanner must give the same results as single-byte rolling, with
+  // all kernels and for lengths which are not a multiple of the vector size
+  if (totalread > 256) {
+    const size_t window = 64;
+    const size_t count = totalread - window;
+    vector<uint32> lo(count), hi(count);
+    for (int k = RsyncScanner::SCALAR; k <= RsyncScanner::AVX2; ++k) {
+      RsyncScanner scanner(window, static_cast<RsyncScanner::Kernel>(k));
+      for (size_t step = 1; step <= 37; step += 12) {
+        RsyncSum64 roll(mem, window), batch(roll);
+        for (size_t i = 0; i < count; i += step) {
+          size_t n = min(step, count - i);
+          scanner.roll(&batch, mem + i, mem + window + i, n, &lo[i], &hi[i]);
+        }
+        bool ok = true;
+        for (size_t i = 0; i < count; ++i) {
+          roll.removeFront(mem[i], window).addBack(mem[window + i]);
+          if (lo[i] != roll.getLo() || hi[i] != roll.getHi()) ok = false;
+        }
+        error(5, ok && batch == roll
+              && roll == RsyncSum64(mem + count, window));
+      }
+    }
+  }
+
   if (errs != 0) {
     printf("%s %s\n", estr, argv[1]);
     return 1;
@@ -12,6 +12,11 @@
 */
 
 #include <config.h>
+
+#if HAVE_X86SIMD
+#  include <immintrin.h>
+#endif
+
 #include <rsyncsum.hh>
 #include <rsyncsum.ih>
 //______________________________________________________________________
@@ -115,6 +120,172 @@ RsyncSum64& RsyncSum64::removeFront(const byte* mem, size_t len,
 }
 //________________________________________
 
+namespace {
+
+  void rollScalar(const uint32* backTable, const uint32* frontTable,
+                  RsyncSum64* sum, const byte* front, const byte* back,
+                  size_t n, uint32* lo, uint32* hi) {
+    uint32 a = sum->getLo();
+    uint32 b = sum->getHi();
+    for (size_t i = 0; i < n; ++i) {
+      a = (a - backTable[front[i]] + backTable[back[i]]) & 0xffffffff;
+      b = (b - frontTable[front[i]] + a) & 0xffffffff;
+      lo[i] = a;
+      hi[i] = b;
+    }
+    sum->set(a, b);
+  }
+
+# if HAVE_X86SIMD
+  /* With d[i] = charTable[back[i]] - charTable[front[i]], the low sums are
+     the prefix sums of d, i.e. lo[i] = lo[i-1] + d[i]. Similarly, the high
+     sums are the prefix sums of lo[i] - frontTable[front[i]]. A vector of
+     prefix sums is calculated with log2(vector length) shifts and adds,
+     the last element is then carried over to the next vector. */
+
+  __attribute__((target("sse2")))
+  inline __m128i prefixSum128(__m128i x) {
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+  }
+
+  __attribute__((target("sse2")))
+  void rollSse2(const uint32* backTable, const uint32* frontTable,
+                RsyncSum64* sum, const byte* front, const byte* back,
+                size_t n, uint32* lo, uint32* hi) {
+    __m128i a = _mm_set1_epi32(sum->getLo());
+    __m128i b = _mm_set1_epi32(sum->getHi());
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      const byte* f = front + i;
+      const byte* k = back + i;
+      __m128i tf = _mm_set_epi32(backTable[f[3]], backTable[f[2]],
+                                 backTable[f[1]], backTable[f[0]]);
+      __m128i tb = _mm_set_epi32(backTable[k[3]], backTable[k[2]],
+                                 backTable[k[1]], backTable[k[0]]);
+      __m128i lf = _mm_set_epi32(frontTable[f[3]], frontTable[f[2]],
+                                 frontTable[f[1]], frontTable[f[0]]);
+      a = _mm_add_epi32(a, prefixSum128(_mm_sub_epi32(tb, tf)));
+      b = _mm_add_epi32(b, prefixSum128(_mm_sub_epi32(a, lf)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lo + i), a);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(hi + i), b);
+      a = _mm_shuffle_epi32(a, 0xff); // Broadcast last element
+      b = _mm_shuffle_epi32(b, 0xff);
+    }
+    sum->set(_mm_cvtsi128_si32(a), _mm_cvtsi128_si32(b));
+    if (i < n)
+      rollScalar(backTable, frontTable, sum, front + i, back + i, n - i,
+                 lo + i, hi + i);
+  }
+
+  __attribute__((target("avx2")))
+  inline __m256i prefixSum256(__m256i x) {
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    // So far, each 128-bit half was handled separately - add last element
+    // of lower half to all elements of upper half
+    __m256i l = _mm256_shuffle_epi32(x, 0xff);
+    return _mm256_add_epi32(x, _mm256_permute2x128_si256(l, l, 0x08));
+  }
+
+  __attribute__((target("avx2")))
+  void rollAvx2(const uint32* backTable, const uint32* frontTable,
+                RsyncSum64* sum, const byte* front, const byte* back,
+                size_t n, uint32* lo, uint32* hi) {
+    const int* bt = reinterpret_cast<const int*>(backTable);
+    const int* ft = reinterpret_cast<const int*>(frontTable);
+    const __m256i last = _mm256_set1_epi32(7);
+    __m256i a = _mm256_set1_epi32(sum->getLo());
+    __m256i b = _mm256_set1_epi32(sum->getHi());
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256i f = _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(front + i)));
+      __m256i k = _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(back + i)));
+      __m256i tf = _mm256_i32gather_epi32(bt, f, 4);
+      __m256i tb = _mm256_i32gather_epi32(bt, k, 4);
+      __m256i lf = _mm256_i32gather_epi32(ft, f, 4);
+      a = _mm256_add_epi32(a, prefixSum256(_mm256_sub_epi32(tb, tf)));
+      b = _mm256_add_epi32(b, prefixSum256(_mm256_sub_epi32(a, lf)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lo + i), a);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(hi + i), b);
+      a = _mm256_permutevar8x32_epi32(a, last); // Broadcast last element
+      b = _mm256_permutevar8x32_epi32(b, last);
+    }
+    sum->set(_mm_cvtsi128_si32(_mm256_castsi256_si128(a)),
+             _mm_cvtsi128_si32(_mm256_castsi256_si128(b)));
+    if (i < n)
+      rollScalar(backTable, frontTable, sum, front + i, back + i, n - i,
+                 lo + i, hi + i);
+  }
+# endif
+
+} // namespace
+//________________________________________
+
+RsyncScanner::RsyncScanner(size_t areaSize, Kernel k) {
+  for (int i = 0; i < 256; ++i)
+    frontTable[i] = (areaSize * RsyncSum64::charTable[i]) & 0xffffffff;
+
+  bool haveSse2 = false, haveAvx2 = false;
+# if HAVE_X86SIMD
+  // The SIMD code relies on uint32 having exactly 32 bits
+  if (sizeof(uint32) == 4) {
+    __builtin_cpu_init();
+    haveSse2 = __builtin_cpu_supports("sse2");
+    haveAvx2 = __builtin_cpu_supports("avx2");
+  }
+# endif
+  /* Without gather instructions, the table lookups make the SSE2 code
+     slower than the scalar code on some CPUs, so only use it on request. */
+  if (k == AUTO) k = (haveAvx2 ? AVX2 : SCALAR);
+  if (k == AVX2 && !haveAvx2) k = SSE2;
+  if (k == SSE2 && !haveSse2) k = SCALAR;
+
+  kern = k;
+  switch (k) {
+# if HAVE_X86SIMD
+  case AVX2: kernelFunc = &rollAvx2; break;
+  case SSE2: kernelFunc = &rollSse2; break;
+# endif
+  default: kernelFunc = &rollScalar; break;
+  }
+}
+
+size_t RsyncScanner::find(RsyncSum64* sum, const byte* front,
+                          const byte* back, size_t n, const uint32* bitmap,
+                          uint32 mask) const {
+  uint32 lo[FIND_BATCH], hi[FIND_BATCH];
+  size_t done = 0;
+  while (done < n) {
+    size_t len = (n - done < FIND_BATCH ? n - done : FIND_BATCH);
+    RsyncSum64 s = *sum;
+    roll(&s, front + done, back + done, len, lo, hi);
+    for (size_t i = 0; i < len; ++i) {
+      uint32 bit = hi[i] & mask;
+      if ((bitmap[bit / 32] & (1U << (bit % 32))) != 0) {
+        sum->set(lo[i], hi[i]);
+        return done + i + 1;
+      }
+    }
+    *sum = s;
+    done += len;
+  }
+  return n;
+}
+
+const char* RsyncScanner::kernelName(Kernel k) {
+  switch (k) {
+  case AUTO: return "auto";
+  case SCALAR: return "scalar";
+  case SSE2: return "sse2";
+  case AVX2: return "avx2";
+  }
+  return "?";
+}
+//______________________________________________________________________
+
 /* These are purely random, no patterns or anything... (I hope)
 
    I do not claim copyright for the actual numbers below, you may use them
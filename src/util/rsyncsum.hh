@@ -115,6 +115,10 @@ public:
   /** Return higher 32 bits of checksum */
   uint32 getHi() const { return sumHi; }
   RsyncSum64& reset() { sumLo = sumHi = 0; return *this; }
+  /** Set checksum to the given values, e.g. as output by RsyncScanner */
+  RsyncSum64& set(uint32 lo, uint32 hi) {
+    sumLo = lo; sumHi = hi; return *this;
+  }
   bool empty() const { return sumLo == 0 && sumHi == 0; }
 
   template<class Iterator>
@@ -124,10 +128,67 @@ public:
   inline size_t serialSizeOf() const;
 
 private:
+  friend class RsyncScanner;
   RsyncSum64& addBack2(const byte* mem, size_t len);
   static const uint32 charTable[256];
   uint32 sumLo, sumHi;
 };
+//________________________________________
+
+/** Rolls an RsyncSum64 over a buffer for a fixed window size, calculating
+    the checksums for many window positions in one go. Searching for
+    interesting checksums with find() is faster than calling removeFront()
+    and addBack() for each byte and looking at each result, because the
+    loops are free of data-dependent branches. The SIMD variants (SSE2,
+    AVX2) are picked at runtime depending on the CPU, unless another one is
+    requested. See rsyncsum-bench.cc for a comparison. */
+class RsyncScanner {
+public:
+  enum Kernel { AUTO, SCALAR, SSE2, AVX2 };
+  /** @param areaSize Size of the window, i.e. the areaSize argument for
+      RsyncSum64::removeFront()
+      @param k Which code to use. If it is not supported by the CPU (or
+      the compiler), the best supported one is used instead. */
+  explicit RsyncScanner(size_t areaSize, Kernel k = AUTO);
+
+  /** Equivalent to sum->removeFront(front[i], areaSize).addBack(back[i])
+      for i = 0..n-1, but additionally stores the value of the checksum
+      after each step i in lo[i] and hi[i]. For best speed, n should be a
+      multiple of 8. */
+  void roll(RsyncSum64* sum, const byte* front, const byte* back, size_t n,
+            uint32* lo, uint32* hi) const {
+    kernelFunc(RsyncSum64::charTable, frontTable, sum, front, back, n,
+               lo, hi);
+  }
+
+  /** Like roll(), but instead of storing all checksums, stop after the
+      first step i for which the bit number (sum->getHi() & mask) is set
+      in bitmap, a bit array of mask+1 bits. Bit j is stored in
+      bitmap[j / 32] & (1 << (j % 32)).
+      @return i + 1 for the first such step i, or n if there is none */
+  size_t find(RsyncSum64* sum, const byte* front, const byte* back,
+              size_t n, const uint32* bitmap, uint32 mask) const;
+
+  /** Return kernel actually in use, never AUTO */
+  Kernel kernel() const { return kern; }
+  /** Human-readable name of a kernel */
+  static const char* kernelName(Kernel k);
+
+private:
+  // Number of bytes find() rolls over in one go
+  static const size_t FIND_BATCH = 32;
+  /* The kernels are plain functions because the SIMD ones need to be
+     compiled with special GCC attributes. */
+  typedef void (*KernelFunc)(const uint32* backTable,
+      const uint32* frontTable, RsyncSum64* sum, const byte* front,
+      const byte* back, size_t n, uint32* lo, uint32* hi);
+
+  Kernel kern;
+  KernelFunc kernelFunc;
+  // areaSize * RsyncSum64::charTable[x], the amount removeFront(x) takes
+  // away from sumHi
+  uint32 frontTable[256];
+};
 
 INLINE ostream& operator<<(ostream& s, const RsyncSum& r);
 INLINE ostream& operator<<(ostream& s, const RsyncSum64& r);
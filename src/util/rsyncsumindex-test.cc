@@ -0,0 +1,87 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Hash table mapping RsyncSum64 values to integers
+
+  #test-deps util/rsyncsum.o util/rsyncsumindex.o
+
+*/
+
+#include <config.h>
+
+#include <vector>
+
+#include <debug.hh>
+#include <rsyncsumindex.hh>
+//______________________________________________________________________
+
+namespace {
+
+  // Checksum of the 4 bytes of x
+  RsyncSum64 sumOf(uint32 x) {
+    byte b[4] = { byte(x), byte(x >> 8), byte(x >> 16), byte(x >> 24) };
+    return RsyncSum64(b, 4);
+  }
+
+  // Return values stored for sum, in order
+  vector<uint32> lookup(RsyncSumIndex& idx, const RsyncSum64& sum) {
+    vector<uint32> result;
+    if (!idx.mayContain(sum)) return result;
+    for (size_t i = idx.first(sum); i != RsyncSumIndex::npos;
+         i = idx.next(sum, i))
+      result.push_back(idx.value(i));
+    return result;
+  }
+
+  // Insert n entries, with every 7th sum present 3 times
+  void fill(RsyncSumIndex& idx, uint32 n) {
+    for (uint32 i = 0; i < n; ++i) {
+      idx.insert(sumOf(i), i);
+      if (i % 7 == 0) {
+        idx.insert(sumOf(i), i + n);
+        idx.insert(sumOf(i), i + 2 * n);
+      }
+    }
+  }
+
+  void check(RsyncSumIndex& idx, uint32 n) {
+    for (uint32 i = 0; i < n; ++i) {
+      vector<uint32> v = lookup(idx, sumOf(i));
+      if (i % 7 == 0) {
+        Assert(v.size() == 3);
+        Assert(v[0] == i && v[1] == i + n && v[2] == i + 2 * n);
+      } else {
+        Assert(v.size() == 1 && v[0] == i);
+      }
+      uint32 bit = sumOf(i).getHi() & idx.bitmapMask();
+      Assert((idx.bitmap()[bit / 32] & (1U << (bit % 32))) != 0);
+    }
+    // Sums which are not present must not be found
+    for (uint32 i = n; i < 2 * n; ++i)
+      Assert(lookup(idx, sumOf(i)).empty());
+  }
+
+}
+
+int main() {
+  const uint32 n = 5000;
+  RsyncSumIndex idx;
+
+  // Correctly sized in advance
+  idx.reserve(n + n / 7 * 2 + 2);
+  fill(idx, n);
+  check(idx, n);
+  Assert(idx.lookups() > 0);
+  Assert(idx.falseCandidates() <= idx.lookups());
+
+  // Table must grow several times, order of duplicates must be kept
+  idx.reserve(0);
+  Assert(idx.size() == 0 && idx.lookups() == 0);
+  fill(idx, n);
+  check(idx, n);
+
+  return 0;
+}
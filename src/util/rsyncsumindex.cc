@@ -0,0 +1,87 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Hash table mapping RsyncSum64 values to integers
+
+*/
+
+#include <config.h>
+
+#include <rsyncsumindex.hh>
+//______________________________________________________________________
+
+const size_t RsyncSumIndex::npos;
+const uint32 RsyncSumIndex::EMPTY;
+const size_t RsyncSumIndex::BITS_PER_ENTRY;
+const size_t RsyncSumIndex::MAX_LOAD_PERCENT;
+
+RsyncSumIndex::RsyncSumIndex()
+  : table(), tableMask(0), bits(), bitsMask(0), count(0), lookupCount(0),
+    falseCandidateCount(0), sameSlotCount(0) {
+  reserve(0);
+}
+//________________________________________
+
+void RsyncSumIndex::reserve(size_t n) {
+  count = 0;
+  lookupCount = falseCandidateCount = sameSlotCount = 0;
+  sizeTable(n);
+
+  size_t nBits = 65536; // 8 kB, still fits in the L1 cache
+  while (nBits < n * BITS_PER_ENTRY && nBits < 0x80000000U) nBits *= 2;
+  bits.assign(nBits / 32, 0);
+  bitsMask = static_cast<uint32>(nBits - 1);
+}
+
+// Make table empty, large enough for n entries
+void RsyncSumIndex::sizeTable(size_t n) {
+  size_t slots = 16;
+  while (slots * MAX_LOAD_PERCENT / 100 < n) slots *= 2;
+  Entry empty = { 0, 0, EMPTY };
+  table.assign(slots, empty);
+  tableMask = slots - 1;
+}
+//________________________________________
+
+void RsyncSumIndex::insert(const RsyncSum64& sum, uint32 value) {
+  Assert(value != EMPTY);
+  if ((count + 1) * 100 > table.size() * MAX_LOAD_PERCENT) {
+    /* Grow the table. Entries for the same sum must stay in insertion
+       order, so re-insert them in slot order, starting after an empty
+       slot: Probe sequences never extend across an empty slot, so this
+       visits the entries of each sequence in order. */
+    vector<Entry> old;
+    old.swap(table);
+    size_t oldMask = tableMask;
+    sizeTable(count * 2 + 1);
+    size_t start = 0;
+    while (old[start].value != EMPTY) ++start;
+    for (size_t i = (start + 1) & oldMask; i != start;
+         i = (i + 1) & oldMask) {
+      const Entry& e = old[i];
+      if (e.value == EMPTY) continue;
+      size_t pos = e.hi & tableMask;
+      while (table[pos].value != EMPTY) pos = (pos + 1) & tableMask;
+      table[pos] = e;
+    }
+  }
+
+  size_t pos = sum.getHi() & tableMask;
+  while (table[pos].value != EMPTY) pos = (pos + 1) & tableMask;
+  Entry& e = table[pos];
+  e.lo = sum.getLo();
+  e.hi = sum.getHi();
+  e.value = value;
+  ++count;
+
+  uint32 bit = sum.getHi() & bitsMask;
+  bits[bit / 32] |= 1U << (bit % 32);
+}
+//________________________________________
+
+size_t RsyncSumIndex::memoryUsage() const {
+  return table.size() * sizeof(Entry) + bits.size() * sizeof(uint32);
+}
@@ -0,0 +1,143 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Hash table mapping RsyncSum64 values to integers, for quick lookups of
+  the rolling checksum at every offset of a large amount of data
+
+*/
+
+#ifndef RSYNCSUMINDEX_HH
+#define RSYNCSUMINDEX_HH
+
+#include <config.h>
+
+#include <vector>
+
+#include <debug.hh>
+#include <nocopy.hh>
+#include <rsyncsum.hh>
+//______________________________________________________________________
+
+/** Multimap from RsyncSum64 to uint32 values, e.g. indexes of files
+    which start with data that has that checksum.
+
+    The table is a single array of entries which store the complete
+    checksum and the value, with collisions resolved by linear probing.
+    Values with the same checksum are returned in the order they were
+    inserted. In front of the table, a bitmap with several bits per entry
+    records which masked getHi() values are present at all. Most lookups
+    are answered by the bitmap alone, which is small enough to stay in the
+    CPU cache. Use its bitmap() with RsyncScanner::find().
+
+    Entries cannot be removed. */
+class RsyncSumIndex : NoCopy {
+public:
+  /** Value returned by first() and next() if there are no more entries */
+  static const size_t npos = static_cast<size_t>(-1);
+
+  RsyncSumIndex();
+
+  /** Remove all entries, and size table and bitmap for n entries. More
+      than n entries can be inserted, but the table must then grow and
+      the bitmap will become less effective. */
+  void reserve(size_t n);
+
+  /** Add an entry. value must not be 0xffffffff. */
+  void insert(const RsyncSum64& sum, uint32 value);
+  size_t size() const { return count; }
+
+  /** The bitmap: Bit (sum.getHi() & bitmapMask()), i.e.
+      bitmap()[bit / 32] & (1 << (bit % 32)), is set if an entry for sum
+      may be present. */
+  const uint32* bitmap() const { return &bits[0]; }
+  uint32 bitmapMask() const { return bitsMask; }
+  /** Check bitmap, if false then the sum is definitely not present */
+  inline bool mayContain(const RsyncSum64& sum) const;
+
+  /** Return position of first entry for sum, or npos if there is none.
+      Always look at the bitmap with mayContain() first, statistics are
+      collected under the assumption that this is done. */
+  inline size_t first(const RsyncSum64& sum);
+  /** Like first(), but does not collect statistics, so several threads
+      can call it at the same time */
+  inline size_t find(const RsyncSum64& sum) const;
+  /** Return position of the next entry for sum after pos, or npos */
+  inline size_t next(const RsyncSum64& sum, size_t pos) const;
+  /** Value of the entry at pos */
+  uint32 value(size_t pos) const { return table[pos].value; }
+
+  /** Number of first() calls */
+  uint64 lookups() const { return lookupCount; }
+  /** Number of first() calls which found nothing, i.e. the bitmap test
+      in mayContain() was a false positive */
+  uint64 falseCandidates() const { return falseCandidateCount; }
+  /** Number of entries first() needed to skip because they were stored
+      for the same table slot, but with a different checksum */
+  uint64 sameSlotMismatches() const { return sameSlotCount; }
+  /** Size of the table and bitmap in bytes */
+  size_t memoryUsage() const;
+
+private:
+  static const uint32 EMPTY = 0xffffffffU;
+  struct Entry {
+    uint32 lo, hi, value; // value == EMPTY => unused
+  };
+  // Bits in bitmap per entry, and max. fill level of table
+  static const size_t BITS_PER_ENTRY = 16;
+  static const size_t MAX_LOAD_PERCENT = 50;
+
+  void sizeTable(size_t n);
+  inline size_t scan(const RsyncSum64& sum, size_t pos) const;
+
+  vector<Entry> table;
+  size_t tableMask;
+  vector<uint32> bits;
+  uint32 bitsMask;
+  size_t count;
+
+  uint64 lookupCount, falseCandidateCount, sameSlotCount;
+};
+//______________________________________________________________________
+
+bool RsyncSumIndex::mayContain(const RsyncSum64& sum) const {
+  uint32 bit = sum.getHi() & bitsMask;
+  return (bits[bit / 32] & (1U << (bit % 32))) != 0;
+}
+
+// Return the first slot from pos onwards which holds sum, or npos
+size_t RsyncSumIndex::scan(const RsyncSum64& sum, size_t pos) const {
+  while (true) {
+    const Entry& e = table[pos];
+    if (e.value == EMPTY) return npos;
+    if (e.hi == sum.getHi() && e.lo == sum.getLo()) return pos;
+    pos = (pos + 1) & tableMask;
+  }
+}
+
+size_t RsyncSumIndex::first(const RsyncSum64& sum) {
+  ++lookupCount;
+  size_t home = sum.getHi() & tableMask;
+  size_t pos = home;
+  while (true) {
+    const Entry& e = table[pos];
+    if (e.value == EMPTY) { ++falseCandidateCount; return npos; }
+    if (e.hi == sum.getHi() && e.lo == sum.getLo()) return pos;
+    if ((e.hi & tableMask) == home) ++sameSlotCount;
+    pos = (pos + 1) & tableMask;
+  }
+}
+
+size_t RsyncSumIndex::find(const RsyncSum64& sum) const {
+  return scan(sum, sum.getHi() & tableMask);
+}
+
+size_t RsyncSumIndex::next(const RsyncSum64& sum, size_t pos) const {
+  return scan(sum, (pos + 1) & tableMask);
+}
+
+#endif
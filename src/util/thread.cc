@@ -0,0 +1,53 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  Minimal wrappers around POSIX threads
+
+*/
+
+#include <config.h>
+
+#include <unistd-jigdo.h>
+
+#include <debug.hh>
+#include <thread.hh>
+//______________________________________________________________________
+
+#if HAVE_PTHREAD
+
+void* Thread::startRoutine(void* self) {
+  static_cast<Thread*>(self)->run();
+  return 0;
+}
+
+bool Thread::start() {
+  Assert(!running);
+  if (pthread_create(&thread, 0, &startRoutine, this) != 0) return FAILURE;
+  running = true;
+  return SUCCESS;
+}
+
+void Thread::join() {
+  if (!running) return;
+  pthread_join(thread, 0);
+  running = false;
+}
+
+#else
+
+bool Thread::start() { return FAILURE; }
+void Thread::join() { }
+
+#endif
+//______________________________________________________________________
+
+unsigned Thread::cpuCount() {
+# if HAVE_PTHREAD && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0) return static_cast<unsigned>(n);
+# endif
+  return 1;
+}
@@ -0,0 +1,104 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  Minimal wrappers around POSIX threads
+
+  If the system has no pthreads (HAVE_PTHREAD == 0), Mutex and Condition
+  do nothing and Thread::start() always fails, so callers must be prepared
+  to do the work on the calling thread instead.
+
+*/
+
+#ifndef THREAD_HH
+#define THREAD_HH
+
+#include <config.h>
+
+#if HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+
+#include <nocopy.hh>
+//______________________________________________________________________
+
+/** A mutual exclusion lock */
+class Mutex : NoCopy {
+  friend class Condition;
+public:
+# if HAVE_PTHREAD
+  Mutex() { pthread_mutex_init(&m, 0); }
+  ~Mutex() { pthread_mutex_destroy(&m); }
+  void lock() { pthread_mutex_lock(&m); }
+  void unlock() { pthread_mutex_unlock(&m); }
+private:
+  pthread_mutex_t m;
+# else
+  void lock() { }
+  void unlock() { }
+# endif
+};
+
+/** Locks a Mutex for the lifetime of the object */
+class MutexLock : NoCopy {
+public:
+  explicit MutexLock(Mutex& mm) : m(mm) { m.lock(); }
+  ~MutexLock() { m.unlock(); }
+private:
+  Mutex& m;
+};
+//______________________________________________________________________
+
+/** A condition variable, always used together with a Mutex */
+class Condition : NoCopy {
+public:
+# if HAVE_PTHREAD
+  Condition() { pthread_cond_init(&c, 0); }
+  ~Condition() { pthread_cond_destroy(&c); }
+  /** Atomically unlock m and wait until signalled, then re-lock m. The
+      mutex must be locked by the caller. */
+  void wait(Mutex& m) { pthread_cond_wait(&c, &m.m); }
+  void signal() { pthread_cond_signal(&c); }
+  void broadcast() { pthread_cond_broadcast(&c); }
+private:
+  pthread_cond_t c;
+# else
+  void wait(Mutex&) { }
+  void signal() { }
+  void broadcast() { }
+# endif
+};
+//______________________________________________________________________
+
+/** Base class for a thread of execution. Derive from this, implement
+    run(), then call start() and later join(). The object must not be
+    destroyed while the thread is running. */
+class Thread : NoCopy {
+public:
+  Thread() : running(false) { }
+  virtual ~Thread() { }
+  /** Start executing run() in a new thread.
+      @return FAILURE if the thread could not be created, e.g. because
+      threads are not supported on this system. */
+  bool start();
+  /** Wait for run() to return. Does nothing if start() failed. */
+  void join();
+  /** Number of CPUs online, or 1 if this cannot be determined */
+  static unsigned cpuCount();
+
+protected:
+  virtual void run() = 0;
+
+private:
+  bool running;
+# if HAVE_PTHREAD
+  pthread_t thread;
+  static void* startRoutine(void* self);
+# endif
+};
+
+#endif
@@ -136,6 +136,36 @@ void ZobstreamBz::deflateReset() {
 }
 //______________________________________________________________________
 
+unsigned ZobstreamBz::zipChunk(const byte* in, unsigned len,
+                               vector<byte>* out) const {
+  bz_stream c;
+  c.bzalloc = 0;
+  c.bzfree = 0;
+  c.opaque = 0;
+  int status = BZ2_bzCompressInit(&c, compressLevel, 0,
+                                  0/*default workFactor*/);
+  if (status != BZ_OK) throwZerrorBz(status);
+
+  // Worst case according to the libbz2 docs: 1% larger plus 600 bytes
+  out->resize(len + len / 100 + 600);
+  c.next_in = reinterpret_cast<char*>(const_cast<byte*>(in));
+  c.avail_in = len;
+  c.next_out = reinterpret_cast<char*>(&(*out)[0]);
+  c.avail_out = static_cast<unsigned>(out->size()); // Chunks are small
+  do {
+    status = BZ2_bzCompress(&c, BZ_FINISH);
+  } while (status == BZ_FINISH_OK && c.avail_out != 0);
+  out->resize(c.total_out_lo32);
+  if (status != BZ_STREAM_END) {
+    BZ2_bzCompressEnd(&c);
+    throwZerrorBz((status == BZ_FINISH_OK ? BZ_OUTBUFF_FULL : status));
+  }
+  status = BZ2_bzCompressEnd(&c);
+  if (status != BZ_OK) throwZerrorBz(status);
+  return 0x50495a42u; // BZIP
+}
+//________________________________________
+
 void ZobstreamBz::zip2(byte* start, unsigned len, bool finish) {
   debug("zip2 %1 bytes at %2", len, start);
   int flush = (finish ? BZ_FINISH : BZ_RUN);
@@ -63,6 +63,8 @@ protected:
   virtual void setNextIn(byte* n) {
     z.next_in = reinterpret_cast<char*>(n); }
   virtual void zip2(byte* start, unsigned len, bool finish = false);
+  virtual unsigned zipChunk(const byte* in, unsigned len,
+                            vector<byte>* out) const;
 
 private:
   bz_stream z;
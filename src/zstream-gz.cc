@@ -77,6 +77,9 @@ void ZobstreamGz::open(bostream& s, unsigned chunkLimit, int level,
   z.next_out = zipBuf->data;
   z.avail_out = (zipBuf == 0 ? 0 : ZIPDATA_SIZE);
   z.total_in = 0;
+  zLevel = level;
+  zWindowBits = windowBits;
+  zMemLevel = memLevel;
   debug("deflateInit2");
   int status = deflateInit2(&z, level, Z_DEFLATED, windowBits, memLevel,
                             Z_DEFAULT_STRATEGY);
@@ -108,6 +111,33 @@ void ZobstreamGz::deflateReset() {
 }
 //______________________________________________________________________
 
+unsigned ZobstreamGz::zipChunk(const byte* in, unsigned len,
+                               vector<byte>* out) const {
+  z_stream c;
+  c.zalloc = (alloc_func)0;
+  c.zfree = (free_func)0;
+  c.opaque = 0;
+  int status = deflateInit2(&c, zLevel, Z_DEFLATED, zWindowBits, zMemLevel,
+                            Z_DEFAULT_STRATEGY);
+  if (status != Z_OK) throwZerrorGz(status, c.msg);
+
+  out->resize(deflateBound(&c, len));
+  c.next_in = const_cast<byte*>(in);
+  c.avail_in = len;
+  c.next_out = &(*out)[0];
+  c.avail_out = static_cast<uInt>(out->size()); // Chunks are small
+  status = deflate(&c, Z_FINISH);
+  out->resize(c.total_out);
+  if (status != Z_STREAM_END) {
+    ::deflateEnd(&c);
+    throwZerrorGz((status == Z_OK ? Z_BUF_ERROR : status), c.msg);
+  }
+  status = ::deflateEnd(&c);
+  if (status != Z_OK) throwZerrorGz(status, c.msg);
+  return 0x41544144u; // DATA
+}
+//________________________________________
+
 void ZobstreamGz::zip2(byte* start, unsigned len, bool finish) {
   debug("zip2 %1 bytes at %2", len, start);
   int flush = (finish ? Z_FINISH : Z_NO_FLUSH);
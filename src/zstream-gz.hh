@@ -65,6 +65,8 @@ protected:
   virtual void setNextOut(byte* n) { z.next_out = n; }
   virtual void setNextIn(byte* n) { z.next_in = n; }
   virtual void zip2(byte* start, unsigned len, bool finish = false);
+  virtual unsigned zipChunk(const byte* in, unsigned len,
+                            vector<byte>* out) const;
 
 private:
   // Throw a Zerror exception, or bad_alloc() for status==Z_MEM_ERROR
@@ -73,6 +75,8 @@ private:
   z_stream z;
   // To keep track in the dtor whether deflateEnd() has been called
   bool memReleased;
+  // Parameters passed to open(), for zipChunk()
+  int zLevel, zWindowBits, zMemLevel;
 };
 //______________________________________________________________________
 
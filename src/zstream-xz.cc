@@ -0,0 +1,174 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  xz compression layer which integrates with C++ streams
+
+*/
+
+#include <config.h>
+
+#if HAVE_LIBLZMA
+
+#include <new>
+
+#include <log.hh>
+#include <string.hh>
+#include <zstream-xz.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("zstream-xz")
+
+namespace {
+
+  /* Input size limit of the XZ parts, see zstream-zstd.cc. The LZMA2
+     dictionary need not be larger than this. */
+  const unsigned XZ_CHUNK_SIZE = 4 * 1024 * 1024;
+
+  // Turn liblzma error codes into C++ exceptions
+  void throwZerrorXz(lzma_ret status) {
+    Assert(status != LZMA_OK && status != LZMA_STREAM_END);
+    if (status == LZMA_MEM_ERROR) throw bad_alloc();
+    throw Zerror(status, ZibstreamXz::errorString(status));
+  }
+
+} // namespace
+//______________________________________________________________________
+
+const char* ZibstreamXz::errorString(lzma_ret status) {
+  switch (status) {
+  case LZMA_OK: return "OK";
+  case LZMA_STREAM_END: return "STREAM_END";
+  case LZMA_MEM_ERROR: return "MEM_ERROR";
+  case LZMA_MEMLIMIT_ERROR: return "MEMLIMIT_ERROR";
+  case LZMA_FORMAT_ERROR: return "FORMAT_ERROR";
+  case LZMA_OPTIONS_ERROR: return "OPTIONS_ERROR";
+  case LZMA_DATA_ERROR: return "DATA_ERROR";
+  case LZMA_BUF_ERROR: return "BUF_ERROR";
+  case LZMA_PROG_ERROR: return "PROG_ERROR";
+  default: return "liblzma error";
+  }
+}
+
+void ZibstreamXz::throwError() const {
+  throwZerrorXz(status);
+}
+//______________________________________________________________________
+
+/* As for bzip2, chunkLim() is the INPUT size limit. */
+void ZobstreamXz::open(bostream& s, int level, unsigned todoBufSz) {
+  if (level < 0) level = 0;
+  if (level > 9) level = 9;
+  if (lzma_lzma_preset(&options, level))
+    throwZerrorXz(LZMA_OPTIONS_ERROR);
+  /* Presets 7 to 9 use a dictionary of 16 to 64 MB. With parts of
+     XZ_CHUNK_SIZE bytes, that would only waste memory. */
+  if (options.dict_size > XZ_CHUNK_SIZE) options.dict_size = XZ_CHUNK_SIZE;
+
+  z.next_in = 0;
+  z.next_out = (zipBuf == 0 ? 0 : zipBuf->data);
+  z.avail_out = (zipBuf == 0 ? 0 : ZIPDATA_SIZE);
+  encoderInit();
+
+  // Declare stream as open
+  Zobstream::open(s, XZ_CHUNK_SIZE, todoBufSz);
+  debug("opened, chunkLim=%1", chunkLim());
+}
+
+void ZobstreamXz::encoderInit() {
+  debug("lzma_stream_encoder");
+  lzma_filter filters[] = {
+    { LZMA_FILTER_LZMA2, &options },
+    { LZMA_VLI_UNKNOWN, 0 }
+  };
+  lzma_ret status = lzma_stream_encoder(&z, filters, LZMA_CHECK_CRC32);
+  if (status != LZMA_OK) throwZerrorXz(status);
+  memReleased = false;
+}
+//______________________________________________________________________
+
+void ZobstreamXz::deflateEnd() {
+  lzma_end(&z);
+  memReleased = true;
+}
+
+void ZobstreamXz::deflateReset() {
+  // liblzma reuses the memory allocated for the previous encoder
+  encoderInit();
+}
+//______________________________________________________________________
+
+unsigned ZobstreamXz::zipChunk(const byte* in, unsigned len,
+                               vector<byte>* out) const {
+  lzma_options_lzma opt = options;
+  lzma_filter filters[] = {
+    { LZMA_FILTER_LZMA2, &opt },
+    { LZMA_VLI_UNKNOWN, 0 }
+  };
+  out->resize(lzma_stream_buffer_bound(len));
+  size_t outPos = 0;
+  lzma_ret status = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, 0,
+                                              in, len, &(*out)[0], &outPos,
+                                              out->size());
+  if (status != LZMA_OK) throwZerrorXz(status);
+  out->resize(outPos);
+  return Zibstream::XZ;
+}
+//________________________________________
+
+void ZobstreamXz::zip2(byte* start, unsigned len, bool finish) {
+  debug("zip2 %1 bytes at %2", len, start);
+  Assert(is_open());
+
+  // true <=> must call lzma_code() at least once
+  bool callLibLzmaOnce = finish;
+
+  z.next_in = start;
+  z.avail_in = len;
+  while (z.avail_in != 0 || z.avail_out == 0 || callLibLzmaOnce) {
+    callLibLzmaOnce = false;
+
+    // If big enough, finish and write out this chunk
+    lzma_action action = (finish ? LZMA_FINISH : LZMA_RUN);
+    size_t availInDifference = 0;
+    if (chunkLim() <= z.total_in + z.avail_in) {
+      // Only pass the data up to the chunk limit to liblzma
+      availInDifference = z.total_in + z.avail_in - chunkLim();
+      action = LZMA_FINISH;
+    }
+
+    if (z.avail_out == 0) {
+      // Get another output buffer object
+      ZipData* zd;
+      if (zipBufLast == 0 || zipBufLast->next == 0) {
+        zd = new ZipData();
+        if (zipBuf == 0) zipBuf = zd;
+        if (zipBufLast != 0) zipBufLast->next = zd;
+      } else {
+        zd = zipBufLast->next;
+      }
+      zipBufLast = zd;
+      z.next_out = zd->data;
+      z.avail_out = ZIPDATA_SIZE;
+    }
+
+    debug("compress ai=%1 ao=%2 ti=%3 action=%4",
+          z.avail_in, z.avail_out, z.total_in, int(action));
+    z.avail_in -= availInDifference;
+    lzma_ret status = lzma_code(&z, action); // Call liblzma
+    z.avail_in += availInDifference;
+    if (status == LZMA_STREAM_END) {
+      const byte* ni = z.next_in;
+      size_t ai = z.avail_in;
+      writeZipped(Zibstream::XZ);
+      z.next_in = ni;
+      z.avail_in = ai;
+      continue;
+    }
+    if (status != LZMA_OK) throwZerrorXz(status);
+  }
+}
+
+#endif /* HAVE_LIBLZMA */
@@ -0,0 +1,137 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  xz (liblzma) compression and decompression for zstream
+
+*/
+
+#ifndef ZSTREAM_XZ_HH
+#define ZSTREAM_XZ_HH
+
+#include <config.h>
+
+#if HAVE_LIBLZMA
+
+#include <lzma.h>
+
+#include <log.hh>
+#include <zstream.hh>
+//______________________________________________________________________
+
+class ZobstreamXz : public Zobstream {
+public:
+  inline ZobstreamXz(bostream& s, int level /*= 6*/,
+                     unsigned todoBufSz /*= 256U*/, MD5Sum* md /*= 0*/);
+  ~ZobstreamXz() { Assert(memReleased); }
+
+  /** @param s Output stream
+      @param level 0 to 9, the xz preset
+      @param todoBufSz Size of mini buffer, which holds data sent to
+      the stream with single put() calls or << statements */
+  void open(bostream& s, int level /*= 6*/, unsigned todoBufSz/* = 256U*/);
+
+protected:
+  virtual void deflateEnd();
+  virtual void deflateReset();
+  /* lzma_stream uses uint64_t totals and size_t counts. The totals are
+     reset for each part, which is at most 4MB uncompressed, and the
+     counts are only ever set from unsigned values, so all of them fit. */
+  virtual unsigned totalOut() const {
+    return static_cast<unsigned>(z.total_out); }
+  virtual unsigned totalIn() const {
+    return static_cast<unsigned>(z.total_in); }
+  virtual unsigned availOut() const {
+    return static_cast<unsigned>(z.avail_out); }
+  virtual unsigned availIn() const {
+    return static_cast<unsigned>(z.avail_in); }
+  virtual byte* nextOut() const { return z.next_out; }
+  virtual byte* nextIn() const { return const_cast<byte*>(z.next_in); }
+  virtual void setTotalOut(unsigned n) { z.total_out = n; }
+  virtual void setTotalIn(unsigned n) { z.total_in = n; }
+  virtual void setAvailOut(unsigned n) { z.avail_out = n; }
+  virtual void setAvailIn(unsigned n) { z.avail_in = n; }
+  virtual void setNextOut(byte* n) { z.next_out = n; }
+  virtual void setNextIn(byte* n) { z.next_in = n; }
+  virtual void zip2(byte* start, unsigned len, bool finish = false);
+  virtual unsigned zipChunk(const byte* in, unsigned len,
+                            vector<byte>* out) const;
+
+private:
+  // (Re)initialize z for a new XZ part
+  void encoderInit();
+
+  lzma_stream z;
+  lzma_options_lzma options;
+  bool memReleased;
+};
+//______________________________________________________________________
+
+class ZibstreamXz : public Zibstream::Impl {
+public:
+  ZibstreamXz() : status(LZMA_OK), memReleased(true) {
+    lzma_stream init = LZMA_STREAM_INIT;
+    z = init;
+  }
+  ~ZibstreamXz() { Assert(memReleased); }
+
+  // As in ZobstreamXz: Totals are per part, counts are set from unsigned
+  virtual unsigned totalOut() const {
+    return static_cast<unsigned>(z.total_out); }
+  virtual unsigned totalIn() const {
+    return static_cast<unsigned>(z.total_in); }
+  virtual unsigned availOut() const {
+    return static_cast<unsigned>(z.avail_out); }
+  virtual unsigned availIn() const {
+    return static_cast<unsigned>(z.avail_in); }
+  virtual byte* nextOut() const { return z.next_out; }
+  virtual byte* nextIn() const { return const_cast<byte*>(z.next_in); }
+  virtual void setTotalOut(unsigned n) { z.total_out = n; }
+  virtual void setTotalIn(unsigned n) { z.total_in = n; }
+  virtual void setAvailIn(unsigned n) { z.avail_in = n; }
+  virtual void setNextIn(byte* n) { z.next_in = n; }
+
+  virtual void init() {
+    status = lzma_stream_decoder(&z, UINT64_MAX, 0);
+    if (ok()) memReleased = false;
+  }
+  virtual void end() { lzma_end(&z); status = LZMA_OK; memReleased = true; }
+  virtual void reset() {
+    // liblzma reuses the memory allocated for the previous decoder
+    status = lzma_stream_decoder(&z, UINT64_MAX, 0);
+  }
+
+  virtual void inflate(byte** nextOut, unsigned* availOut) {
+    z.next_out = *nextOut; z.avail_out = *availOut;
+    status = lzma_code(&z, LZMA_RUN);
+    *nextOut = z.next_out; *availOut = static_cast<unsigned>(z.avail_out);
+  }
+  virtual bool streamEnd() const { return status == LZMA_STREAM_END; }
+  virtual bool ok() const { return status == LZMA_OK; }
+
+  /** Return description of a liblzma status code */
+  static const char* errorString(lzma_ret status);
+  virtual void throwError() const;
+
+private:
+  lzma_ret status;
+  lzma_stream z;
+  bool memReleased;
+};
+//======================================================================
+
+ZobstreamXz::ZobstreamXz(bostream& s, int level, unsigned todoBufSz,
+                         MD5Sum* md)
+    : Zobstream(md), memReleased(true) {
+  lzma_stream init = LZMA_STREAM_INIT;
+  z = init;
+  open(s, level, todoBufSz);
+}
+
+#endif /* HAVE_LIBLZMA */
+
+#endif
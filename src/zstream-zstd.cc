@@ -0,0 +1,198 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+  zstd compression layer which integrates with C++ streams
+
+*/
+
+#include <config.h>
+
+#if HAVE_LIBZSTD
+
+#include <zstd_errors.h>
+
+#include <new>
+
+#include <log.hh>
+#include <string.hh>
+#include <zstream-zstd.hh>
+//______________________________________________________________________
+
+DEBUG_UNIT("zstream-zstd")
+
+namespace {
+
+  /* Input size limit of the ZSTD parts. Larger parts compress a little
+     better, but applications which seek in the image have to decompress
+     more data on average. */
+  const unsigned ZSTD_CHUNK_SIZE = 4 * 1024 * 1024;
+
+  // Turn libzstd error codes into C++ exceptions
+  void throwZerrorZstd(size_t status) {
+    Assert(ZSTD_isError(status));
+    if (ZSTD_getErrorCode(status) == ZSTD_error_memory_allocation)
+      throw bad_alloc();
+    throw Zerror(ZSTD_getErrorCode(status), ZSTD_getErrorName(status));
+  }
+
+} // namespace
+//______________________________________________________________________
+
+/* Unlike for gzip, chunkLim() is the INPUT size limit, like for bzip2. */
+void ZobstreamZstd::open(bostream& s, int level, unsigned todoBufSz) {
+  if (level < 1) level = 1;
+  if (level > ZSTD_maxCLevel()) level = ZSTD_maxCLevel();
+  compressLevel = level;
+
+  nextInVal = 0;
+  nextOutVal = (zipBuf == 0 ? 0 : zipBuf->data);
+  availOutVal = (zipBuf == 0 ? 0 : ZIPDATA_SIZE);
+  totalInVal = totalOutVal = 0;
+  debug("ZSTD_createCCtx");
+  z = ZSTD_createCCtx();
+  if (z == 0) throw bad_alloc();
+  memReleased = false;
+  size_t status = ZSTD_CCtx_setParameter(z, ZSTD_c_compressionLevel,
+                                         compressLevel);
+  if (ZSTD_isError(status)) throwZerrorZstd(status);
+
+  // Declare stream as open
+  Zobstream::open(s, ZSTD_CHUNK_SIZE, todoBufSz);
+  debug("opened, chunkLim=%1", chunkLim());
+}
+//______________________________________________________________________
+
+void ZobstreamZstd::deflateEnd() {
+  ZSTD_freeCCtx(z);
+  z = 0;
+  memReleased = true;
+}
+
+void ZobstreamZstd::deflateReset() {
+  // Keeps the compression level
+  size_t status = ZSTD_CCtx_reset(z, ZSTD_reset_session_only);
+  if (ZSTD_isError(status)) throwZerrorZstd(status);
+}
+//______________________________________________________________________
+
+unsigned ZobstreamZstd::zipChunk(const byte* in, unsigned len,
+                                 vector<byte>* out) const {
+  out->resize(ZSTD_compressBound(len));
+  size_t status = ZSTD_compress(&(*out)[0], out->size(), in, len,
+                                compressLevel);
+  if (ZSTD_isError(status)) throwZerrorZstd(status);
+  out->resize(status);
+  return Zibstream::ZSTD;
+}
+//________________________________________
+
+void ZobstreamZstd::zip2(byte* start, unsigned len, bool finish) {
+  debug("zip2 %1 bytes at %2", len, start);
+  Assert(is_open());
+
+  // true <=> must call ZSTD_compressStream2() at least once
+  bool callLibZstdOnce = finish;
+
+  nextInVal = start;
+  availInVal = len;
+  while (availInVal != 0 || availOutVal == 0 || callLibZstdOnce) {
+    callLibZstdOnce = false;
+
+    // If big enough, finish and write out this chunk
+    ZSTD_EndDirective mode = (finish ? ZSTD_e_end : ZSTD_e_continue);
+    unsigned availInDifference = 0;
+    if (chunkLim() <= totalInVal + availInVal) {
+      // Only pass the data up to the chunk limit to libzstd
+      availInDifference = totalInVal + availInVal - chunkLim();
+      mode = ZSTD_e_end;
+    }
+
+    if (availOutVal == 0) {
+      // Get another output buffer object
+      ZipData* zd;
+      if (zipBufLast == 0 || zipBufLast->next == 0) {
+        zd = new ZipData();
+        if (zipBuf == 0) zipBuf = zd;
+        if (zipBufLast != 0) zipBufLast->next = zd;
+      } else {
+        zd = zipBufLast->next;
+      }
+      zipBufLast = zd;
+      nextOutVal = zd->data;
+      availOutVal = ZIPDATA_SIZE;
+    }
+
+    ZSTD_inBuffer in = { nextInVal, availInVal - availInDifference, 0 };
+    ZSTD_outBuffer out = { nextOutVal, availOutVal, 0 };
+    debug("compress ai=%1 ao=%2 ti=%3 mode=%4",
+          in.size, out.size, totalInVal, int(mode));
+    size_t status = ZSTD_compressStream2(z, &out, &in, mode); // Call libzstd
+    if (ZSTD_isError(status)) throwZerrorZstd(status);
+    nextInVal += in.pos;
+    availInVal -= in.pos;
+    totalInVal += in.pos;
+    nextOutVal += out.pos;
+    availOutVal -= out.pos;
+    totalOutVal += out.pos;
+
+    // With ZSTD_e_end, 0 means that the frame is complete
+    if (mode == ZSTD_e_end && status == 0) {
+      byte* ni = nextInVal;
+      unsigned ai = availInVal;
+      writeZipped(Zibstream::ZSTD);
+      nextInVal = ni;
+      availInVal = ai;
+    }
+  }
+}
+//______________________________________________________________________
+
+void ZibstreamZstd::init() {
+  z = ZSTD_createDStream();
+  if (z == 0) {
+    status = FAILED;
+    err = 0;
+    return;
+  }
+  status = OK;
+}
+
+void ZibstreamZstd::reset() {
+  size_t r = ZSTD_DCtx_reset(z, ZSTD_reset_session_only);
+  if (ZSTD_isError(r)) {
+    status = FAILED;
+    err = r;
+    return;
+  }
+  status = OK;
+}
+
+void ZibstreamZstd::inflate(byte** nextOut, unsigned* availOut) {
+  ZSTD_inBuffer in = { nextInVal, availInVal, 0 };
+  ZSTD_outBuffer out = { *nextOut, *availOut, 0 };
+  size_t r = ZSTD_decompressStream(z, &out, &in);
+  nextInVal += in.pos;
+  availInVal -= in.pos;
+  totalInVal += in.pos;
+  *nextOut += out.pos;
+  *availOut -= out.pos;
+  totalOutVal += out.pos;
+  availOutVal = *availOut;
+  if (ZSTD_isError(r)) {
+    status = FAILED;
+    err = r;
+  } else {
+    // 0 means that the frame was completely decoded and flushed
+    status = (r == 0 ? STREAM_END : OK);
+  }
+}
+
+void ZibstreamZstd::throwError() const {
+  if (err == 0) throw bad_alloc();
+  throwZerrorZstd(err);
+}
+
+#endif /* HAVE_LIBZSTD */
@@ -0,0 +1,124 @@
+/* $Id$ -*- C++ -*-
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License, version 2. See
+  the file COPYING for details.
+
+*//** @file
+
+  zstd compression and decompression for zstream
+
+*/
+
+#ifndef ZSTREAM_ZSTD_HH
+#define ZSTREAM_ZSTD_HH
+
+#include <config.h>
+
+#if HAVE_LIBZSTD
+
+#include <zstd.h>
+
+#include <log.hh>
+#include <zstream.hh>
+//______________________________________________________________________
+
+class ZobstreamZstd : public Zobstream {
+public:
+  inline ZobstreamZstd(bostream& s, int level /*= 19*/,
+                       unsigned todoBufSz /*= 256U*/, MD5Sum* md /*= 0*/);
+  ~ZobstreamZstd() { Assert(memReleased); }
+
+  /** @param s Output stream
+      @param level 1 to ZSTD_maxCLevel(), i.e. 22 (values outside this
+      range are clamped)
+      @param todoBufSz Size of mini buffer, which holds data sent to
+      the stream with single put() calls or << statements */
+  void open(bostream& s, int level /*= 19*/, unsigned todoBufSz/* = 256U*/);
+
+protected:
+  virtual void deflateEnd();
+  virtual void deflateReset();
+  virtual unsigned totalOut() const { return totalOutVal; }
+  virtual unsigned totalIn() const { return totalInVal; }
+  virtual unsigned availOut() const { return availOutVal; }
+  virtual unsigned availIn() const { return availInVal; }
+  virtual byte* nextOut() const { return nextOutVal; }
+  virtual byte* nextIn() const { return nextInVal; }
+  virtual void setTotalOut(unsigned n) { totalOutVal = n; }
+  virtual void setTotalIn(unsigned n) { totalInVal = n; }
+  virtual void setAvailOut(unsigned n) { availOutVal = n; }
+  virtual void setAvailIn(unsigned n) { availInVal = n; }
+  virtual void setNextOut(byte* n) { nextOutVal = n; }
+  virtual void setNextIn(byte* n) { nextInVal = n; }
+  virtual void zip2(byte* start, unsigned len, bool finish = false);
+  virtual unsigned zipChunk(const byte* in, unsigned len,
+                            vector<byte>* out) const;
+
+private:
+  /* Unlike zlib and libbz2, libzstd does not keep these in a struct which
+     is visible to us, they are passed to each ZSTD_compressStream2() */
+  byte* nextInVal;
+  byte* nextOutVal;
+  unsigned availInVal, availOutVal, totalInVal, totalOutVal;
+
+  ZSTD_CCtx* z;
+  int compressLevel;
+  bool memReleased;
+};
+//______________________________________________________________________
+
+class ZibstreamZstd : public Zibstream::Impl {
+public:
+  ZibstreamZstd() : nextInVal(0), nextOutVal(0), availInVal(0),
+      availOutVal(0), totalInVal(0), totalOutVal(0), z(0), status(OK),
+      err(0) { }
+  ~ZibstreamZstd() { Assert(z == 0); }
+
+  virtual unsigned totalOut() const { return totalOutVal; }
+  virtual unsigned totalIn() const { return totalInVal; }
+  virtual unsigned availOut() const { return availOutVal; }
+  virtual unsigned availIn() const { return availInVal; }
+  virtual byte* nextOut() const { return nextOutVal; }
+  virtual byte* nextIn() const { return nextInVal; }
+  virtual void setTotalOut(unsigned n) { totalOutVal = n; }
+  virtual void setTotalIn(unsigned n) { totalInVal = n; }
+  virtual void setAvailIn(unsigned n) { availInVal = n; }
+  virtual void setNextIn(byte* n) { nextInVal = n; }
+
+  virtual void init();
+  virtual void end() {
+    if (z != 0) ZSTD_freeDStream(z);
+    z = 0;
+    status = OK;
+  }
+  virtual void reset();
+
+  virtual void inflate(byte** nextOut, unsigned* availOut);
+  virtual bool streamEnd() const { return status == STREAM_END; }
+  virtual bool ok() const { return status == OK; }
+
+  virtual void throwError() const;
+
+private:
+  byte* nextInVal;
+  byte* nextOutVal;
+  unsigned availInVal, availOutVal, totalInVal, totalOutVal;
+
+  ZSTD_DStream* z;
+  enum { OK, STREAM_END, FAILED } status;
+  size_t err; // libzstd error code if status == FAILED, or 0 for no memory
+};
+//======================================================================
+
+ZobstreamZstd::ZobstreamZstd(bostream& s, int level, unsigned todoBufSz,
+                             MD5Sum* md)
+    : Zobstream(md), nextInVal(0), nextOutVal(0), availInVal(0),
+      availOutVal(0), totalInVal(0), totalOutVal(0), z(0),
+      memReleased(true) {
+  open(s, level, todoBufSz);
+}
+
+#endif /* HAVE_LIBZSTD */
+
+#endif
@@ -7,18 +7,20 @@
   it under the terms of the GNU General Public License, version 2. See
   the file COPYING for details.
 
-  Zlib/bzlib2 compression layer which integrates with C++ streams
+  Zlib/bzlib2/zstd/xz compression layer which integrates with C++ streams
 
 */
 
 #include <config.h>
 
 #include <errno.h>
+#include <math.h>
 #include <string.h>
 #include <zlib.h>
 
 #include <algorithm>
 #include <fstream>
+#include <memory>
 #include <new>
 
 #include <log.hh>
@@ -28,10 +30,17 @@
 #include <zstream.hh>
 #include <zstream-gz.hh>
 #include <zstream-bz.hh>
-// struct ZibstreamBz : Zibstream::Impl { };
+#include <zstream-xz.hh>
+#include <zstream-zstd.hh>
 //______________________________________________________________________
 
 DEBUG_UNIT("zstream")
+
+const unsigned Zibstream::DATA;
+const unsigned Zibstream::BZIP;
+const unsigned Zibstream::ZSTD;
+const unsigned Zibstream::XZ;
+const unsigned Zibstream::STOR;
 //________________________________________
 
 void Zobstream::close() {
@@ -39,7 +48,10 @@ void Zobstream::close() {
   try {
     zip(todoBuf, todoCount, Z_FINISH); // Flush out remain. buffer contents
     deflateEnd();
-  } catch (Zerror) {
+  } catch (...) {
+    stopThreads();
+    storeBlock.clear();
+    stored.clear();
     zipBufLast = zipBuf;
     // Deallocate memory
     delete[] todoBuf;
@@ -52,6 +64,9 @@ void Zobstream::close() {
     throw;
   }
 
+  stopThreads();
+  storeBlock.clear();
+  stored.clear();
   zipBufLast = zipBuf;
 
   // Deallocate memory
@@ -62,10 +77,10 @@ void Zobstream::close() {
 }
 //______________________________________________________________________
 
-// Write compressed, flushed data to output stream
-void Zobstream::writeZipped(unsigned partId) {
+// Write header of a compressed chunk to output stream
+void Zobstream::writeHeader(unsigned partId, uint64 zipped, uint64 unzipped) {
   debug("Writing %1 bytes compressed, was %2 uncompressed",
-        totalOut(), totalIn());
+        zipped, unzipped);
 
   // #Bytes     Value   Description
   // ----------------------------------------------------------------------
@@ -76,14 +91,19 @@ void Zobstream::writeZipped(unsigned partId) {
   byte buf[16];
   byte* p = buf;
   serialize4(partId, p); // DATA or BZIP
-  uint64 l = totalOut() + 16;
-  serialize6(l, p + 4);
-  l = totalIn();
-  serialize6(l, p + 10);
+  serialize6(zipped + 16, p + 4);
+  serialize6(unzipped, p + 10);
   writeBytes(*stream, buf, 16);
   if (!stream->good())
     throw Zerror(0, string(_("Could not write template data")));
   if (md5sum != 0) md5sum->update(buf, 16);
+  bytesInVal += unzipped;
+  bytesOutVal += zipped + 16;
+}
+
+// Write compressed, flushed data to output stream
+void Zobstream::writeZipped(unsigned partId) {
+  writeHeader(partId, totalOut(), totalIn());
 
   ZipData* zd = zipBuf;
   unsigned len;
@@ -110,6 +130,282 @@ void Zobstream::writeZipped(unsigned partId) {
 }
 //______________________________________________________________________
 
+/* Unit of work for the Compressor threads: One chunk of input data,
+   which is compressed into one DATA/BZIP part. */
+struct Zobstream::Job {
+  Job() : in(), out(), id(0), done(false), failed(false), noMemory(false),
+          errStatus(0), errMessage() { }
+  // Compress, remembering any error for the thread that writes the output
+  void run(const Zobstream* zs) {
+    static const byte empty = 0;
+    try {
+      // in holds at most chunkLim() bytes, so its size fits
+      id = zs->zipChunk((in.empty() ? &empty : &in[0]),
+                        static_cast<unsigned>(in.size()), &out);
+      if (zs->storeIncompressible && out.size() >= in.size()) {
+        // Compression did not help after all
+        id = Zibstream::STOR;
+        out.clear();
+      }
+    } catch (Zerror e) {
+      failed = true;
+      errStatus = e.status;
+      errMessage = e.message;
+    } catch (bad_alloc&) {
+      failed = noMemory = true;
+    }
+  }
+  vector<byte> in, out; // For STOR parts, out is unused
+  unsigned id;
+  bool done; // Set by Compressor once out is valid
+  bool failed, noMemory;
+  int errStatus;
+  string errMessage;
+};
+
+class Zobstream::Compressor : public Thread {
+public:
+  explicit Compressor(Zobstream* z) : zs(z) { }
+protected:
+  virtual void run() {
+    MutexLock lock(zs->mutex);
+    while (true) {
+      while (zs->todo.empty() && !zs->stopping) zs->cond.wait(zs->mutex);
+      if (zs->stopping) return;
+      Job* job = zs->todo.front();
+      zs->todo.pop_front();
+      zs->mutex.unlock();
+      job->run(zs);
+      zs->mutex.lock();
+      job->done = true;
+      zs->cond.broadcast();
+    }
+  }
+private:
+  Zobstream* zs;
+};
+//________________________________________
+
+void Zobstream::setThreads(unsigned n) {
+  Assert(is_open() && current == 0 && jobs.empty() && workers.empty());
+  if (n <= 1) return;
+  threads = n;
+  for (unsigned i = 0; i < n; ++i) {
+    Compressor* c = new Compressor(this);
+    if (c->start() == FAILURE) { delete c; break; }
+    workers.push_back(c);
+  }
+  debug("setThreads: %1 compressor threads", workers.size());
+}
+
+void Zobstream::stopThreads() {
+  if (!workers.empty()) {
+    mutex.lock();
+    stopping = true;
+    cond.broadcast();
+    mutex.unlock();
+    for (vector<Compressor*>::iterator i = workers.begin(),
+           e = workers.end(); i != e; ++i) {
+      (*i)->join();
+      delete *i;
+    }
+    workers.clear();
+    stopping = false;
+  }
+  delete current;
+  current = 0;
+  while (!jobs.empty()) { delete jobs.front(); jobs.pop_front(); }
+  todo.clear();
+  threads = 1;
+}
+
+/* Like zip2(), but for setThreads() mode. Unlike in zip2(), chunks always
+   end after chunkLim() bytes of input. A final chunk is always written when
+   finishing, even if it is empty, just like zip2() does. */
+void Zobstream::zipParallel(const byte* start, unsigned len, bool finish) {
+  while (len > 0 || finish) {
+    if (current == 0) current = new Job();
+    unsigned n = chunkLim() - static_cast<unsigned>(current->in.size());
+    if (n > len) n = len;
+    current->in.insert(current->in.end(), start, start + n);
+    start += n;
+    len -= n;
+    if (current->in.size() < chunkLim() && !(finish && len == 0)) continue;
+
+    Job* job = current;
+    current = 0;
+    submitJob(job);
+    if (len == 0 && finish) {
+      writeJobs(0);
+      return;
+    }
+    // Limit memory usage by not letting too many jobs queue up
+    writeJobs(2 * threads);
+  }
+}
+
+void Zobstream::submitJob(Job* job) {
+  if (workers.empty()) {
+    job->run(this);
+    job->done = true;
+    jobs.push_back(job);
+  } else {
+    MutexLock lock(mutex);
+    jobs.push_back(job);
+    todo.push_back(job);
+    cond.broadcast();
+  }
+}
+
+void Zobstream::writeJobs(size_t maxPending) {
+  while (!jobs.empty()) {
+    {
+      MutexLock lock(mutex);
+      if (!jobs.front()->done && jobs.size() <= maxPending) return;
+      while (!jobs.front()->done) cond.wait(mutex);
+    }
+    auto_ptr<Job> job(jobs.front());
+    jobs.pop_front();
+    if (job->noMemory) throw bad_alloc();
+    if (job->failed) throw Zerror(job->errStatus, job->errMessage);
+
+    const vector<byte>& data = (job->id == Zibstream::STOR ?
+                                job->in : job->out);
+    writeHeader(job->id, data.size(), job->in.size());
+    writeBytes(*stream, &data[0], data.size());
+    if (!stream->good())
+      throw Zerror(0, string(_("Could not write template data")));
+    if (md5sum != 0) md5sum->update(&data[0], data.size());
+  }
+}
+//______________________________________________________________________
+
+/* For already compressed data, the order-0 entropy is very close to 8
+   bits per byte. Plain data rarely comes close to this, even if it only
+   compresses a little, e.g. executable code. Small blocks are always
+   compressed, their estimate is less reliable. */
+bool Zobstream::incompressible(const byte* data, unsigned len) {
+  if (len < STORE_BLOCK_SIZE / 4) return false;
+  // Count in several tables so that successive increments do not stall
+  unsigned count[4][256];
+  memset(count, 0, sizeof(count));
+  const byte* end4 = data + (len & ~3U);
+  const byte* p = data;
+  while (p < end4) {
+    ++count[0][p[0]]; ++count[1][p[1]]; ++count[2][p[2]]; ++count[3][p[3]];
+    p += 4;
+  }
+  while (p < data + len) ++count[0][*p++];
+
+  // entropy = log2(len) - sum(c * log2(c)) / len
+  double sum = 0;
+  for (int i = 0; i < 256; ++i) {
+    unsigned c = count[0][i] + count[1][i] + count[2][i] + count[3][i];
+    if (c != 0) sum += c * log(double(c));
+  }
+  double entropy = (log(double(len)) - sum / len) / log(2.0);
+  return entropy >= 7.98;
+}
+
+/* Like zip(), but for setStoreIncompressible() mode. Compressible blocks
+   are passed on to zip2() or zipParallel(). Incompressible ones end the
+   current compressed part and are collected in stored, which is written
+   once it reaches chunkLim() bytes or a compressible block follows. In
+   setThreads() mode, STOR parts are queued as finished jobs to keep the
+   output in order. */
+void Zobstream::zipStore(const byte* start, unsigned len, bool finish) {
+  while (len > 0 || finish) {
+    unsigned n = STORE_BLOCK_SIZE - static_cast<unsigned>(storeBlock.size());
+    if (n > len) n = len;
+    storeBlock.insert(storeBlock.end(), start, start + n);
+    start += n;
+    len -= n;
+    bool last = (finish && len == 0);
+    if (storeBlock.size() < STORE_BLOCK_SIZE && !last) return;
+
+    if (!storeBlock.empty()) {
+      // At most STORE_BLOCK_SIZE, see above
+      unsigned blockLen = static_cast<unsigned>(storeBlock.size());
+      if (incompressible(&storeBlock[0], blockLen)) {
+        finishPart();
+        stored.insert(stored.end(), storeBlock.begin(), storeBlock.end());
+        if (stored.size() >= chunkLim()) writeStored();
+      } else {
+        writeStored();
+        if (threads > 1)
+          zipParallel(&storeBlock[0], blockLen, false);
+        else
+          zip2(&storeBlock[0], blockLen, false);
+      }
+      storeBlock.clear();
+    }
+
+    if (last) {
+      writeStored();
+      finishPart();
+      if (threads > 1) writeJobs(0);
+      return;
+    }
+  }
+}
+
+void Zobstream::finishPart() {
+  if (threads > 1) {
+    if (current == 0 || current->in.empty()) return;
+    Job* job = current;
+    current = 0;
+    submitJob(job);
+    writeJobs(2 * threads);
+  } else if (totalIn() > 0) {
+    zip2(todoBuf, 0, true);
+  }
+}
+
+void Zobstream::writeStored() {
+  if (stored.empty()) return;
+  if (threads > 1) {
+    Job* job = new Job();
+    job->in.swap(stored);
+    job->id = Zibstream::STOR;
+    job->done = true;
+    {
+      MutexLock lock(mutex);
+      jobs.push_back(job);
+    }
+    writeJobs(2 * threads);
+  } else {
+    writeHeader(Zibstream::STOR, stored.size(), stored.size());
+    writeBytes(*stream, &stored[0], stored.size());
+    if (!stream->good())
+      throw Zerror(0, string(_("Could not write template data")));
+    if (md5sum != 0) md5sum->update(&stored[0], stored.size());
+    stored.clear();
+  }
+}
+//______________________________________________________________________
+
+void Zobstream::writeChunk(const byte* part, size_t len) {
+  Assert(is_open());
+  zip(todoBuf, todoCount);
+  if (storeIncompressible) zipStore(0, 0, true);
+  /* An empty part would be taken as corrupted data by Zibstream, so only
+     finish the current part if it has any content. */
+  if (threads > 1) {
+    if (current != 0 && !current->in.empty())
+      zipParallel(0, 0, true);
+    else
+      writeJobs(0);
+  } else if (totalIn() > 0) {
+    zip2(todoBuf, 0, true);
+  }
+
+  writeBytes(*stream, part, len);
+  if (!stream->good())
+    throw Zerror(0, string(_("Could not write template data")));
+  if (md5sum != 0) md5sum->update(part, len);
+}
+//______________________________________________________________________
+
 Zobstream& Zobstream::put(uint32 x) {
   if (todoCount > todoBufSize - 4) zip(todoBuf, todoCount);
   todoBuf[todoCount] = static_cast<byte>(x & 0xff);
@@ -125,6 +421,61 @@ Zobstream& Zobstream::put(uint32 x) {
 
 //======================================================================
 
+namespace {
+
+  /* Pass-through "decompression" for STOR parts. Zibstream::read()
+     normally bypasses it and reads their data directly into the
+     destination. */
+  class ZibstreamStored : public Zibstream::Impl {
+  public:
+    ZibstreamStored() : nextInVal(0), availInVal(0), availOutVal(0),
+                        totalInVal(0), totalOutVal(0) { }
+    virtual unsigned totalOut() const { return totalOutVal; }
+    virtual unsigned totalIn() const { return totalInVal; }
+    virtual unsigned availOut() const { return availOutVal; }
+    virtual unsigned availIn() const { return availInVal; }
+    virtual byte* nextOut() const { return 0; }
+    virtual byte* nextIn() const { return nextInVal; }
+    virtual void setTotalOut(unsigned n) { totalOutVal = n; }
+    virtual void setTotalIn(unsigned n) { totalInVal = n; }
+    virtual void setAvailIn(unsigned n) { availInVal = n; }
+    virtual void setNextIn(byte* n) { nextInVal = n; }
+    virtual void init() { }
+    virtual void end() { }
+    virtual void reset() { }
+    virtual void inflate(byte** nextOut, unsigned* availOut) {
+      unsigned n = min(availInVal, *availOut);
+      memcpy(*nextOut, nextInVal, n);
+      nextInVal += n; availInVal -= n; totalInVal += n;
+      *nextOut += n; *availOut -= n; totalOutVal += n;
+      availOutVal = *availOut;
+    }
+    virtual bool streamEnd() const { return false; }
+    virtual bool ok() const { return true; }
+    virtual void throwError() const { Assert(false); }
+  private:
+    byte* nextInVal;
+    unsigned availInVal, availOutVal, totalInVal, totalOutVal;
+  };
+
+} // namespace
+//________________________________________
+
+Zibstream::Impl* Zibstream::newImpl(unsigned id) {
+  switch (id) {
+  case STOR: return new ZibstreamStored();
+  case DATA: return new ZibstreamGz();
+  case BZIP: return new ZibstreamBz();
+# if HAVE_LIBZSTD
+  case ZSTD: return new ZibstreamZstd();
+# endif
+# if HAVE_LIBLZMA
+  case XZ: return new ZibstreamXz();
+# endif
+  default: return 0;
+  }
+}
+
 void Zibstream::open(bistream& s) {
   Assert(!is_open());
   Paranoid(buf == 0);
@@ -155,7 +506,7 @@ void Zibstream::close() {
   /* Only report errors *after* marking the stream as closed, to avoid
      another exception being thrown when the Zibstream object goes out of
      scope and ~Zibstream calls close() again. */
-  if (!z->ok()) z->throwError();
+  if (z != 0 && !z->ok()) z->throwError();
 }
 //________________________________________
 
@@ -172,8 +523,11 @@ Zibstream& Zibstream::read(byte* dest, unsigned n) {
     //____________________
 
     /* If possible, uncompress into destination buffer. Handling this
-       case first for speed */
-    if (z != 0 && z->availIn() != 0) {
+       case first for speed. After the last input of a part, zstd and xz
+       may still hold back output, so continue until dataUnc is 0. */
+    bool flushOnly = (z != 0 && z->availIn() == 0 && dataLen == 0
+                      && dataUnc > 0);
+    if (z != 0 && (z->availIn() != 0 || flushOnly)) {
       byte* oldNextOut = nextOut;
       z->inflate(&nextOut, &availOut);
       gcountVal = nextOut - dest;
@@ -184,6 +538,12 @@ Zibstream& Zibstream::read(byte* dest, unsigned n) {
       if (z->availOut() == 0) break;
       if (!z->ok() && !z->streamEnd())
         z->throwError();
+      if (flushOnly && nextOut == oldNextOut) {
+        // Part's compressed data ended before all its data was output
+        delete[] buf;
+        buf = 0;
+        throw Zerror(0, string(_("Corrupted input data")));
+      }
       continue;
     }
     //____________________
@@ -194,8 +554,8 @@ Zibstream& Zibstream::read(byte* dest, unsigned n) {
       streamsize prevPos = stream->tellg();
       unsigned id;
       unserialize4(id, in);
-      if (!*stream || (id != DATA && id != BZIP)) {
-        // Reached end of file or a non-DATA/BZIP part
+      if (!*stream || !isDataPart(id)) {
+        // Reached end of file or a part without compressed data
         stream->seekg(prevPos, ios::beg);
         delete[] buf;
         buf = 0; // Causes fail() == true
@@ -226,18 +586,14 @@ Zibstream& Zibstream::read(byte* dest, unsigned n) {
            << " dataLen=" << dataLen
            << " dataUnc=" << dataUnc << " - new DATA part" << endl;
 #     endif
-      if (dataUnc == 0 || !*stream) {
+      if (dataUnc == 0 || !*stream || (id == STOR && dataLen != dataUnc)) {
         delete[] buf;
         buf = 0;
         throw Zerror(0, string(_("Corrupted input data")));
       }
 
       // Decide whether to (re)allocate inflater
-      // One or both out of gz/bz will be null
-      ZibstreamGz* gz = dynamic_cast<ZibstreamGz*>(z);
-      ZibstreamBz* bz = dynamic_cast<ZibstreamBz*>(z);
-      if ((id == DATA && gz == 0)
-          || (id == BZIP && bz == 0)) {
+      if (z == 0 || id != zId) {
         if (z != 0) {
           // Delete old, unneeded inflater
           z->end();
@@ -245,10 +601,16 @@ Zibstream& Zibstream::read(byte* dest, unsigned n) {
           delete z;
         }
         // Allocate and init new one
-        if (id == DATA)
-          z = new ZibstreamGz();
-        else
-          z = new ZibstreamBz();
+        z = newImpl(id);
+        zId = id;
+        if (z == 0) {
+          delete[] buf;
+          buf = 0;
+          const char* method = (id == ZSTD ? "zstd" : "xz");
+          throw Zerror(0, subst(_("Template data is compressed with %1, "
+                                  "which is not supported by this "
+                                  "program"), method));
+        }
         z->setNextIn(0);
         z->setAvailIn(0);
         z->init();
@@ -262,6 +624,34 @@ Zibstream& Zibstream::read(byte* dest, unsigned n) {
     } // endif (dataLen == 0) // Need to read another DATA part?
     //____________________
 
+    // Read STOR data directly into destination buffer?
+    if (zId == STOR) {
+      // Not more than availOut, so these fit
+      unsigned toRead =
+          static_cast<unsigned>(dataLen < availOut ? dataLen : availOut);
+      byte* b = nextOut;
+      unsigned left = toRead;
+      while (*stream && left > 0) {
+        readBytes(*stream, b, left);
+        unsigned n = static_cast<unsigned>(stream->gcount());
+        b += n;
+        left -= n;
+      }
+      if (!*stream) {
+        delete[] buf;
+        buf = 0;
+        string err = subst(_("Error reading compressed data - %1"),
+                           strerror(errno));
+        throw Zerror(0, err);
+      }
+      nextOut += toRead;
+      availOut -= toRead;
+      dataLen -= toRead;
+      dataUnc -= toRead;
+      gcountVal = nextOut - dest;
+      continue;
+    }
+
     // Read data from file into buffer?
     unsigned toRead = (dataLen < bufSize ? dataLen : bufSize);
     byte* b = &buf[0];
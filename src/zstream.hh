@@ -9,9 +9,9 @@
 
 *//** @file
 
-  Zlib/bzlib2 compression layer which integrates with C++ streams. When
-  deflating, chops up data into DATA chunks of approximately zippedBufSz (see
-  ctor below and ../doc/TechDetails.txt).
+  Zlib/bzlib2/zstd/xz compression layer which integrates with C++ streams.
+  When deflating, chops up data into DATA chunks of approximately
+  zippedBufSz (see ctor below and ../doc/TechDetails.txt).
 
   Maybe this should use streambuf, but 1) I don't really understand
   streambuf, and 2) the C++ library that comes with GCC 2.95 probably doesn't
@@ -24,12 +24,15 @@
 
 #include <config.h>
 
+#include <deque>
 #include <iostream>
+#include <vector>
 
 #include <bstream.hh>
 #include <config.h>
 #include <debug.hh>
 #include <md5sum.fh>
+#include <thread.hh>
 #include <zstream.fh>
 //______________________________________________________________________
 
@@ -50,21 +53,52 @@ struct Zerror : Error {
 
     Additional features mainly useful for jigdo: If an MD5Sum object
     is passed to Zobstream(), any data written to the output stream is
-    also passed to the object. */
+    also passed to the object.
+
+    With setThreads(), the input is instead cut into chunks of chunkLimit
+    *uncompressed* bytes, which are compressed independently by a pool
+    of threads and written out in order. For bzip2, whose chunks are
+    limited by input size anyway, this produces the same output as the
+    single-threaded mode.
+
+    With setStoreIncompressible(), data which looks like it will not
+    compress (e.g. because it already is compressed) is written to STOR
+    parts as it is, without passing it through the compressor. */
 class Zobstream {
 public:
 
   inline explicit Zobstream(MD5Sum* md = 0);
   /** Calls close(), which might throw a Zerror exception! Call
       close() before destroying the object to avoid this. */
-  virtual ~Zobstream() { close(); delete zipBuf; Assert(todoBuf == 0); }
+  virtual ~Zobstream() {
+    close(); delete zipBuf; Assert(todoBuf == 0 && workers.empty());
+  }
   bool is_open() const { return stream != 0; }
   /** Forces any remaining data to be compressed and written out */
   void close();
 
+  /** Use n compression threads (n > 1) or compress on the calling thread
+      (n <= 1, the default). Must be called before any data is written.
+      If threads cannot be created, compression happens on the calling
+      thread, still in chunks of chunkLimit uncompressed bytes. */
+  void setThreads(unsigned n);
+
+  /** Whether to check blocks of STORE_BLOCK_SIZE bytes of input for their
+      compressibility, and write incompressible ones to STOR parts. Must
+      be called before any data is written. Default: false */
+  void setStoreIncompressible(bool x) {
+    Assert(todoCount == 0 && storeBlock.empty());
+    storeIncompressible = x;
+  }
+
   /** Get reference to underlying ostream */
   bostream& getStream() { return *stream; }
 
+  /** Total nr of bytes before resp. after compression of the parts written
+      so far, including their headers. Does not count writeChunk() data. */
+  uint64 bytesIn() const { return bytesInVal; }
+  uint64 bytesOut() const { return bytesOutVal; }
+
   /** Output 1 character */
   inline Zobstream& put(unsigned char x);
   inline Zobstream& put(signed char x);
@@ -80,6 +114,17 @@ public:
 //   inline Zobstream& write(const void* x, size_t n);
   inline Zobstream& write(const byte* x, unsigned n);
 
+  /** Finish the current DATA/BZIP part (if it contains any data), then
+      copy len bytes verbatim to the output. part must contain one or
+      more complete parts, e.g. ones read from another template file. */
+  void writeChunk(const byte* part, size_t len);
+
+  /** Granularity of setStoreIncompressible() */
+  static const unsigned STORE_BLOCK_SIZE = 64*1024;
+  /** Estimate whether the compressors will save any space on data. For
+      speed, this only looks at the byte frequencies. */
+  static bool incompressible(const byte* data, unsigned len);
+
 protected:
   static const unsigned ZIPDATA_SIZE = 64*1024;
 
@@ -88,6 +133,8 @@ protected:
   unsigned chunkLim() const { return chunkLimVal; }
   // Write data in zipBuf
   void writeZipped(unsigned partId);
+  // Write 16-byte header of a DATA or BZIP part
+  void writeHeader(unsigned partId, uint64 zipped, uint64 unzipped);
 
   virtual void deflateEnd() = 0; // May throw Zerror
   virtual void deflateReset() = 0; // May throw Zerror
@@ -107,6 +154,14 @@ protected:
 
   virtual void zip2(byte* start, unsigned len, bool finish) = 0;
 
+  /** For setThreads() mode: Compress len bytes at in into one complete,
+      independent chunk, replacing the contents of out. Must not modify
+      the object, since it is called concurrently from several threads.
+      May throw Zerror or bad_alloc.
+      @return ID of the chunk, e.g. DATA or BZIP */
+  virtual unsigned zipChunk(const byte* in, unsigned len,
+                            vector<byte>* out) const = 0;
+
   /* Compressed data is stored in a linked list of ZipData objects.
      During the Zobstream object's lifetime, the list is only ever
      added to, never shortened. */
@@ -122,6 +177,26 @@ protected:
 private:
   static const unsigned MIN_TODOBUF_SIZE = 256;
 
+  // Support for setThreads()
+  struct Job;
+  class Compressor;
+  friend class Compressor;
+  // Append data to current job, start compression once it is full
+  void zipParallel(const byte* start, unsigned len, bool finish);
+  // Hand the job to a Compressor, or do it ourselves if there are none
+  void submitJob(Job* job);
+  // Write out finished jobs until at most maxPending jobs remain
+  void writeJobs(size_t maxPending);
+  // Make the Compressor threads exit, wait for them
+  void stopThreads();
+
+  // Support for setStoreIncompressible()
+  void zipStore(const byte* start, unsigned len, bool finish);
+  // Finish the current compressed part, if it contains any data
+  void finishPart();
+  // Write out the data in stored as STOR part
+  void writeStored();
+
 //   // Throw a Zerror exception, or bad_alloc() for status==Z_MEM_ERROR
 //   inline void throwZerror(int status, const char* zmsg);
   // Pipe contents of todoBuf through zlib into zipBuf
@@ -138,16 +213,43 @@ private:
   unsigned chunkLimVal;
 
   MD5Sum* md5sum;
+
+  unsigned threads; // >1 => setThreads() mode
+  Job* current; // Job whose input is being collected, or null
+  vector<Compressor*> workers;
+  Mutex mutex;
+  Condition cond; // Broadcast whenever jobs, todo or stopping change
+  deque<Job*> jobs; // All submitted jobs, in output order
+  deque<Job*> todo; // Jobs not yet picked up by a Compressor
+  bool stopping; // Tell Compressors to exit
+
+  bool storeIncompressible;
+  vector<byte> storeBlock; // Input not yet checked with incompressible()
+  vector<byte> stored; // Incompressible input, not yet written
+
+  uint64 bytesInVal, bytesOutVal; // For bytesIn(), bytesOut()
 };
 //______________________________________________________________________
 
 /** Input stream which decompresses data. Analogous to Zobstream, aware of
-    jigdo file formats - expects a number of DATA or BZIP parts at current
-    stream position. */
+    jigdo file formats - expects a number of DATA, BZIP, ZSTD, XZ or STOR
+    parts at current stream position. */
 class Zibstream {
 public:
 
-  /** Interface for gzip and bzip2 implementors. */
+  /** IDs of the parts which contain (usually compressed) data */
+  static const unsigned DATA = 0x41544144u; // gzip
+  static const unsigned BZIP = 0x50495a42u; // bzip2
+  static const unsigned ZSTD = 0x4454535au; // zstd
+  static const unsigned XZ   = 0x20205a58u; // xz, "XZ  "
+  static const unsigned STOR = 0x524f5453u; // not compressed
+  /** Is id one of the above? (The compression method need not be
+      supported by this build, read() throws a Zerror in that case.) */
+  static inline bool isDataPart(unsigned id) {
+    return id == DATA || id == BZIP || id == ZSTD || id == XZ || id == STOR;
+  }
+
+  /** Interface for gzip, bzip2, zstd and xz implementors. */
   class Impl {
   public:
     virtual ~Impl() { }
@@ -224,13 +326,14 @@ private:
   // Throw a Zerror exception, or bad_alloc() for status==Z_MEM_ERROR
   //inline void throwZerror(int status, const char* zmsg);
 
-  static const unsigned DATA = 0x41544144u;
-  static const unsigned BZIP = 0x50495a42u;
-
   void open(bistream& s);
+  /* Return a new, uninitialized inflater for parts with that ID, or null
+     if the compression method is not supported by this build */
+  static Impl* newImpl(unsigned id);
 
 //   z_stream z;
   Impl* z;
+  unsigned zId; // ID of the parts which z decompresses
   bistream* stream;
   mutable streamsize gcountVal;
   unsigned bufSize;
@@ -247,7 +350,9 @@ private:
    calls to put() and write() */
 Zobstream::Zobstream(MD5Sum* md)
     : zipBuf(0), zipBufLast(0), todoBuf(0), todoBufSize(0), todoCount(0),
-      stream(0), md5sum(md) { }
+      stream(0), md5sum(md), threads(1), current(0), workers(), jobs(),
+      todo(), stopping(false), storeIncompressible(false), storeBlock(),
+      stored(), bytesInVal(0), bytesOutVal(0) { }
 //________________________________________
 
 void Zobstream::open(bostream& s, unsigned chunkLimit, unsigned todoBufSz) {
@@ -263,7 +368,11 @@ void Zobstream::open(bostream& s, unsigned chunkLimit, unsigned todoBufSz) {
 }
 
 void Zobstream::zip(byte* start, unsigned len, bool finish) {
-  if (len != 0 || finish)
+  if (storeIncompressible)
+    zipStore(start, len, finish);
+  else if (threads > 1)
+    zipParallel(start, len, finish);
+  else if (len != 0 || finish)
     zip2(start, len, finish);
   todoCount = 0;
 }
@@ -308,11 +417,11 @@ Zobstream& Zobstream::write(const byte* x, unsigned n) {
 //________________________________________
 
 Zibstream::Zibstream(unsigned bufSz)
-    : z(0), stream(0), bufSize(bufSz), buf(0) {
+    : z(0), zId(0), stream(0), bufSize(bufSz), buf(0) {
 }
 
 Zibstream::Zibstream(bistream& s, unsigned bufSz)
-    : z(0), stream(0), bufSize(bufSz), buf(0) {
+    : z(0), zId(0), stream(0), bufSize(bufSz), buf(0) {
   // data* will be init'ed by open()
   open(s);
 }